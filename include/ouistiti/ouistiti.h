@@ -29,6 +29,9 @@
 #ifndef __OUISTITI_CONFIG_H__
 #define __OUISTITI_CONFIG_H__
 
+#include <stdint.h>
+#include <time.h>
+
 #ifndef MAX_SERVERS
 #define MAX_SERVERS 4
 #endif
@@ -64,6 +67,19 @@ struct module_list_s
 	struct module_list_s *next;
 };
 
+typedef struct cacheconfig_s cacheconfig_t;
+struct cacheconfig_s
+{
+	/** directory of the disk tier */
+	const char *path;
+	int entries;
+	int maxsize;
+	/** default stale-while-revalidate delay */
+	int stale;
+	/** delay before another request takes a lost fetch */
+	int pending;
+};
+
 typedef struct mod_s mod_t;
 struct mod_s
 {
@@ -78,6 +94,16 @@ struct serverconfig_s
 	http_server_config_t *server;
 	const char *root;
 	void *modulesconfig;
+	/** uri of the metrics of the server */
+	const char *metrics;
+	/** file and format of the access log */
+	const char *accesslog;
+	const char *accessformat;
+	/** shared cache of the responses of the CGI and the forward links */
+	cacheconfig_t cache;
+	/** servers on the same port, loaded as virtual hosts */
+	serverconfig_t *vhosts;
+	serverconfig_t *next;
 };
 
 typedef struct ouistiticonfig_s
@@ -87,6 +113,8 @@ typedef struct ouistiticonfig_s
 	const char *init_d;
 	serverconfig_t *config[MAX_SERVERS];
 	int nservers;
+	int workers;
+	int logratelimit;
 } ouistiticonfig_t;
 
 ouistiticonfig_t *ouistiticonfig_create(const char *filepath);
@@ -99,7 +127,130 @@ void ouistiti_registermodule(const module_t *module, void *dh);
 const module_list_t *ouistiti_modules(server_t *server);
 int ouistiti_issecure(server_t *server);
 http_server_t *ouistiti_httpserver(server_t *server);
+/**
+ * a protocol layer with a framing (mod_http2) sends the file of
+ * mod_document itself. ouistiti_sendfile returns ECONTINUE when the
+ * client uses the raw socket, otherwise the number of bytes sent
+ * or -1 with errno.
+ */
+typedef int (*ouistiti_sendfile_t)(void *arg, http_client_t *clt, int fd, size_t size);
+void ouistiti_setsendfile(ouistiti_sendfile_t func, void *arg);
+int ouistiti_sendfile(http_client_t *clt, int fd, size_t size);
 serverconfig_t *ouistiti_serverconfig(server_t *server);
+/**
+ * the data shared by the connectors of several modules is released
+ * after the destruction of the server, when the connectors may not
+ * run anymore.
+ */
+typedef void (*ouistiti_release_t)(void *arg);
+int ouistiti_atrelease(http_server_t *server, ouistiti_release_t release, void *arg);
+/**
+ * the context of a module for a client, allocated by the first request
+ * which requires it. ouistiti_clientctx allocates a zeroed context of
+ * "size" bytes when it does not exist, with size 0 it only looks for it.
+ * The module frees it at the end of the client.
+ */
+void *ouistiti_clientctx(http_client_t *clt, const void *owner, size_t size);
+void ouistiti_freeclientctx(http_client_t *clt, const void *owner);
+/**
+ * the memory of a request. The allocations are zeroed and taken into
+ * blocks kept by the client, ouistiti_requestfree gives back the last
+ * allocation. The blocks return to the worker when all the allocations
+ * are freed, or at the next request, or at the end of the client.
+ * The pointers must not be passed to free.
+ */
+void *ouistiti_requestalloc(http_message_t *request, size_t size);
+void ouistiti_requestfree(http_message_t *request, void *ptr);
+int ouistiti_arena(http_server_t *server);
+/**
+ * register a header sent with all the responses of the server.
+ * The headers are checked once and added without any test per response.
+ */
+int ouistiti_setheader(http_server_t *server, const char *key, const char *value, size_t valuelen);
+void ouistiti_freeheaders(http_server_t *server);
+/**
+ * register a Cache-Control value for the uris matching the expressions
+ * (the uri and the mime type of its extension, NULL matches all).
+ * ouistiti_cachecontrol returns the value of the first rule of the
+ * server matching the uri, or NULL.
+ */
+int ouistiti_cachepolicy(http_server_t *server, const char *match, const char *mime, const char *control, size_t controllen);
+const char *ouistiti_cachecontrol(http_server_t *server, const char *uri, size_t *length);
+void ouistiti_freecachepolicy(http_server_t *server);
+/**
+ * the clock is updated once per second and shared by the processes
+ * forked after ouistiti_clock. The date is the IMF-fixdate of the
+ * Date header, the buffer must contain 30 bytes.
+ */
+int ouistiti_clock(void);
+time_t ouistiti_time(void);
+time_t ouistiti_monotonic(void);
+size_t ouistiti_date(char *date, size_t size);
+/**
+ * ouistiti_wait sleeps while the word of a shared memory keeps its value,
+ * at most "ms" milliseconds. ouistiti_wake changes the word and wakes up
+ * all its waiters.
+ */
+void ouistiti_wait(uint32_t *word, uint32_t value, int ms);
+void ouistiti_wake(uint32_t *word);
+
+#if defined(METRICS) || defined(LOGGER)
+/**
+ * measure the connectors of the server and send the counters on the uri
+ * of the configuration. The modules register their connectors with
+ * ouistiti_addconnector and ouistiti_addclientconnector to be measured,
+ * the metrics layer is used by the access log too.
+ */
+int ouistiti_metrics(http_server_t *server, const serverconfig_t *config);
+void ouistiti_freemetrics(http_server_t *server);
+int ouistiti_addconnector(http_server_t *server, http_connector_t cb, void *arg, int type, const char *name);
+int ouistiti_addclientconnector(http_client_t *clt, http_connector_t cb, void *arg, int type, const char *name);
+/**
+ * call cb when a connector of the server ends a response.
+ */
+int ouistiti_metricscomplete(http_server_t *server, http_connector_t cb, void *arg);
+/**
+ * count the memory allocated (or freed with a negative size) for a
+ * client, the metrics display the memory held by the connected clients.
+ */
+void ouistiti_clientmemory(http_client_t *clt, long size);
+#else
+#define ouistiti_addconnector httpserver_addconnector
+#define ouistiti_addclientconnector httpclient_addconnector
+#define ouistiti_clientmemory(...)
+#endif
+
+#ifdef CACHE
+/**
+ * the responses of the producers (mod_cgi, mod_forward) are stored with
+ * the format of the output of a CGI, into a shared memory and a directory.
+ * ouistiti_cachebegin returns:
+ *  - ESUCCESS, the response is sent with ouistiti_cachereplay,
+ *  - EINCOMPLETE, another request fetches the response, call again later,
+ *  - ECONTINUE, the caller fetches the response and appends it,
+ *  - EREJECT, the caller fetches the response without the cache.
+ */
+typedef struct ouistiti_cachectx_s ouistiti_cachectx_t;
+int ouistiti_cache(http_server_t *server, const serverconfig_t *config);
+void ouistiti_freecache(http_server_t *server);
+int ouistiti_cachebegin(http_server_t *server, http_message_t *request, ouistiti_cachectx_t **ctx);
+int ouistiti_cacheappend(ouistiti_cachectx_t *ctx, const char *data, size_t length);
+void ouistiti_cacheend(ouistiti_cachectx_t *ctx, int result);
+int ouistiti_cachereplay(ouistiti_cachectx_t *ctx, http_message_t *response);
+void ouistiti_cachefree(ouistiti_cachectx_t *ctx);
+#endif
+
+#ifdef LOGGER
+/**
+ * the messages are copied into the rings of a shared memory and
+ * written by a thread of the main process. The errors are limited
+ * to ratelimit messages per second.
+ */
+int ouistiti_logger(int ratelimit);
+void ouistiti_loggerstop(void);
+int ouistiti_accesslog(http_server_t *server, const serverconfig_t *config);
+void ouistiti_freeaccesslog(http_server_t *server);
+#endif
 
 typedef struct string_s string_t;
 struct string_s
@@ -0,0 +1,236 @@
+/*****************************************************************************
+ * arena.c: memory of the requests allocated into blocks of the client
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    The connectors allocate their private data for each request. The
+    arena of the client takes them into a block with a bump pointer,
+    and counts the allocations still in use. When the count returns to
+    zero the blocks go back to a free list of the worker, then the next
+    request reuses them without malloc.
+
+    A client runs one request at a time: the blocks still used when a
+    new request starts, or at the end of the client, are the leaks of
+    the previous request and they are released too.
+    The allocations larger than a block have their own block, which is
+    freed with the request.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sched.h>
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/log.h"
+#include "ouistiti.h"
+#include "log.h"
+
+#define ARENA_BLOCKSIZE 8192
+#define ARENA_FREEMAX 64
+#define ARENA_ALIGN(size) (((size) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+static const char str_arena[] = "arena";
+
+typedef struct _arena_block_s _arena_block_t;
+struct _arena_block_s
+{
+	_arena_block_t *next;
+	size_t size;
+	size_t offset;
+	max_align_t data[];
+};
+
+typedef struct _arena_s _arena_t;
+struct _arena_s
+{
+	http_message_t *request;
+	/// the current block is the first
+	_arena_block_t *blocks;
+	void *last;
+	int live;
+};
+
+/// the blocks of the worker, the workers are processes
+static _arena_block_t *g_arenafree = NULL;
+static int g_arenanfree = 0;
+static int g_arenalock = 0;
+
+static void _arena_lock(void)
+{
+	while (__atomic_exchange_n(&g_arenalock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void _arena_unlock(void)
+{
+	__atomic_store_n(&g_arenalock, 0, __ATOMIC_RELEASE);
+}
+
+static _arena_block_t *_arena_newblock(size_t size)
+{
+	_arena_block_t *block = NULL;
+	if (size <= ARENA_BLOCKSIZE)
+	{
+		_arena_lock();
+		block = g_arenafree;
+		if (block != NULL)
+		{
+			g_arenafree = block->next;
+			g_arenanfree--;
+		}
+		_arena_unlock();
+		size = ARENA_BLOCKSIZE;
+	}
+	if (block == NULL)
+		block = malloc(sizeof(*block) + size);
+	if (block == NULL)
+		return NULL;
+	block->next = NULL;
+	block->size = size;
+	block->offset = 0;
+	return block;
+}
+
+static void _arena_release(http_client_t *clt, _arena_t *arena)
+{
+	_arena_block_t *next = NULL;
+	for (_arena_block_t *block = arena->blocks; block != NULL; block = next)
+	{
+		next = block->next;
+		ouistiti_clientmemory(clt, -(long)(sizeof(*block) + block->size));
+		if (block->size == ARENA_BLOCKSIZE)
+		{
+			_arena_lock();
+			if (g_arenanfree < ARENA_FREEMAX)
+			{
+				block->next = g_arenafree;
+				g_arenafree = block;
+				g_arenanfree++;
+				block = NULL;
+			}
+			_arena_unlock();
+		}
+		free(block);
+	}
+	arena->blocks = NULL;
+	arena->last = NULL;
+	arena->live = 0;
+}
+
+static _arena_t *_arena_get(http_message_t *request, size_t size)
+{
+	http_client_t *clt = httpmessage_client(request);
+	_arena_t *arena = ouistiti_clientctx(clt, str_arena, size);
+	if (arena == NULL)
+		return NULL;
+	if (arena->request != request)
+	{
+		if (arena->blocks != NULL)
+		{
+			dbg("arena: %d allocations lost by the previous request", arena->live);
+			_arena_release(clt, arena);
+		}
+		arena->request = request;
+	}
+	return arena;
+}
+
+void *ouistiti_requestalloc(http_message_t *request, size_t size)
+{
+	if (size == 0)
+		return NULL;
+	_arena_t *arena = _arena_get(request, sizeof(*arena));
+	if (arena == NULL)
+		return NULL;
+	size = ARENA_ALIGN(size);
+	_arena_block_t *block = arena->blocks;
+	if (block == NULL || block->offset + size > block->size)
+	{
+		block = _arena_newblock(size);
+		if (block == NULL)
+			return NULL;
+		ouistiti_clientmemory(httpmessage_client(request), sizeof(*block) + block->size);
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+	void *ptr = (char *)block->data + block->offset;
+	block->offset += size;
+	memset(ptr, 0, size);
+	arena->last = ptr;
+	arena->live++;
+	return ptr;
+}
+
+void ouistiti_requestfree(http_message_t *request, void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	_arena_t *arena = _arena_get(request, 0);
+	if (arena == NULL || arena->blocks == NULL)
+		return;
+	/// the last allocation is given back to the block
+	if (ptr == arena->last)
+	{
+		arena->blocks->offset = (char *)ptr - (char *)arena->blocks->data;
+		arena->last = NULL;
+	}
+	arena->live--;
+	if (arena->live <= 0)
+		_arena_release(httpmessage_client(request), arena);
+}
+
+static int _arena_startconnector(void *arg, http_message_t *request, http_message_t *response)
+{
+	/// the blocks of the previous request are released
+	_arena_get(request, 0);
+	return EREJECT;
+}
+
+static void *_arena_getctx(void *arg, http_client_t *clt, struct sockaddr *addr, int addrsize)
+{
+	/// the arena is allocated by the first request which uses it
+	return clt;
+}
+
+static void _arena_freectx(void *arg)
+{
+	http_client_t *clt = (http_client_t *)arg;
+	_arena_t *arena = ouistiti_clientctx(clt, str_arena, 0);
+	if (arena == NULL)
+		return;
+	_arena_release(clt, arena);
+	ouistiti_freeclientctx(clt, str_arena);
+}
+
+int ouistiti_arena(http_server_t *server)
+{
+	httpserver_addmod(server, _arena_getctx, _arena_freectx, NULL, str_arena);
+	ouistiti_addconnector(server, _arena_startconnector, NULL, CONNECTOR_SERVER, str_arena);
+	return ESUCCESS;
+}
@@ -35,6 +35,7 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "authn_basic.h"
+#include "log.h"
 
 #define auth_dbg(...)
 
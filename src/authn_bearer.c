@@ -36,6 +36,7 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "authn_bearer.h"
+#include "log.h"
 
 #define auth_dbg(...)
 
@@ -89,9 +90,7 @@ static const char *authn_bearer_check(void *arg, authz_t *authz, const char *met
 		size_t datalen = sign - data;
 		sign++;
 		signlen -= sign - string;
-		const char *key = mod->authn->config->secret.data;
-		size_t keylen = mod->authn->config->secret.length;
-		if (authn_checksignature(key, keylen, data, datalen, sign, signlen) == ESUCCESS)
+		if (authn_checktokensignature(mod->authn->config, data, datalen, sign, signlen) == ESUCCESS)
 		{
 			user = authz->rules->check(authz->ctx, NULL, NULL, string);
 		}
@@ -28,6 +28,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <time.h>
 
 #include "ouistiti/httpserver.h"
@@ -36,10 +41,46 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "authn_digest.h"
+#include "log.h"
 
 #define auth_dbg(...)
 
 #define MAXNONCE 64
+/**
+ * the stateless nonce (RFC 7616 5.4) is:
+ *   base64url(timestamp | random | HMAC-SHA256(secret, timestamp | random ":" realm)[0..NONCE_TAGLEN])
+ * it is valid for all connections and all the worker processes.
+ */
+#define NONCE_TIMELEN 8
+#define NONCE_RANDLEN 8
+#define NONCE_TAGLEN 16
+#define NONCE_SECRETLEN 32
+/// number of nonce-count values checked by nonce
+#define NC_WINDOW 64
+/// number of nonces checked together
+#define NC_BUCKETS 256
+/// number of nonces by bucket
+#define NC_WAYS 4
+
+typedef struct authn_digest_nc_s authn_digest_nc_t;
+struct authn_digest_nc_s
+{
+	uint64_t tag;
+	/// creation time of the nonce, the oldest one is replaced first
+	uint64_t timestamp;
+	/// bit i is set when the nonce-count "base + i" was used
+	uint64_t bitmap;
+	uint32_t base;
+};
+
+typedef struct authn_digest_ncbucket_s authn_digest_ncbucket_t;
+struct authn_digest_ncbucket_s
+{
+	authn_digest_nc_t ways[NC_WAYS];
+	/// the nonces created before are unknown, they may have been replaced
+	uint64_t floor;
+	uint32_t lock;
+};
 
 typedef struct authn_digest_config_s authn_digest_config_t;
 typedef struct authn_digest_s authn_digest_t;
@@ -48,16 +89,33 @@ struct authn_digest_s
 	authn_digest_config_t *config;
 	const authn_t *authn;
 	const hash_t *hash;
+#ifdef DEBUG
+	char _nonce[MAXNONCE];
+	string_t nonce;
+#endif
+	char _secret[NONCE_SECRETLEN];
+	string_t secret;
+	/// shared between the processes to reject the replays
+	authn_digest_ncbucket_t *nctable;
+	int encode;
+};
+
+typedef struct authn_digest_client_s authn_digest_client_t;
+struct authn_digest_client_s
+{
+	authn_digest_t *mod;
+	/// random nonce of the connection when the stateless nonce is not available
 	char _nonce[MAXNONCE];
 	string_t nonce;
 	char *user;
+	/// set by the check of the request for its challenge
 	int stale;
-	int encode;
 };
 
 struct authn_digest_config_s
 {
 	string_t opaque;
+	int userhash;
 };
 
 #ifdef FILE_CONFIG
@@ -75,6 +133,10 @@ void *authn_digest_config(const config_setting_t *configauth)
 
 	authn_config = calloc(1, sizeof(*authn_config));
 	_string_store(&authn_config->opaque, opaque, -1);
+	/**
+	 * userhash allows the client to hide the username (RFC 7616 3.4.4)
+	 */
+	config_setting_lookup_bool(configauth, "userhash", &authn_config->userhash);
 	return authn_config;
 }
 #endif
@@ -96,6 +158,32 @@ static char str_nonce_rfc7616[] = "7ypf/xlj9XXwfDPEoM4URrv/xwf94BcCAzFZH4GiTo0v"
 static char str_nonce_rfc2617[] = "dcd98b7102dd2f0e8b11d0f600bfb0c093";
 #endif
 
+static void authn_digest_secret(authn_digest_t *mod)
+{
+	const mod_auth_t *config = mod->authn->config;
+	if (config->secret.data != NULL)
+	{
+		_string_store(&mod->secret, config->secret.data, config->secret.length);
+		return;
+	}
+	/**
+	 * without secret the nonce is signed with a random key
+	 * generated before the fork of the workers.
+	 */
+	int fd = open("/dev/urandom", O_RDONLY);
+	size_t length = 0;
+	if (fd >= 0)
+	{
+		ssize_t ret = read(fd, mod->_secret, sizeof(mod->_secret));
+		if (ret > 0)
+			length = ret;
+		close(fd);
+	}
+	for (; length < sizeof(mod->_secret); length++)
+		mod->_secret[length] = random();
+	_string_store(&mod->secret, mod->_secret, sizeof(mod->_secret));
+}
+
 static void *authn_digest_create(const authn_t *authn, void *config)
 {
 	if (authn->config->authn.hash == NULL)
@@ -104,9 +192,20 @@ static void *authn_digest_create(const authn_t *authn, void *config)
 	mod->config = (authn_digest_config_t *)config;
 	mod->authn = authn;
 	mod->hash = authn->config->authn.hash;
-	_string_store(&mod->nonce, mod->_nonce, 0);
+	authn_digest_secret(mod);
+	if (hash_macsha256 != NULL)
+	{
+		mod->nctable = mmap(NULL, sizeof(*mod->nctable) * NC_BUCKETS, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (mod->nctable == MAP_FAILED)
+		{
+			err("auth: digest nonce-count table not available %m");
+			mod->nctable = NULL;
+		}
+	}
 #ifdef DEBUG
 	err("Auth DIGEST is not secure in DEBUG mode, rebuild!!!");
+	_string_store(&mod->nonce, mod->_nonce, 0);
 	if (! _string_cmp(&mod->config->opaque, STRING_REF(str_opaque_rfc7616)))
 		mod->nonce.length = snprintf(STRING_REF(mod->_nonce), "%s", str_nonce_rfc7616); //RFC7616
 	else
@@ -115,34 +214,145 @@ static void *authn_digest_create(const authn_t *authn, void *config)
 	return mod;
 }
 
+static size_t authn_digest_noncesign(const authn_digest_t *mod, const unsigned char *timestamp, char *signature)
+{
+	if (hash_macsha256 == NULL)
+		return 0;
+	void *ctx = hash_macsha256->initkey(mod->secret.data, mod->secret.length);
+	if (ctx == NULL)
+		return 0;
+	hash_macsha256->update(ctx, (const char *)timestamp, NONCE_TIMELEN + NONCE_RANDLEN);
+	hash_macsha256->update(ctx, ":", 1);
+	hash_macsha256->update(ctx, STRING_INFO(mod->authn->config->realm));
+	return hash_macsha256->finish(ctx, signature);
+}
+
 static int authn_digest_noncetime(authn_digest_t *mod, char *nonce, size_t noncelen)
 {
+	unsigned char raw[NONCE_TIMELEN + NONCE_RANDLEN + HASH_MAX_SIZE];
+	uint64_t now = ouistiti_time();
+	for (int i = 0; i < NONCE_TIMELEN; i++)
+		raw[i] = (now >> ((NONCE_TIMELEN - 1 - i) * 8)) & 0xFF;
+	/// two clients of the same second must not share the nonce-counts
+	for (int i = 0; i < NONCE_RANDLEN; i++)
+		raw[NONCE_TIMELEN + i] = random() & 0xFF;
+	size_t signlen = authn_digest_noncesign(mod, raw, (char *)raw + NONCE_TIMELEN + NONCE_RANDLEN);
+	if (signlen < NONCE_TAGLEN)
+		return EREJECT;
+	return base64_urlencoding->encode((char *)raw, NONCE_TIMELEN + NONCE_RANDLEN + NONCE_TAGLEN, nonce, noncelen);
+}
+
+static int authn_digest_noncecheck(const authn_digest_t *mod, const char *nonce, size_t noncelen, uint64_t *tag, uint64_t *timestamp, int *stale)
+{
+	unsigned char raw[NONCE_TIMELEN + NONCE_RANDLEN + HASH_MAX_SIZE];
+	if (noncelen >= MAXNONCE)
+		return EREJECT;
+	int length = base64_urlencoding->decode(nonce, noncelen, (char *)raw, sizeof(raw));
+	if (length != NONCE_TIMELEN + NONCE_RANDLEN + NONCE_TAGLEN)
+		return EREJECT;
+
+	char signature[HASH_MAX_SIZE];
+	size_t signlen = authn_digest_noncesign(mod, raw, signature);
+	if (signlen < NONCE_TAGLEN)
+		return EREJECT;
+	unsigned char diff = 0;
+	for (int i = 0; i < NONCE_TAGLEN; i++)
+		diff |= signature[i] ^ raw[NONCE_TIMELEN + NONCE_RANDLEN + i];
+	if (diff != 0)
+		return EREJECT;
+
+	*timestamp = 0;
+	for (int i = 0; i < NONCE_TIMELEN; i++)
+		*timestamp = (*timestamp << 8) | raw[i];
 	int expire = 30;
 	if (mod->authn->config->expire != 0)
 		expire = mod->authn->config->expire;
-	time_t now = time(NULL);
-	now -= now % (60 * expire);
-	now += (60 *expire);
-	const char *key = mod->authn->config->secret.data;
-	size_t keylen = mod->authn->config->secret.length;
-	if (hash_macsha256 != NULL && key != NULL)
-	{
-		void *ctx = hash_macsha256->initkey(key, keylen);
-		if (ctx)
+	uint64_t now = ouistiti_time();
+	if (*timestamp > now + 1 || now - *timestamp > (60 * expire))
+	{
+		/// the client is right but it has to use a new nonce
+		*stale = 1;
+		return EREJECT;
+	}
+	memcpy(tag, raw + NONCE_TIMELEN + NONCE_RANDLEN, sizeof(*tag));
+	return ESUCCESS;
+}
+
+/**
+ * the nonce takes a way of its bucket with its first nonce-count,
+ * then the nonce is replaced by the newer ones when it is the oldest
+ * of the bucket. The replaced nonces and the older ones may not be
+ * used again: the client has to use a new nonce.
+ */
+static authn_digest_nc_t *authn_digest_ncregister(authn_digest_ncbucket_t *bucket, uint64_t tag, uint64_t timestamp)
+{
+	if (timestamp < bucket->floor)
+		return NULL;
+	authn_digest_nc_t *slot = &bucket->ways[0];
+	for (int i = 1; i < NC_WAYS; i++)
+	{
+		if (bucket->ways[i].timestamp < slot->timestamp)
+			slot = &bucket->ways[i];
+	}
+	if (slot->tag != 0 && slot->timestamp > timestamp)
+		return NULL;
+	/// two nonces of the same second are not ordered, both are refused after the replacement
+	if (slot->tag != 0)
+		bucket->floor = slot->timestamp + 1;
+	slot->tag = tag;
+	slot->timestamp = timestamp;
+	slot->base = 1;
+	slot->bitmap = 0;
+	return slot;
+}
+
+static int authn_digest_nccheck(const authn_digest_t *mod, uint64_t tag, uint64_t timestamp, unsigned long nc, int *stale)
+{
+	int ret = ESUCCESS;
+	if (mod->nctable == NULL)
+		return ret;
+
+	authn_digest_ncbucket_t *bucket = &mod->nctable[tag % NC_BUCKETS];
+	while (__atomic_exchange_n(&bucket->lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+	authn_digest_nc_t *slot = NULL;
+	for (int i = 0; i < NC_WAYS && slot == NULL; i++)
+	{
+		if (bucket->ways[i].tag == tag)
+			slot = &bucket->ways[i];
+	}
+	if (slot == NULL && nc == 1)
+		slot = authn_digest_ncregister(bucket, tag, timestamp);
+	if (slot == NULL)
+	{
+		/**
+		 * the nonce was replaced by a newer one, the counts of this one are
+		 * lost and a replay may not be detected: the client has to use
+		 * a new nonce.
+		 */
+		*stale = 1;
+		ret = EREJECT;
+	}
+	if (ret == ESUCCESS && nc < slot->base)
+		ret = EREJECT;
+	if (ret == ESUCCESS)
+	{
+		if (nc >= slot->base + NC_WINDOW)
 		{
-			hash_macsha256->update(ctx, (char*)&now, sizeof(now));
-			char signature[HASH_MAX_SIZE];
-			size_t signlen = HASH_MAX_SIZE;
-			signlen = hash_macsha256->finish(ctx, signature);
-#if 0
-			if ((signlen * 1.5) > noncelen)
-				signlen = noncelen / 1.5;
-#endif
-			signlen = base64_urlencoding->encode(signature, signlen, nonce, noncelen);
-			return signlen;
+			unsigned long shift = nc - slot->base - NC_WINDOW + 1;
+			slot->bitmap = (shift >= NC_WINDOW)? 0: slot->bitmap >> shift;
+			slot->base += shift;
 		}
+		uint64_t bit = 1ULL << (nc - slot->base);
+		if (slot->bitmap & bit)
+			ret = EREJECT;
+		else
+			slot->bitmap |= bit;
 	}
-	return EREJECT;
+	__atomic_store_n(&bucket->lock, 0, __ATOMIC_RELEASE);
+	if (ret == EREJECT)
+		warn("auth: digest nonce-count %lu refused", nc);
+	return ret;
 }
 
 static int authn_digest_nonce(authn_digest_t *mod, char *nonce, size_t noncelen)
@@ -154,23 +364,17 @@ static int authn_digest_nonce(authn_digest_t *mod, char *nonce, size_t noncelen)
  * or hexa encoded data
  */
 #ifndef DEBUG
-	char _nonce[((HASH_MAX_SIZE * 3) / 2 + 1)] = {0};
-
-	srandom(time(NULL));
-	int usedate = random() % 5;
-	if (usedate)
-	{
-		ret = authn_digest_noncetime(mod, _nonce, sizeof(_nonce));
-	}
+	ret = authn_digest_noncetime(mod, nonce, noncelen);
 	if (ret == EREJECT)
 	{
+		char _nonce[((HASH_MAX_SIZE * 3) / 2 + 1)] = {0};
 		int i;
 		for (i = 0; i < (sizeof(_nonce) / sizeof(int)); i++)
 			*(int *)(_nonce + i * sizeof(int)) = random();
 		ret = base64->encode(_nonce, sizeof(_nonce), nonce, noncelen);
 	}
 #else
-	ret = mod->nonce.length;
+	ret = snprintf(nonce, noncelen, "%.*s", (int)mod->nonce.length, mod->nonce.data);
 #endif
 	return ret;
 }
@@ -179,15 +383,36 @@ static void * authn_digest_setup(void *arg, http_client_t *UNUSED(ctl), struct s
 {
 	authn_digest_t *mod = (authn_digest_t *)arg;
 
-	mod->stale = 0;
-	int length = authn_digest_nonce(arg, STRING_REF(mod->_nonce));
-	if (length < 0)
+	authn_digest_client_t *client = calloc(1, sizeof(*client));
+	if (client == NULL)
 		return NULL;
-	mod->nonce.length = length;
-	return mod;
+	client->mod = mod;
+	_string_store(&client->nonce, client->_nonce, 0);
+	/**
+	 * the stateless nonce is generated with the challenge,
+	 * the random nonce is kept during the connection.
+	 */
+	if (hash_macsha256 == NULL)
+	{
+		int length = authn_digest_nonce(mod, STRING_REF(client->_nonce));
+		if (length < 0)
+		{
+			free(client);
+			return NULL;
+		}
+		client->nonce.length = length;
+	}
+	return client;
+}
+
+static void authn_digest_cleanup(void *arg)
+{
+	authn_digest_client_t *client = (authn_digest_client_t *)arg;
+	free(client->user);
+	free(client);
 }
 
-static void authn_digest_www_authenticate(authn_digest_t *mod, http_message_t * response)
+static void authn_digest_www_authenticate(const authn_digest_t *mod, http_message_t * response, const char *nonce, size_t noncelen, int stale)
 {
 	httpmessage_addheader(response, str_authenticate, STRING_REF("Digest "));
 	if (mod->authn->config->realm.data != NULL && mod->authn->config->realm.data[0] != 0)
@@ -197,26 +422,48 @@ static void authn_digest_www_authenticate(authn_digest_t *mod, http_message_t *
 		httpmessage_appendheader(response, str_authenticate, STRING_REF("\""));
 	}
 	httpmessage_appendheader(response, str_authenticate, STRING_REF(",qop=\"auth\",nonce=\""));
-	httpmessage_appendheader(response, str_authenticate, STRING_INFO(mod->nonce));
+	httpmessage_appendheader(response, str_authenticate, nonce, noncelen);
 	httpmessage_appendheader(response, str_authenticate, STRING_REF("\",opaque=\""));
 	httpmessage_appendheader(response, str_authenticate, STRING_INFO(mod->config->opaque));
 	httpmessage_appendheader(response, str_authenticate, STRING_REF("\",stale="));
-	if (mod->stale)
+	if (stale)
 		httpmessage_appendheader(response, str_authenticate, STRING_REF("true"));
 	else
 		httpmessage_appendheader(response, str_authenticate, STRING_REF("false"));
+	if (mod->config->userhash)
+		httpmessage_appendheader(response, str_authenticate, STRING_REF(",userhash=true"));
 }
 
 static int authn_digest_challenge(void *arg, http_message_t *UNUSED(request), http_message_t *response)
 {
 	int ret;
-	authn_digest_t *mod = (authn_digest_t *)arg;
+	authn_digest_client_t *client = (authn_digest_client_t *)arg;
+	authn_digest_t *mod = client->mod;
+	char _nonce[MAXNONCE];
+	string_t nonce = {0};
 
+	_string_store(&nonce, client->nonce.data, client->nonce.length);
+#ifndef DEBUG
+	if (hash_macsha256 != NULL)
+	{
+		int length = authn_digest_nonce(mod, STRING_REF(_nonce));
+		if (length < 0)
+			return EREJECT;
+		_string_store(&nonce, _nonce, length);
+	}
+#else
+	int length = authn_digest_nonce(mod, STRING_REF(_nonce));
+	if (length < 0)
+		return EREJECT;
+	_string_store(&nonce, _nonce, length);
+#endif
 	/**
 	 * WWW-AUTHENTICATE header without algorithm is mandatory
 	 * Firefox and Chrome doesn't support other algorithm than MD5
 	 */
-	authn_digest_www_authenticate(mod, response);
+	authn_digest_www_authenticate(mod, response, STRING_INFO(nonce), client->stale);
+	/// the stale flag belongs to the request checked just before
+	client->stale = 0;
 
 	if (mod->hash != hash_md5)
 	{
@@ -225,10 +472,10 @@ static int authn_digest_challenge(void *arg, http_message_t *UNUSED(request), ht
 	}
 
 #ifdef DEBUG
-	char _nonce[(int)(HASH_MAX_SIZE * 1.5) + 1];
-	int length = authn_digest_noncetime(arg, _nonce, sizeof(_nonce));
-	if (length > 0)
-		httpmessage_addheader(response, "test-nonce-time", _nonce, length);
+	char _noncetime[(int)(HASH_MAX_SIZE * 1.5) + 1];
+	int timelength = authn_digest_noncetime(mod, _noncetime, sizeof(_noncetime));
+	if (timelength > 0)
+		httpmessage_addheader(response, "test-nonce-time", _noncetime, timelength);
 #endif
 
 	httpmessage_keepalive(response);
@@ -247,7 +494,7 @@ static char *authn_digest_digest(const hash_t * hash, const char *a1, size_t a1l
 {
 	if (a1 && a2)
 	{
-		unsigned char digest[32];
+		unsigned char digest[HASH_MAX_SIZE];
 		void *ctx;
 
 		ctx = hash->init();
@@ -288,7 +535,7 @@ static size_t authn_digest_a1(const hash_t * hash, const char *user, size_t user
 {
 	if (passwd[0] != '$')
 	{
-		unsigned char A1[32];
+		unsigned char A1[HASH_MAX_SIZE];
 		void *ctx;
 
 		ctx = hash->init();
@@ -320,9 +567,9 @@ static size_t authn_digest_a1(const hash_t * hash, const char *user, size_t user
 			passwd += 1;
 			if (decode)
 			{
-				unsigned char b64passwd[64] = {0};
+				unsigned char b64passwd[HASH_MAX_SIZE] = {0};
 				passwdlen -= passwd - fullpasswd;
-				int len = base64->decode(passwd, passwdlen, b64passwd, 64);
+				int len = base64->decode(passwd, passwdlen, b64passwd, sizeof(b64passwd));
 				return utils_stringify(b64passwd, len, a1);
 			}
 			*a1 = strdup(passwd);
@@ -334,7 +581,7 @@ static size_t authn_digest_a1(const hash_t * hash, const char *user, size_t user
 
 static size_t authn_digest_a2(const hash_t * hash, const char *method, size_t methodlen, const char *uri, size_t urilen, const char *entity, size_t entitylen, char **a2)
 {
-	unsigned char A2[32];
+	unsigned char A2[HASH_MAX_SIZE];
 	void *ctx;
 
 	ctx = hash->init();
@@ -442,22 +689,43 @@ static int authn_digest_checkrealm(void *data, const char *value, size_t length)
 	return EREJECT;
 }
 
+struct checknonce_s
+{
+	authn_digest_client_t *client;
+	const char *value;
+	size_t length;
+	uint64_t tag;
+	uint64_t timestamp;
+	int stateless;
+};
+typedef struct checknonce_s checknonce_t;
 static int authn_digest_checknonce(void *data, const char *value, size_t length)
 {
-	checkstring_t *info = (checkstring_t *)data;
-	authn_digest_t *mod = info->mod;
+	checknonce_t *info = (checknonce_t *)data;
+	authn_digest_client_t *client = info->client;
 
-	if (value != NULL && !_string_cmp(&mod->nonce, value, length))
+	if (value == NULL)
 	{
-		info->value = value;
-		info->length = length;
-		auth_dbg("nonce %.*s", (int)length, value);
-		return ESUCCESS;
+		warn("auth: nonce is unset");
+		return EREJECT;
 	}
-	warn("auth: nonce is unset or bad");
-	mod->stale++;
-	mod->stale %= 5;
-	return EREJECT;
+	if (hash_macsha256 != NULL && authn_digest_noncecheck(client->mod, value, length, &info->tag, &info->timestamp, &client->stale) == ESUCCESS)
+		info->stateless = 1;
+#ifndef DEBUG
+	else if (hash_macsha256 == NULL && !_string_cmp(&client->nonce, value, length))
+#else
+	else if (!_string_cmp(&client->mod->nonce, value, length))
+#endif
+		info->stateless = 0;
+	else
+	{
+		warn("auth: nonce is bad");
+		return EREJECT;
+	}
+	info->value = value;
+	info->length = length;
+	auth_dbg("nonce %.*s", (int)length, value);
+	return ESUCCESS;
 }
 
 static int authn_digest_checkopaque(void *data, const char *value, size_t length)
@@ -506,23 +774,31 @@ static int authn_digest_checkqop(void *data, const char *value, size_t length)
 	return EREJECT;
 }
 
+struct checknc_s
+{
+	authn_digest_t *mod;
+	const char *value;
+	size_t length;
+	unsigned long nc;
+};
+typedef struct checknc_s checknc_t;
 static int authn_digest_checknc(void *data, const char *value, size_t length)
 {
-	checkstring_t *info = (checkstring_t *)data;
-	authn_digest_t *mod = info->mod;
+	checknc_t *info = (checknc_t *)data;
 
 	if (value != NULL)
 	{
-		long nc = strtol(value, NULL, 10);
-		if (nc < 5)
+		/// nc is 8 hexadecimal digits (RFC 7616 3.4)
+		info->nc = strtoul(value, NULL, 16);
+		if (info->nc == 0)
 		{
-			info->value = value;
-			info->length = length;
-			auth_dbg("nc %.*s", (int)length, value);
-			return ESUCCESS;
+			warn("auth: nc is bad");
+			return EREJECT;
 		}
-		mod->stale = 0;
-		return EREJECT;
+		info->value = value;
+		info->length = length;
+		auth_dbg("nc %.*s", (int)length, value);
+		return ESUCCESS;
 	}
 	warn("auth: nc is unset");
 	return ESUCCESS;
@@ -543,11 +819,24 @@ static int authn_digest_checkresponse(void *data, const char *value, size_t leng
 	return EREJECT;
 }
 
+static int authn_digest_checkstring(void *data, const char *value, size_t length)
+{
+	checkstring_t *info = (checkstring_t *)data;
+
+	if (value != NULL)
+	{
+		info->value = value;
+		info->length = length;
+	}
+	return ESUCCESS;
+}
+
 struct checkuser_s
 {
 	authz_t *authz;
 	const char *value;
 	size_t length;
+	char *name;
 	const char *passwd;
 	size_t passwdlen;
 };
@@ -556,40 +845,69 @@ typedef struct checkuser_s checkuser_t;
 static int authn_digest_checkuser(void *data, const char *user, size_t length)
 {
 	checkuser_t *info = (checkuser_t *)data;
-	authz_t *authz = info->authz;
 
 	if (user != NULL)
 	{
-		info->passwdlen = authz->rules->passwd(authz->ctx, user, &info->passwd);
-		if (info->passwdlen > 0)
-		{
-			info->value = user;
-			info->length = length;
-			auth_dbg("user %.*s", (int)length, user);
-			return ESUCCESS;
-		}
-		warn("auth: user %s is unknown", user);
+		info->value = user;
+		info->length = length;
+		auth_dbg("user %.*s", (int)length, user);
+		return ESUCCESS;
 	}
 	warn("auth: user is unset");
 	return EREJECT;
 }
 
+/**
+ * the password is looked up after the parsing
+ * because "userhash" may follow "username" into the header.
+ */
+static int authn_digest_finduser(const authn_digest_t *mod, const hash_t *hash, checkuser_t *info, const checkstring_t *userhash)
+{
+	authz_t *authz = info->authz;
+
+	if (userhash->length == 4 && !strncmp(userhash->value, "true", 4))
+	{
+		const char *name = NULL;
+		if (authz->rules->userhash != NULL)
+			name = authz->rules->userhash(authz->ctx, hash, &mod->authn->config->realm, info->value, info->length);
+		if (name == NULL)
+		{
+			warn("auth: userhash %.*s is unknown", (int)info->length, info->value);
+			return EREJECT;
+		}
+		/// the name may be a reference into the storage of the authz
+		info->name = strdup(name);
+	}
+	else
+		info->name = strndup(info->value, info->length);
+
+	int ret = authz->rules->passwd(authz->ctx, info->name, &info->passwd);
+	if (ret <= 0)
+	{
+		warn("auth: user %s is unknown", info->name);
+		return EREJECT;
+	}
+	info->passwdlen = ret;
+	return ESUCCESS;
+}
 
 static char *str_empty = "";
 static const char *authn_digest_check(void *arg, authz_t *authz, const char *method, size_t methodlen, const char *uri, size_t urilen, const char *string, size_t stringlen)
 {
 	const char *user_ret = NULL;
-	authn_digest_t *mod = (authn_digest_t *)arg;
+	authn_digest_client_t *client = (authn_digest_client_t *)arg;
+	authn_digest_t *mod = client->mod;
 	checkuri_t url = { .mod = mod, .url = uri};
 	chekcalgorithm_t algorithm = { .mod = mod};
 	checkuser_t user = {.authz = authz};
 	checkstring_t realm = {.mod = mod, .value = str_empty, .length = 0};
 	checkstring_t qop = {.mod = mod};
-	checkstring_t nonce = {.mod = mod};
+	checknonce_t nonce = {.client = client};
 	checkstring_t cnonce = {.mod = mod, .value = str_empty, .length = 0};
-	checkstring_t nc = {.mod = mod};
+	checknc_t nc = {.mod = mod};
 	checkstring_t opaque = {.mod = mod, .value = str_empty, .length = 0};
 	checkstring_t response = {.mod = mod};
+	checkstring_t userhash = {.mod = mod, .value = str_empty, .length = 0};
 	utils_parsestring_t parser[] = {
 		{.field = "username", .cb = authn_digest_checkuser, .cbdata = &user},
 		{.field = "response", .cb = authn_digest_checkresponse, .cbdata = &response},
@@ -601,14 +919,23 @@ static const char *authn_digest_check(void *arg, authz_t *authz, const char *met
 		{.field = "cnonce", .cb = authn_digest_checkcnonce,.cbdata =  &cnonce},
 		{.field = "nc", .cb = authn_digest_checknc, .cbdata = &nc},
 		{.field = "opaque", .cb = authn_digest_checkopaque, .cbdata = &opaque},
+		{.field = "userhash", .cb = authn_digest_checkstring, .cbdata = &userhash},
 	};
 
-	int ret = utils_parsestring(string, stringlen, 10, parser);
+	client->stale = 0;
+	int ret = utils_parsestring(string, stringlen, sizeof(parser) / sizeof(*parser), parser);
+	if (ret == ESUCCESS)
+		ret = authn_digest_finduser(mod, algorithm.hash, &user, &userhash);
+	if (ret == ESUCCESS && nonce.stateless && nc.value == NULL)
+	{
+		warn("auth: nc is required with this nonce");
+		ret = EREJECT;
+	}
 	if (ret == ESUCCESS && authn_digest_computing)
 	{
 		char *a1 = NULL;
 		size_t a1len = authn_digest_computing->a1(algorithm.hash,
-						user.value, user.length,
+						user.name, strlen(user.name),
 						realm.value, realm.length,
 						user.passwd, user.passwdlen, &a1);
 		auth_dbg("a1:\n\t%.*s\n", (int)a1len, a1);
@@ -627,27 +954,32 @@ static const char *authn_digest_check(void *arg, authz_t *authz, const char *met
 						a2, a2len);
 
 		auth_dbg("Digest:\n\t%.*s\n\t%s", (int)response.length, response.value, digest);
-		if (mod->user != NULL)
-			free(mod->user);
-		if (digest && !strncmp(digest, response.value, response.length))
+		free(client->user);
+		client->user = NULL;
+		/**
+		 * the nonce-count is registered only for a right digest,
+		 * otherwise anybody may burn the counters of a client.
+		 */
+		if (digest && !strncmp(digest, response.value, response.length) &&
+			(!nonce.stateless || authn_digest_nccheck(mod, nonce.tag, nonce.timestamp, nc.nc, &client->stale) == ESUCCESS))
 		{
-			mod->user = strndup(user.value, user.length);
-			user_ret = mod->user;
+			client->user = user.name;
+			user.name = NULL;
+			user_ret = client->user;
 		}
-		else
-			mod->user = NULL;
 		free (a1);
 		free (a2);
 		free (digest);
 	}
+	free(user.name);
 	return user_ret;
 }
 
 static void authn_digest_destroy(void *arg)
 {
 	authn_digest_t *mod = (authn_digest_t *)arg;
-	if (mod->user != NULL)
-		free(mod->user);
+	if (mod->nctable != NULL)
+		munmap(mod->nctable, sizeof(*mod->nctable) * NC_BUCKETS);
 	free(mod->config);
 	free(mod);
 }
@@ -656,6 +988,7 @@ authn_rules_t authn_digest_rules =
 {
 	.create = &authn_digest_create,
 	.setup = &authn_digest_setup,
+	.cleanup = &authn_digest_cleanup,
 	.challenge = &authn_digest_challenge,
 	.check = &authn_digest_check,
 	.destroy = &authn_digest_destroy,
@@ -42,6 +42,7 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "authn_none.h"
+#include "log.h"
 
 #define auth_dbg(...)
 
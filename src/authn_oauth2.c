@@ -1,5 +1,5 @@
 /*****************************************************************************
- * authn_oauth2.c: Basic Authentication mode
+ * authn_oauth2.c: oAuth2 Authentication mode
  * this file is part of https://github.com/ouistiti-project/ouistiti
  *****************************************************************************
  * Copyright (C) 2016-2017
@@ -28,8 +28,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
 #include <time.h>
-#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <jansson.h>
 
@@ -39,45 +42,70 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "authn_oauth2.h"
+#include "log.h"
+#ifdef AUTHZ_JWT
 #include "authz_jwt.h"
-
-#define auth_dbg(...)
-
-#ifdef TLS
-const httpclient_ops_t *tlsclient_ops;
 #endif
 
-static const char *str_authresp = "/auth/resp";
-static const char *str_oauth2 = "oauth2";
-static const char *str_auth = "auth";
-
-typedef struct authn_oauth2_config_s authn_oauth2_config_t;
+#define auth_dbg(...)
 
-typedef struct authn_oauth2_s authn_oauth2_t;
-struct authn_oauth2_s
+#define OAUTH2_CACHE_KEYLEN 16
+#define OAUTH2_CACHE_SIZE 256
+#define OAUTH2_CACHE_TTL 60
+/// a refused token is kept a short time to protect the authorization server
+#define OAUTH2_CACHE_NEGATIVETTL 5
+/// a lookup pending more than this delay is restarted by another client
+#define OAUTH2_PENDING_TIMEOUT 10
+/// delay of a waiter of a pending lookup, in ms
+#define OAUTH2_WAIT 20
+#define OAUTH2_CONTENT_MAX 16384
+
+static const char str_authresp[] = "/auth/resp";
+static const char str_oauth2[] = "oauth2";
+
+typedef enum
 {
-	authn_oauth2_config_t *config;
-	authz_t *authz;
-	http_client_t *clt;
-	void *vhost;
-	int state;
+	OAUTH2_FREE_E = 0,
+	OAUTH2_PENDING_E,
+	OAUTH2_VALID_E,
+	OAUTH2_INVALID_E,
+} oauth2_state_t;
+
+/**
+ * the cache is shared between the processes of the clients.
+ * It is direct mapped on the key, which is the beginning of
+ * the hash of the token. The token itself is never stored.
+ */
+typedef struct oauth2_entry_s oauth2_entry_t;
+struct oauth2_entry_s
+{
+	uint32_t lock;
+	uint32_t state;
+	/// changed at the end of the pending state, the waiters sleep on it
+	uint32_t wakeup;
+	unsigned char key[OAUTH2_CACHE_KEYLEN];
+	time_t expires;
+	char user[USER_MAX];
 };
 
-typedef struct _mod_oauth2_ctx_s _mod_oauth2_ctx_t;
-struct _mod_oauth2_ctx_s
+typedef enum
 {
-	authn_oauth2_t *mod;
-};
+	OAUTH2_TOKEN_E,
+	OAUTH2_USERINFO_E,
+} oauth2_lookup_type_t;
 
-json_t *json_load_callback(json_load_callback_t callback, void *data, size_t flags, json_error_t *error);
-struct _json_load_s
+typedef struct oauth2_lookup_s oauth2_lookup_t;
+struct oauth2_lookup_s
 {
+	oauth2_lookup_type_t type;
 	http_client_t *client;
 	http_message_t *request;
 	http_message_t *response;
-	const char *content;
+	unsigned char key[OAUTH2_CACHE_KEYLEN];
+	int owner;
 };
 
+typedef struct authn_oauth2_config_s authn_oauth2_config_t;
 struct authn_oauth2_config_s
 {
 	string_t client_id;
@@ -85,320 +113,533 @@ struct authn_oauth2_config_s
 	string_t discovery;
 	string_t auth_ep;
 	string_t token_ep;
-	string_t iss;
+	string_t userinfo_ep;
+	int cachettl;
+	int cachesize;
+};
+
+typedef struct authn_oauth2_s authn_oauth2_t;
+struct authn_oauth2_s
+{
+	authn_oauth2_config_t *config;
+	const authn_t *authn;
+	oauth2_entry_t *cache;
+	http_client_t *clt;
+	oauth2_lookup_t *lookup;
+	/// the last token resolved by this client, even without cache
+	unsigned char userkey[OAUTH2_CACHE_KEYLEN];
+	char user[USER_MAX];
+	int state;
 };
 
 #ifdef FILE_CONFIG
+static void _oauth2_configstring(const config_setting_t *configauth, const char *name, string_t *value)
+{
+	const char *data = NULL;
+	config_setting_lookup_string(configauth, name, &data);
+	if (data != NULL)
+		_string_store(value, data, -1);
+}
+
 void *authn_oauth2_config(const config_setting_t *configauth)
 {
 	authn_oauth2_config_t *authn_config = NULL;
-	const char *auth_ep = NULL;
-	const char *discovery = NULL;
-
-	config_setting_lookup_string(configauth, "discovery", (const char **)&discovery);
-	config_setting_lookup_string(configauth, "auth_ep", (const char **)&auth_ep);
 
 	authn_config = calloc(1, sizeof(*authn_config));
-	authn_config->discovery = discovery;
-	authn_config->auth_ep = auth_ep;
-
-	config_setting_lookup_string(configauth, "realm", (const char **)&authn_config->realm);
-
-	config_setting_lookup_string(configauth, "client_id", (const char **)&authn_config->client_id);
-	if (authn_config->client_id == NULL)
-		authn_config->client_id = authn_config->realm;
-
-	config_setting_lookup_string(configauth, "client_passwd", (const char **)&authn_config->client_passwd);
-	if (authn_config->client_passwd == NULL)
-	{
-		config_setting_lookup_string(configauth, "secret", (const char **)&authn_config->client_passwd);
-	}
-
-	if (authn_config->iss == NULL)
-		authn_config->iss = authn_config->realm;
+	_oauth2_configstring(configauth, "discovery", &authn_config->discovery);
+	_oauth2_configstring(configauth, "auth_ep", &authn_config->auth_ep);
+	_oauth2_configstring(configauth, "token_ep", &authn_config->token_ep);
+	_oauth2_configstring(configauth, "userinfo_ep", &authn_config->userinfo_ep);
+	_oauth2_configstring(configauth, "client_id", &authn_config->client_id);
+	_oauth2_configstring(configauth, "client_passwd", &authn_config->client_passwd);
+	if (authn_config->client_passwd.data == NULL)
+		_oauth2_configstring(configauth, "secret", &authn_config->client_passwd);
+
+	authn_config->cachettl = OAUTH2_CACHE_TTL;
+	config_setting_lookup_int(configauth, "cachettl", &authn_config->cachettl);
+	authn_config->cachesize = OAUTH2_CACHE_SIZE;
+	config_setting_lookup_int(configauth, "cachesize", &authn_config->cachesize);
+	if (authn_config->cachesize < 0)
+		authn_config->cachesize = 0;
 
 	return authn_config;
 }
 #endif
 
-size_t _json_load(void *buffer, size_t buflen, void *data)
+static void _oauth2_cache_key(const char *token, size_t tokenlen, unsigned char *key)
 {
-	int ret;
-	size_t size;
-	struct _json_load_s *info = (struct _json_load_s *)data;
+	const hash_t *hash = hash_sha256;
+	if (hash == NULL)
+		hash = hash_md5;
+	char digest[HASH_MAX_SIZE] = {0};
+	void *ctx = hash->init();
+	hash->update(ctx, token, tokenlen);
+	hash->finish(ctx, digest);
+	memcpy(key, digest, OAUTH2_CACHE_KEYLEN);
+}
 
-	if (info->response == NULL)
-		info->response = httpmessage_create(654);
+static oauth2_entry_t *_oauth2_cache_lock(const authn_oauth2_t *mod, const unsigned char *key)
+{
+	if (mod->cache == NULL)
+		return NULL;
+	uint32_t index = 0;
+	memcpy(&index, key, sizeof(index));
+	oauth2_entry_t *entry = &mod->cache[index % mod->config->cachesize];
+	while (__atomic_exchange_n(&entry->lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+	return entry;
+}
 
-	do
-	{
-		ret = httpclient_sendrequest(info->client, info->request, info->response);
-	} while (ret == EINCOMPLETE);
+static void _oauth2_cache_unlock(oauth2_entry_t *entry)
+{
+	__atomic_store_n(&entry->lock, 0, __ATOMIC_RELEASE);
+}
 
-	char *content = NULL;
-	unsigned long long length = 0;
-	size = httpmessage_content(info->response, &content, &length);
-	if (size > 0 && size < buflen)
+/**
+ * @return OAUTH2_VALID_E and the user, OAUTH2_INVALID_E for a refused token,
+ *  OAUTH2_PENDING_E if another client is looking for the same token,
+ *  OAUTH2_FREE_E if the caller has to do the lookup. In this last case
+ *  "owner" is set when the slot is reserved for the result.
+ *  Without "owner" the cache is only read.
+ */
+static oauth2_state_t _oauth2_cache_claim(const authn_oauth2_t *mod, const unsigned char *key, char *user, int *owner)
+{
+	oauth2_state_t state = OAUTH2_FREE_E;
+	if (owner != NULL)
+		*owner = 0;
+	oauth2_entry_t *entry = _oauth2_cache_lock(mod, key);
+	if (entry == NULL)
+		return state;
+
+	time_t now = ouistiti_time();
+	int same = !memcmp(entry->key, key, OAUTH2_CACHE_KEYLEN);
+	if (entry->state != OAUTH2_FREE_E && entry->expires < now)
+		entry->state = OAUTH2_FREE_E;
+	if (same && entry->state != OAUTH2_FREE_E)
 	{
-		memcpy(buffer, content, size);
+		state = entry->state;
+		if (state == OAUTH2_VALID_E && user != NULL)
+			strncpy(user, entry->user, USER_MAX - 1);
 	}
-	else if (size == EREJECT)
-		size = 0;
-	else if (size < 0)
-		size = sizeof(size) - 1;
-	return size;
+	else if (owner != NULL && entry->state != OAUTH2_PENDING_E)
+	{
+		/// the previous token is evicted
+		memcpy(entry->key, key, OAUTH2_CACHE_KEYLEN);
+		entry->state = OAUTH2_PENDING_E;
+		entry->expires = now + OAUTH2_PENDING_TIMEOUT;
+		*owner = 1;
+	}
+	_oauth2_cache_unlock(entry);
+	return state;
 }
 
-static int _oauth2_checkidtoken(authn_oauth2_t *mod, json_t *json_idtoken, authsession_t *authinfo)
+/**
+ * the client sleeps until the end of the lookup of the other client,
+ * at most OAUTH2_WAIT ms before to return to the loop of its server.
+ */
+static void _oauth2_cache_wait(const authn_oauth2_t *mod, const unsigned char *key)
 {
-	authn_oauth2_config_t *config = (authn_oauth2_config_t *)mod->config;
+	oauth2_entry_t *entry = _oauth2_cache_lock(mod, key);
+	if (entry == NULL)
+		return;
+	int pending = (entry->state == OAUTH2_PENDING_E && !memcmp(entry->key, key, OAUTH2_CACHE_KEYLEN));
+	uint32_t wakeup = entry->wakeup;
+	_oauth2_cache_unlock(entry);
+	if (pending)
+		ouistiti_wait(&entry->wakeup, wakeup, OAUTH2_WAIT);
+}
 
-	const char *id_token = json_string_value(json_idtoken);
-	const char *data = id_token;
-	const char *sign = strrchr(id_token, '.');
-	if (sign != NULL)
+static void _oauth2_cache_set(const authn_oauth2_t *mod, const unsigned char *key, const char *user, int expires_in)
+{
+	oauth2_entry_t *entry = _oauth2_cache_lock(mod, key);
+	if (entry == NULL)
+		return;
+	int same = !memcmp(entry->key, key, OAUTH2_CACHE_KEYLEN);
+	int pending = (entry->state == OAUTH2_PENDING_E);
+	/// a pending lookup of another token keeps the slot
+	if (same || !pending)
 	{
-		size_t datalen = sign - data;
-		sign++;
-		if (authn_checksignature(config->client_passwd, data, datalen, sign, strlen(sign)) == ESUCCESS)
+		memcpy(entry->key, key, OAUTH2_CACHE_KEYLEN);
+		int ttl = mod->config->cachettl;
+		if (user != NULL)
 		{
-			jwt_decode(id_token, authinfo);
-			auth_dbg("oAuth2 id_token: %s", id_token);
-			return ESUCCESS;
+			strncpy(entry->user, user, USER_MAX - 1);
+			entry->user[USER_MAX - 1] = '\0';
+			entry->state = OAUTH2_VALID_E;
+			if (expires_in > 0 && expires_in < ttl)
+				ttl = expires_in;
 		}
+		else
+		{
+			entry->user[0] = '\0';
+			entry->state = OAUTH2_INVALID_E;
+			if (ttl > OAUTH2_CACHE_NEGATIVETTL)
+				ttl = OAUTH2_CACHE_NEGATIVETTL;
+		}
+		entry->expires = ouistiti_time() + ttl;
 	}
-	return EREJECT;
+	else
+		pending = 0;
+	_oauth2_cache_unlock(entry);
+	if (pending)
+		ouistiti_wake(&entry->wakeup);
 }
 
-static json_t *_oauth2_authresp_send(authn_oauth2_t *mod, http_message_t *request)
+static void _oauth2_cache_release(const authn_oauth2_t *mod, const unsigned char *key)
 {
-	json_t *json_authtokens = NULL;
-	authn_oauth2_config_t *config = (authn_oauth2_config_t *)mod->config;
-	http_client_t *client = NULL;
-	http_message_t *response2 = NULL;
-	http_message_t *request2 = NULL;
-
-	request2 = httpmessage_create();
+	oauth2_entry_t *entry = _oauth2_cache_lock(mod, key);
+	if (entry == NULL)
+		return;
+	int pending = (entry->state == OAUTH2_PENDING_E && !memcmp(entry->key, key, OAUTH2_CACHE_KEYLEN));
+	if (pending)
+		entry->state = OAUTH2_FREE_E;
+	_oauth2_cache_unlock(entry);
+	if (pending)
+		ouistiti_wake(&entry->wakeup);
+}
 
-	const char *code = httpmessage_parameter(request, str_authorization_code);
-	if (code == NULL)
+static oauth2_lookup_t *_oauth2_lookup_create(const char *method, const string_t *url)
+{
+	if (url->data == NULL || url->length == 0)
+		return NULL;
+	oauth2_lookup_t *lookup = calloc(1, sizeof(*lookup));
+	lookup->request = httpmessage_create(0);
+	lookup->client = httpmessage_request(lookup->request, method, url->data, NULL);
+	if (lookup->client == NULL)
+	{
+		err("oauth2: server %s unreachable", url->data);
+		httpmessage_destroy(lookup->request);
+		free(lookup);
 		return NULL;
+	}
+	lookup->response = httpmessage_create(0);
+	return lookup;
+}
 
-	char location[256];
-	snprintf(location, 256, "%s", config->token_ep);
+static void _oauth2_lookup_destroy(oauth2_lookup_t *lookup)
+{
+	if (lookup->request != NULL)
+		httpmessage_destroy(lookup->request);
+	if (lookup->response != NULL)
+		httpmessage_destroy(lookup->response);
+	if (lookup->client != NULL)
+		httpclient_destroy(lookup->client);
+	free(lookup);
+}
 
-	client = httpmessage_request(request2, "POST", location, NULL);
+/**
+ * the request to the authorization server is sent step by step.
+ * The connector returns EINCOMPLETE and the server calls it again
+ * when it is ready, then the worker is never blocked during
+ * the round trip.
+ */
+static int _oauth2_lookup_run(oauth2_lookup_t *lookup, json_t **json)
+{
+	int ret = httpclient_sendrequest(lookup->client, lookup->request, lookup->response);
+	if (ret == EINCOMPLETE)
+		return ret;
+	*json = NULL;
+	if (ret == EREJECT)
+	{
+		err("oauth2: authorization server error");
+		return EREJECT;
+	}
 
-	if (client != NULL)
+	char *content = NULL;
+	size_t contentlen = 0;
+	const char *input = NULL;
+	size_t rest = 0;
+	int length;
+	while ((length = httpmessage_content(lookup->response, &input, &rest)) > 0)
+	{
+		if (contentlen + length > OAUTH2_CONTENT_MAX)
+			break;
+		content = realloc(content, contentlen + length);
+		memcpy(content + contentlen, input, length);
+		contentlen += length;
+	}
+	const char *status = httpmessage_REQUEST(lookup->response, "result");
+	if (status != NULL && atoi(status) == 200 && contentlen > 0)
 	{
-		const char *type = "authorization_code"; /** RFC6749 4.1.2 */
+		json_error_t error;
+		*json = json_loadb(content, contentlen, 0, &error);
+		if (*json == NULL)
+			err("oauth2: json decoding error %s", error.text);
+	}
+	else
+		warn("oauth2: authorization server result %s", status);
+	free(content);
+	return (*json != NULL)? ESUCCESS: EREJECT;
+}
 
+static const char *_oauth2_jsonstring(const json_t *json, const char *key)
+{
+	const json_t *value = json_object_get(json, key);
+	if (value != NULL && json_is_string(value))
+		return json_string_value(value);
+	return NULL;
+}
 
-		httpmessage_addheader(request2, str_authorization, STRING_REF("Basic "));
+/**
+ * userinfo endpoint (OpenID Connect Core 5.3)
+ */
+static int _oauth2_userinfo_start(authn_oauth2_t *mod, const char *token, size_t tokenlen, const unsigned char *key, int owner)
+{
+	oauth2_lookup_t *lookup = _oauth2_lookup_create("GET", &mod->config->userinfo_ep);
+	if (lookup == NULL)
+		return EREJECT;
+	lookup->type = OAUTH2_USERINFO_E;
+	lookup->owner = owner;
+	memcpy(lookup->key, key, OAUTH2_CACHE_KEYLEN);
+	httpmessage_addheader(lookup->request, str_authorization, STRING_REF("Bearer "));
+	httpmessage_appendheader(lookup->request, str_authorization, token, tokenlen);
+	mod->lookup = lookup;
+	return ESUCCESS;
+}
 
-		char authorization[256] = {0};
-		char basic[164];
-		snprintf(basic, 164, "%s:%s", config->client_id, config->client_passwd);
-		int length = base64_urlencoding->encode(basic, strlen(basic), authorization, 256);
-		httpmessage_appendheader(request2, str_authorization, authorization, length);
+static int _oauth2_userinfo_receive(authn_oauth2_t *mod)
+{
+	json_t *json = NULL;
+	int ret = _oauth2_lookup_run(mod->lookup, &json);
+	if (ret == EINCOMPLETE)
+		return ret;
 
-		response2 = httpmessage_create();
+	const char *user = NULL;
+	if (json != NULL)
+	{
+		user = _oauth2_jsonstring(json, "preferred_username");
+		if (user == NULL)
+			user = _oauth2_jsonstring(json, "username");
+		if (user == NULL)
+			user = _oauth2_jsonstring(json, "sub");
+	}
+	/// the result is stored even without owner, the slot may be free now
+	_oauth2_cache_set(mod, mod->lookup->key, user, 0);
+	memcpy(mod->userkey, mod->lookup->key, OAUTH2_CACHE_KEYLEN);
+	mod->user[0] = '\0';
+	if (user != NULL)
+		strncpy(mod->user, user, USER_MAX - 1);
+	if (json != NULL)
+		json_decref(json);
+	_oauth2_lookup_destroy(mod->lookup);
+	mod->lookup = NULL;
+	return ECONTINUE;
+}
 
-		struct _json_load_s _json_load_data = {
-			.client = client,
-			.request = request2,
-			.response = response2,
-			.content = 0,
-		};
+static const char *_oauth2_bearer(http_message_t *request, size_t *tokenlen)
+{
+	const char *authorization = NULL;
+	size_t length = httpmessage_REQUEST2(request, str_authorization, &authorization);
+	if (length <= 7 || strncmp(authorization, "Bearer ", 7))
+		return NULL;
+	*tokenlen = length - 7;
+	return authorization + 7;
+}
 
-		http_server_t *server = httpclient_server(mod->clt);
-		_json_load_data.content += httpmessage_addcontent(request2, "application/x-www-form-urlencoded", STRING_REF("grant_type="));
-		_json_load_data.content += httpmessage_appendcontent(request2, type, -1);
-		_json_load_data.content += httpmessage_appendcontent(request2, STRING_REF("&code="));
-		_json_load_data.content += httpmessage_appendcontent(request2, code, -1);
-		_json_load_data.content += httpmessage_appendcontent(request2, STRING_REF("&client_id="));
-		_json_load_data.content += httpmessage_appendcontent(request2, config->client_id, -1);
-		_json_load_data.content += httpmessage_appendcontent(request2, STRING_REF("&scope=openid roles profile"));
-		_json_load_data.content += httpmessage_appendcontent(request2, STRING_REF("&redirect_uri="));
-		const char *scheme = NULL;
-		size_t schemelen = httpserver_INFO2(server, "scheme", &scheme);
-		_json_load_data.content += httpmessage_appendcontent(request2, scheme, schemelen);
-		_json_load_data.content += httpmessage_appendcontent(request2, STRING_REF("://"));
-		const char *host = NULL;
-		size_t hostlen = httpserver_INFO2(server, "hostname", &host);
-		if (hostlen == 0)
-		{
-			hostlen = httpserver_REQUEST2(request, "addr", &host);
-		}
-		_json_load_data.content += httpmessage_appendcontent(request2, host, hostlen);
-		const char *port = NULL;
-		size_t portlen = httpserver_INFO2(server, "port");
-		if (portlen != 0)
-		{
-			_json_load_data.content += httpmessage_appendcontent(request2, STRING_REF(":"));
-			_json_load_data.content += httpmessage_appendcontent(request2, port, portlen);
-		}
-		_json_load_data.content += httpmessage_appendcontent(request2, STRING_REF(str_authresp));
-		_json_load_data.content += httpmessage_appendcontent(request2, STRING_REF("&state="));
-		char state[4] = {0};
-		int statelen = snprintf(state, 4, "%.3d", mod->state);
-		_json_load_data.content += httpmessage_appendcontent(request2, state, statelen);
-
-		/**
-		 * send checking request to the authmanager
-		 */
-		json_error_t error;
-		json_authtokens = json_load_callback(_json_load, &_json_load_data, 0, &error);
-		if (json_authtokens == NULL)
-		{
-			int result = atoi(httpmessage_REQUEST(_json_load_data.response, "Status"));
-			if (result == 200)
-				err("oauth2 json decoding error %s", error.text);
-			else
-				err("oauth2 authorization error %d", result);
-		}
+/**
+ * the connector resolves the token before the check of mod_auth.
+ * Only one client looks for a token at a time, the others wait
+ * for the result into the cache (single-flight).
+ */
+static int _oauth2_userinfo_connector(authn_oauth2_t *mod, http_message_t *request)
+{
+	if (mod->config->userinfo_ep.data == NULL)
+		return ECONTINUE;
+	size_t tokenlen = 0;
+	const char *token = _oauth2_bearer(request, &tokenlen);
+	if (token == NULL)
+		return ECONTINUE;
+
+	unsigned char key[OAUTH2_CACHE_KEYLEN];
+	_oauth2_cache_key(token, tokenlen, key);
+	int owner = 0;
+	oauth2_state_t state = _oauth2_cache_claim(mod, key, NULL, &owner);
+	if (state == OAUTH2_PENDING_E)
+	{
+		_oauth2_cache_wait(mod, key);
+		return EINCOMPLETE;
+	}
+	if (state != OAUTH2_FREE_E)
+		return ECONTINUE;
+	if (_oauth2_userinfo_start(mod, token, tokenlen, key, owner) != ESUCCESS)
+	{
+		_oauth2_cache_set(mod, key, NULL, 0);
+		return ECONTINUE;
 	}
-	if (request2 != NULL)
-		httpmessage_destroy(request2);
-	if (response2 != NULL)
-		httpmessage_destroy(response2);
-	if (client != NULL)
-		httpclient_destroy(client);
-	return json_authtokens;
+	return EINCOMPLETE;
 }
 
-static int _oauth2_authresp_receive(authn_oauth2_t *mod, json_t *json_authtokens, authsession_t *authinfo)
+/**
+ * token endpoint (RFC6749 4.1.3)
+ */
+static int _oauth2_token_start(authn_oauth2_t *mod, http_message_t *request)
 {
-	int ret = EREJECT;
-	if (json_is_object(json_authtokens))
+	const authn_oauth2_config_t *config = mod->config;
+	const char *code = NULL;
+	size_t codelen = httpmessage_parameter(request, "code", &code);
+	if (codelen == 0)
+		return EREJECT;
+
+	oauth2_lookup_t *lookup = _oauth2_lookup_create("POST", &config->token_ep);
+	if (lookup == NULL)
+		return EREJECT;
+	lookup->type = OAUTH2_TOKEN_E;
+
+	char basic[164];
+	int basiclen = snprintf(basic, sizeof(basic), "%s:%s", config->client_id.data,
+				(config->client_passwd.data)? config->client_passwd.data: "");
+	char authorization[256] = {0};
+	int length = base64->encode(basic, basiclen, authorization, sizeof(authorization));
+	httpmessage_addheader(lookup->request, str_authorization, STRING_REF("Basic "));
+	httpmessage_appendheader(lookup->request, str_authorization, authorization, length);
+
+	http_server_t *server = httpclient_server(mod->clt);
+	httpmessage_addcontent(lookup->request, "application/x-www-form-urlencoded", STRING_REF("grant_type=authorization_code"));
+	httpmessage_appendcontent(lookup->request, STRING_REF("&code="));
+	httpmessage_appendcontent(lookup->request, code, codelen);
+	httpmessage_appendcontent(lookup->request, STRING_REF("&client_id="));
+	httpmessage_appendcontent(lookup->request, config->client_id.data, config->client_id.length);
+	httpmessage_appendcontent(lookup->request, STRING_REF("&redirect_uri="));
+	const char *scheme = NULL;
+	size_t schemelen = httpserver_INFO2(server, "scheme", &scheme);
+	httpmessage_appendcontent(lookup->request, scheme, schemelen);
+	httpmessage_appendcontent(lookup->request, STRING_REF("://"));
+	const char *host = NULL;
+	size_t hostlen = httpserver_INFO2(server, "hostname", &host);
+	if (hostlen == 0)
+		hostlen = httpmessage_REQUEST2(request, "addr", &host);
+	httpmessage_appendcontent(lookup->request, host, hostlen);
+	const char *port = NULL;
+	size_t portlen = httpserver_INFO2(server, "port", &port);
+	if (portlen != 0)
 	{
-		const char *access_token = NULL;
-		const char *user;
+		httpmessage_appendcontent(lookup->request, STRING_REF(":"));
+		httpmessage_appendcontent(lookup->request, port, portlen);
+	}
+	httpmessage_appendcontent(lookup->request, STRING_REF(str_authresp));
+	char state[8];
+	int statelen = snprintf(state, sizeof(state), "&state=%.3d", mod->state);
+	httpmessage_appendcontent(lookup->request, state, statelen);
 
-		json_t *json_error = json_object_get(json_authtokens, "error");
-		if (json_error != NULL && json_is_string(json_error))
-		{
-			const char *error = json_string_value(json_error);
-			const char *desc = NULL;
-			json_t *json_desc = json_object_get(json_authtokens, "error");
-			if (json_desc != NULL && json_is_string(json_desc))
-				desc = json_string_value(json_desc);
-			err("oAuth2 authorization error: %s (%s)", error, desc);
-		}
-		json_t *json_acctoken = json_object_get(json_authtokens, "access_token");
-		if (json_acctoken != NULL && json_is_string(json_acctoken))
-		{
-			access_token = json_string_value(json_acctoken);
-			auth_dbg("oAuth2 access_token: %s", access_token);
-		}
-		json_t *json_idtoken = json_object_get(json_authtokens, "id_token");
-		if (json_idtoken != NULL && json_is_string(json_idtoken))
-		{
-			ret = _oauth2_checkidtoken(mod, json_idtoken, authinfo);
-		}
-		json_t *json_username = json_object_get(json_authtokens, "username");
-		if (json_username != NULL && json_is_string(json_username))
-		{
-			strncpy(authinfo->user, json_string_value(json_username), sizeof(authinfo->user));
-			strncpy(authinfo->group, "users", sizeof(authinfo->group));
-			ret = ESUCCESS;
-		}
-		json_t *json_expire = json_object_get(json_authtokens, "expires_in");
-		if (json_expire != NULL && json_is_integer(json_expire))
-		{
-			authinfo->expires = json_integer_value(json_expire);
-			auth_dbg("oAuth2 access_token expire in: %ds", authinfo->expires);
-		}
+	mod->lookup = lookup;
+	return ESUCCESS;
+}
 
-		if (access_token != NULL)
+static const char *_oauth2_token_user(authn_oauth2_t *mod, const json_t *json)
+{
+	const char *user = _oauth2_jsonstring(json, "username");
+#ifdef AUTHZ_JWT
+	const char *id_token = _oauth2_jsonstring(json, "id_token");
+	const char *sign = (id_token != NULL)? strrchr(id_token, '.'): NULL;
+	if (user == NULL && sign != NULL)
+	{
+		const mod_auth_t *config = mod->authn->config;
+		size_t datalen = sign - id_token;
+		sign++;
+		if (authn_checktokensignature(config, id_token, datalen, sign, strlen(sign)) == ESUCCESS)
 		{
-			/**
-			 * keep only the signature of the access_token.
-			 * The KeyCloak token is too long for ouistiti.
-			 */
-			if (strlen(access_token) > TOKEN_MAX)
-			{
-				char *tmp = strrchr(access_token, '.');
-				if (tmp != NULL)
-				{
-					access_token = tmp + 1;
-				}
-				tmp = (char *)access_token + TOKEN_MAX;
-				*tmp = '\0';
-			}
-			strncpy(authinfo->token, access_token, TOKEN_MAX);
+			const char *issuer = NULL;
+			authz_jwt_getinfo(id_token, &user, &issuer);
 		}
 		else
-			ret = EREJECT;
+			err("oauth2: id_token with bad signature");
 	}
-	return ret;
+#endif
+	return user;
 }
 
-static int _oauth2_authresp_connector(void *arg, http_message_t *request, http_message_t *response)
+static int _oauth2_token_receive(authn_oauth2_t *mod, http_message_t *request, http_message_t *response)
+{
+	json_t *json = NULL;
+	int ret = _oauth2_lookup_run(mod->lookup, &json);
+	if (ret == EINCOMPLETE)
+		return ret;
+
+	const char *access_token = NULL;
+	const char *user = NULL;
+	if (json_is_object(json))
+	{
+		const char *error = _oauth2_jsonstring(json, "error");
+		if (error != NULL)
+			err("oauth2: authorization error: %s (%s)", error, _oauth2_jsonstring(json, "error_description"));
+		access_token = _oauth2_jsonstring(json, "access_token");
+		user = _oauth2_token_user(mod, json);
+	}
+	if (access_token != NULL && user != NULL)
+	{
+		int expires_in = 0;
+		const json_t *json_expire = json_object_get(json, "expires_in");
+		if (json_expire != NULL && json_is_integer(json_expire))
+			expires_in = json_integer_value(json_expire);
+		/// the next requests with this token don't need the userinfo endpoint
+		unsigned char key[OAUTH2_CACHE_KEYLEN];
+		_oauth2_cache_key(access_token, strlen(access_token), key);
+		_oauth2_cache_set(mod, key, user, expires_in);
+
+		httpmessage_addheader(response, str_authorization, STRING_REF("Bearer "));
+		httpmessage_appendheader(response, str_authorization, access_token, -1);
+		const char *scheme = NULL;
+		size_t schemelen = httpmessage_REQUEST2(request, "scheme", &scheme);
+		httpmessage_addheader(response, str_location, scheme, schemelen);
+		httpmessage_appendheader(response, str_location, STRING_REF("://"));
+		const char *host = NULL;
+		size_t hostlen = httpmessage_REQUEST2(request, "host", &host);
+		httpmessage_appendheader(response, str_location, host, hostlen);
+		httpmessage_appendheader(response, str_location, STRING_REF("/"));
+		httpmessage_result(response, RESULT_302);
+	}
+	else
+		httpmessage_result(response, RESULT_401);
+
+	if (json != NULL)
+		json_decref(json);
+	_oauth2_lookup_destroy(mod->lookup);
+	mod->lookup = NULL;
+	return ESUCCESS;
+}
+
+static int _oauth2_connector(void *arg, http_message_t *request, http_message_t *response)
 {
-	int ret = EREJECT;
 	authn_oauth2_t *mod = (authn_oauth2_t *)arg;
-	authn_oauth2_config_t *config = (authn_oauth2_config_t *)mod->config;
 
-	const char *uri = httpmessage_REQUEST(request, "uri");
-	if (utils_searchexp(uri, str_authresp, NULL) == ESUCCESS)
+	if (mod->lookup != NULL && mod->lookup->type == OAUTH2_USERINFO_E)
+		return _oauth2_userinfo_receive(mod);
+	if (mod->lookup != NULL && mod->lookup->type == OAUTH2_TOKEN_E)
+		return _oauth2_token_receive(mod, request, response);
+
+	const char *uri = NULL;
+	size_t urilen = httpmessage_REQUEST2(request, "uri", &uri);
+	if (urilen > 0 && utils_searchexp(uri, str_authresp, NULL) == ESUCCESS)
 	{
-		mod->state = 1;
-		/** set the default result */
-		httpmessage_result(response, RESULT_500);
-		warn("authentication from server: %s", uri);
-		char squery[1024];
-		json_t *json_authtokens = NULL;
-		const char *username = "root";
-		authsession_t authinfo = {0};
-		int expires_in = -1;
-		char *state = NULL;
-		char *end = NULL;
-
-		json_authtokens = _oauth2_authresp_send(mod, request);
 		mod->state++;
-		if (json_authtokens != NULL)
-			ret = _oauth2_authresp_receive(mod,json_authtokens, &authinfo);
-
-		if (ret == ESUCCESS)
-		{
-			httpmessage_addheader(response, str_authorization, STRING_REF("oAuth2 "));
-			httpmessage_appendheader(response, str_authorization, authinfo.token, -1);
-
-			const char *scheme = httpmessage_REQUEST(request, "scheme");
-			httpmessage_addheader(response, str_location, scheme, -1);
-			const char *host = httpmessage_REQUEST(request, "host");
-			httpmessage_appendheader(response, str_location, STRING_REF("://"));
-			httpmessage_appendheader(response, str_location, host, -1);
-			httpmessage_appendheader(response, str_location, STRING_REF("/"));
-			httpmessage_result(response, RESULT_302);
-
-			ret = ESUCCESS;
-		}
-		else
+		if (_oauth2_token_start(mod, request) != ESUCCESS)
 		{
 			httpmessage_result(response, RESULT_401);
-			ret = ESUCCESS;
-		}
-
-		if (json_authtokens != NULL)
-		{
-			json_decref(json_authtokens);
+			return ESUCCESS;
 		}
+		return EINCOMPLETE;
 	}
-	return ret;
+	return _oauth2_userinfo_connector(mod, request);
 }
 
 static void *authn_oauth2_create(const authn_t *authn, void *config)
 {
-	if (authn->hash == NULL)
-		return NULL;
 	authn_oauth2_t *mod = calloc(1, sizeof(*mod));
 	mod->config = (authn_oauth2_config_t *)config;
-	mod->state = 0;
-	if (mod->config->realm == NULL)
-		mod->config->realm = httpserver_INFO(authn->server, "host");
-
+	mod->authn = authn;
+	if (mod->config->client_id.data == NULL)
+		_string_store(&mod->config->client_id, authn->config->realm.data, authn->config->realm.length);
+	if (mod->config->cachesize > 0)
+	{
+		/// the cache is allocated before the fork of the clients
+		mod->cache = mmap(NULL, sizeof(*mod->cache) * mod->config->cachesize, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (mod->cache == MAP_FAILED)
+		{
+			err("oauth2: cache not available %m");
+			mod->cache = NULL;
+		}
+	}
 	return mod;
 }
 
@@ -406,67 +647,77 @@ static void authn_oauth2_destroy(void *arg)
 {
 	authn_oauth2_t *mod = (authn_oauth2_t *)arg;
 
+	if (mod->cache != NULL)
+		munmap(mod->cache, sizeof(*mod->cache) * mod->config->cachesize);
 	free(mod->config);
 	free(mod);
 }
 
-static void *authn_oauth2_setup(void *arg, authz_t *authz, http_client_t *clt, struct sockaddr *addr, int addrsize)
+static void *authn_oauth2_setup(void *arg, http_client_t *clt, struct sockaddr *UNUSED(addr), int UNUSED(addrsize))
 {
-	authn_oauth2_t *mod = (authn_oauth2_t *)arg;
+	const authn_oauth2_t *mod = (authn_oauth2_t *)arg;
 
 	authn_oauth2_t *cltmod = calloc(1, sizeof(*cltmod));
 	cltmod->clt = clt;
-	cltmod->authz = authz;
+	cltmod->authn = mod->authn;
 	cltmod->config = mod->config;
-	httpclient_addconnector(clt, _oauth2_authresp_connector, cltmod, CONNECTOR_AUTH, str_oauth2);
+	cltmod->cache = mod->cache;
+	ouistiti_addclientconnector(clt, _oauth2_connector, cltmod, CONNECTOR_AUTH, str_oauth2);
 	return cltmod;
 }
 
 static void authn_oauth2_cleanup(void *arg)
 {
-	free(arg);
+	authn_oauth2_t *mod = (authn_oauth2_t *)arg;
+	if (mod->lookup != NULL)
+	{
+		/// the waiting clients must not wait the timeout
+		if (mod->lookup->owner)
+			_oauth2_cache_release(mod, mod->lookup->key);
+		_oauth2_lookup_destroy(mod->lookup);
+	}
+	free(mod);
 }
 
 static int authn_oauth2_challenge(void *arg, http_message_t *request, http_message_t *response)
 {
 	int ret = ECONTINUE;
-	authn_oauth2_t *mod = (authn_oauth2_t *)arg;
-	authn_oauth2_config_t *config = mod->config;
+	const authn_oauth2_t *mod = (authn_oauth2_t *)arg;
+	const authn_oauth2_config_t *config = mod->config;
+	const mod_auth_t *authconfig = mod->authn->config;
 
-	const char *uri = httpmessage_REQUEST(request, "uri");
-	char authenticate[256];
-	int authlen = snprintf(authenticate, 256, "Bearer realm=\"%s\"", mod->authn->config->realm);
-	httpmessage_addheader(response, str_authenticate, authenticate, authlen);
+	httpmessage_addheader(response, str_authenticate, STRING_REF("Bearer realm=\""));
+	httpmessage_appendheader(response, str_authenticate, authconfig->realm.data, authconfig->realm.length);
+	httpmessage_appendheader(response, str_authenticate, STRING_REF("\""));
 
-	if (!utils_searchexp(uri, str_authresp, NULL))
+	const char *uri = NULL;
+	size_t urilen = httpmessage_REQUEST2(request, "uri", &uri);
+	if (urilen > 0 && utils_searchexp(uri, str_authresp, NULL) == ESUCCESS)
 	{
 		ret = EREJECT;
 	}
-	else if (config->token_ep != NULL && config->token_ep[0] != '\0')
+	else if (config->auth_ep.data != NULL && mod->clt != NULL)
 	{
 		http_server_t *server = httpclient_server(mod->clt);
-		const char *scheme = httpserver_INFO(server, "scheme");
-		const char *host = httpserver_INFO(server, "host");
-
-		const char *portseparator = "";
-			portseparator = ":";
-		httpmessage_addheader(response, str_location, config->auth_ep, -1);
-		httpmessage_appendheader(response, str_location, STRING_REF("?"));
-		httpmessage_appendheader(response, str_location, STRING_REF("response_type=code&"));
-		httpmessage_appendheader(response, str_location, STRING_REF("scope=openid roles&"));
-		httpmessage_appendheader(response, str_location, STRING_REF("client_id="));
-		httpmessage_appendheader(response, str_location, config->client_id, -1);
-		httpmessage_appendheader(response, str_location, STRING_REF("&"));
-		httpmessage_appendheader(response, str_location, STRING_REF("redirect_uri="));
-		httpmessage_appendheader(response, str_location, scheme, -1);
-		httpmessage_appendheader(response, str_location, host, -1);
-		const char *port = httpserver_INFO(server, "port");
-		if (port[0] != '\0')
+		const char *scheme = NULL;
+		size_t schemelen = httpserver_INFO2(server, "scheme", &scheme);
+		const char *host = NULL;
+		size_t hostlen = httpserver_INFO2(server, "host", &host);
+
+		httpmessage_addheader(response, str_location, config->auth_ep.data, config->auth_ep.length);
+		httpmessage_appendheader(response, str_location, STRING_REF("?response_type=code&scope=openid roles&client_id="));
+		httpmessage_appendheader(response, str_location, config->client_id.data, config->client_id.length);
+		httpmessage_appendheader(response, str_location, STRING_REF("&redirect_uri="));
+		httpmessage_appendheader(response, str_location, scheme, schemelen);
+		httpmessage_appendheader(response, str_location, STRING_REF("://"));
+		httpmessage_appendheader(response, str_location, host, hostlen);
+		const char *port = NULL;
+		size_t portlen = httpserver_INFO2(server, "port", &port);
+		if (portlen > 0)
 		{
 			httpmessage_appendheader(response, str_location, STRING_REF(":"));
-			httpmessage_appendheader(response, str_location, port, -1);
+			httpmessage_appendheader(response, str_location, port, portlen);
 		}
-		httpmessage_appendheader(response, str_location, STRING_REF("/"));
 		httpmessage_appendheader(response, str_location, STRING_REF(str_authresp));
 		httpmessage_result(response, RESULT_302);
 		ret = ESUCCESS;
@@ -474,23 +725,40 @@ static int authn_oauth2_challenge(void *arg, http_message_t *request, http_messa
 	return ret;
 }
 
-static const char *authn_oauth2_check(void *arg, const char *method, size_t methodlen, const char *uri, size_t urilen, const char *string, size_t stringlen))
+static const char *authn_oauth2_check(void *arg, authz_t *authz, const char *UNUSED(method), size_t UNUSED(methodlen), const char *UNUSED(uri), size_t UNUSED(urilen), const char *string, size_t stringlen)
 {
 	authn_oauth2_t *mod = (authn_oauth2_t *)arg;
-	authn_oauth2_config_t *config = mod->config;
-	const char *user = NULL;
-	int ret;
 
 	if (string == NULL)
 		return NULL;
+	if (!strncmp(string, "Bearer ", 7))
+	{
+		string += 7;
+		stringlen -= 7;
+	}
+
+	unsigned char key[OAUTH2_CACHE_KEYLEN];
+	_oauth2_cache_key(string, stringlen, key);
+	if (mod->config->userinfo_ep.data != NULL && !memcmp(mod->userkey, key, OAUTH2_CACHE_KEYLEN))
+		return (mod->user[0] != '\0')? mod->user: NULL;
+	oauth2_state_t state = _oauth2_cache_claim(mod, key, mod->user, NULL);
+	if (state == OAUTH2_VALID_E)
+		return mod->user;
+	if (state == OAUTH2_INVALID_E)
+		return NULL;
 
-	if (!strcmp(uri, config->token_ep))
+	/// the token is a JWT signed with the secret or the JWKS
+	const char *user = NULL;
+	const char *sign = strrchr(string, '.');
+	if (sign != NULL)
 	{
-		return str_anonymous;
+		size_t datalen = sign - string;
+		sign++;
+		if (authn_checktokensignature(mod->authn->config, string, datalen, sign, stringlen - datalen - 1) == ESUCCESS)
+			user = authz->rules->check(authz->ctx, NULL, NULL, string);
+		else
+			err("oauth2: token with bad signature");
 	}
-	warn("oauth2 check %s", string);
-	user = mod->authz->rules->check(mod->authz->ctx, NULL, NULL, string);
-	warn("oauth2 check %s", user);
 	return user;
 }
 
@@ -36,6 +36,7 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "authn_wwwform.h"
+#include "log.h"
 
 #define auth_dbg(...)
 
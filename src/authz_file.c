@@ -42,6 +42,7 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "authz_file.h"
+#include "log.h"
 
 
 #define auth_dbg(...)
@@ -217,6 +218,37 @@ static int authz_file_passwd(void *arg, const char *user, const char **passwd)
 	return 0;
 }
 
+#ifndef FILE_MMAP
+static const char *authz_file_userhash(void *arg, const hash_t *hash, const string_t *realm, const char *userhash, size_t userhashlen)
+{
+	authz_file_t *ctx = (authz_file_t *)arg;
+	const authz_file_config_t *config = ctx->config;
+	const char *user = NULL;
+
+	FILE *file = fopen(config->path, "r");
+	while(file && !feof(file))
+	{
+		memset(ctx->storage, 0, MAXLENGTH);
+		if (fgets(ctx->storage, MAXLENGTH, file) == NULL)
+			break;
+		char *end = strchr(ctx->storage, ':');
+		if (end == NULL)
+			continue;
+		if (authz_checkuserhash(hash, ctx->storage, end - ctx->storage, realm, userhash, userhashlen) == ESUCCESS)
+		{
+			/// the user is the first field of the storage
+			*end = '\0';
+			user = ctx->storage;
+			break;
+		}
+	}
+	if (file) fclose(file);
+	return user;
+}
+#else
+#define authz_file_userhash NULL
+#endif
+
 static int _authz_file_checkpasswd(authz_file_t *ctx, const char *user, const char *passwd)
 {
 	int ret = 0;
@@ -282,6 +314,7 @@ authz_rules_t authz_file_rules =
 	.create = &authz_file_create,
 	.check = &authz_file_check,
 	.passwd = &authz_file_passwd,
+	.userhash = authz_file_userhash,
 	.setsession = &authz_file_setsession,
 	.destroy = &authz_file_destroy,
 };
@@ -0,0 +1,755 @@
+/*****************************************************************************
+ * authz_jwks.c: JSON Web Key Set for asymmetric token signature
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    The JWKS file contains the public keys of the identity provider
+    (RFC 7517). The keys are parsed once with the TLS library linked
+    to the server and stay resident. The "kid" of the token header
+    selects the key, the "alg" selects the verification.
+
+    RS256, RS384, RS512, ES256, ES384 are available with OpenSSL and
+    mbedTLS, EdDSA (Ed25519) only with OpenSSL.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+
+#include <jansson.h>
+
+#if defined(OPENSSL)
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/bn.h>
+#include <openssl/obj_mac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/param_build.h>
+#endif
+#elif defined(MBEDTLS)
+#include <mbedtls/pk.h>
+#include <mbedtls/md.h>
+#include <mbedtls/rsa.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/ecdsa.h>
+#else
+#error "JWKS requires OPENSSL or MBEDTLS"
+#endif
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/hash.h"
+#include "ouistiti/log.h"
+#include "ouistiti.h"
+#include "authz_jwks.h"
+#include "log.h"
+
+#define jwks_dbg(...)
+
+#define KID_MAX 64
+#define HEADER_MAX 512
+/// RSA 4096 bits
+#define SIGNATURE_MAX 512
+#define COMPONENT_MAX 512
+
+typedef enum
+{
+	JWKS_KTY_RSA,
+	JWKS_KTY_EC,
+	JWKS_KTY_OKP,
+} jwks_kty_t;
+
+typedef enum
+{
+	JWKS_MD_NONE,
+	JWKS_MD_SHA256,
+	JWKS_MD_SHA384,
+	JWKS_MD_SHA512,
+} jwks_md_t;
+
+typedef struct jwks_alg_s jwks_alg_t;
+struct jwks_alg_s
+{
+	const char *name;
+	jwks_kty_t kty;
+	jwks_md_t md;
+	/// size of r and s for ECDSA
+	size_t componentlen;
+};
+
+static const jwks_alg_t jwks_algs[] =
+{
+	{ .name = "RS256", .kty = JWKS_KTY_RSA, .md = JWKS_MD_SHA256},
+	{ .name = "RS384", .kty = JWKS_KTY_RSA, .md = JWKS_MD_SHA384},
+	{ .name = "RS512", .kty = JWKS_KTY_RSA, .md = JWKS_MD_SHA512},
+	{ .name = "ES256", .kty = JWKS_KTY_EC, .md = JWKS_MD_SHA256, .componentlen = 32},
+	{ .name = "ES384", .kty = JWKS_KTY_EC, .md = JWKS_MD_SHA384, .componentlen = 48},
+	{ .name = "EdDSA", .kty = JWKS_KTY_OKP, .md = JWKS_MD_NONE},
+};
+
+typedef struct jwks_key_s jwks_key_t;
+struct jwks_key_s
+{
+	char kid[KID_MAX];
+	jwks_kty_t kty;
+	/// algorithm forced by the key, NULL if the key accepts all algs of its type
+	const jwks_alg_t *alg;
+#if defined(OPENSSL)
+	EVP_PKEY *pkey;
+#elif defined(MBEDTLS)
+	mbedtls_pk_context pk;
+#endif
+	jwks_key_t *next;
+};
+
+/**
+ * the checks of the other threads keep a reference on the keys of the file,
+ * a reload replaces the set and the last check frees the previous one.
+ */
+typedef struct jwks_keyset_s jwks_keyset_t;
+struct jwks_keyset_s
+{
+	jwks_key_t *keys;
+	int refs;
+};
+
+struct authz_jwks_s
+{
+	const char *path;
+	jwks_keyset_t *keyset;
+	int lock;
+	struct timespec mtime;
+	off_t size;
+	ino_t ino;
+	time_t checked;
+};
+
+static const jwks_alg_t *_jwks_findalg(const char *name)
+{
+	if (name == NULL)
+		return NULL;
+	for (int i = 0; i < (sizeof(jwks_algs) / sizeof(*jwks_algs)); i++)
+	{
+		if (!strcmp(jwks_algs[i].name, name))
+			return &jwks_algs[i];
+	}
+	return NULL;
+}
+
+static size_t _jwks_component(const json_t *jkey, const char *name, unsigned char *value, size_t valuelen)
+{
+	const json_t *jvalue = json_object_get(jkey, name);
+	if (jvalue == NULL || !json_is_string(jvalue))
+		return 0;
+	const char *b64value = json_string_value(jvalue);
+	int length = base64_urlencoding->decode(b64value, json_string_length(jvalue), (char *)value, valuelen);
+	if (length <= 0)
+		return 0;
+	return length;
+}
+
+#if defined(OPENSSL)
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int _jwks_fromdata(jwks_key_t *key, const char *type, OSSL_PARAM_BLD *bld)
+{
+	int ret = EREJECT;
+	OSSL_PARAM *params = OSSL_PARAM_BLD_to_param(bld);
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_from_name(NULL, type, NULL);
+	key->pkey = NULL;
+	if (params != NULL && ctx != NULL &&
+		EVP_PKEY_fromdata_init(ctx) == 1 &&
+		EVP_PKEY_fromdata(ctx, &key->pkey, EVP_PKEY_PUBLIC_KEY, params) == 1)
+		ret = ESUCCESS;
+	EVP_PKEY_CTX_free(ctx);
+	OSSL_PARAM_free(params);
+	return ret;
+}
+
+static int _jwks_keyrsa(jwks_key_t *key, const unsigned char *n, size_t nlen, const unsigned char *e, size_t elen)
+{
+	int ret = EREJECT;
+	BIGNUM *bn = BN_bin2bn(n, nlen, NULL);
+	BIGNUM *be = BN_bin2bn(e, elen, NULL);
+	OSSL_PARAM_BLD *bld = OSSL_PARAM_BLD_new();
+	if (bn != NULL && be != NULL && bld != NULL &&
+		OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_N, bn) == 1 &&
+		OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_E, be) == 1)
+		ret = _jwks_fromdata(key, "RSA", bld);
+	OSSL_PARAM_BLD_free(bld);
+	BN_free(bn);
+	BN_free(be);
+	return ret;
+}
+
+static int _jwks_keyec(jwks_key_t *key, const char *crv, const unsigned char *x, size_t xlen, const unsigned char *y, size_t ylen)
+{
+	const char *group = NULL;
+	size_t coordlen = 0;
+	if (!strcmp(crv, "P-256"))
+	{
+		group = SN_X9_62_prime256v1;
+		coordlen = 32;
+	}
+	else if (!strcmp(crv, "P-384"))
+	{
+		group = SN_secp384r1;
+		coordlen = 48;
+	}
+	else
+		return EREJECT;
+	if (xlen != coordlen || ylen != coordlen)
+		return EREJECT;
+
+	/// uncompressed point: 0x04 || x || y
+	unsigned char point[1 + 2 * 48];
+	point[0] = POINT_CONVERSION_UNCOMPRESSED;
+	memcpy(point + 1, x, xlen);
+	memcpy(point + 1 + xlen, y, ylen);
+
+	int ret = EREJECT;
+	OSSL_PARAM_BLD *bld = OSSL_PARAM_BLD_new();
+	if (bld != NULL &&
+		OSSL_PARAM_BLD_push_utf8_string(bld, OSSL_PKEY_PARAM_GROUP_NAME, group, 0) == 1 &&
+		OSSL_PARAM_BLD_push_octet_string(bld, OSSL_PKEY_PARAM_PUB_KEY, point, 1 + xlen + ylen) == 1)
+		ret = _jwks_fromdata(key, "EC", bld);
+	OSSL_PARAM_BLD_free(bld);
+	return ret;
+}
+#else
+static int _jwks_keyrsa(jwks_key_t *key, const unsigned char *n, size_t nlen, const unsigned char *e, size_t elen)
+{
+	RSA *rsa = RSA_new();
+	if (rsa == NULL)
+		return EREJECT;
+	if (RSA_set0_key(rsa, BN_bin2bn(n, nlen, NULL), BN_bin2bn(e, elen, NULL), NULL) != 1)
+	{
+		RSA_free(rsa);
+		return EREJECT;
+	}
+	key->pkey = EVP_PKEY_new();
+	EVP_PKEY_assign_RSA(key->pkey, rsa);
+	return ESUCCESS;
+}
+
+static int _jwks_keyec(jwks_key_t *key, const char *crv, const unsigned char *x, size_t xlen, const unsigned char *y, size_t ylen)
+{
+	int nid = NID_undef;
+	if (!strcmp(crv, "P-256"))
+		nid = NID_X9_62_prime256v1;
+	else if (!strcmp(crv, "P-384"))
+		nid = NID_secp384r1;
+	else
+		return EREJECT;
+
+	EC_KEY *ec = EC_KEY_new_by_curve_name(nid);
+	if (ec == NULL)
+		return EREJECT;
+	BIGNUM *bx = BN_bin2bn(x, xlen, NULL);
+	BIGNUM *by = BN_bin2bn(y, ylen, NULL);
+	int ret = EC_KEY_set_public_key_affine_coordinates(ec, bx, by);
+	BN_free(bx);
+	BN_free(by);
+	if (ret != 1)
+	{
+		EC_KEY_free(ec);
+		return EREJECT;
+	}
+	key->pkey = EVP_PKEY_new();
+	EVP_PKEY_assign_EC_KEY(key->pkey, ec);
+	return ESUCCESS;
+}
+
+#endif
+
+static int _jwks_keyokp(jwks_key_t *key, const char *crv, const unsigned char *x, size_t xlen)
+{
+	if (strcmp(crv, "Ed25519"))
+		return EREJECT;
+	key->pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, x, xlen);
+	if (key->pkey == NULL)
+		return EREJECT;
+	return ESUCCESS;
+}
+
+static void _jwks_keyfree(jwks_key_t *key)
+{
+	EVP_PKEY_free(key->pkey);
+}
+
+static const EVP_MD *_jwks_md(jwks_md_t md)
+{
+	switch (md)
+	{
+	case JWKS_MD_SHA256:
+		return EVP_sha256();
+	case JWKS_MD_SHA384:
+		return EVP_sha384();
+	case JWKS_MD_SHA512:
+		return EVP_sha512();
+	default:
+		break;
+	}
+	return NULL;
+}
+
+static int _jwks_verify(const jwks_key_t *key, const jwks_alg_t *alg,
+		const char *data, size_t datalen, const unsigned char *sign, size_t signlen)
+{
+	int ret = EREJECT;
+	unsigned char der[SIGNATURE_MAX];
+
+	if (alg->kty == JWKS_KTY_EC)
+	{
+		/// JWS stores r|s, OpenSSL waits for an ASN.1 sequence
+		if (signlen != alg->componentlen * 2)
+			return EREJECT;
+		ECDSA_SIG *ecsig = ECDSA_SIG_new();
+		BIGNUM *r = BN_bin2bn(sign, alg->componentlen, NULL);
+		BIGNUM *s = BN_bin2bn(sign + alg->componentlen, alg->componentlen, NULL);
+		ECDSA_SIG_set0(ecsig, r, s);
+		unsigned char *offset = der;
+		int length = i2d_ECDSA_SIG(ecsig, &offset);
+		ECDSA_SIG_free(ecsig);
+		if (length <= 0)
+			return EREJECT;
+		sign = der;
+		signlen = length;
+	}
+
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+	if (mdctx == NULL)
+		return EREJECT;
+	if (EVP_DigestVerifyInit(mdctx, NULL, _jwks_md(alg->md), NULL, key->pkey) == 1 &&
+		EVP_DigestVerify(mdctx, sign, signlen, (const unsigned char *)data, datalen) == 1)
+		ret = ESUCCESS;
+	EVP_MD_CTX_free(mdctx);
+	return ret;
+}
+#elif defined(MBEDTLS)
+static int _jwks_keyrsa(jwks_key_t *key, const unsigned char *n, size_t nlen, const unsigned char *e, size_t elen)
+{
+	mbedtls_pk_init(&key->pk);
+	if (mbedtls_pk_setup(&key->pk, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA)) != 0)
+		return EREJECT;
+	mbedtls_rsa_context *rsa = mbedtls_pk_rsa(key->pk);
+	if (mbedtls_rsa_import_raw(rsa, n, nlen, NULL, 0, NULL, 0, NULL, 0, e, elen) != 0 ||
+		mbedtls_rsa_complete(rsa) != 0)
+	{
+		mbedtls_pk_free(&key->pk);
+		return EREJECT;
+	}
+	return ESUCCESS;
+}
+
+static int _jwks_keyec(jwks_key_t *key, const char *crv, const unsigned char *x, size_t xlen, const unsigned char *y, size_t ylen)
+{
+	mbedtls_ecp_group_id gid = MBEDTLS_ECP_DP_NONE;
+	if (!strcmp(crv, "P-256"))
+		gid = MBEDTLS_ECP_DP_SECP256R1;
+	else if (!strcmp(crv, "P-384"))
+		gid = MBEDTLS_ECP_DP_SECP384R1;
+	else
+		return EREJECT;
+
+	mbedtls_pk_init(&key->pk);
+	if (mbedtls_pk_setup(&key->pk, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY)) != 0)
+		return EREJECT;
+	mbedtls_ecp_keypair *ec = mbedtls_pk_ec(key->pk);
+	if (mbedtls_ecp_group_load(&ec->grp, gid) != 0 ||
+		mbedtls_mpi_read_binary(&ec->Q.X, x, xlen) != 0 ||
+		mbedtls_mpi_read_binary(&ec->Q.Y, y, ylen) != 0 ||
+		mbedtls_mpi_lset(&ec->Q.Z, 1) != 0 ||
+		mbedtls_ecp_check_pubkey(&ec->grp, &ec->Q) != 0)
+	{
+		mbedtls_pk_free(&key->pk);
+		return EREJECT;
+	}
+	return ESUCCESS;
+}
+
+static int _jwks_keyokp(jwks_key_t *UNUSED(key), const char *UNUSED(crv), const unsigned char *UNUSED(x), size_t UNUSED(xlen))
+{
+	warn("jwks: EdDSA is not available with mbedTLS");
+	return EREJECT;
+}
+
+static void _jwks_keyfree(jwks_key_t *key)
+{
+	mbedtls_pk_free(&key->pk);
+}
+
+static mbedtls_md_type_t _jwks_md(jwks_md_t md)
+{
+	switch (md)
+	{
+	case JWKS_MD_SHA256:
+		return MBEDTLS_MD_SHA256;
+	case JWKS_MD_SHA384:
+		return MBEDTLS_MD_SHA384;
+	case JWKS_MD_SHA512:
+		return MBEDTLS_MD_SHA512;
+	default:
+		break;
+	}
+	return MBEDTLS_MD_NONE;
+}
+
+static int _jwks_verify(const jwks_key_t *key, const jwks_alg_t *alg,
+		const char *data, size_t datalen, const unsigned char *sign, size_t signlen)
+{
+	int ret = EREJECT;
+	mbedtls_md_type_t mdtype = _jwks_md(alg->md);
+	const mbedtls_md_info_t *mdinfo = mbedtls_md_info_from_type(mdtype);
+	unsigned char digest[MBEDTLS_MD_MAX_SIZE];
+
+	if (mdinfo == NULL ||
+		mbedtls_md(mdinfo, (const unsigned char *)data, datalen, digest) != 0)
+		return EREJECT;
+	size_t digestlen = mbedtls_md_get_size(mdinfo);
+
+	if (alg->kty == JWKS_KTY_RSA)
+	{
+		if (mbedtls_pk_verify((mbedtls_pk_context *)&key->pk, mdtype, digest, digestlen, sign, signlen) == 0)
+			ret = ESUCCESS;
+	}
+	else if (alg->kty == JWKS_KTY_EC)
+	{
+		/// JWS stores r|s, mbedtls_pk_verify waits for an ASN.1 sequence
+		if (signlen != alg->componentlen * 2)
+			return EREJECT;
+		const mbedtls_ecp_keypair *ec = mbedtls_pk_ec(key->pk);
+		mbedtls_mpi r, s;
+		mbedtls_mpi_init(&r);
+		mbedtls_mpi_init(&s);
+		if (mbedtls_mpi_read_binary(&r, sign, alg->componentlen) == 0 &&
+			mbedtls_mpi_read_binary(&s, sign + alg->componentlen, alg->componentlen) == 0 &&
+			mbedtls_ecdsa_verify((mbedtls_ecp_group *)&ec->grp, digest, digestlen, &ec->Q, &r, &s) == 0)
+			ret = ESUCCESS;
+		mbedtls_mpi_free(&r);
+		mbedtls_mpi_free(&s);
+	}
+	return ret;
+}
+#endif
+
+static jwks_key_t *_jwks_loadkey(const json_t *jkey)
+{
+	const char *kty = json_string_value(json_object_get(jkey, "kty"));
+	const char *use = json_string_value(json_object_get(jkey, "use"));
+	const char *kid = json_string_value(json_object_get(jkey, "kid"));
+	const char *crv = json_string_value(json_object_get(jkey, "crv"));
+	const char *algname = json_string_value(json_object_get(jkey, "alg"));
+
+	if (kty == NULL)
+		return NULL;
+	if (use != NULL && strcmp(use, "sig"))
+	{
+		jwks_dbg("jwks: key %s not used for signature", kid);
+		return NULL;
+	}
+
+	jwks_key_t *key = calloc(1, sizeof(*key));
+	if (kid != NULL)
+		strncpy(key->kid, kid, sizeof(key->kid) - 1);
+	key->alg = _jwks_findalg(algname);
+
+	unsigned char x[COMPONENT_MAX];
+	unsigned char y[COMPONENT_MAX];
+	size_t xlen = 0;
+	size_t ylen = 0;
+	int ret = EREJECT;
+	if (!strcmp(kty, "RSA"))
+	{
+		key->kty = JWKS_KTY_RSA;
+		xlen = _jwks_component(jkey, "n", x, sizeof(x));
+		ylen = _jwks_component(jkey, "e", y, sizeof(y));
+		if (xlen > 0 && ylen > 0)
+			ret = _jwks_keyrsa(key, x, xlen, y, ylen);
+	}
+	else if (!strcmp(kty, "EC") && crv != NULL)
+	{
+		key->kty = JWKS_KTY_EC;
+		xlen = _jwks_component(jkey, "x", x, sizeof(x));
+		ylen = _jwks_component(jkey, "y", y, sizeof(y));
+		if (xlen > 0 && ylen > 0)
+			ret = _jwks_keyec(key, crv, x, xlen, y, ylen);
+	}
+	else if (!strcmp(kty, "OKP") && crv != NULL)
+	{
+		key->kty = JWKS_KTY_OKP;
+		xlen = _jwks_component(jkey, "x", x, sizeof(x));
+		if (xlen > 0)
+			ret = _jwks_keyokp(key, crv, x, xlen);
+	}
+	if (ret == ESUCCESS && key->alg != NULL && key->alg->kty != key->kty)
+	{
+		_jwks_keyfree(key);
+		ret = EREJECT;
+	}
+	if (ret != ESUCCESS)
+	{
+		err("jwks: key %s (%s) unsupported", key->kid, kty);
+		free(key);
+		return NULL;
+	}
+	jwks_dbg("jwks: key %s (%s) loaded", key->kid, kty);
+	return key;
+}
+
+static void _jwks_freekeys(jwks_key_t *keys)
+{
+	while (keys != NULL)
+	{
+		jwks_key_t *next = keys->next;
+		_jwks_keyfree(keys);
+		free(keys);
+		keys = next;
+	}
+}
+
+static jwks_key_t *_jwks_load(const char *path)
+{
+	json_error_t error;
+	json_t *jwks = json_load_file(path, 0, &error);
+	if (jwks == NULL)
+	{
+		err("jwks: %s error %s", path, error.text);
+		return NULL;
+	}
+	const json_t *jkeys = json_object_get(jwks, "keys");
+	if (jkeys == NULL || !json_is_array(jkeys))
+	{
+		err("jwks: %s doesn't contain keys", path);
+		json_decref(jwks);
+		return NULL;
+	}
+
+	jwks_key_t *keys = NULL;
+	size_t index;
+	const json_t *jkey;
+	json_array_foreach(jkeys, index, jkey)
+	{
+		jwks_key_t *key = _jwks_loadkey(jkey);
+		if (key != NULL)
+		{
+			key->next = keys;
+			keys = key;
+		}
+	}
+	json_decref(jwks);
+	if (keys == NULL)
+		err("jwks: %s doesn't contain any valid key", path);
+	return keys;
+}
+
+static void _jwks_lock(authz_jwks_t *jwks)
+{
+	while (__atomic_exchange_n(&jwks->lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void _jwks_unlock(authz_jwks_t *jwks)
+{
+	__atomic_store_n(&jwks->lock, 0, __ATOMIC_RELEASE);
+}
+
+static jwks_keyset_t *_jwks_acquire(authz_jwks_t *jwks)
+{
+	_jwks_lock(jwks);
+	jwks_keyset_t *keyset = jwks->keyset;
+	if (keyset != NULL)
+		keyset->refs++;
+	_jwks_unlock(jwks);
+	return keyset;
+}
+
+static void _jwks_release(authz_jwks_t *jwks, jwks_keyset_t *keyset)
+{
+	if (keyset == NULL)
+		return;
+	_jwks_lock(jwks);
+	int refs = --keyset->refs;
+	_jwks_unlock(jwks);
+	if (refs == 0)
+	{
+		_jwks_freekeys(keyset->keys);
+		free(keyset);
+	}
+}
+
+static int _jwks_reload(authz_jwks_t *jwks)
+{
+	time_t now = ouistiti_time();
+	_jwks_lock(jwks);
+	int loaded = (jwks->keyset != NULL);
+	/// the file is checked at most once per second by one thread
+	if (now == jwks->checked && loaded)
+	{
+		_jwks_unlock(jwks);
+		return ESUCCESS;
+	}
+	jwks->checked = now;
+	struct timespec mtime = jwks->mtime;
+	off_t size = jwks->size;
+	ino_t ino = jwks->ino;
+	_jwks_unlock(jwks);
+
+	struct stat filestat;
+	if (stat(jwks->path, &filestat) != 0)
+	{
+		err("jwks: %s not found %m", jwks->path);
+		return loaded? ESUCCESS: EREJECT;
+	}
+	/// a rewrite within the same second changes the nanoseconds or the size
+	if (filestat.st_mtim.tv_sec == mtime.tv_sec && filestat.st_mtim.tv_nsec == mtime.tv_nsec &&
+		filestat.st_size == size && filestat.st_ino == ino)
+		return ESUCCESS;
+
+	jwks_key_t *keys = _jwks_load(jwks->path);
+	jwks_keyset_t *keyset = NULL;
+	if (keys != NULL)
+		keyset = calloc(1, sizeof(*keyset));
+	if (keyset == NULL)
+	{
+		_jwks_freekeys(keys);
+		/// keep the previous keys until the file is fixed
+		return loaded? ESUCCESS: EREJECT;
+	}
+	keyset->keys = keys;
+	/// the reference of jwks
+	keyset->refs = 1;
+
+	_jwks_lock(jwks);
+	jwks_keyset_t *old = jwks->keyset;
+	jwks->keyset = keyset;
+	jwks->mtime = filestat.st_mtim;
+	jwks->size = filestat.st_size;
+	jwks->ino = filestat.st_ino;
+	_jwks_unlock(jwks);
+	if (old != NULL)
+	{
+		warn("jwks: %s reloaded", jwks->path);
+		_jwks_release(jwks, old);
+	}
+	return ESUCCESS;
+}
+
+authz_jwks_t *authz_jwks_create(const char *path)
+{
+	authz_jwks_t *jwks = calloc(1, sizeof(*jwks));
+	if (jwks == NULL)
+		return NULL;
+	jwks->path = path;
+	if (_jwks_reload(jwks) != ESUCCESS)
+	{
+		free(jwks);
+		return NULL;
+	}
+	return jwks;
+}
+
+static const jwks_key_t *_jwks_findkey(const jwks_keyset_t *keyset, const jwks_alg_t *alg, const char *kid)
+{
+	for (const jwks_key_t *key = keyset->keys; key != NULL; key = key->next)
+	{
+		if (key->kty != alg->kty)
+			continue;
+		/// the key forces its algorithm, the token may not change it
+		if (key->alg != NULL && key->alg != alg)
+			continue;
+		if (kid == NULL || !strcmp(kid, key->kid))
+			return key;
+	}
+	return NULL;
+}
+
+int authz_jwks_check(authz_jwks_t *jwks, const char *data, size_t datalen, const char *sign, size_t signlen)
+{
+	const char *b64header = data;
+	const char *end = memchr(data, '.', datalen);
+	if (end == NULL)
+		return EREJECT;
+
+	char header[HEADER_MAX];
+	int headerlen = base64_urlencoding->decode(b64header, end - b64header, header, sizeof(header));
+	if (headerlen <= 0)
+		return EREJECT;
+	json_error_t error;
+	json_t *jheader = json_loadb(header, headerlen, 0, &error);
+	if (jheader == NULL)
+	{
+		err("jwks: header error %s", error.text);
+		return EREJECT;
+	}
+	const char *algname = json_string_value(json_object_get(jheader, "alg"));
+	if (algname != NULL && !strncmp(algname, "HS", 2))
+	{
+		json_decref(jheader);
+		return ECONTINUE;
+	}
+	const jwks_alg_t *alg = _jwks_findalg(algname);
+	if (alg == NULL)
+	{
+		err("jwks: algorithm %s not supported", algname);
+		json_decref(jheader);
+		return EREJECT;
+	}
+
+	_jwks_reload(jwks);
+	jwks_keyset_t *keyset = _jwks_acquire(jwks);
+	const char *kid = json_string_value(json_object_get(jheader, "kid"));
+	const jwks_key_t *key = NULL;
+	if (keyset != NULL)
+		key = _jwks_findkey(keyset, alg, kid);
+	json_decref(jheader);
+	if (key == NULL)
+	{
+		warn("jwks: key not found for %s", alg->name);
+		_jwks_release(jwks, keyset);
+		return EREJECT;
+	}
+
+	int ret = EREJECT;
+	unsigned char signature[SIGNATURE_MAX];
+	int length = base64_urlencoding->decode(sign, signlen, (char *)signature, sizeof(signature));
+	if (length > 0)
+		ret = _jwks_verify(key, alg, data, datalen, signature, length);
+	_jwks_release(jwks, keyset);
+	return ret;
+}
+
+void authz_jwks_destroy(authz_jwks_t *jwks)
+{
+	_jwks_release(jwks, jwks->keyset);
+	free(jwks);
+}
@@ -0,0 +1,59 @@
+/*****************************************************************************
+ * authz_jwks.h: JSON Web Key Set for asymmetric token signature
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef __AUTHZ_JWKS_H__
+#define __AUTHZ_JWKS_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct authz_jwks_s authz_jwks_t;
+
+/**
+ * load the public keys of the JWKS file.
+ * The keys stay parsed in memory and the file is reloaded
+ * when its modification time changes.
+ */
+authz_jwks_t *authz_jwks_create(const char *path);
+/**
+ * check the signature of a JWT "header.payload".
+ * @return ESUCCESS or EREJECT if the "alg" of the header is asymmetric,
+ *  ECONTINUE for HMAC algorithms which are checked with the "secret".
+ */
+int authz_jwks_check(authz_jwks_t *jwks, const char *data, size_t datalen, const char *sign, size_t signlen);
+void authz_jwks_destroy(authz_jwks_t *jwks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -47,6 +47,7 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "authz_jwt.h"
+#include "log.h"
 
 #define auth_dbg(...)
 
@@ -114,7 +115,7 @@ size_t authz_generatejwtoken(const mod_auth_t *config, http_message_t *request,
 		json_object_set(jtoken, "roles", jroles);
 	}
 #ifndef DEBUG
-	time_t now = time(NULL);
+	time_t now = ouistiti_time();
 #else
 	time_t now = 0;
 #endif
@@ -219,7 +220,7 @@ static int _jwt_checkexpiration(json_t *jinfo)
 	{
 		time_t expire = json_integer_value(jexpire);
 #ifndef DEBUG
-		time_t now = time(NULL);
+		time_t now = ouistiti_time();
 #else
 		time_t now = 0;
 #endif
@@ -371,10 +372,8 @@ static int authz_jwt_setsession(void *arg, const char *user, auth_saveinfo_t cb,
 	if (jexpire && json_is_integer(jexpire))
 	{
 		time_t expire = json_integer_value(jexpire);
-		struct tm *tmp;
-		char expire_str[16] = {0};
-		tmp = localtime(&expire);
-		size_t length = strftime(expire_str, sizeof(expire_str), "%s", tmp);
+		char expire_str[24] = {0};
+		int length = snprintf(expire_str, sizeof(expire_str), "%ld", (long)expire);
 		if (length > 0)
 			cb(cbarg, STRING_REF("expire"), expire_str, length);
 	}
@@ -35,6 +35,7 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "authz_simple.h"
+#include "log.h"
 
 #define auth_dbg(...)
 
@@ -97,6 +98,14 @@ static int authz_simple_passwd(void *arg,const  char *user, const char **passwd)
 	return 0;
 }
 
+static const char *authz_simple_userhash(void *arg, const hash_t *hash, const string_t *realm, const char *userhash, size_t userhashlen)
+{
+	const authz_simple_t *ctx = (const authz_simple_t *)arg;
+	if (authz_checkuserhash(hash, STRING_INFO(ctx->user), realm, userhash, userhashlen) == ESUCCESS)
+		return ctx->user.data;
+	return NULL;
+}
+
 static const char *authz_simple_check(void *arg, const char *user, const char *passwd, const char *UNUSED(token))
 {
 	const authz_simple_t *ctx = (const authz_simple_t *)arg;
@@ -128,6 +137,7 @@ authz_rules_t authz_simple_rules =
 	.create = &authz_simple_create,
 	.check = &authz_simple_check,
 	.passwd = &authz_simple_passwd,
+	.userhash = &authz_simple_userhash,
 	.setsession = &authz_simple_setsession,
 	.destroy = NULL,
 };
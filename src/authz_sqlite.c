@@ -44,6 +44,7 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "authz_sqlite.h"
+#include "log.h"
 
 #define auth_dbg(...)
 
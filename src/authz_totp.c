@@ -45,6 +45,7 @@
 #include "ouistiti/hash.h"
 #include "mod_auth.h"
 #include "authz_totp.h"
+#include "log.h"
 
 #define auth_dbg(...)
 
@@ -141,7 +142,7 @@ static unsigned long totp_generator(const hash_t *hash, const char* key, size_t
 	long t0 = 0;
 	long x = period;
 #ifndef DEBUG
-	long t = (time(NULL) - t0 ) / x;
+	long t = (ouistiti_time() - t0 ) / x;
 #else
 	time_t t = 56666053;
 #endif
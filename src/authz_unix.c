@@ -46,6 +46,7 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "authz_unix.h"
+#include "log.h"
 
 #define auth_dbg(...)
 
@@ -156,7 +157,7 @@ static int _authz_unix_checkpasswd(authz_unix_t *ctx, const char *user, const ch
 			if (seteuid(uid) < 0)
 				warn("not enought rights to change user");
 			if (spasswd && (spasswd->sp_expire > 0) &&
-				(spasswd->sp_expire < (time(NULL) / (60 * 60 * 24))))
+				(spasswd->sp_expire < (ouistiti_time() / (60 * 60 * 24))))
 			{
 				warn("authz: user %s password expired", user);
 				return 0;
@@ -170,7 +171,7 @@ static int _authz_unix_checkpasswd(authz_unix_t *ctx, const char *user, const ch
 				warn("authz unix: unaccessible user");
 				return 0;
 			}
-			time_t now = time(NULL);
+			time_t now = ouistiti_time();
 			long day = now / (60 * 60 * 24);
 			if (spasswd->sp_max > 0 && day > (spasswd->sp_lstchg + spasswd->sp_max))
 				_string_store(&status, STRING_REF(str_status_reapproving));
@@ -0,0 +1,1087 @@
+/*****************************************************************************
+ * cache.c: shared cache of the responses of the CGI and the forward links
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2024
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    The responses are stored with the format of the output of a CGI
+    (RFC3875 6.2): the header with a "Status" line, an empty line and
+    the content. The producers (mod_cgi, mod_forward) append what they
+    send and the hits are replayed with httpmessage_parsecgi.
+
+    The memory tier is a shared memory allocated with the server, before
+    the fork of the workers: a table of entries chained by buckets of the
+    hash of the key, and one data slot of "maxsize" bytes per entry.
+    A global spin lock protects the table. The data of a valid entry is
+    never modified, a reader increments its counter, copies the data
+    without the lock and decrements it. The entries without reader are
+    evicted by the least recent access.
+    The disk tier keeps one file by key into "path". The file is written
+    with another name and renamed, the readers never see a partial file.
+    An entry evicted from the memory is loaded again from the disk.
+
+    The key is the method, the host, the URI and the query. The values
+    of the request headers named by the Vary header of the response make
+    the variant of the key.
+    The first request missing a key owns a "pending" entry and runs the
+    producer, the next requests of the same key wait the result. A waiter
+    sleeps on a futex of the entry, woken up by the owner at the end of
+    the fetch, at most CACHE_WAIT ms before to return to the loop of its
+    client. A stale
+    entry is still sent during the "stale-while-revalidate" delay while
+    one request only fetches the new response. A response which is not
+    cacheable lets a "pass" entry, the next requests of the key do not
+    wait during the "pending" delay.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/utils.h"
+#include "ouistiti/log.h"
+#include "ouistiti.h"
+
+#include "log.h"
+
+#define cache_dbg(...)
+
+#define CACHE_MAXSIZE 65536
+#define CACHE_PENDING 10
+#define CACHE_KEYMAX 256
+#define CACHE_VARYMAX 128
+#define CACHE_CHUNKSIZE 4096
+#define CACHE_AGEMAX 32
+#define CACHE_MAGIC 0x4f554943
+/// delay of a waiter of a pending entry, in ms
+#define CACHE_WAIT 20
+
+typedef enum
+{
+	CACHE_FREE_E = 0,
+	CACHE_PENDING_E,
+	CACHE_VALID_E,
+	/// the response is not cacheable, the requests do not wait
+	CACHE_PASS_E,
+} _cache_state_t;
+
+typedef struct _cache_entry_s _cache_entry_t;
+struct _cache_entry_s
+{
+	uint32_t state;
+	uint32_t refs;
+	int32_t next;
+	uint32_t length;
+	uint64_t hash;
+	uint64_t variant;
+	time_t date;
+	time_t expires;
+	/// end of stale-while-revalidate
+	time_t stale;
+	/// end of the pending fetch or of the revalidation
+	time_t pending;
+	time_t access;
+	/// changed at the end of the pending state, the waiters sleep on it
+	uint32_t wakeup;
+	char key[CACHE_KEYMAX];
+	char vary[CACHE_VARYMAX];
+};
+
+/**
+ * the header of the files of the disk tier
+ */
+typedef struct _cache_file_s _cache_file_t;
+struct _cache_file_s
+{
+	uint32_t magic;
+	uint32_t length;
+	uint64_t variant;
+	time_t date;
+	time_t expires;
+	time_t stale;
+	char key[CACHE_KEYMAX];
+	char vary[CACHE_VARYMAX];
+};
+
+typedef struct _cache_shm_s _cache_shm_t;
+struct _cache_shm_s
+{
+	int lock;
+	int nentries;
+	size_t maxsize;
+	/// followed by the buckets, the entries and the data slots
+};
+
+typedef struct _cache_s _cache_t;
+struct _cache_s
+{
+	http_server_t *server;
+	const cacheconfig_t *config;
+	_cache_shm_t *shm;
+	size_t shmsize;
+	int pending;
+	int32_t *buckets;
+	_cache_entry_t *entries;
+	char *data;
+	_cache_t *next;
+};
+
+struct ouistiti_cachectx_s
+{
+	_cache_t *cache;
+	/// the Vary of the response selects the headers of the request
+	http_message_t *request;
+	enum
+	{
+		CACHE_LOOKUP,
+		CACHE_WAIT_E,
+		CACHE_FILL,
+		CACHE_HIT,
+		CACHE_DONE,
+	} state;
+	uint64_t hash;
+	char key[CACHE_KEYMAX];
+	int get;
+	/// the request asked a new response
+	int refresh;
+	/// the pending entry owned by the request
+	int owner;
+	time_t pending;
+	/// the stale entry replaced by the new response
+	int retire;
+	char *data;
+	size_t length;
+	size_t size;
+	size_t offset;
+	int overflow;
+};
+
+static _cache_t *g_cache = NULL;
+
+static void _cache_lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void _cache_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static _cache_t *_cache_get(http_server_t *server)
+{
+	for (_cache_t *cache = g_cache; cache != NULL; cache = cache->next)
+	{
+		if (cache->server == server)
+			return cache;
+	}
+	return NULL;
+}
+
+static uint64_t _cache_hash(uint64_t hash, const char *data, size_t length)
+{
+	/// FNV-1a
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static uint64_t _cache_variant(const char *vary, http_message_t *request)
+{
+	uint64_t variant = 14695981039346656037ULL;
+	while (vary != NULL && *vary != '\0')
+	{
+		const char *end = strchr(vary, ',');
+		size_t length = (end != NULL)? (size_t)(end - vary): strlen(vary);
+		char name[CACHE_VARYMAX];
+		snprintf(name, sizeof(name), "%.*s", (int)length, vary);
+		const char *value = NULL;
+		size_t valuelen = httpmessage_REQUEST2(request, name, &value);
+		if (value != NULL)
+			variant = _cache_hash(variant, value, valuelen);
+		variant = _cache_hash(variant, STRING_REF("\n"));
+		vary = (end != NULL)? end + 1: NULL;
+	}
+	return variant;
+}
+
+static _cache_entry_t *_cache_entry(_cache_t *cache, int index)
+{
+	if (index < 0 || index >= cache->shm->nentries)
+		return NULL;
+	return &cache->entries[index];
+}
+
+static char *_cache_slot(_cache_t *cache, int index)
+{
+	return cache->data + (size_t)index * cache->shm->maxsize;
+}
+
+static void _cache_unlink(_cache_t *cache, int index)
+{
+	_cache_entry_t *entry = &cache->entries[index];
+	int32_t *previous = &cache->buckets[entry->hash % cache->shm->nentries];
+	while (*previous != -1)
+	{
+		if (*previous == index)
+		{
+			*previous = entry->next;
+			break;
+		}
+		previous = &cache->entries[*previous].next;
+	}
+	entry->next = -1;
+	entry->state = CACHE_FREE_E;
+}
+
+static void _cache_link(_cache_t *cache, int index)
+{
+	_cache_entry_t *entry = &cache->entries[index];
+	int32_t *bucket = &cache->buckets[entry->hash % cache->shm->nentries];
+	entry->next = *bucket;
+	*bucket = index;
+}
+
+/**
+ * the lock is taken. Returns a free entry or the least recently used
+ * entry without reader, -1 if all the entries are busy.
+ */
+static int _cache_evict(_cache_t *cache, time_t now)
+{
+	int victim = -1;
+	for (int i = 0; i < cache->shm->nentries; i++)
+	{
+		_cache_entry_t *entry = &cache->entries[i];
+		if (entry->state == CACHE_FREE_E)
+			return i;
+		if (entry->refs > 0)
+			continue;
+		if (entry->state == CACHE_PENDING_E && entry->pending > now)
+			continue;
+		if (victim == -1 || entry->access < cache->entries[victim].access)
+			victim = i;
+	}
+	if (victim != -1)
+		_cache_unlink(cache, victim);
+	return victim;
+}
+
+static int _cache_claim(_cache_t *cache, ouistiti_cachectx_t *ctx, const char *vary, uint64_t variant, time_t now)
+{
+	int index = _cache_evict(cache, now);
+	_cache_entry_t *entry = _cache_entry(cache, index);
+	if (entry == NULL)
+		return -1;
+	/// the waiters of the previous key may sleep on the word
+	uint32_t wakeup = entry->wakeup;
+	memset(entry, 0, sizeof(*entry));
+	entry->wakeup = wakeup;
+	entry->state = CACHE_PENDING_E;
+	entry->hash = ctx->hash;
+	entry->variant = variant;
+	entry->pending = now + cache->pending;
+	entry->access = now;
+	strncpy(entry->key, ctx->key, CACHE_KEYMAX - 1);
+	strncpy(entry->vary, vary, CACHE_VARYMAX - 1);
+	_cache_link(cache, index);
+	ctx->pending = entry->pending;
+	return index;
+}
+
+/**
+ * the lock is taken. The vary of the key is the one of its first entry.
+ */
+static int _cache_find(_cache_t *cache, ouistiti_cachectx_t *ctx, http_message_t *request,
+				const char **vary, uint64_t *variant)
+{
+	int32_t index = cache->buckets[ctx->hash % cache->shm->nentries];
+	*vary = NULL;
+	while (index != -1)
+	{
+		_cache_entry_t *entry = &cache->entries[index];
+		if (entry->state != CACHE_FREE_E && entry->hash == ctx->hash && !strcmp(entry->key, ctx->key))
+		{
+			if (*vary == NULL || strcmp(*vary, entry->vary))
+			{
+				*vary = entry->vary;
+				*variant = _cache_variant(entry->vary, request);
+			}
+			if (entry->variant == *variant)
+				return index;
+		}
+		index = entry->next;
+	}
+	if (*vary == NULL)
+	{
+		*vary = "";
+		*variant = _cache_variant(NULL, request);
+	}
+	return -1;
+}
+
+/**
+ * the lock is taken. The entry stays to the request until the end of
+ * its fetch, another request takes it after the pending delay.
+ */
+static _cache_entry_t *_cache_owned(_cache_t *cache, const ouistiti_cachectx_t *ctx)
+{
+	_cache_entry_t *entry = _cache_entry(cache, ctx->owner);
+	if (entry == NULL || entry->state != CACHE_PENDING_E ||
+		entry->pending != ctx->pending || strcmp(entry->key, ctx->key))
+		return NULL;
+	return entry;
+}
+
+static void _cache_filename(const _cache_t *cache, uint64_t hash, char *filename, size_t size)
+{
+	snprintf(filename, size, "%s/%016llx", cache->config->path, (unsigned long long)hash);
+}
+
+/**
+ * the entry of the disk is copied into the memory. Returns ESUCCESS
+ * when a valid entry of the key is inside the memory after the call.
+ */
+static int _cache_load(_cache_t *cache, ouistiti_cachectx_t *ctx, http_message_t *request, time_t now)
+{
+	if (cache->config->path == NULL)
+		return EREJECT;
+	char filename[PATH_MAX];
+	_cache_filename(cache, ctx->hash, filename, sizeof(filename));
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return EREJECT;
+	_cache_file_t header = {0};
+	int ret = EREJECT;
+	char *data = NULL;
+	if (read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != CACHE_MAGIC ||
+		strncmp(header.key, ctx->key, CACHE_KEYMAX))
+		goto load_end;
+	header.vary[CACHE_VARYMAX - 1] = '\0';
+	if (header.stale <= now)
+	{
+		unlink(filename);
+		goto load_end;
+	}
+	if (header.length > cache->shm->maxsize ||
+		header.variant != _cache_variant(header.vary, request))
+		goto load_end;
+	data = malloc(header.length);
+	if (data == NULL || read(fd, data, header.length) != header.length)
+		goto load_end;
+
+	_cache_lock(&cache->shm->lock);
+	const char *vary = NULL;
+	uint64_t variant = 0;
+	int index = _cache_find(cache, ctx, request, &vary, &variant);
+	_cache_entry_t *entry = _cache_entry(cache, index);
+	if (entry == NULL)
+	{
+		index = _cache_claim(cache, ctx, header.vary, header.variant, now);
+		entry = _cache_entry(cache, index);
+		if (entry != NULL)
+		{
+			memcpy(_cache_slot(cache, index), data, header.length);
+			entry->length = header.length;
+			entry->date = header.date;
+			entry->expires = header.expires;
+			entry->stale = header.stale;
+			entry->pending = 0;
+			entry->state = CACHE_VALID_E;
+		}
+	}
+	if (entry != NULL && entry->state == CACHE_VALID_E)
+		ret = ESUCCESS;
+	_cache_unlock(&cache->shm->lock);
+	cache_dbg("cache: %s loaded from %s", ctx->key, filename);
+load_end:
+	free(data);
+	close(fd);
+	return ret;
+}
+
+static int _cache_copy(_cache_t *cache, ouistiti_cachectx_t *ctx, int index, time_t now)
+{
+	_cache_entry_t *entry = &cache->entries[index];
+	entry->refs++;
+	entry->access = now;
+	size_t length = entry->length;
+	time_t age = now - entry->date;
+	_cache_unlock(&cache->shm->lock);
+
+	char line[CACHE_AGEMAX];
+	int agelength = snprintf(line, sizeof(line), "Age: %ld\r\n", (long)((age > 0)? age: 0));
+	ctx->data = malloc(agelength + length);
+	if (ctx->data != NULL)
+	{
+		memcpy(ctx->data, line, agelength);
+		memcpy(ctx->data + agelength, _cache_slot(cache, index), length);
+		ctx->length = agelength + length;
+		ctx->offset = 0;
+	}
+	_cache_lock(&cache->shm->lock);
+	entry->refs--;
+	if (entry->state == CACHE_VALID_E && entry->stale == 0 && entry->refs == 0)
+		/// the entry was replaced during the copy
+		_cache_unlink(cache, index);
+	_cache_unlock(&cache->shm->lock);
+	return (ctx->data != NULL)? ESUCCESS: EREJECT;
+}
+
+/**
+ * @return ESUCCESS when the response is available for ouistiti_cachereplay,
+ *  EINCOMPLETE when another request fetches it,
+ *  ECONTINUE when the caller fetches it,
+ *  EREJECT when the caller fetches it without the cache.
+ */
+static int _cache_lookup(_cache_t *cache, ouistiti_cachectx_t *ctx, http_message_t *request)
+{
+	time_t now = ouistiti_time();
+	int loaded = 0;
+	do
+	{
+		_cache_lock(&cache->shm->lock);
+		const char *vary = NULL;
+		uint64_t variant = 0;
+		int index = _cache_find(cache, ctx, request, &vary, &variant);
+		_cache_entry_t *entry = _cache_entry(cache, index);
+		if (entry != NULL && entry->state == CACHE_PASS_E)
+		{
+			if (entry->expires > now)
+			{
+				_cache_unlock(&cache->shm->lock);
+				return EREJECT;
+			}
+			_cache_unlink(cache, index);
+			entry = NULL;
+		}
+		if (entry != NULL && entry->state == CACHE_VALID_E && entry->stale <= now)
+		{
+			/// a reader of the entry removes it after its copy
+			if (entry->refs == 0)
+				_cache_unlink(cache, index);
+			entry = NULL;
+		}
+		if (entry == NULL && !loaded)
+		{
+			_cache_unlock(&cache->shm->lock);
+			if (ctx->refresh || _cache_load(cache, ctx, request, now) != ESUCCESS)
+				loaded = -1;
+			else
+				loaded = 1;
+			continue;
+		}
+		if (entry == NULL)
+		{
+			ctx->owner = _cache_claim(cache, ctx, vary, variant, now);
+			_cache_unlock(&cache->shm->lock);
+			return ECONTINUE;
+		}
+		if (entry->state == CACHE_PENDING_E)
+		{
+			if (entry->pending <= now)
+			{
+				/// the previous fetch is lost
+				entry->pending = now + cache->pending;
+				ctx->owner = index;
+				ctx->pending = entry->pending;
+				_cache_unlock(&cache->shm->lock);
+				return ECONTINUE;
+			}
+			uint32_t wakeup = entry->wakeup;
+			_cache_unlock(&cache->shm->lock);
+			ouistiti_wait(&entry->wakeup, wakeup, CACHE_WAIT);
+			return EINCOMPLETE;
+		}
+		if ((entry->expires <= now || ctx->refresh) && entry->pending <= now)
+		{
+			/// one request revalidates, the others receive the stale response
+			entry->pending = now + cache->pending;
+			ctx->retire = index;
+			_cache_unlock(&cache->shm->lock);
+			return ECONTINUE;
+		}
+		/// the lock is released by the copy
+		return _cache_copy(cache, ctx, index, now);
+	} while (loaded != 0);
+	return EREJECT;
+}
+
+static int _cache_cacheable(http_message_t *request)
+{
+	const char *method = httpmessage_REQUEST(request, "method");
+	if (method == NULL || (strcmp(method, str_get) && strcmp(method, str_head)))
+		return EREJECT;
+	/// a shared cache keeps only the public responses
+	const char *authorization = httpmessage_REQUEST(request, str_authorization);
+	if (authorization != NULL && authorization[0] != '\0')
+		return EREJECT;
+	const char *cachecontrol = httpmessage_REQUEST(request, str_cachecontrol);
+	if (cachecontrol != NULL && strstr(cachecontrol, "no-store") != NULL)
+		return EREJECT;
+	return ESUCCESS;
+}
+
+static ouistiti_cachectx_t *_cache_ctx(_cache_t *cache, http_message_t *request)
+{
+	ouistiti_cachectx_t *ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+	ctx->cache = cache;
+	ctx->owner = -1;
+	ctx->retire = -1;
+
+	const char *method = NULL;
+	size_t methodlen = httpmessage_REQUEST2(request, "method", &method);
+	const char *host = NULL;
+	size_t hostlen = httpmessage_REQUEST2(request, "Host", &host);
+	const char *uri = NULL;
+	size_t urilen = httpmessage_REQUEST2(request, "uri", &uri);
+	const char *query = NULL;
+	size_t querylen = httpmessage_REQUEST2(request, "query", &query);
+	int length = snprintf(ctx->key, sizeof(ctx->key), "%.*s %.*s%.*s%s%.*s",
+			(int)methodlen, method, (int)hostlen, (host != NULL)? host: "",
+			(int)urilen, uri, (querylen > 0)? "?": "", (int)querylen, (query != NULL)? query: "");
+	if (length >= sizeof(ctx->key))
+	{
+		free(ctx);
+		return NULL;
+	}
+	ctx->hash = _cache_hash(14695981039346656037ULL, ctx->key, length);
+	ctx->get = (method != NULL && !strcmp(method, str_get));
+
+	const char *cachecontrol = httpmessage_REQUEST(request, str_cachecontrol);
+	const char *pragma = httpmessage_REQUEST(request, "Pragma");
+	if ((cachecontrol != NULL && (strstr(cachecontrol, "no-cache") || strstr(cachecontrol, "max-age=0"))) ||
+		(pragma != NULL && strstr(pragma, "no-cache")))
+		ctx->refresh = 1;
+	return ctx;
+}
+
+int ouistiti_cachebegin(http_server_t *server, http_message_t *request, ouistiti_cachectx_t **pctx)
+{
+	ouistiti_cachectx_t *ctx = *pctx;
+	if (ctx == NULL)
+	{
+		_cache_t *cache = _cache_get(server);
+		if (cache == NULL || _cache_cacheable(request) != ESUCCESS)
+			return EREJECT;
+		ctx = _cache_ctx(cache, request);
+		if (ctx == NULL)
+			return EREJECT;
+		*pctx = ctx;
+	}
+	ctx->request = request;
+	switch (ctx->state)
+	{
+	case CACHE_HIT:
+		return ESUCCESS;
+	case CACHE_FILL:
+		return ECONTINUE;
+	case CACHE_DONE:
+		return EREJECT;
+	default:
+	break;
+	}
+	int ret = _cache_lookup(ctx->cache, ctx, request);
+	switch (ret)
+	{
+	case ESUCCESS:
+		cache_dbg("cache: %s hit", ctx->key);
+		ctx->state = CACHE_HIT;
+	break;
+	case EINCOMPLETE:
+		if (ctx->state == CACHE_LOOKUP)
+			cache_dbg("cache: %s wait", ctx->key);
+		/// the request returns to the loop of the client and calls again
+		ctx->state = CACHE_WAIT_E;
+	break;
+	case ECONTINUE:
+		cache_dbg("cache: %s miss", ctx->key);
+		ctx->state = CACHE_FILL;
+	break;
+	default:
+		ctx->state = CACHE_DONE;
+	break;
+	}
+	return ret;
+}
+
+int ouistiti_cacheappend(ouistiti_cachectx_t *ctx, const char *data, size_t length)
+{
+	if (ctx == NULL || ctx->state != CACHE_FILL || ctx->overflow)
+		return EREJECT;
+	size_t maxsize = ctx->cache->shm->maxsize;
+	if (ctx->length + length > maxsize)
+	{
+		/// the response is sent without the cache
+		ctx->overflow = 1;
+		return EREJECT;
+	}
+	if (ctx->length + length > ctx->size)
+	{
+		size_t size = ctx->size + CACHE_CHUNKSIZE;
+		while (size < ctx->length + length)
+			size += CACHE_CHUNKSIZE;
+		char *buffer = realloc(ctx->data, size);
+		if (buffer == NULL)
+		{
+			ctx->overflow = 1;
+			return EREJECT;
+		}
+		ctx->data = buffer;
+		ctx->size = size;
+	}
+	memcpy(ctx->data + ctx->length, data, length);
+	ctx->length += length;
+	return ESUCCESS;
+}
+
+typedef struct _cache_policy_s _cache_policy_t;
+struct _cache_policy_s
+{
+	int status;
+	time_t expires;
+	time_t stale;
+	char vary[CACHE_VARYMAX];
+	int contentlength;
+};
+
+static long _cache_directive(const char *value, size_t length, const char *name)
+{
+	size_t namelen = strlen(name);
+	for (const char *it = value; it != NULL && it + namelen <= value + length; it++)
+	{
+		it = memmem(it, value + length - it, name, namelen);
+		if (it == NULL)
+			break;
+		if ((it == value || it[-1] == ' ' || it[-1] == ',') && it[namelen] == '=')
+			return strtol(it + namelen + 1, NULL, 10);
+	}
+	return -1;
+}
+
+static int _cache_varyappend(char *vary, const char *value, size_t length)
+{
+	size_t offset = strlen(vary);
+	while (length > 0)
+	{
+		while (length > 0 && (*value == ' ' || *value == ','))
+		{
+			value++;
+			length--;
+		}
+		size_t namelen = 0;
+		while (namelen < length && value[namelen] != ',' && value[namelen] != ' ')
+			namelen++;
+		if (namelen == 0)
+			break;
+		if (namelen == 1 && value[0] == '*')
+			return EREJECT;
+		if (offset + namelen + 2 > CACHE_VARYMAX)
+			return EREJECT;
+		if (offset > 0)
+			vary[offset++] = ',';
+		memcpy(vary + offset, value, namelen);
+		offset += namelen;
+		vary[offset] = '\0';
+		value += namelen;
+		length -= namelen;
+	}
+	return ESUCCESS;
+}
+
+/**
+ * RFC9111: the shared cache stores the responses with an explicit
+ * freshness and without private data.
+ */
+static int _cache_policy(const char *header, size_t length, time_t now, int stale, _cache_policy_t *policy)
+{
+	long maxage = -1;
+	long smaxage = -1;
+	long swr = -1;
+	time_t expires = -1;
+	const char *location = NULL;
+	const char *line = header;
+
+	policy->status = 0;
+	while (line < header + length)
+	{
+		const char *end = memchr(line, '\n', header + length - line);
+		if (end == NULL)
+			end = header + length;
+		const char *lineend = end;
+		if (lineend > line && lineend[-1] == '\r')
+			lineend--;
+		const char *colon = memchr(line, ':', lineend - line);
+		if (colon != NULL)
+		{
+			size_t namelen = colon - line;
+			const char *value = colon + 1;
+			while (value < lineend && (*value == ' ' || *value == '\t'))
+				value++;
+			size_t valuelen = lineend - value;
+			if (namelen == 6 && !strncasecmp(line, "Status", 6))
+				policy->status = strtol(value, NULL, 10);
+			else if (namelen == 13 && !strncasecmp(line, str_cachecontrol, 13))
+			{
+				if (memmem(value, valuelen, STRING_REF("no-store")) ||
+					memmem(value, valuelen, STRING_REF("no-cache")) ||
+					memmem(value, valuelen, STRING_REF("private")))
+					return EREJECT;
+				maxage = _cache_directive(value, valuelen, "max-age");
+				smaxage = _cache_directive(value, valuelen, "s-maxage");
+				swr = _cache_directive(value, valuelen, "stale-while-revalidate");
+				if (memmem(value, valuelen, STRING_REF("must-revalidate")) ||
+					memmem(value, valuelen, STRING_REF("proxy-revalidate")))
+					swr = 0;
+			}
+			else if (namelen == 7 && !strncasecmp(line, "Expires", 7))
+			{
+				struct tm tm = {0};
+				char date[64];
+				snprintf(date, sizeof(date), "%.*s", (int)valuelen, value);
+				if (strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL)
+					expires = timegm(&tm);
+				else
+					expires = 0;
+			}
+			else if (namelen == 4 && !strncasecmp(line, "Vary", 4))
+			{
+				if (_cache_varyappend(policy->vary, value, valuelen) != ESUCCESS)
+					return EREJECT;
+			}
+			else if (namelen == 10 && !strncasecmp(line, "Set-Cookie", 10))
+				return EREJECT;
+			else if (namelen == 8 && !strncasecmp(line, "Location", 8))
+				location = value;
+			else if (namelen == 14 && !strncasecmp(line, str_contentlength, 14))
+				policy->contentlength = 1;
+		}
+		line = end + 1;
+	}
+	if (policy->status == 0)
+		policy->status = (location != NULL)? 302: 200;
+	switch (policy->status)
+	{
+	case 200:
+	case 203:
+	case 204:
+	case 300:
+	case 301:
+	case 404:
+	case 410:
+	break;
+	default:
+		return EREJECT;
+	}
+	if (smaxage >= 0)
+		policy->expires = now + smaxage;
+	else if (maxage >= 0)
+		policy->expires = now + maxage;
+	else if (expires >= 0)
+		policy->expires = expires;
+	else
+		return EREJECT;
+	if (policy->expires <= now)
+		return EREJECT;
+	policy->stale = policy->expires + ((swr >= 0)? swr: stale);
+	return ESUCCESS;
+}
+
+/**
+ * the header of the producer is completed with the length of the content,
+ * the response of the cache keeps the connection alive.
+ */
+static int _cache_complete(ouistiti_cachectx_t *ctx, size_t headerlength, size_t separator)
+{
+	size_t contentlength = ctx->length - headerlength - separator;
+	char line[64];
+	int length = snprintf(line, sizeof(line), "%s: %zu\r\n", str_contentlength, contentlength);
+	if (ctx->length + length > ctx->cache->shm->maxsize)
+		return EREJECT;
+	if (ctx->length + length > ctx->size)
+	{
+		char *buffer = realloc(ctx->data, ctx->length + length);
+		if (buffer == NULL)
+			return EREJECT;
+		ctx->data = buffer;
+		ctx->size = ctx->length + length;
+	}
+	memmove(ctx->data + headerlength + length, ctx->data + headerlength, ctx->length - headerlength);
+	memcpy(ctx->data + headerlength, line, length);
+	ctx->length += length;
+	return ESUCCESS;
+}
+
+static void _cache_write(_cache_t *cache, ouistiti_cachectx_t *ctx, const _cache_policy_t *policy,
+				uint64_t variant, time_t now)
+{
+	char filename[PATH_MAX];
+	char tmpname[PATH_MAX];
+	_cache_filename(cache, ctx->hash, filename, sizeof(filename));
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, getpid());
+	int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+	{
+		warn("cache: %s %m", tmpname);
+		return;
+	}
+	_cache_file_t header = {0};
+	header.magic = CACHE_MAGIC;
+	header.length = ctx->length;
+	header.variant = variant;
+	header.date = now;
+	header.expires = policy->expires;
+	header.stale = policy->stale;
+	strncpy(header.key, ctx->key, CACHE_KEYMAX - 1);
+	strncpy(header.vary, policy->vary, CACHE_VARYMAX - 1);
+	if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+		write(fd, ctx->data, ctx->length) != ctx->length)
+	{
+		close(fd);
+		unlink(tmpname);
+		return;
+	}
+	close(fd);
+	if (rename(tmpname, filename) < 0)
+		unlink(tmpname);
+}
+
+static void _cache_release(ouistiti_cachectx_t *ctx, int pass)
+{
+	_cache_t *cache = ctx->cache;
+	_cache_lock(&cache->shm->lock);
+	_cache_entry_t *owned = _cache_owned(cache, ctx);
+	if (owned != NULL && pass)
+	{
+		owned->state = CACHE_PASS_E;
+		owned->expires = ouistiti_time() + cache->pending;
+		owned->pending = 0;
+	}
+	else if (owned != NULL)
+		_cache_unlink(cache, ctx->owner);
+	_cache_entry_t *entry = _cache_entry(cache, ctx->retire);
+	if (entry != NULL && entry->state == CACHE_VALID_E && !strcmp(entry->key, ctx->key))
+		/// another request may revalidate
+		entry->pending = 0;
+	_cache_unlock(&cache->shm->lock);
+	if (owned != NULL)
+		ouistiti_wake(&owned->wakeup);
+	ctx->owner = -1;
+	ctx->retire = -1;
+}
+
+static int _cache_store(ouistiti_cachectx_t *ctx)
+{
+	_cache_t *cache = ctx->cache;
+	time_t now = ouistiti_time();
+	const char *end = memmem(ctx->data, ctx->length, "\r\n\r\n", 4);
+	size_t separator = 4;
+	if (end == NULL)
+	{
+		end = memmem(ctx->data, ctx->length, "\n\n", 2);
+		separator = 2;
+	}
+	if (end == NULL)
+		return EREJECT;
+	size_t headerlength = end - ctx->data + separator / 2;
+	_cache_policy_t policy = {0};
+	if (_cache_policy(ctx->data, headerlength, now, cache->config->stale, &policy) != ESUCCESS)
+		return EREJECT;
+	/// the length of the content of HEAD is unknown
+	if (!policy.contentlength && ctx->get &&
+		_cache_complete(ctx, headerlength, separator / 2) != ESUCCESS)
+		return EREJECT;
+	uint64_t variant = _cache_variant(policy.vary, ctx->request);
+
+	_cache_lock(&cache->shm->lock);
+	_cache_entry_t *entry = _cache_owned(cache, ctx);
+	if (entry == NULL)
+	{
+		/// the revalidation writes into a new entry
+		ctx->owner = _cache_claim(cache, ctx, policy.vary, variant, now);
+		entry = _cache_entry(cache, ctx->owner);
+	}
+	_cache_entry_t *retire = _cache_entry(cache, ctx->retire);
+	if (retire != NULL && retire->state == CACHE_VALID_E && !strcmp(retire->key, ctx->key))
+	{
+		/// the readers of the stale entry finish their copy
+		retire->expires = 0;
+		retire->stale = 0;
+		if (retire->refs == 0)
+			_cache_unlink(cache, ctx->retire);
+	}
+	ctx->retire = -1;
+	if (entry != NULL)
+	{
+		entry->variant = variant;
+		strncpy(entry->vary, policy.vary, CACHE_VARYMAX - 1);
+		entry->pending = now + cache->pending;
+	}
+	_cache_unlock(&cache->shm->lock);
+
+	if (entry != NULL)
+	{
+		/// the entry is pending, nobody reads its slot
+		memcpy(_cache_slot(cache, ctx->owner), ctx->data, ctx->length);
+		_cache_lock(&cache->shm->lock);
+		entry->length = ctx->length;
+		entry->date = now;
+		entry->expires = policy.expires;
+		entry->stale = policy.stale;
+		entry->access = now;
+		entry->pending = 0;
+		entry->state = CACHE_VALID_E;
+		_cache_unlock(&cache->shm->lock);
+		ouistiti_wake(&entry->wakeup);
+		ctx->owner = -1;
+	}
+	if (cache->config->path != NULL)
+		_cache_write(cache, ctx, &policy, variant, now);
+	cache_dbg("cache: %s stored for %lds", ctx->key, (long)(policy.expires - now));
+	return ESUCCESS;
+}
+
+void ouistiti_cacheend(ouistiti_cachectx_t *ctx, int result)
+{
+	if (ctx == NULL || ctx->state != CACHE_FILL)
+		return;
+	int pass = 0;
+	/// a complete response is cached or lets a pass entry
+	if (result == ESUCCESS)
+		pass = (ctx->overflow || ctx->data == NULL || _cache_store(ctx) != ESUCCESS);
+	_cache_release(ctx, pass);
+	free(ctx->data);
+	ctx->data = NULL;
+	ctx->length = 0;
+	ctx->size = 0;
+	ctx->state = CACHE_DONE;
+}
+
+int ouistiti_cachereplay(ouistiti_cachectx_t *ctx, http_message_t *response)
+{
+	if (ctx == NULL || ctx->state != CACHE_HIT)
+		return EREJECT;
+	if (ctx->offset < ctx->length)
+	{
+		int rest = ctx->length - ctx->offset;
+		if (rest > CACHE_CHUNKSIZE)
+			rest = CACHE_CHUNKSIZE;
+		int length = rest;
+		httpmessage_parsecgi(response, ctx->data + ctx->offset, &rest);
+		ctx->offset += length;
+		return ECONTINUE;
+	}
+	httpmessage_parsecgi(response, NULL, 0);
+	free(ctx->data);
+	ctx->data = NULL;
+	ctx->state = CACHE_DONE;
+	return ESUCCESS;
+}
+
+void ouistiti_cachefree(ouistiti_cachectx_t *ctx)
+{
+	if (ctx == NULL)
+		return;
+	if (ctx->state == CACHE_FILL)
+		_cache_release(ctx, 0);
+	free(ctx->data);
+	free(ctx);
+}
+
+int ouistiti_cache(http_server_t *server, const serverconfig_t *config)
+{
+	const cacheconfig_t *cacheconfig = &config->cache;
+	if (cacheconfig->entries <= 0 || _cache_get(server) != NULL)
+		return EREJECT;
+	int nentries = cacheconfig->entries;
+	size_t maxsize = (cacheconfig->maxsize > 0)? cacheconfig->maxsize: CACHE_MAXSIZE;
+	size_t shmsize = sizeof(_cache_shm_t) + sizeof(int32_t) * nentries +
+			sizeof(_cache_entry_t) * nentries + maxsize * nentries;
+	/// the pages of the data are allocated on the first use
+	_cache_shm_t *shm = mmap(NULL, shmsize, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED)
+	{
+		err("cache: memory allocation error %m");
+		return EREJECT;
+	}
+	_cache_t *cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+	{
+		munmap(shm, shmsize);
+		return EREJECT;
+	}
+	shm->nentries = nentries;
+	shm->maxsize = maxsize;
+	cache->server = server;
+	cache->config = cacheconfig;
+	cache->shm = shm;
+	cache->shmsize = shmsize;
+	cache->pending = (cacheconfig->pending > 0)? cacheconfig->pending: CACHE_PENDING;
+	cache->buckets = (int32_t *)(shm + 1);
+	cache->entries = (_cache_entry_t *)(cache->buckets + nentries);
+	cache->data = (char *)(cache->entries + nentries);
+	for (int i = 0; i < nentries; i++)
+	{
+		cache->buckets[i] = -1;
+		cache->entries[i].next = -1;
+	}
+	if (cacheconfig->path != NULL && access(cacheconfig->path, W_OK) != 0)
+		warn("cache: %s unavailable %m", cacheconfig->path);
+	cache->next = g_cache;
+	g_cache = cache;
+	warn("cache: %d entries of %zu bytes%s%s", nentries, maxsize,
+		(cacheconfig->path != NULL)? " and ": "", (cacheconfig->path != NULL)? cacheconfig->path: "");
+	return ESUCCESS;
+}
+
+void ouistiti_freecache(http_server_t *server)
+{
+	for (_cache_t **previous = &g_cache; *previous != NULL; previous = &(*previous)->next)
+	{
+		_cache_t *cache = *previous;
+		if (cache->server == server)
+		{
+			*previous = cache->next;
+			munmap(cache->shm, cache->shmsize);
+			free(cache);
+			return;
+		}
+	}
+}
@@ -0,0 +1,134 @@
+/*****************************************************************************
+ * cachepolicy.c: Cache-Control of the responses by uri and mime type
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    The modules register the rules of their documents during their
+    creation. A rule contains the expressions of the uri and of the
+    mime type (the same expressions as the htaccess of mod_document)
+    and the value of the Cache-Control header, built once.
+    The first rule of the server matching the uri of the request gives
+    the header. The mime type is the one of the extension of the uri,
+    then mod_server and mod_document take the same decision on a
+    request before and after the opening of the file.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/utils.h"
+#include "ouistiti/log.h"
+#include "ouistiti.h"
+#include "log.h"
+
+typedef struct _cachepolicy_s _cachepolicy_t;
+struct _cachepolicy_s
+{
+	http_server_t *server;
+	char *match;
+	char *mime;
+	char *control;
+	size_t controllen;
+	_cachepolicy_t *next;
+};
+
+static _cachepolicy_t *g_cachepolicy = NULL;
+
+int ouistiti_cachepolicy(http_server_t *server, const char *match, const char *mime, const char *control, size_t controllen)
+{
+	if (control == NULL)
+		return EREJECT;
+	if (controllen == (size_t)-1)
+		controllen = strlen(control);
+	if (memchr(control, '\r', controllen) || memchr(control, '\n', controllen))
+	{
+		err("cachepolicy: forbidden value %.*s", (int)controllen, control);
+		return EREJECT;
+	}
+	_cachepolicy_t *policy = calloc(1, sizeof(*policy));
+	if (policy == NULL)
+		return EREJECT;
+	policy->server = server;
+	if (match != NULL)
+		policy->match = strdup(match);
+	if (mime != NULL)
+		policy->mime = strdup(mime);
+	policy->control = strndup(control, controllen);
+	policy->controllen = controllen;
+
+	/// the rules keep the order of the configuration
+	_cachepolicy_t **last = &g_cachepolicy;
+	while (*last != NULL)
+		last = &(*last)->next;
+	*last = policy;
+	dbg("cachepolicy: %s %s: %s", match, mime, policy->control);
+	return ESUCCESS;
+}
+
+const char *ouistiti_cachecontrol(http_server_t *server, const char *uri, size_t *length)
+{
+	const char *mime = NULL;
+	if (uri == NULL)
+		return NULL;
+	for (const _cachepolicy_t *policy = g_cachepolicy; policy != NULL; policy = policy->next)
+	{
+		if (policy->server != server)
+			continue;
+		if (policy->match != NULL && utils_searchexp(uri, policy->match, NULL) != ESUCCESS)
+			continue;
+		if (policy->mime != NULL)
+		{
+			if (mime == NULL)
+				mime = utils_getmime(uri);
+			if (mime == NULL || utils_searchexp(mime, policy->mime, NULL) != ESUCCESS)
+				continue;
+		}
+		if (length != NULL)
+			*length = policy->controllen;
+		return policy->control;
+	}
+	return NULL;
+}
+
+void ouistiti_freecachepolicy(http_server_t *server)
+{
+	_cachepolicy_t **previous = &g_cachepolicy;
+	while (*previous != NULL)
+	{
+		_cachepolicy_t *policy = *previous;
+		if (policy->server != server)
+		{
+			previous = &policy->next;
+			continue;
+		}
+		*previous = policy->next;
+		free(policy->match);
+		free(policy->mime);
+		free(policy->control);
+		free(policy);
+	}
+}
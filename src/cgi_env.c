@@ -41,6 +41,7 @@
 #include "ouistiti.h"
 #include "mod_cgi.h"
 #include "mod_auth.h"
+#include "log.h"
 
 #define cgi_dbg(...)
 
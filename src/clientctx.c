@@ -0,0 +1,140 @@
+/*****************************************************************************
+ * clientctx.c: contexts of the modules allocated on demand for the clients
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    The getctx callback of a module is called for each new client, even
+    if the client never sends a request for this module. A module which
+    needs a context only for some requests (websocket, webstream,
+    upgrade) registers its connector with the module itself, returns
+    the client as context, and asks the context here when a request
+    requires it. The idle clients hold no context.
+
+    The contexts are stored into a hash table of the process, keyed by
+    the client and the owner (a static of the module). The context is
+    allocated with its entry.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sched.h>
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/log.h"
+#include "ouistiti.h"
+#include "log.h"
+
+#define CLIENTCTX_BUCKETS 1024
+
+typedef struct _clientctx_s _clientctx_t;
+struct _clientctx_s
+{
+	http_client_t *clt;
+	const void *owner;
+	size_t size;
+	_clientctx_t *next;
+	/// the context of the module follows the entry
+	max_align_t data[];
+};
+
+static _clientctx_t *g_clientctx[CLIENTCTX_BUCKETS] = {0};
+static int g_clientctxlock = 0;
+
+static void _clientctx_lock(void)
+{
+	while (__atomic_exchange_n(&g_clientctxlock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void _clientctx_unlock(void)
+{
+	__atomic_store_n(&g_clientctxlock, 0, __ATOMIC_RELEASE);
+}
+
+static _clientctx_t **_clientctx_bucket(const http_client_t *clt, const void *owner)
+{
+	uintptr_t key = (uintptr_t)clt ^ ((uintptr_t)owner >> 4);
+	/// the pointers are aligned, the low bits are dropped
+	key = (key >> 4) * 0x9E3779B1u;
+	return &g_clientctx[(key >> 8) % CLIENTCTX_BUCKETS];
+}
+
+void *ouistiti_clientctx(http_client_t *clt, const void *owner, size_t size)
+{
+	_clientctx_t **bucket = _clientctx_bucket(clt, owner);
+	_clientctx_t *entry = NULL;
+	int created = 0;
+
+	_clientctx_lock();
+	for (entry = *bucket; entry != NULL; entry = entry->next)
+	{
+		if (entry->clt == clt && entry->owner == owner)
+			break;
+	}
+	if (entry == NULL && size > 0)
+	{
+		entry = calloc(1, sizeof(*entry) + size);
+		if (entry != NULL)
+		{
+			entry->clt = clt;
+			entry->owner = owner;
+			entry->size = size;
+			entry->next = *bucket;
+			*bucket = entry;
+			created = 1;
+		}
+	}
+	_clientctx_unlock();
+	if (entry == NULL)
+		return NULL;
+	if (created)
+		ouistiti_clientmemory(clt, sizeof(*entry) + size);
+	return entry->data;
+}
+
+void ouistiti_freeclientctx(http_client_t *clt, const void *owner)
+{
+	_clientctx_t **bucket = _clientctx_bucket(clt, owner);
+	_clientctx_t *entry = NULL;
+
+	_clientctx_lock();
+	for (_clientctx_t **previous = bucket; *previous != NULL; previous = &(*previous)->next)
+	{
+		if ((*previous)->clt == clt && (*previous)->owner == owner)
+		{
+			entry = *previous;
+			*previous = entry->next;
+			break;
+		}
+	}
+	_clientctx_unlock();
+	if (entry == NULL)
+		return;
+	ouistiti_clientmemory(clt, -(long)(sizeof(*entry) + entry->size));
+	free(entry);
+}
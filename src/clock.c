@@ -0,0 +1,196 @@
+/*****************************************************************************
+ * clock.c: shared clock of the servers
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    The clock keeps the current second, a monotonic second and the
+    IMF-fixdate of the Date header inside a shared memory allocated
+    before the first fork. The readers get the coarse clock of the vDSO
+    (no syscall) and compare its second to the shared one. The first
+    process seeing a new second formats the date and publishes it with
+    a sequence lock: the sequence is odd during the update and the
+    readers retry their copy when the sequence changed under them.
+    Then gmtime and strftime are called once per second for all the
+    processes and the readers never lock.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/log.h"
+#include "ouistiti.h"
+
+#include "log.h"
+
+#ifdef CLOCK_REALTIME_COARSE
+#define CLOCK_SOURCE CLOCK_REALTIME_COARSE
+#define CLOCK_MONOTONICSOURCE CLOCK_MONOTONIC_COARSE
+#else
+#define CLOCK_SOURCE CLOCK_REALTIME
+#define CLOCK_MONOTONICSOURCE CLOCK_MONOTONIC
+#endif
+/// "Sun, 06 Nov 1994 08:49:37 GMT"
+#define CLOCK_DATELENGTH 29
+#define CLOCK_RETRIES 64
+
+typedef struct _clock_s _clock_t;
+struct _clock_s
+{
+	unsigned int seq;
+	time_t now;
+	time_t monotonic;
+	char date[CLOCK_DATELENGTH + 1];
+};
+
+/// the memory of the process is used until the shared memory exists
+static _clock_t g_localclock = {0};
+static _clock_t *g_clock = &g_localclock;
+
+static size_t _clock_format(time_t now, char *date, size_t size)
+{
+	struct tm tm;
+	if (gmtime_r(&now, &tm) == NULL)
+		return 0;
+	return strftime(date, size, "%a, %d %b %Y %T GMT", &tm);
+}
+
+static time_t _clock_tick(_clock_t *clock)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_SOURCE, &ts);
+	time_t last = __atomic_load_n(&clock->now, __ATOMIC_ACQUIRE);
+	if (ts.tv_sec == last)
+		return ts.tv_sec;
+
+	unsigned int seq = __atomic_load_n(&clock->seq, __ATOMIC_RELAXED);
+	unsigned int locked = seq + 1;
+	if (seq & 1)
+	{
+		/**
+		 * another process is updating, its result is the same.
+		 * A process killed during the update leaves the sequence odd,
+		 * the next second takes over.
+		 */
+		if (ts.tv_sec <= last + 1)
+			return ts.tv_sec;
+		locked = seq + 2;
+	}
+	if (!__atomic_compare_exchange_n(&clock->seq, &seq, locked,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return ts.tv_sec;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	struct timespec mono;
+	clock_gettime(CLOCK_MONOTONICSOURCE, &mono);
+	_clock_format(ts.tv_sec, clock->date, sizeof(clock->date));
+	__atomic_store_n(&clock->monotonic, mono.tv_sec, __ATOMIC_RELAXED);
+	__atomic_store_n(&clock->now, ts.tv_sec, __ATOMIC_RELEASE);
+	/// the sequence is even again and the readers may copy the date
+	__atomic_store_n(&clock->seq, locked + 1, __ATOMIC_RELEASE);
+	return ts.tv_sec;
+}
+
+int ouistiti_clock(void)
+{
+	if (g_clock != &g_localclock)
+		return ESUCCESS;
+	_clock_t *clock = mmap(NULL, sizeof(*clock), PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (clock == MAP_FAILED)
+	{
+		err("clock: memory allocation error %m");
+		return EREJECT;
+	}
+	_clock_tick(clock);
+	g_clock = clock;
+	return ESUCCESS;
+}
+
+time_t ouistiti_time(void)
+{
+	return _clock_tick(g_clock);
+}
+
+time_t ouistiti_monotonic(void)
+{
+	_clock_tick(g_clock);
+	return __atomic_load_n(&g_clock->monotonic, __ATOMIC_RELAXED);
+}
+
+size_t ouistiti_date(char *date, size_t size)
+{
+	if (size < CLOCK_DATELENGTH + 1)
+		return 0;
+	_clock_t *clock = g_clock;
+	time_t now = _clock_tick(clock);
+	for (int i = 0; i < CLOCK_RETRIES; i++)
+	{
+		unsigned int seq = __atomic_load_n(&clock->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(date, clock->date, CLOCK_DATELENGTH + 1);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&clock->seq, __ATOMIC_RELAXED) == seq && date[0] != '\0')
+			return CLOCK_DATELENGTH;
+	}
+	/// the writer is too slow, the date is formatted here
+	dbg("clock: date formatted by the reader");
+	return _clock_format(now, date, size);
+}
+
+/**
+ * the word is inside a shared memory, the futex is not private.
+ * Without futex the waiter sleeps the whole delay.
+ */
+void ouistiti_wait(uint32_t *word, uint32_t value, int ms)
+{
+	struct timespec timeout = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+	if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != value)
+		return;
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+#else
+	nanosleep(&timeout, NULL);
+#endif
+}
+
+void ouistiti_wake(uint32_t *word)
+{
+	__atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
@@ -43,11 +43,15 @@
 
 #include "ouistiti/log.h"
 #include "ouistiti.h"
+#include "log.h"
+
+#define DEFAULT_CACHEENTRIES 64
 
 extern char str_hostname[HOST_NAME_MAX + 7];
 
 static char *logfile = NULL;
 static int logfd = 0;
+static int logflags = O_TRUNC;
 
 typedef void (*_parsercb_t)(void *arg, const char *option, size_t length);
 
@@ -119,6 +123,25 @@ static serverconfig_t *config_server(config_setting_t *iterator, config_t *confi
 		}
 	}
 	config_setting_lookup_string(iterator, "root", &config->root);
+#ifdef METRICS
+	config_setting_lookup_string(iterator, "metrics", &config->metrics);
+#endif
+	config_setting_lookup_string(iterator, "accesslog", &config->accesslog);
+	config_setting_lookup_string(iterator, "accesslog-format", &config->accessformat);
+#if LIBCONFIG_VER_MINOR < 5
+	const config_setting_t *configcache = config_setting_get_member(iterator, "cache");
+#else
+	const config_setting_t *configcache = config_setting_lookup(iterator, "cache");
+#endif
+	if (configcache != NULL)
+	{
+		config->cache.entries = DEFAULT_CACHEENTRIES;
+		config_setting_lookup_int(configcache, "entries", &config->cache.entries);
+		config_setting_lookup_int(configcache, "maxsize", &config->cache.maxsize);
+		config_setting_lookup_int(configcache, "stale", &config->cache.stale);
+		config_setting_lookup_int(configcache, "pending", &config->cache.pending);
+		config_setting_lookup_string(configcache, "path", &config->cache.path);
+	}
 	config->modulesconfig = iterator;
 	config->configfile = configfile;
 	return config;
@@ -126,7 +149,16 @@ static serverconfig_t *config_server(config_setting_t *iterator, config_t *confi
 
 static int ouistiticonfig_mergeserver(serverconfig_t *main, serverconfig_t *new)
 {
-	return EREJECT;
+	if (!strcmp(main->server->hostname, new->server->hostname))
+	{
+		err("config: server %s:%d defined twice", new->server->hostname, new->server->port);
+		return EREJECT;
+	}
+	/// the server is loaded as virtual host of the first server on the port
+	warn("config: server %s merged as vhost of %s", new->server->hostname, main->server->hostname);
+	new->next = main->vhosts;
+	main->vhosts = new;
+	return ESUCCESS;
 }
 
 static int ouistiticonfig_appendserver(serverconfig_t *new, ouistiticonfig_t *ouistiticonfig)
@@ -225,20 +257,26 @@ ouistiticonfig_t *ouistiticonfig_create(const char *filepath)
 	ouistiticonfig->configfile = configfile;
 
 	config_lookup_string(configfile, str_user, (const char **)&ouistiticonfig->user);
+	logfile = NULL;
 	config_lookup_string(configfile, "log-file", (const char **)&logfile);
 	if (logfile != NULL && logfile[0] != '\0')
 	{
-		logfd = open(logfile, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+		logfd = open(logfile, O_WRONLY | O_CREAT | logflags, 00644);
 		if (logfd > 0)
 		{
 			dup2(logfd, 1);
 			dup2(logfd, 2);
 			close(logfd);
+			logfd = 0;
+			/// the file is not truncated on reload
+			logflags = O_APPEND;
 		}
 		else
 			err("log file error %s", strerror(errno));
 	}
 	config_lookup_string(configfile, "init_d", (const char **)&ouistiticonfig->init_d);
+	config_lookup_int(configfile, "workers", &ouistiticonfig->workers);
+	config_lookup_int(configfile, "log-ratelimit", &ouistiticonfig->logratelimit);
 	const config_setting_t *configmimes = config_lookup(configfile, "mimetypes");
 	config_mimes(configmimes);
 
@@ -274,6 +312,19 @@ ouistiticonfig_t *ouistiticonfig_create(const char *filepath)
 	return ouistiticonfig;
 }
 
+static void ouistiticonfig_freeserver(serverconfig_t *config, ouistiticonfig_t *ouistiticonfig, void **lastconfig)
+{
+	if ((config->configfile != ouistiticonfig->configfile) &&
+		(config->configfile != *lastconfig))
+	{
+		*lastconfig = config->configfile;
+		config_destroy((config_t *)config->configfile);
+		free(config->configfile);
+	}
+	free(config->server);
+	free(config);
+}
+
 void ouistiticonfig_destroy(ouistiticonfig_t *ouistiticonfig)
 {
 	if (logfd > 0)
@@ -283,15 +334,14 @@ void ouistiticonfig_destroy(ouistiticonfig_t *ouistiticonfig)
 	{
 		if (ouistiticonfig->config[i] != NULL)
 		{
-			if ((ouistiticonfig->config[i]->configfile != ouistiticonfig->configfile) &&
-				(ouistiticonfig->config[i]->configfile != lastconfig))
+			serverconfig_t *vhost = ouistiticonfig->config[i]->vhosts;
+			while (vhost != NULL)
 			{
-				lastconfig = ouistiticonfig->config[i]->configfile;
-				config_destroy((config_t *)ouistiticonfig->config[i]->configfile);
-				free(ouistiticonfig->config[i]->configfile);
+				serverconfig_t *next = vhost->next;
+				ouistiticonfig_freeserver(vhost, ouistiticonfig, &lastconfig);
+				vhost = next;
 			}
-			free(ouistiticonfig->config[i]->server);
-			free(ouistiticonfig->config[i]);
+			ouistiticonfig_freeserver(ouistiticonfig->config[i], ouistiticonfig, &lastconfig);
 		}
 	}
 	config_destroy((config_t *)ouistiticonfig->configfile);
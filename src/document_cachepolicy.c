@@ -0,0 +1,114 @@
+/*****************************************************************************
+ * document_cachepolicy.c: Cache-Control rules of the documents
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef FILE_CONFIG
+#include <libconfig.h>
+#endif
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/utils.h"
+#include "ouistiti/log.h"
+#include "mod_document.h"
+#include "log.h"
+
+#define CACHEPOLICY_CONTROLMAX 192
+
+#ifdef FILE_CONFIG
+static char *_cachepolicy_control(config_setting_t *setting)
+{
+	char control[CACHEPOLICY_CONTROLMAX];
+	int length = 0;
+	int nocache = 0;
+	int private = 0;
+	int immutable = 0;
+	int maxage = -1;
+	int smaxage = -1;
+	int stale = -1;
+
+	config_setting_lookup_bool(setting, "nocache", &nocache);
+	config_setting_lookup_bool(setting, "private", &private);
+	config_setting_lookup_bool(setting, "immutable", &immutable);
+	config_setting_lookup_int(setting, "maxage", &maxage);
+	config_setting_lookup_int(setting, "smaxage", &smaxage);
+	config_setting_lookup_int(setting, "stalewhilerevalidate", &stale);
+
+	length += snprintf(control + length, sizeof(control) - length, "%s", private? "private": "public");
+	if (nocache)
+		length += snprintf(control + length, sizeof(control) - length, ",no-cache");
+	if (maxage > -1)
+		length += snprintf(control + length, sizeof(control) - length, ",max-age=%d", maxage);
+	if (smaxage > -1 && !private)
+		length += snprintf(control + length, sizeof(control) - length, ",s-maxage=%d", smaxage);
+	if (stale > -1)
+		length += snprintf(control + length, sizeof(control) - length, ",stale-while-revalidate=%d", stale);
+	if (immutable)
+		length += snprintf(control + length, sizeof(control) - length, ",immutable");
+	return strdup(control);
+}
+
+int cachepolicy_config(config_setting_t *setting, cachepolicy_t **policies)
+{
+	config_setting_t *rules = config_setting_get_member(setting, "cachepolicy");
+	if (rules == NULL)
+		return ESUCCESS;
+	/// one rule may be a group instead of a list
+	int nbrules = config_setting_is_group(rules)? 1: config_setting_length(rules);
+
+	cachepolicy_t **last = policies;
+	for (int i = 0; i < nbrules; i++)
+	{
+		config_setting_t *rule = config_setting_is_group(rules)? rules: config_setting_get_elem(rules, i);
+		if (rule == NULL || !config_setting_is_group(rule))
+			continue;
+		cachepolicy_t *policy = calloc(1, sizeof(*policy));
+		if (policy == NULL)
+			return EREJECT;
+		config_setting_lookup_string(rule, "match", &policy->match);
+		config_setting_lookup_string(rule, "mime", &policy->mime);
+		policy->control = _cachepolicy_control(rule);
+		dbg("document: cache policy %s %s: %s", policy->match, policy->mime, policy->control);
+		*last = policy;
+		last = &policy->next;
+	}
+	return ESUCCESS;
+}
+#endif
+
+void cachepolicy_free(cachepolicy_t *policies)
+{
+	cachepolicy_t *next = NULL;
+	for (cachepolicy_t *policy = policies; policy != NULL; policy = next)
+	{
+		next = policy->next;
+		free(policy->control);
+		free(policy);
+	}
+}
@@ -36,6 +36,7 @@
 #include "ouistiti/utils.h"
 #include "ouistiti/log.h"
 #include "mod_document.h"
+#include "log.h"
 
 const char str_wildcard[] = "*";
 
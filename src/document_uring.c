@@ -0,0 +1,562 @@
+/*****************************************************************************
+ * document_uring.c: transfer of the static files with io_uring
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    The "uring" option sends the files with one io_uring of the worker:
+     - each chunk is a read of the file into a registered buffer, linked
+       to the send of the buffer on the socket. Both are submitted and
+       completed with one io_uring_enter.
+     - the ring and the buffers are created by the first request of the
+       worker. The file descriptor of the ring is registered too.
+     - the clients of a threaded worker share the ring: each one reaps
+       the completions of all the others while it waits its own ones.
+       The operations of a chunk belong to the ring with its buffer, a
+       client may return before its completions (disabled ring), the
+       last completion releases the buffer.
+    The ring is not available on the kernels before 5.11 or when it is
+    forbidden (seccomp, kernel.io_uring_disabled), then the module
+    keeps sendfile or read.
+    The offset of the read is the offset of the connector, a short send
+    does not hold the buffer: the rest is read again by the next chunk.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/log.h"
+#include "mod_document.h"
+#include "log.h"
+
+#define URING_ENTRIES 64
+#define URING_BUFFERS 16
+#define URING_BUFFERSIZE (128 * 1024)
+/// a client may wait completions reaped by another thread
+#define URING_WAITNS 10000000
+
+typedef struct _uring_op_s _uring_op_t;
+struct _uring_op_s
+{
+	int result;
+	int done;
+};
+
+/// the read, the send and the send after a short read of one buffer
+#define URING_CHUNKOPS 3
+#define URING_USERDATA(index, op) (((uint64_t)(index) << 2) | (op))
+
+typedef struct _uring_chunk_s _uring_chunk_t;
+struct _uring_chunk_s
+{
+	_uring_op_t ops[URING_CHUNKOPS];
+	int pending;
+	/// the client does not wait the completions anymore
+	int abandoned;
+};
+
+typedef struct _uring_s _uring_t;
+struct _uring_s
+{
+	pid_t pid;
+	int fd;
+	/// the registered index of the ring is only valid for its thread
+	pthread_t thread;
+	int registeredfd;
+	int disabled;
+	int lock;
+	void *sqring;
+	size_t sqringsize;
+	void *cqring;
+	size_t cqringsize;
+	struct io_uring_sqe *sqes;
+	size_t sqessize;
+	unsigned int *sqhead;
+	unsigned int *sqtail;
+	unsigned int *sqarray;
+	unsigned int sqmask;
+	unsigned int sqentries;
+	unsigned int sqlocal;
+	unsigned int *cqhead;
+	unsigned int *cqtail;
+	unsigned int cqmask;
+	struct io_uring_cqe *cqes;
+	uint8_t *buffers;
+	uint32_t freebuffers;
+	_uring_chunk_t chunks[URING_BUFFERS];
+};
+
+static _uring_t g_uring = {.fd = -1};
+
+static void _uring_lock(_uring_t *ring)
+{
+	while (__atomic_exchange_n(&ring->lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void _uring_unlock(_uring_t *ring)
+{
+	__atomic_store_n(&ring->lock, 0, __ATOMIC_RELEASE);
+}
+
+static void _uring_free(_uring_t *ring)
+{
+	if (ring->buffers != NULL)
+		munmap(ring->buffers, URING_BUFFERS * URING_BUFFERSIZE);
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqessize);
+	if (ring->cqring != NULL && ring->cqring != ring->sqring)
+		munmap(ring->cqring, ring->cqringsize);
+	if (ring->sqring != NULL)
+		munmap(ring->sqring, ring->sqringsize);
+	if (ring->fd != -1)
+		close(ring->fd);
+	int lock = ring->lock;
+	memset(ring, 0, sizeof(*ring));
+	ring->lock = lock;
+	ring->fd = -1;
+	ring->registeredfd = -1;
+}
+
+static int _uring_probe(_uring_t *ring)
+{
+	size_t length = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, length);
+	if (probe == NULL)
+		return EREJECT;
+	int ret = EREJECT;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+		probe->last_op >= IORING_OP_SEND &&
+		(probe->ops[IORING_OP_READ_FIXED].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED))
+		ret = ESUCCESS;
+	free(probe);
+	return ret;
+}
+
+static int _uring_buffers(_uring_t *ring)
+{
+	ring->buffers = mmap(NULL, URING_BUFFERS * URING_BUFFERSIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buffers == MAP_FAILED)
+	{
+		ring->buffers = NULL;
+		return EREJECT;
+	}
+	struct iovec iov[URING_BUFFERS];
+	for (int i = 0; i < URING_BUFFERS; i++)
+	{
+		iov[i].iov_base = ring->buffers + i * URING_BUFFERSIZE;
+		iov[i].iov_len = URING_BUFFERSIZE;
+	}
+	/// the buffers are locked into the memory (RLIMIT_MEMLOCK)
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) != 0)
+		return EREJECT;
+	ring->freebuffers = (URING_BUFFERS < 32)? (1U << URING_BUFFERS) - 1: (uint32_t)-1;
+	return ESUCCESS;
+}
+
+static int _uring_setup(_uring_t *ring)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->pid = getpid();
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->fd < 0)
+	{
+		warn("document: io_uring not available (%s)", strerror(errno));
+		ring->fd = -1;
+		return EREJECT;
+	}
+	/// the wait with a timeout is available since linux 5.11
+	if (!(params.features & IORING_FEAT_EXT_ARG))
+	{
+		warn("document: io_uring too old");
+		return EREJECT;
+	}
+	ring->registeredfd = -1;
+
+	ring->sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cqringsize > ring->sqringsize)
+			ring->sqringsize = ring->cqringsize;
+		ring->cqringsize = ring->sqringsize;
+	}
+	ring->sqring = mmap(NULL, ring->sqringsize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqring == MAP_FAILED)
+	{
+		ring->sqring = NULL;
+		return EREJECT;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cqring = ring->sqring;
+	else
+	{
+		ring->cqring = mmap(NULL, ring->cqringsize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cqring == MAP_FAILED)
+		{
+			ring->cqring = NULL;
+			return EREJECT;
+		}
+	}
+	ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		ring->sqes = NULL;
+		return EREJECT;
+	}
+	uint8_t *sq = ring->sqring;
+	ring->sqhead = (unsigned int *)(sq + params.sq_off.head);
+	ring->sqtail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sqarray = (unsigned int *)(sq + params.sq_off.array);
+	ring->sqmask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sqentries = params.sq_entries;
+	ring->sqlocal = *ring->sqtail;
+	uint8_t *cq = ring->cqring;
+	ring->cqhead = (unsigned int *)(cq + params.cq_off.head);
+	ring->cqtail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cqmask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	if (_uring_probe(ring) != ESUCCESS)
+	{
+		warn("document: io_uring without read_fixed and send");
+		return EREJECT;
+	}
+	if (_uring_buffers(ring) != ESUCCESS)
+	{
+		warn("document: io_uring buffers error %s", strerror(errno));
+		return EREJECT;
+	}
+	/// the registered ring avoids the lookup of its file on each enter (linux 5.18)
+	struct io_uring_rsrc_update update = {.offset = -1U, .data = ring->fd};
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_RING_FDS, &update, 1) == 1)
+	{
+		ring->registeredfd = update.offset;
+		ring->thread = pthread_self();
+	}
+	dbg("document: io_uring ready %u entries", params.sq_entries);
+	return ESUCCESS;
+}
+
+int mod_send_uringready(void)
+{
+	_uring_t *ring = &g_uring;
+	int ret = EREJECT;
+	_uring_lock(ring);
+	/// the ring belongs to the process which creates it, each worker has its own
+	if (ring->pid != getpid())
+	{
+		_uring_free(ring);
+		if (_uring_setup(ring) != ESUCCESS)
+		{
+			_uring_free(ring);
+			ring->pid = getpid();
+			ring->disabled = 1;
+		}
+	}
+	if (!ring->disabled)
+		ret = ESUCCESS;
+	_uring_unlock(ring);
+	return ret;
+}
+
+/// the ring must be locked
+static struct io_uring_sqe *_uring_sqe(_uring_t *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+	if (ring->sqlocal - head >= ring->sqentries)
+		return NULL;
+	unsigned int index = ring->sqlocal & ring->sqmask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqarray[index] = index;
+	ring->sqlocal++;
+	return sqe;
+}
+
+/// the ring must be locked
+static unsigned int _uring_reap(_uring_t *ring)
+{
+	unsigned int head = *ring->cqhead;
+	unsigned int tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+	unsigned int count = 0;
+	for (; head != tail; head++, count++)
+	{
+		const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqmask];
+		unsigned int index = cqe->user_data >> 2;
+		unsigned int opnum = cqe->user_data & 0x3;
+		if (index >= URING_BUFFERS || opnum >= URING_CHUNKOPS)
+			continue;
+		_uring_chunk_t *chunk = &ring->chunks[index];
+		chunk->ops[opnum].result = cqe->res;
+		chunk->ops[opnum].done = 1;
+		chunk->pending--;
+		if (chunk->abandoned && chunk->pending == 0)
+		{
+			/// the kernel does not use the buffer anymore
+			chunk->abandoned = 0;
+			ring->freebuffers |= (1U << index);
+		}
+	}
+	__atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+static int _uring_enter(_uring_t *ring, unsigned int submit, unsigned int wait)
+{
+	struct __kernel_timespec timeout = {.tv_sec = 0, .tv_nsec = URING_WAITNS};
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uintptr_t)&timeout;
+	unsigned int flags = IORING_ENTER_EXT_ARG;
+	int fd = ring->fd;
+	if (wait > 0)
+		flags |= IORING_ENTER_GETEVENTS;
+	if (ring->registeredfd != -1 && pthread_equal(ring->thread, pthread_self()))
+	{
+		flags |= IORING_ENTER_REGISTERED_RING;
+		fd = ring->registeredfd;
+	}
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, &arg, sizeof(arg));
+}
+
+/**
+ * submit the entries of all the clients and wait the operations of
+ * the caller. The completions of the other clients are stored into
+ * their operations.
+ */
+static int _uring_wait(_uring_t *ring, const _uring_op_t *ops, int nbops)
+{
+	while (1)
+	{
+		_uring_lock(ring);
+		if (ring->disabled)
+		{
+			_uring_unlock(ring);
+			return EREJECT;
+		}
+		_uring_reap(ring);
+		unsigned int pending = 0;
+		for (int i = 0; i < nbops; i++)
+			pending += !ops[i].done;
+		unsigned int submit = ring->sqlocal - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+		__atomic_store_n(ring->sqtail, ring->sqlocal, __ATOMIC_RELEASE);
+		_uring_unlock(ring);
+		if (pending == 0)
+			return ESUCCESS;
+		if (_uring_enter(ring, submit, pending) < 0 &&
+			errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+		{
+			err("document: io_uring enter error %s", strerror(errno));
+			/// the operations in progress are never reaped
+			__atomic_store_n(&ring->disabled, 1, __ATOMIC_RELEASE);
+			return EREJECT;
+		}
+	}
+	return EREJECT;
+}
+
+static int _uring_getbuffer(_uring_t *ring)
+{
+	int index = -1;
+	_uring_lock(ring);
+	if (ring->freebuffers != 0)
+	{
+		index = __builtin_ctz(ring->freebuffers);
+		ring->freebuffers &= ~(1U << index);
+	}
+	_uring_unlock(ring);
+	return index;
+}
+
+/**
+ * the buffer is free when the operations of its chunk are completed,
+ * otherwise the reaper of the last completion frees it
+ */
+static void _uring_putbuffer(_uring_t *ring, int index)
+{
+	_uring_lock(ring);
+	if (ring->chunks[index].pending > 0)
+		ring->chunks[index].abandoned = 1;
+	else
+		ring->freebuffers |= (1U << index);
+	_uring_unlock(ring);
+}
+
+/// the send may be linked to the previous read
+static int _uring_send(_uring_t *ring, int sock, int index, size_t length, int opnum)
+{
+	struct io_uring_sqe *sqe = _uring_sqe(ring);
+	if (sqe == NULL)
+		return EREJECT;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = sock;
+	sqe->addr = (uintptr_t)(ring->buffers + index * URING_BUFFERSIZE);
+	sqe->len = length;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = URING_USERDATA(index, opnum);
+	ring->chunks[index].pending++;
+	return ESUCCESS;
+}
+
+static int _uring_read(_uring_t *ring, int fd, int index, size_t length, unsigned long long offset, int opnum)
+{
+	/// the read and the send are queued together
+	if (ring->sqlocal - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE) + 2 > ring->sqentries)
+		return EREJECT;
+	struct io_uring_sqe *sqe = _uring_sqe(ring);
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)(ring->buffers + index * URING_BUFFERSIZE);
+	sqe->len = length;
+	sqe->off = offset;
+	sqe->buf_index = index;
+	sqe->user_data = URING_USERDATA(index, opnum);
+	ring->chunks[index].pending++;
+	return ESUCCESS;
+}
+
+static int _uring_socket(document_connector_t *private, http_message_t *response)
+{
+	int ret;
+	do
+	{
+		ret = httpclient_wait(httpmessage_client(response), 1);
+	}
+	while (ret == EINCOMPLETE);
+	if (ret > 0)
+		private->fdsocket = ret;
+	return ret;
+}
+
+int mod_send_uring(document_connector_t *private, http_message_t *response)
+{
+	_uring_t *ring = &g_uring;
+
+	if (!(private->type & DOCUMENT_URING))
+	{
+		/**
+		 * the first loop must not send content
+		 * it should send the header first.
+		 */
+		private->type |= DOCUMENT_URING;
+		private->fdsocket = -1;
+		errno = EAGAIN;
+		return ECONTINUE;
+	}
+	if (__atomic_load_n(&ring->disabled, __ATOMIC_ACQUIRE))
+	{
+		errno = EIO;
+		return -1;
+	}
+	if (private->fdsocket < 0 && _uring_socket(private, response) <= 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	int index = _uring_getbuffer(ring);
+	if (index == -1)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	size_t length = (private->size < URING_BUFFERSIZE)? private->size: URING_BUFFERSIZE;
+	/// the operations stay into the ring until their completions
+	_uring_chunk_t *chunk = &ring->chunks[index];
+
+	_uring_lock(ring);
+	memset(chunk->ops, 0, sizeof(chunk->ops));
+	int ret = _uring_read(ring, private->fdfile, index, length, private->offset, 0);
+	if (ret == ESUCCESS)
+		ret = _uring_send(ring, private->fdsocket, index, length, 1);
+	_uring_unlock(ring);
+	if (ret == ESUCCESS)
+		ret = _uring_wait(ring, chunk->ops, 2);
+	if (ret != ESUCCESS)
+	{
+		/// the ring is full, the chunk is sent by the next loop
+		_uring_putbuffer(ring, index);
+		errno = __atomic_load_n(&ring->disabled, __ATOMIC_ACQUIRE)? EIO: EAGAIN;
+		return -1;
+	}
+
+	int received = chunk->ops[0].result;
+	int sent = chunk->ops[1].result;
+	if (received > 0 && sent == -ECANCELED)
+	{
+		/// a short read breaks the link, the file is shorter than its size
+		_uring_lock(ring);
+		ret = _uring_send(ring, private->fdsocket, index, received, 2);
+		_uring_unlock(ring);
+		if (ret == ESUCCESS)
+			ret = _uring_wait(ring, &chunk->ops[2], 1);
+		sent = (ret == ESUCCESS)? chunk->ops[2].result: -EAGAIN;
+	}
+	/// the chunk may be used by another client after the release
+	_uring_putbuffer(ring, index);
+
+	if (received < 0)
+	{
+		errno = -received;
+		err("document: io_uring read error %s", strerror(errno));
+		return -1;
+	}
+	if (received == 0)
+		return 0;
+	if (sent == -EAGAIN || sent == 0)
+	{
+		/// the next loop waits the socket
+		private->fdsocket = -1;
+		errno = EAGAIN;
+		return -1;
+	}
+	if (sent < 0)
+	{
+		errno = -sent;
+		return -1;
+	}
+	return sent;
+}
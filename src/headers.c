@@ -0,0 +1,159 @@
+/*****************************************************************************
+ * headers.c: static response headers shared by the modules
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    The modules register the headers which never change from one response
+    to another during their creation. The headers of a server are kept
+    into one array of key/value pairs, checked once, and the connector
+    adds them to each response without any test of the configuration.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/log.h"
+#include "ouistiti.h"
+
+#include "log.h"
+
+#define HEADERS_CHUNK 8
+
+static const char str_headers[] = "headers";
+
+typedef struct _header_s _header_t;
+struct _header_s
+{
+	char *key;
+	char *value;
+	size_t valuelen;
+};
+
+typedef struct _headers_s _headers_t;
+struct _headers_s
+{
+	http_server_t *server;
+	_header_t *array;
+	int nbheaders;
+	int size;
+	_headers_t *next;
+};
+
+static _headers_t *g_headers = NULL;
+
+static int _headers_connector(void *arg, http_message_t *request, http_message_t *response)
+{
+	const _headers_t *headers = (const _headers_t *)arg;
+	for (int i = 0; i < headers->nbheaders; i++)
+		httpmessage_addheader(response, headers->array[i].key, headers->array[i].value, headers->array[i].valuelen);
+	return EREJECT;
+}
+
+static int _headers_append(_headers_t *headers, const char *key, const char *value, size_t valuelen)
+{
+	if (headers->nbheaders == headers->size)
+	{
+		_header_t *array = realloc(headers->array, (headers->size + HEADERS_CHUNK) * sizeof(*array));
+		if (array == NULL)
+			return EREJECT;
+		headers->array = array;
+		headers->size += HEADERS_CHUNK;
+	}
+	_header_t *header = &headers->array[headers->nbheaders];
+	header->key = strdup(key);
+	header->value = strndup(value, valuelen);
+	if (header->key == NULL || header->value == NULL)
+	{
+		free(header->key);
+		free(header->value);
+		return EREJECT;
+	}
+	header->valuelen = valuelen;
+	headers->nbheaders++;
+	return ESUCCESS;
+}
+
+static _headers_t *_headers_get(http_server_t *server)
+{
+	for (_headers_t *headers = g_headers; headers != NULL; headers = headers->next)
+	{
+		if (headers->server == server)
+			return headers;
+	}
+	return NULL;
+}
+
+int ouistiti_setheader(http_server_t *server, const char *key, const char *value, size_t valuelen)
+{
+	if (value == NULL)
+		return EREJECT;
+	if (valuelen == (size_t)-1)
+		valuelen = strlen(value);
+	/// the strings are sent as is, they must not break the header
+	if (strpbrk(key, "\r\n:") != NULL || memchr(value, '\r', valuelen) || memchr(value, '\n', valuelen))
+	{
+		err("headers: %s forbidden header", key);
+		return EREJECT;
+	}
+
+	_headers_t *headers = _headers_get(server);
+	if (headers == NULL)
+	{
+		headers = calloc(1, sizeof(*headers));
+		if (headers == NULL)
+			return EREJECT;
+		headers->server = server;
+		headers->next = g_headers;
+		g_headers = headers;
+		ouistiti_addconnector(server, _headers_connector, headers, CONNECTOR_SERVER, str_headers);
+	}
+	if (_headers_append(headers, key, value, valuelen) != ESUCCESS)
+		return EREJECT;
+	dbg("headers: %s: %.*s", key, (int)valuelen, value);
+	return ESUCCESS;
+}
+
+void ouistiti_freeheaders(http_server_t *server)
+{
+	_headers_t **previous = &g_headers;
+	for (_headers_t *headers = g_headers; headers != NULL; headers = headers->next)
+	{
+		if (headers->server == server)
+		{
+			*previous = headers->next;
+			for (int i = 0; i < headers->nbheaders; i++)
+			{
+				free(headers->array[i].key);
+				free(headers->array[i].value);
+			}
+			free(headers->array);
+			free(headers);
+			return;
+		}
+		previous = &headers->next;
+	}
+}
@@ -0,0 +1,741 @@
+/*****************************************************************************
+ * log.c: asynchronous logger of the servers
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    The messages are formatted by the caller into a slot of a ring. The
+    rings are inside a shared memory allocated before the first fork,
+    one ring per CPU as the shards of metrics, then the forked clients,
+    the threads and the workers write into the same memory.
+    A slot is reserved with a compare-and-swap on the head of its ring
+    and published with its sequence number (bounded MPMC queue). The
+    writer never waits: when the ring is full the message is dropped
+    and counted.
+    A thread of the main process drains the rings every LOG_PERIOD, or
+    LOG_BUSYPERIOD during the bursts, and writes the messages of each
+    output with one write. A slow log file
+    or journald only fills the rings.
+    The errors are limited to "log-ratelimit" messages per second, the
+    number of suppressed messages is written at the end of the second.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <linux/tcp.h>
+#include <linux/sockios.h>
+#endif
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/log.h"
+#include "ouistiti.h"
+#include "mod_auth.h"
+#include "log.h"
+
+/// the logger can't log its own errors into its rings
+#undef err
+#undef warn
+#define err(format, ...) fprintf(stderr, "\x1B[31m"format"\x1B[0m\n",  ##__VA_ARGS__)
+#define warn(format, ...) fprintf(stderr, "\x1B[35m"format"\x1B[0m\n",  ##__VA_ARGS__)
+
+#define LOG_RINGS 8
+#define LOG_SLOTS 256
+#define LOG_LINEMAX 496
+#define LOG_OUTPUTS 8
+#define LOG_BUFFERSIZE (64 * 1024)
+#define LOG_PERIOD 10000000
+#define LOG_BUSYPERIOD 1000000
+#define LOG_RATELIMIT 100
+
+#define LOG_ACCESS_COMMON 0
+#define LOG_ACCESS_COMBINED 1
+#define LOG_ACCESS_BINARY 2
+
+#define LOG_BINARY_VERSION 1
+#define LOG_BINARY_ACCESS 'A'
+
+static const char str_log[] = "log";
+
+typedef struct _log_slot_s _log_slot_t;
+struct _log_slot_s
+{
+	unsigned long seq;
+	unsigned short length;
+	unsigned short output;
+	char data[LOG_LINEMAX];
+};
+
+typedef struct _log_ring_s _log_ring_t;
+struct _log_ring_s
+{
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+	_log_slot_t slots[LOG_SLOTS];
+};
+
+typedef struct _log_shm_s _log_shm_t;
+struct _log_shm_s
+{
+	int ratelimit;
+	long window;
+	unsigned int count;
+	unsigned long suppressed;
+	unsigned long dropped;
+	_log_ring_t rings[LOG_RINGS];
+};
+
+typedef struct _log_output_s _log_output_t;
+struct _log_output_s
+{
+	const char *path;
+	int fd;
+	size_t length;
+	char *buffer;
+};
+
+typedef struct _log_s _log_t;
+struct _log_s
+{
+	_log_shm_t *shm;
+	pid_t pid;
+	pthread_t thread;
+	int run;
+	int noutputs;
+	_log_output_t outputs[LOG_OUTPUTS];
+};
+
+static _log_t *g_logger = NULL;
+
+static _log_ring_t *_log_ring(_log_shm_t *shm)
+{
+	int cpu = sched_getcpu();
+	if (cpu < 0)
+		cpu = 0;
+	return &shm->rings[cpu % LOG_RINGS];
+}
+
+static _log_slot_t *_log_reserve(_log_shm_t *shm)
+{
+	_log_ring_t *ring = _log_ring(shm);
+	unsigned long pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	while (1)
+	{
+		_log_slot_t *slot = &ring->slots[pos % LOG_SLOTS];
+		unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		long diff = (long)(seq - pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				return slot;
+		}
+		else if (diff < 0)
+		{
+			__atomic_fetch_add(&shm->dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		else
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void _log_publish(_log_slot_t *slot)
+{
+	/// the sequence of the reserved slot is its position
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * the errors of the current second are counted in the shared memory
+ */
+static int _log_ratelimit(_log_shm_t *shm)
+{
+	if (shm->ratelimit <= 0)
+		return ESUCCESS;
+	long now = ouistiti_time();
+	long window = __atomic_load_n(&shm->window, __ATOMIC_RELAXED);
+	if (window != now &&
+		__atomic_compare_exchange_n(&shm->window, &window, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&shm->count, 0, __ATOMIC_RELAXED);
+	if (__atomic_fetch_add(&shm->count, 1, __ATOMIC_RELAXED) < shm->ratelimit)
+		return ESUCCESS;
+	__atomic_fetch_add(&shm->suppressed, 1, __ATOMIC_RELAXED);
+	return EREJECT;
+}
+
+void ouistiti_log(int level, const char *format, ...)
+{
+	const char *color = (level <= LOG_ERR)? "\x1B[31m": "\x1B[35m";
+	va_list ap;
+	va_start(ap, format);
+	if (g_logger == NULL)
+	{
+		fputs(color, stderr);
+		vfprintf(stderr, format, ap);
+		fputs("\x1B[0m\n", stderr);
+		va_end(ap);
+		return;
+	}
+	_log_shm_t *shm = g_logger->shm;
+	if (level <= LOG_ERR && _log_ratelimit(shm) != ESUCCESS)
+	{
+		va_end(ap);
+		return;
+	}
+	_log_slot_t *slot = _log_reserve(shm);
+	if (slot == NULL)
+	{
+		va_end(ap);
+		return;
+	}
+	/// the end of the color and the new line are kept on truncation
+	size_t max = LOG_LINEMAX - sizeof("\x1B[0m\n") + 1;
+	size_t length = strlen(color);
+	memcpy(slot->data, color, length);
+	int ret = vsnprintf(slot->data + length, max - length, format, ap);
+	va_end(ap);
+	if (ret > 0)
+		length += ((size_t)ret < max - length)? (size_t)ret: max - length - 1;
+	memcpy(slot->data + length, STRING_REF("\x1B[0m\n"));
+	slot->length = length + sizeof("\x1B[0m\n") - 1;
+	slot->output = 0;
+	_log_publish(slot);
+}
+
+static size_t _log_pop(_log_t *logger, _log_ring_t *ring)
+{
+	size_t length = 0;
+	while (1)
+	{
+		unsigned long pos = ring->tail;
+		_log_slot_t *slot = &ring->slots[pos % LOG_SLOTS];
+		unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq != pos + 1)
+			break;
+		int noutputs = __atomic_load_n(&logger->noutputs, __ATOMIC_ACQUIRE);
+		_log_output_t *output = &logger->outputs[(slot->output < noutputs)? slot->output: 0];
+		if (output->length + slot->length > LOG_BUFFERSIZE)
+			break;
+		memcpy(output->buffer + output->length, slot->data, slot->length);
+		output->length += slot->length;
+		length += slot->length;
+		__atomic_store_n(&slot->seq, pos + LOG_SLOTS, __ATOMIC_RELEASE);
+		ring->tail = pos + 1;
+	}
+	return length;
+}
+
+static void _log_flush(_log_output_t *output)
+{
+	size_t offset = 0;
+	while (offset < output->length)
+	{
+		ssize_t ret = write(output->fd, output->buffer + offset, output->length - offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		offset += ret;
+	}
+	output->length = 0;
+}
+
+static void _log_counters(_log_t *logger)
+{
+	_log_shm_t *shm = logger->shm;
+	char line[LOG_LINEMAX];
+	int length = 0;
+	unsigned long suppressed = __atomic_exchange_n(&shm->suppressed, 0, __ATOMIC_RELAXED);
+	if (suppressed > 0)
+		length += snprintf(line + length, sizeof(line) - length,
+			"\x1B[35mlog: %lu errors suppressed\x1B[0m\n", suppressed);
+	unsigned long dropped = __atomic_exchange_n(&shm->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped > 0)
+		length += snprintf(line + length, sizeof(line) - length,
+			"\x1B[35mlog: %lu messages dropped\x1B[0m\n", dropped);
+	if (length > 0 && write(logger->outputs[0].fd, line, length) < 0)
+		return;
+}
+
+static void *_log_drain(void *arg)
+{
+	_log_t *logger = (_log_t *)arg;
+	struct timespec period = {.tv_sec = 0, .tv_nsec = LOG_PERIOD};
+	struct timespec busyperiod = {.tv_sec = 0, .tv_nsec = LOG_BUSYPERIOD};
+	int busy = 0;
+	long second = ouistiti_time();
+	size_t length = 0;
+	int run = 1;
+	do
+	{
+		/// the last pass starts after the stop
+		run = __atomic_load_n(&logger->run, __ATOMIC_ACQUIRE);
+		length = 0;
+		for (int i = 0; i < LOG_RINGS; i++)
+			length += _log_pop(logger, &logger->shm->rings[i]);
+		int noutputs = __atomic_load_n(&logger->noutputs, __ATOMIC_ACQUIRE);
+		for (int i = 0; i < noutputs; i++)
+		{
+			if (logger->outputs[i].length > 0)
+				_log_flush(&logger->outputs[i]);
+		}
+		if (second != ouistiti_time())
+		{
+			second = ouistiti_time();
+			_log_counters(logger);
+		}
+		/// the period is shorter during the bursts of messages
+		if (length > 0)
+			busy = 10;
+		else if (busy > 0)
+			busy--;
+		if (length == 0 && run)
+			nanosleep((busy > 0)? &busyperiod: &period, NULL);
+	} while (length > 0 || run);
+	_log_counters(logger);
+	return NULL;
+}
+
+/**
+ * an output is opened once, a reload of the configuration reopens the
+ * file onto the same descriptor, the messages in the rings keep
+ * their output.
+ */
+static int _log_output(_log_t *logger, const char *path)
+{
+	if (path == NULL || path[0] == '\0')
+		return 0;
+	int id = 1;
+	for (; id < logger->noutputs; id++)
+	{
+		if (!strcmp(logger->outputs[id].path, path))
+			break;
+	}
+	if (id == LOG_OUTPUTS)
+	{
+		err("log: too many outputs, %s not opened", path);
+		return 0;
+	}
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 00644);
+	if (fd < 0)
+	{
+		err("log: %s %s", path, strerror(errno));
+		return 0;
+	}
+	_log_output_t *output = &logger->outputs[id];
+	if (id < logger->noutputs)
+	{
+		dup2(fd, output->fd);
+		close(fd);
+		return id;
+	}
+	output->buffer = malloc(LOG_BUFFERSIZE);
+	output->path = strdup(path);
+	if (output->buffer == NULL || output->path == NULL)
+	{
+		free(output->buffer);
+		free((char *)output->path);
+		close(fd);
+		return 0;
+	}
+	output->fd = fd;
+	output->length = 0;
+	/// the drainer reads the output after the counter
+	__atomic_store_n(&logger->noutputs, id + 1, __ATOMIC_RELEASE);
+	return id;
+}
+
+int ouistiti_logger(int ratelimit)
+{
+	if (g_logger != NULL)
+	{
+		g_logger->shm->ratelimit = (ratelimit != 0)? ratelimit: LOG_RATELIMIT;
+		return ESUCCESS;
+	}
+	_log_shm_t *shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED)
+	{
+		err("log: memory allocation error %m");
+		return EREJECT;
+	}
+	for (int i = 0; i < LOG_RINGS; i++)
+	{
+		for (int j = 0; j < LOG_SLOTS; j++)
+			shm->rings[i].slots[j].seq = j;
+	}
+	shm->ratelimit = (ratelimit != 0)? ratelimit: LOG_RATELIMIT;
+	_log_t *logger = calloc(1, sizeof(*logger));
+	if (logger != NULL)
+		logger->outputs[0].buffer = malloc(LOG_BUFFERSIZE);
+	if (logger == NULL || logger->outputs[0].buffer == NULL)
+	{
+		free(logger);
+		munmap(shm, sizeof(*shm));
+		return EREJECT;
+	}
+	/// the first output is stderr, it follows the "log-file"
+	logger->outputs[0].fd = STDERR_FILENO;
+	logger->outputs[0].path = "";
+	logger->noutputs = 1;
+	logger->shm = shm;
+	logger->pid = getpid();
+	logger->run = 1;
+	if (pthread_create(&logger->thread, NULL, _log_drain, logger) != 0)
+	{
+		err("log: thread error %m");
+		free(logger->outputs[0].buffer);
+		free(logger);
+		munmap(shm, sizeof(*shm));
+		return EREJECT;
+	}
+	g_logger = logger;
+	return ESUCCESS;
+}
+
+void ouistiti_loggerstop(void)
+{
+	_log_t *logger = g_logger;
+	/// the forked processes write into the rings of the main process
+	if (logger == NULL || logger->pid != getpid())
+		return;
+	__atomic_store_n(&logger->run, 0, __ATOMIC_RELEASE);
+	pthread_join(logger->thread, NULL);
+	g_logger = NULL;
+	for (int i = 0; i < logger->noutputs; i++)
+	{
+		if (i > 0)
+		{
+			close(logger->outputs[i].fd);
+			free((char *)logger->outputs[i].path);
+		}
+		free(logger->outputs[i].buffer);
+	}
+	munmap(logger->shm, sizeof(*logger->shm));
+	free(logger);
+}
+
+typedef struct _log_access_s _log_access_t;
+struct _log_access_s
+{
+	http_server_t *server;
+	int format;
+	int output;
+	_log_access_t *next;
+};
+
+/**
+ * the state of the request is stored into the context of the client,
+ * allocated by its first request and released with the client.
+ */
+typedef struct _log_request_s _log_request_t;
+struct _log_request_s
+{
+	struct timespec start;
+	uint64_t written;
+};
+
+static _log_access_t *g_access = NULL;
+/// the requests logged without duration nor size
+static unsigned long g_lostrequests = 0;
+
+static _log_request_t *_log_request(http_message_t *request)
+{
+	http_client_t *clt = httpmessage_client(request);
+	_log_request_t *state = ouistiti_clientctx(clt, str_log, sizeof(*state));
+	if (state == NULL && __atomic_fetch_add(&g_lostrequests, 1, __ATOMIC_RELAXED) == 0)
+		warn("log: request state not allocated, the access log misses the durations");
+	return state;
+}
+
+static void *_log_getctx(void *arg, http_client_t *clt, struct sockaddr *addr, int addrsize)
+{
+	/// the state is allocated by the first request
+	return clt;
+}
+
+static void _log_freectx(void *arg)
+{
+	http_client_t *clt = (http_client_t *)arg;
+	ouistiti_freeclientctx(clt, str_log);
+}
+
+/**
+ * the bytes written on the socket: the acknowledged bytes and the
+ * bytes still into the queue of the socket. It counts the data sent
+ * with sendfile and through the TLS layer.
+ */
+static uint64_t _log_written(http_client_t *clt)
+{
+	uint64_t written = 0;
+#if defined(TCP_INFO) && defined(SIOCOUTQ)
+	struct tcp_info info = {0};
+	socklen_t length = sizeof(info);
+	int sock = httpclient_socket(clt);
+	if (sock < 0 || getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &length) < 0 ||
+		length < offsetof(struct tcp_info, tcpi_bytes_acked) + sizeof(info.tcpi_bytes_acked))
+		return 0;
+	int queued = 0;
+	if (ioctl(sock, SIOCOUTQ, &queued) < 0)
+		queued = 0;
+	written = info.tcpi_bytes_acked + queued;
+#endif
+	return written;
+}
+
+static int _log_startconnector(void *arg, http_message_t *request, http_message_t *response)
+{
+	_log_request_t *state = _log_request(request);
+	if (state != NULL)
+		clock_gettime(CLOCK_MONOTONIC, &state->start);
+	return EREJECT;
+}
+
+/**
+ * the strings are copied with the escape sequences of the common log
+ * format, the quotes and the control characters are not copied as is.
+ */
+static size_t _log_escape(char *out, size_t size, const char *string)
+{
+	static const char hexa[] = "0123456789abcdef";
+	if (string == NULL || string[0] == '\0')
+		string = "-";
+	size_t length = 0;
+	for (; *string != '\0' && length + 4 < size; string++)
+	{
+		unsigned char c = *string;
+		if (c == '"' || c == '\\' || c < 0x20 || c == 0x7f)
+		{
+			out[length++] = '\\';
+			out[length++] = 'x';
+			out[length++] = hexa[c >> 4];
+			out[length++] = hexa[c & 0x0f];
+		}
+		else
+			out[length++] = c;
+	}
+	return length;
+}
+
+/**
+ * the date of the common log format changes once per second
+ */
+static const char *_log_date(time_t now)
+{
+	static __thread time_t last = 0;
+	static __thread char date[32];
+	if (now != last)
+	{
+		struct tm tm;
+		localtime_r(&now, &tm);
+		strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+		last = now;
+	}
+	return date;
+}
+
+static size_t _log_append(char *line, size_t size, size_t length, const char *format, ...)
+{
+	if (length + 1 >= size)
+		return length;
+	va_list ap;
+	va_start(ap, format);
+	int ret = vsnprintf(line + length, size - length, format, ap);
+	va_end(ap);
+	if (ret < 0)
+		return length;
+	length += ret;
+	return (length < size)? length: size - 1;
+}
+
+static size_t _log_text(const _log_access_t *access, http_message_t *request, int status, uint64_t bytes, char *line, size_t size)
+{
+	const char *user = auth_info(request, STRING_REF(str_user));
+	const char *query = httpmessage_REQUEST(request, "query");
+	/// the new line is always written
+	size--;
+	size_t length = 0;
+	length += _log_escape(line + length, size - length, httpmessage_REQUEST(request, "remote_addr"));
+	length = _log_append(line, size, length, " - ");
+	length += _log_escape(line + length, size - length, user);
+	length = _log_append(line, size, length, " [%s] \"", _log_date(ouistiti_time()));
+	length += _log_escape(line + length, size - length, httpmessage_REQUEST(request, "method"));
+	length = _log_append(line, size, length, " ");
+	length += _log_escape(line + length, size - length, httpmessage_REQUEST(request, "uri"));
+	if (query != NULL && query[0] != '\0')
+	{
+		length = _log_append(line, size, length, "?");
+		length += _log_escape(line + length, size - length, query);
+	}
+	length = _log_append(line, size, length, " ");
+	length += _log_escape(line + length, size - length, httpmessage_REQUEST(request, "protocol"));
+	if (bytes > 0)
+		length = _log_append(line, size, length, "\" %d %llu", status, (unsigned long long)bytes);
+	else
+		length = _log_append(line, size, length, "\" %d -", status);
+	if (access->format == LOG_ACCESS_COMBINED)
+	{
+		length = _log_append(line, size, length, " \"");
+		length += _log_escape(line + length, size - length, httpmessage_REQUEST(request, "Referer"));
+		length = _log_append(line, size, length, "\" \"");
+		length += _log_escape(line + length, size - length, httpmessage_REQUEST(request, "User-Agent"));
+		length = _log_append(line, size, length, "\"");
+	}
+	line[length++] = '\n';
+	return length;
+}
+
+/**
+ * the binary record:
+ *   uint16 length, uint8 version, uint8 type, uint16 status,
+ *   uint16 reserved, uint32 duration (us), uint64 time (us),
+ *   uint64 bytes, then the strings terminated by '\0':
+ *   address, user, method, uri, query, protocol, referer, user-agent
+ */
+static size_t _log_binary(const _log_access_t *access, http_message_t *request, int status, uint64_t bytes, uint32_t duration, char *line, size_t size)
+{
+	const char *user = auth_info(request, STRING_REF(str_user));
+	const char *strings[] =
+	{
+		httpmessage_REQUEST(request, "remote_addr"),
+		user,
+		httpmessage_REQUEST(request, "method"),
+		httpmessage_REQUEST(request, "uri"),
+		httpmessage_REQUEST(request, "query"),
+		httpmessage_REQUEST(request, "protocol"),
+		httpmessage_REQUEST(request, "Referer"),
+		httpmessage_REQUEST(request, "User-Agent"),
+	};
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint64_t time = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	size_t length = 28;
+	line[2] = LOG_BINARY_VERSION;
+	line[3] = LOG_BINARY_ACCESS;
+	uint16_t value16 = status;
+	memcpy(line + 4, &value16, sizeof(value16));
+	value16 = 0;
+	memcpy(line + 6, &value16, sizeof(value16));
+	memcpy(line + 8, &duration, sizeof(duration));
+	memcpy(line + 12, &time, sizeof(time));
+	memcpy(line + 20, &bytes, sizeof(bytes));
+	for (int i = 0; i < sizeof(strings) / sizeof(*strings); i++)
+	{
+		const char *string = (strings[i] != NULL)? strings[i]: "";
+		size_t stringlen = strnlen(string, size - length - (sizeof(strings) / sizeof(*strings) - i));
+		memcpy(line + length, string, stringlen);
+		length += stringlen;
+		line[length++] = '\0';
+	}
+	value16 = length;
+	memcpy(line, &value16, sizeof(value16));
+	return length;
+}
+
+static int _log_completeconnector(void *arg, http_message_t *request, http_message_t *response)
+{
+	const _log_access_t *access = (const _log_access_t *)arg;
+	_log_request_t *state = _log_request(request);
+	uint64_t bytes = 0;
+	uint32_t duration = 0;
+	if (state != NULL)
+	{
+		uint64_t written = _log_written(httpmessage_client(request));
+		if (written > state->written)
+			bytes = written - state->written;
+		state->written = written;
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		duration = (now.tv_sec - state->start.tv_sec) * 1000000 +
+				(now.tv_nsec - state->start.tv_nsec) / 1000;
+	}
+	int status = httpmessage_result(response, 0);
+
+	if (g_logger == NULL)
+		return EREJECT;
+	_log_slot_t *slot = _log_reserve(g_logger->shm);
+	if (slot == NULL)
+		return EREJECT;
+	if (access->format == LOG_ACCESS_BINARY)
+		slot->length = _log_binary(access, request, status, bytes, duration, slot->data, sizeof(slot->data));
+	else
+		slot->length = _log_text(access, request, status, bytes, slot->data, sizeof(slot->data));
+	slot->output = access->output;
+	_log_publish(slot);
+	return EREJECT;
+}
+
+int ouistiti_accesslog(http_server_t *server, const serverconfig_t *config)
+{
+	if (config->accesslog == NULL || g_logger == NULL)
+		return EREJECT;
+	_log_access_t *access = calloc(1, sizeof(*access));
+	if (access == NULL)
+		return EREJECT;
+	access->server = server;
+	access->format = LOG_ACCESS_COMBINED;
+	if (config->accessformat != NULL && !strcmp(config->accessformat, "common"))
+		access->format = LOG_ACCESS_COMMON;
+	else if (config->accessformat != NULL && !strcmp(config->accessformat, "binary"))
+		access->format = LOG_ACCESS_BINARY;
+	access->output = _log_output(g_logger, config->accesslog);
+	access->next = g_access;
+	g_access = access;
+
+	httpserver_addmod(server, _log_getctx, _log_freectx, access, str_log);
+	ouistiti_addconnector(server, _log_startconnector, access, CONNECTOR_SERVER, str_log);
+	ouistiti_metricscomplete(server, _log_completeconnector, access);
+	return ESUCCESS;
+}
+
+void ouistiti_freeaccesslog(http_server_t *server)
+{
+	for (_log_access_t **previous = &g_access; *previous != NULL; previous = &(*previous)->next)
+	{
+		_log_access_t *access = *previous;
+		if (access->server == server)
+		{
+			*previous = access->next;
+			free(access);
+			return;
+		}
+	}
+}
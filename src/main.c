@@ -36,6 +36,7 @@
 #include <libgen.h>
 #include <sched.h>
 #include <dirent.h>
+#include <time.h>
 #ifdef BACKTRACE
 #include <execinfo.h> // for backtrace
 #endif
@@ -43,6 +44,7 @@
 #ifndef WIN32
 # include <sys/socket.h>
 # include <sys/types.h>
+# include <netinet/in.h>
 # include <unistd.h>
 # include <fcntl.h>
 # include <pwd.h>
@@ -52,9 +54,11 @@
 #endif
 
 #include "daemonize.h"
+#include "workers.h"
 #include "../compliant.h"
 #include "ouistiti/httpserver.h"
 #include "ouistiti/log.h"
+#include "log.h"
 
 #ifndef FILE_CONFIG
 #define STATIC_CONFIG
@@ -142,11 +146,17 @@ int auth_setowner(const char *user)
 static module_list_t *g_modules = NULL;
 
 #define MAX_MODULES 16
+#define MAX_SERVERSOCKETS 4
 struct server_s
 {
 	serverconfig_t *config;
 	http_server_t *server;
 	mod_t *modules;
+	/// the listening sockets created by httpserver_connect
+	int sockets[MAX_SERVERSOCKETS];
+	int nsockets;
+	/// the clients connected, a drain waits for the end of them
+	int clients;
 
 	struct server_s *next;
 	unsigned int id;
@@ -255,18 +265,29 @@ void display_help(char * const *argv)
 	fprintf(stderr, "\t-K \t\tto kill other instances of the server\n");
 	fprintf(stderr, "\t-s <server num>\tselect a server into the configuration file\n");
 	fprintf(stderr, "\t-W <directory>\tset the working directory\n");
+	fprintf(stderr, "\t-w <workers>\tset the number of processes accepting the connections\n");
 }
 
 #undef BACKTRACE
 static server_t *g_first = NULL;
 static char run = 0;
+static char alarmed = 0;
 static int g_default_port = 80;
+static const char *g_configfile = NULL;
+static ouistiticonfig_t *g_ouistiticonfig = NULL;
+static int g_serverid = -1;
 #ifdef HAVE_SIGACTION
 static void handler(int sig, siginfo_t *UNUSED(si), void *UNUSED(arg))
 #else
 static void handler(int sig)
 #endif
 {
+	/// the wake up of the drain
+	if (sig == SIGALRM)
+	{
+		alarmed = 1;
+		return;
+	}
 	err("main: signal %d", sig);
 	if (sig == SIGSEGV)
 	{
@@ -287,6 +308,19 @@ static void handler(int sig)
 		exit(1);
 #endif
 	}
+	if (sig == SIGHUP)
+	{
+		if (run != 'q')
+			run = 'r';
+		return;
+	}
+	/// SIGQUIT stops after the end of the clients in progress
+	if (sig == SIGQUIT)
+	{
+		if (run != 'q')
+			run = 'd';
+		return;
+	}
 	run = 'q';
 }
 
@@ -306,15 +340,75 @@ int ouistiti_issecure(server_t *server)
 	return !strcmp(secure, "true");
 }
 
+static ouistiti_sendfile_t g_sendfile = NULL;
+static void *g_sendfilearg = NULL;
+
+void ouistiti_setsendfile(ouistiti_sendfile_t func, void *arg)
+{
+	g_sendfile = func;
+	g_sendfilearg = arg;
+}
+
+int ouistiti_sendfile(http_client_t *clt, int fd, size_t size)
+{
+	if (g_sendfile == NULL)
+		return ECONTINUE;
+	return g_sendfile(g_sendfilearg, clt, fd, size);
+}
+
+typedef struct _release_s _release_t;
+struct _release_s
+{
+	http_server_t *server;
+	ouistiti_release_t release;
+	void *arg;
+	_release_t *next;
+};
+static _release_t *g_releases = NULL;
+
+int ouistiti_atrelease(http_server_t *server, ouistiti_release_t release, void *arg)
+{
+	_release_t *entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		return EREJECT;
+	entry->server = server;
+	entry->release = release;
+	entry->arg = arg;
+	entry->next = g_releases;
+	g_releases = entry;
+	return ESUCCESS;
+}
+
+static void ouistiti_release(http_server_t *server)
+{
+	for (_release_t **it = &g_releases; *it != NULL;)
+	{
+		_release_t *entry = *it;
+		if (entry->server != server)
+		{
+			it = &entry->next;
+			continue;
+		}
+		*it = entry->next;
+		entry->release(entry->arg);
+		free(entry);
+	}
+}
+
 static int ouistiti_loadmodule(server_t *server, const module_t *module, configure_t configure, void *parser)
 {
 	int i = 0;
 	mod_t *mod = server->modules;
 	warn("module %s regitering...", module->name);
-	for (;i < MAX_MODULES && mod != NULL; i++)
+	const module_t *last = NULL;
+	while (i < MAX_MODULES && mod != NULL)
 	{
 		if (! strcmp(mod->ops->name, module->name))
 			warn(" already set");
+		/// the instances of the same module (i.e. vhosts) count for one
+		if (mod->ops != last)
+			i++;
+		last = mod->ops;
 		mod = mod->next;
 	}
 	if (i == MAX_MODULES)
@@ -409,6 +503,38 @@ static void __ouistiti_freemodule()
 	}
 }
 
+static void *main_clientctx(void *arg, http_client_t *UNUSED(clt), struct sockaddr *UNUSED(addr), int UNUSED(addrsize))
+{
+	server_t *server = (server_t *)arg;
+	__atomic_add_fetch(&server->clients, 1, __ATOMIC_RELAXED);
+	return server;
+}
+
+static void main_clientfree(void *arg)
+{
+	server_t *server = (server_t *)arg;
+	__atomic_sub_fetch(&server->clients, 1, __ATOMIC_RELAXED);
+}
+
+static int main_clients(const server_t *first)
+{
+	int count = 0;
+	for (const server_t *server = first; server != NULL; server = server->next)
+		count += __atomic_load_n(&server->clients, __ATOMIC_RELAXED);
+	return count;
+}
+
+static int main_listeners(const server_t *first, int *fds, int max)
+{
+	int nfds = 0;
+	for (const server_t *server = first; server != NULL; server = server->next)
+	{
+		for (int i = 0; i < server->nsockets && nfds < max; i++)
+			fds[nfds++] = server->sockets[i];
+	}
+	return nfds;
+}
+
 static server_t *ouistiti_loadserver(serverconfig_t *config, int id)
 {
 	if (g_first == NULL && id == -1)
@@ -426,12 +552,26 @@ static server_t *ouistiti_loadserver(serverconfig_t *config, int id)
 		return NULL;
 	}
 
+#if defined(METRICS) || defined(LOGGER)
+	/// the metrics must be ready before the registration of the connectors
+	ouistiti_metrics(httpserver, config);
+#endif
+#ifdef LOGGER
+	ouistiti_accesslog(httpserver, config);
+#endif
+	/// the memory of the previous request is released before the modules
+	ouistiti_arena(httpserver);
+#ifdef CACHE
+	/// the shared memory of the cache is allocated before the fork of the workers
+	ouistiti_cache(httpserver, config);
+#endif
 	server_t *server = NULL;
 	server = calloc(1, sizeof(*server));
 
 	server->server = httpserver;
 	server->config = config;
 	server->id = id;
+	httpserver_addmod(httpserver, main_clientctx, main_clientfree, server, "clients");
 	char *cwd = NULL;
 	if (config->root != NULL && config->root[0] != '\0' )
 	{
@@ -482,25 +622,231 @@ void ouistiticonfig_destroy(ouistiticonfig_t *ouistiticonfig)
 }
 #endif
 
-static int main_run(server_t *first)
+#define MAX_LISTENERS 16
+typedef struct main_handover_s main_handover_t;
+struct main_handover_s
+{
+	int oldfd;
+	int newfd;
+};
+
+static int main_listenerport(int fd, int *family)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0)
+		return -1;
+	*family = addr.ss_family;
+	if (addr.ss_family == AF_INET)
+		return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+	if (addr.ss_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+	return -1;
+}
+
+static int main_findlistener(const int *fds, int nfds, int port, int family)
+{
+	for (int i = 0; i < nfds; i++)
+	{
+		int fdfamily = 0;
+		if (fds[i] >= 0 && main_listenerport(fds[i], &fdfamily) == port &&
+			(family == 0 || family == fdfamily))
+			return i;
+	}
+	return -1;
+}
+
+static int main_isnew(const int *before, int nbefore, int fd)
+{
+	for (int i = 0; i < nbefore; i++)
+	{
+		if (before[i] == fd)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * The new servers are connected on a temporary port when the port is
+ * already listening. The running sockets are moved onto the file
+ * descriptors of the new servers, then the port never stops to accept
+ * the connections.
+ * Each server keeps the sockets created by its connection.
+ */
+static int main_connect(server_t *first, main_handover_t *handovers, int maxhandovers)
+{
+	int oldfds[MAX_LISTENERS];
+	int noldfds = 0;
+	if (handovers != NULL)
+		noldfds = main_listeners(g_first, oldfds, MAX_LISTENERS);
+	int nhandovers = 0;
+
+	for (server_t *server = first; server != NULL; server = server->next)
+	{
+		http_server_config_t *config = server->config->server;
+		int port = config->port;
+		int handover = (noldfds > 0 && main_findlistener(oldfds, noldfds, port, 0) >= 0);
+		int before[MAX_LISTENERS];
+		int nbefore = workers_listeners(before, MAX_LISTENERS);
+		if (handover)
+			config->port = 0;
+		httpserver_connect(server->server);
+		config->port = port;
+		int after[MAX_LISTENERS];
+		int nafter = workers_listeners(after, MAX_LISTENERS);
+		server->nsockets = 0;
+		for (int i = 0; i < nafter && server->nsockets < MAX_SERVERSOCKETS; i++)
+		{
+			if (!main_isnew(before, nbefore, after[i]))
+				continue;
+			server->sockets[server->nsockets++] = after[i];
+			if (!handover)
+				continue;
+			int family = 0;
+			main_listenerport(after[i], &family);
+			int old = main_findlistener(oldfds, noldfds, port, family);
+			if (old < 0 || nhandovers == maxhandovers)
+				return EREJECT;
+			handovers[nhandovers].oldfd = oldfds[old];
+			handovers[nhandovers].newfd = after[i];
+			nhandovers++;
+			oldfds[old] = -1;
+		}
+		if (handover && server->nsockets == 0)
+		{
+			err("main: server on port %d not connected", port);
+			return EREJECT;
+		}
+	}
+	return nhandovers;
+}
+
+static int main_reload(int drain);
+
+/**
+ * the servers replaced by a reload do not accept anymore and stay until
+ * the end of their clients, or WORKERS_DRAINTIMEOUT. The clients of the
+ * new servers on the same port are counted too.
+ */
+typedef struct main_drain_s main_drain_t;
+struct main_drain_s
+{
+	server_t *first;
+	ouistiticonfig_t *config;
+	time_t end;
+	main_drain_t *next;
+};
+static main_drain_t *g_drains = NULL;
+
+static void main_destroyservers(server_t *first);
+
+static int main_drained(int force)
+{
+	time_t now = time(NULL);
+	for (main_drain_t **it = &g_drains; *it != NULL;)
+	{
+		main_drain_t *drain = *it;
+		if (!force && main_clients(drain->first) > 0 && now < drain->end)
+		{
+			it = &drain->next;
+			continue;
+		}
+		*it = drain->next;
+		warn("main: previous configuration drained");
+		main_destroyservers(drain->first);
+		ouistiticonfig_destroy(drain->config);
+		free(drain);
+	}
+	if (g_drains != NULL)
+		alarm(1);
+	return (g_drains != NULL);
+}
+
+/**
+ * SIGQUIT on the process or on the worker after a reload:
+ * the listeners are closed and the process exits after its clients.
+ */
+static int main_drain(void)
 {
+	static time_t end = 0;
+	if (end == 0)
+	{
+		int fds[MAX_LISTENERS];
+		int nfds = main_listeners(g_first, fds, MAX_LISTENERS);
+		for (int i = 0; i < nfds; i++)
+			workers_stoplistener(fds[i]);
+		end = time(NULL) + WORKERS_DRAINTIMEOUT;
+		warn("main: drain on %d", getpid());
+	}
+	if (main_clients(g_first) > 0 && time(NULL) < end)
+	{
+		alarm(1);
+		return 1;
+	}
+	return 0;
+}
+
+static int main_run(int nworkers)
+{
+	int worker = -1;
 	/**
 	 * connection must be after the owner change
 	 */
-	for (const server_t *server = first; server != NULL; server = server->next)
+	main_connect(g_first, NULL, 0);
+
+	/**
+	 * the master supervises the workers and returns on exit.
+	 */
+	int fds[MAX_LISTENERS];
+	int nfds = main_listeners(g_first, fds, MAX_LISTENERS);
+	if (nworkers > 1 && workers_create(nworkers, fds, nfds) == 0)
 	{
-		httpserver_connect(server->server);
+		while ((worker = workers_run(&run)) == WORKERS_RELOAD)
+		{
+			run = 0;
+			/// the clients are in the workers
+			main_reload(0);
+		}
+		if (worker < 0)
+		{
+			workers_destroy();
+			return worker;
+		}
+		warn("main: worker %d running on %d", worker, getpid());
 	}
 
 	while(run != 'q')
 	{
-		if (first == NULL || first->server == NULL || httpserver_run(first->server) == ESUCCESS)
+		const server_t *first = g_first;
+		if (first == NULL || first->server == NULL)
+			break;
+		int ret = httpserver_run(first->server);
+		if (run == 'r')
+		{
+			run = 0;
+			main_reload(1);
+			continue;
+		}
+		if (run == 'd')
+		{
+			if (main_drain())
+				continue;
+			break;
+		}
+		if (alarmed)
+		{
+			alarmed = 0;
+			main_drained(0);
+			continue;
+		}
+		if (ret == ESUCCESS)
 			break;
 	}
-	return 0;
+	main_drained(1);
+	return worker;
 }
 
-void main_destroy(server_t *first)
+static void main_destroyservers(server_t *first)
 {
 	server_t *next = NULL;
 
@@ -518,9 +864,26 @@ void main_destroy(server_t *first)
 			mod = next;
 		}
 		httpserver_disconnect(server->server);
+		ouistiti_freeheaders(server->server);
+		ouistiti_freecachepolicy(server->server);
 		httpserver_destroy(server->server);
+		ouistiti_release(server->server);
+#if defined(METRICS) || defined(LOGGER)
+		ouistiti_freemetrics(server->server);
+#endif
+#ifdef LOGGER
+		ouistiti_freeaccesslog(server->server);
+#endif
+#ifdef CACHE
+		ouistiti_freecache(server->server);
+#endif
 		free(server);
 	}
+}
+
+void main_destroy(server_t *first)
+{
+	main_destroyservers(first);
 	__ouistiti_freemodule();
 }
 
@@ -547,6 +910,77 @@ static server_t *ouistiti_loadservers(ouistiticonfig_t *ouistiticonfig, int serv
 	return first;
 }
 
+/**
+ * The new configuration is loaded next to the running one. The running
+ * servers are replaced only if all the new servers are ready, otherwise
+ * the new configuration is dropped.
+ * With drain, the current clients stay on the previous servers until
+ * their end, the master of the workers destroys them at once.
+ */
+static int main_reload(int drain)
+{
+	warn("main: reload %s", g_configfile);
+	ouistiticonfig_t *ouistiticonfig = ouistiticonfig_create(g_configfile);
+	if (ouistiticonfig == NULL)
+	{
+		err("main: configuration rejected");
+		return EREJECT;
+	}
+#ifdef LOGGER
+	ouistiti_logger(ouistiticonfig->logratelimit);
+#endif
+	int nservers = (g_serverid == -1)? ouistiticonfig->nservers: 1;
+	server_t *first = ouistiti_loadservers(ouistiticonfig, g_serverid);
+	int count = 0;
+	for (const server_t *server = first; server != NULL; server = server->next)
+		count++;
+
+	int oldfds[MAX_LISTENERS];
+	int noldfds = main_listeners(g_first, oldfds, MAX_LISTENERS);
+	main_handover_t handovers[MAX_LISTENERS];
+	int nhandovers = EREJECT;
+	if (count > 0 && count >= nservers)
+		nhandovers = main_connect(first, handovers, MAX_LISTENERS);
+	if (nhandovers < 0)
+	{
+		err("main: configuration rejected");
+		main_destroyservers(first);
+		ouistiticonfig_destroy(ouistiticonfig);
+		return EREJECT;
+	}
+	for (int i = 0; i < nhandovers; i++)
+	{
+		dup2(handovers[i].oldfd, handovers[i].newfd);
+		workers_movelistener(handovers[i].oldfd, handovers[i].newfd);
+	}
+
+	server_t *old = g_first;
+	g_first = first;
+	main_drain_t *olddrain = NULL;
+	if (drain)
+		olddrain = calloc(1, sizeof(*olddrain));
+	if (olddrain != NULL)
+	{
+		/// the previous servers keep their sockets without connection
+		for (int i = 0; i < noldfds; i++)
+			workers_stoplistener(oldfds[i]);
+		olddrain->first = old;
+		olddrain->config = g_ouistiticonfig;
+		olddrain->end = time(NULL) + WORKERS_DRAINTIMEOUT;
+		olddrain->next = g_drains;
+		g_drains = olddrain;
+		main_drained(0);
+	}
+	else
+	{
+		main_destroyservers(old);
+		ouistiticonfig_destroy(g_ouistiticonfig);
+	}
+	g_ouistiticonfig = ouistiticonfig;
+	warn("main: configuration reloaded");
+	return ESUCCESS;
+}
+
 #define DAEMONIZE 0x01
 #define KILLDAEMON 0x02
 #define CONFIGURATION 0x04
@@ -558,6 +992,7 @@ int main(int argc, char * const *argv)
 	const char *workingdir = NULL;
 	int mode = 0;
 	int serverid = -1;
+	int nworkers = 0;
 	const char *pkglib = PKGLIBDIR;
 
 //	setlinebuf /( stdout /);
@@ -571,7 +1006,7 @@ int main(int argc, char * const *argv)
 	int opt;
 	do
 	{
-		opt = getopt(argc, argv, "s:f:p:P:hDKCVM:W:");
+		opt = getopt(argc, argv, "s:f:p:P:hDKCVM:W:w:");
 		switch (opt)
 		{
 			case 's':
@@ -607,6 +1042,9 @@ int main(int argc, char * const *argv)
 			case 'W':
 				 workingdir = optarg;
 			break;
+			case 'w':
+				nworkers = atoi(optarg);
+			break;
 			default:
 			break;
 		}
@@ -657,6 +1095,13 @@ int main(int argc, char * const *argv)
 		return 0;
 	}
 
+	/// the clock is shared by all the processes forked from here
+	ouistiti_clock();
+#ifdef LOGGER
+	/// the logger is shared by all the processes forked from here
+	ouistiti_logger(ouistiticonfig->logratelimit);
+#endif
+
 	if (ouistiticonfig->init_d != NULL)
 	{
 		int rootfd = AT_FDCWD;
@@ -664,6 +1109,9 @@ int main(int argc, char * const *argv)
 	}
 
 	g_first = ouistiti_loadservers(ouistiticonfig, serverid);
+	g_ouistiticonfig = ouistiticonfig;
+	g_configfile = configfile;
+	g_serverid = serverid;
 
 #ifdef HAVE_SIGACTION
 	struct sigaction action;
@@ -672,6 +1120,9 @@ int main(int argc, char * const *argv)
 	action.sa_sigaction = handler;
 	sigaction(SIGTERM, &action, NULL);
 	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGHUP, &action, NULL);
+	sigaction(SIGQUIT, &action, NULL);
+	sigaction(SIGALRM, &action, NULL);
 #ifdef BACKTRACE
 	sigaction(SIGSEGV, &action, NULL);
 #endif
@@ -684,6 +1135,9 @@ int main(int argc, char * const *argv)
 #else
 	signal(SIGTERM, handler);
 	signal(SIGINT, handler);
+	signal(SIGHUP, handler);
+	signal(SIGQUIT, handler);
+	signal(SIGALRM, handler);
 #ifdef BACKTRACE
 	signal(SIGSEGV, handler);
 #endif
@@ -696,16 +1150,25 @@ int main(int argc, char * const *argv)
 	else
 		warn("%s run as %s", argv[0], ouistiticonfig->user);
 
-	main_run(g_first);
+	if (nworkers == 0)
+		nworkers = ouistiticonfig->workers;
+	int worker = main_run(nworkers);
+	/// the configuration may change during the run
+	ouistiticonfig = g_ouistiticonfig;
 
-	killdaemon(pidfile);
+	/// the workers leave the pid file and the init scripts to the master
+	if (worker < 0)
+		killdaemon(pidfile);
 	main_destroy(g_first);
-	if (ouistiticonfig->init_d != NULL)
+	if (worker < 0 && ouistiticonfig->init_d != NULL)
 	{
 		int rootfd = AT_FDCWD;
 		main_initat(rootfd, ouistiticonfig->init_d, 1);
 	}
 	ouistiticonfig_destroy(ouistiticonfig);
+#ifdef LOGGER
+	ouistiti_loggerstop();
+#endif
 	warn("good bye");
 	return 0;
 }
@@ -0,0 +1,740 @@
+/*****************************************************************************
+ * metrics.c: measurement of the connectors and the servers
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2024
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    The modules register their connectors with ouistiti_addconnector
+    and ouistiti_addclientconnector. When the server has
+    a "metrics" or an "accesslog" entry, each connector is registered
+    behind a trampoline which measures the duration of the calls and
+    signals the end of the responses. Otherwise the connector is
+    registered as is and there is no cost during the requests.
+
+    The clients may run into forked processes, the counters are stored
+    into a shared memory allocated with the server. The counters are
+    split into shards, one per CPU, to avoid the sharing of the cache
+    lines between the processes or the threads.
+    The durations are stored into log-linear histograms (HDR style):
+    4 sub-buckets for each power of two of microseconds.
+    The clients of the process are indexed by their socket, into pages
+    allocated when a socket of the page is used. The lookup on each
+    request doesn't take any lock.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <linux/tcp.h>
+#endif
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/utils.h"
+#include "ouistiti/log.h"
+#include "ouistiti.h"
+
+#include "log.h"
+
+#define METRICS_MAXCONNECTORS 32
+#define METRICS_NAMEMAX 32
+#define METRICS_SHARDS 8
+#define METRICS_SUBBITS 2
+#define METRICS_SUBBUCKETS (1 << METRICS_SUBBITS)
+#define METRICS_BUCKETS (28 * METRICS_SUBBUCKETS)
+#define METRICS_LINEMAX 256
+#define METRICS_MAXCLIENTS (1 << 20)
+#define METRICS_PAGESHIFT 10
+#define METRICS_PAGESIZE (1 << METRICS_PAGESHIFT)
+#define METRICS_NPAGES (METRICS_MAXCLIENTS / METRICS_PAGESIZE)
+
+static const char str_metrics[] = "metrics";
+
+typedef struct _metrics_stats_s _metrics_stats_t;
+struct _metrics_stats_s
+{
+	uint64_t calls;
+	uint64_t time;
+	uint64_t max;
+	uint64_t buckets[METRICS_BUCKETS];
+};
+
+typedef struct _metrics_shard_s _metrics_shard_t;
+struct _metrics_shard_s
+{
+	uint64_t connections;
+	uint64_t requests;
+	uint64_t rxbytes;
+	uint64_t txbytes;
+	/// the gauges may be negative in a shard, only the sum is valid
+	int64_t clients;
+	int64_t memory;
+	_metrics_stats_t connectors[METRICS_MAXCONNECTORS];
+} __attribute__((aligned(64)));
+
+typedef struct _metrics_slot_s _metrics_slot_t;
+struct _metrics_slot_s
+{
+	http_connector_t cb;
+	int type;
+	char name[METRICS_NAMEMAX];
+};
+
+/**
+ * the memory shared by all the processes of the server
+ */
+typedef struct _metrics_shm_s _metrics_shm_t;
+struct _metrics_shm_s
+{
+	int lock;
+	int nslots;
+	_metrics_slot_t slots[METRICS_MAXCONNECTORS];
+	_metrics_shard_t shards[METRICS_SHARDS];
+};
+
+typedef struct _metrics_s _metrics_t;
+
+typedef struct _metrics_connector_s _metrics_connector_t;
+struct _metrics_connector_s
+{
+	http_connector_t cb;
+	void *arg;
+	_metrics_t *metrics;
+	int slot;
+	_metrics_connector_t *next;
+};
+
+typedef struct _metrics_client_s _metrics_client_t;
+struct _metrics_client_s
+{
+	http_client_t *clt;
+	_metrics_t *metrics;
+	int sock;
+	uint64_t rxbytes;
+	uint64_t txbytes;
+	_metrics_connector_t *connectors;
+};
+
+struct _metrics_s
+{
+	http_server_t *server;
+	const char *uri;
+	char label[METRICS_NAMEMAX * 2];
+	_metrics_shm_t *shm;
+	_metrics_connector_t *connectors;
+	/**
+	 * the clients of the process indexed by the socket, into pages
+	 * allocated with the first client of the page and never moved.
+	 */
+	_metrics_client_t **pages[METRICS_NPAGES];
+	http_connector_t complete;
+	void *completearg;
+	_metrics_t *next;
+};
+
+static _metrics_t *g_metrics = NULL;
+
+static void _metrics_lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void _metrics_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static _metrics_t *_metrics_get(http_server_t *server)
+{
+	for (_metrics_t *metrics = g_metrics; metrics != NULL; metrics = metrics->next)
+	{
+		if (metrics->server == server)
+			return metrics;
+	}
+	return NULL;
+}
+
+static _metrics_shard_t *_metrics_shard(_metrics_t *metrics)
+{
+	int cpu = sched_getcpu();
+	if (cpu < 0)
+		cpu = 0;
+	return &metrics->shm->shards[cpu % METRICS_SHARDS];
+}
+
+static int _metrics_bucket(uint64_t value)
+{
+	if (value < METRICS_SUBBUCKETS)
+		return value;
+	int exponent = 63 - __builtin_clzll(value);
+	int sub = (value >> (exponent - METRICS_SUBBITS)) & (METRICS_SUBBUCKETS - 1);
+	int index = ((exponent - METRICS_SUBBITS + 1) << METRICS_SUBBITS) + sub;
+	return (index < METRICS_BUCKETS)? index: METRICS_BUCKETS - 1;
+}
+
+/**
+ * returns the first value (in microseconds) over the bucket
+ */
+static uint64_t _metrics_bucketmax(int index)
+{
+	int block = index >> METRICS_SUBBITS;
+	uint64_t sub = index & (METRICS_SUBBUCKETS - 1);
+	if (block == 0)
+		return sub + 1;
+	return (METRICS_SUBBUCKETS + sub + 1) << (block - 1);
+}
+
+static void _metrics_record(_metrics_t *metrics, int slot, uint64_t duration)
+{
+	_metrics_stats_t *stats = &_metrics_shard(metrics)->connectors[slot];
+	__atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->time, duration, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->buckets[_metrics_bucket(duration / 1000)], 1, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&stats->max, __ATOMIC_RELAXED);
+	while (duration > max &&
+		!__atomic_compare_exchange_n(&stats->max, &max, duration, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static int _metrics_connector(void *arg, http_message_t *request, http_message_t *response)
+{
+	const _metrics_connector_t *connector = (const _metrics_connector_t *)arg;
+	struct timespec start;
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int ret = connector->cb(connector->arg, request, response);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint64_t duration = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+	_metrics_record(connector->metrics, connector->slot, duration);
+	/// the connector returning ESUCCESS ends the response
+	if (ret == ESUCCESS && connector->metrics->complete != NULL)
+		connector->metrics->complete(connector->metrics->completearg, request, response);
+	return ret;
+}
+
+static int _metrics_findslot(const _metrics_shm_t *shm, http_connector_t cb, int type, const char *name)
+{
+	int nslots = __atomic_load_n(&shm->nslots, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nslots; i++)
+	{
+		const _metrics_slot_t *slot = &shm->slots[i];
+		if (slot->cb == cb && slot->type == type && !strncmp(slot->name, name, METRICS_NAMEMAX - 1))
+			return i;
+	}
+	return EREJECT;
+}
+
+/**
+ * the connectors of the clients are registered into the forked processes,
+ * the slots are shared to be known by the process which sends the metrics.
+ */
+static int _metrics_slot(_metrics_t *metrics, http_connector_t cb, int type, const char *name)
+{
+	_metrics_shm_t *shm = metrics->shm;
+	if (name == NULL)
+		name = "";
+	int index = _metrics_findslot(shm, cb, type, name);
+	if (index != EREJECT)
+		return index;
+	_metrics_lock(&shm->lock);
+	index = _metrics_findslot(shm, cb, type, name);
+	if (index == EREJECT && shm->nslots < METRICS_MAXCONNECTORS)
+	{
+		index = shm->nslots;
+		_metrics_slot_t *slot = &shm->slots[index];
+		slot->cb = cb;
+		slot->type = type;
+		strncpy(slot->name, name, METRICS_NAMEMAX - 1);
+		__atomic_store_n(&shm->nslots, index + 1, __ATOMIC_RELEASE);
+	}
+	_metrics_unlock(&shm->lock);
+	if (index == EREJECT)
+		warn("metrics: too many connectors, %s not measured", name);
+	return index;
+}
+
+static _metrics_connector_t *_metrics_wrap(_metrics_t *metrics, http_connector_t cb, void *arg, int type, const char *name)
+{
+	int slot = _metrics_slot(metrics, cb, type, name);
+	if (slot == EREJECT)
+		return NULL;
+	_metrics_connector_t *connector = calloc(1, sizeof(*connector));
+	if (connector == NULL)
+		return NULL;
+	connector->cb = cb;
+	connector->arg = arg;
+	connector->metrics = metrics;
+	connector->slot = slot;
+	return connector;
+}
+
+int ouistiti_addconnector(http_server_t *server, http_connector_t cb, void *arg, int type, const char *name)
+{
+	_metrics_t *metrics = _metrics_get(server);
+	_metrics_connector_t *connector = NULL;
+	if (metrics != NULL)
+		connector = _metrics_wrap(metrics, cb, arg, type, name);
+	if (connector == NULL)
+		return httpserver_addconnector(server, cb, arg, type, name);
+	connector->next = metrics->connectors;
+	metrics->connectors = connector;
+	return httpserver_addconnector(server, _metrics_connector, connector, type, name);
+}
+
+/**
+ * the client entry is created by the first of the connectors or the
+ * metrics context of the client. It is released with the context.
+ * A socket belongs to one client at a time, the entry of a previous
+ * client on the same socket is replaced and released by its own context.
+ */
+static _metrics_client_t **_metrics_entry(_metrics_t *metrics, int sock, int create)
+{
+	if (sock < 0 || (sock >> METRICS_PAGESHIFT) >= METRICS_NPAGES)
+		return NULL;
+	_metrics_client_t ***page = &metrics->pages[sock >> METRICS_PAGESHIFT];
+	_metrics_client_t **entries = __atomic_load_n(page, __ATOMIC_ACQUIRE);
+	if (entries == NULL && create)
+	{
+		_metrics_client_t **new = calloc(METRICS_PAGESIZE, sizeof(*new));
+		if (new == NULL)
+			return NULL;
+		/// another thread may allocate the same page
+		if (__atomic_compare_exchange_n(page, &entries, new, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			entries = new;
+		else
+			free(new);
+	}
+	if (entries == NULL)
+		return NULL;
+	return &entries[sock & (METRICS_PAGESIZE - 1)];
+}
+
+static _metrics_client_t *_metrics_client(_metrics_t *metrics, http_client_t *clt, int create)
+{
+	int sock = httpclient_socket(clt);
+	_metrics_client_t **entry = _metrics_entry(metrics, sock, create);
+	if (entry == NULL)
+		return NULL;
+	_metrics_client_t *client = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+	if (client != NULL && client->clt == clt)
+		return client;
+	if (!create)
+		return NULL;
+	_metrics_client_t *new = calloc(1, sizeof(*new));
+	if (new == NULL)
+		return NULL;
+	new->clt = clt;
+	new->metrics = metrics;
+	new->sock = sock;
+	if (!__atomic_compare_exchange_n(entry, &client, new, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		free(new);
+		return (client != NULL && client->clt == clt)? client: NULL;
+	}
+	return new;
+}
+
+int ouistiti_addclientconnector(http_client_t *clt, http_connector_t cb, void *arg, int type, const char *name)
+{
+	_metrics_t *metrics = _metrics_get(httpclient_server(clt));
+	_metrics_client_t *client = NULL;
+	_metrics_connector_t *connector = NULL;
+	if (metrics != NULL)
+		client = _metrics_client(metrics, clt, 1);
+	if (client != NULL)
+		connector = _metrics_wrap(metrics, cb, arg, type, name);
+	if (connector == NULL)
+		return httpclient_addconnector(clt, cb, arg, type, name);
+	__atomic_fetch_add(&_metrics_shard(metrics)->memory, sizeof(*connector), __ATOMIC_RELAXED);
+	connector->next = client->connectors;
+	client->connectors = connector;
+	return httpclient_addconnector(clt, _metrics_connector, connector, type, name);
+}
+
+/**
+ * the bytes are read from the TCP stack to count the data sent
+ * with sendfile or through the TLS layer.
+ */
+static void _metrics_bytes(_metrics_t *metrics, _metrics_client_t *client)
+{
+#ifdef TCP_INFO
+	struct tcp_info info = {0};
+	socklen_t length = sizeof(info);
+	int sock = httpclient_socket(client->clt);
+	if (sock < 0 || getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &length) < 0 ||
+		length < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received))
+		return;
+	_metrics_shard_t *shard = _metrics_shard(metrics);
+	if (info.tcpi_bytes_acked > client->txbytes)
+		__atomic_fetch_add(&shard->txbytes, info.tcpi_bytes_acked - client->txbytes, __ATOMIC_RELAXED);
+	if (info.tcpi_bytes_received > client->rxbytes)
+		__atomic_fetch_add(&shard->rxbytes, info.tcpi_bytes_received - client->rxbytes, __ATOMIC_RELAXED);
+	client->txbytes = info.tcpi_bytes_acked;
+	client->rxbytes = info.tcpi_bytes_received;
+#endif
+}
+
+static int _metrics_requestconnector(void *arg, http_message_t *request, http_message_t *response)
+{
+	_metrics_t *metrics = (_metrics_t *)arg;
+	__atomic_fetch_add(&_metrics_shard(metrics)->requests, 1, __ATOMIC_RELAXED);
+	_metrics_client_t *client = _metrics_client(metrics, httpmessage_client(request), 0);
+	if (client != NULL)
+		_metrics_bytes(metrics, client);
+	return EREJECT;
+}
+
+static void *_metrics_getctx(void *arg, http_client_t *clt, struct sockaddr *UNUSED(addr), int UNUSED(addrsize))
+{
+	_metrics_t *metrics = (_metrics_t *)arg;
+	_metrics_shard_t *shard = _metrics_shard(metrics);
+	__atomic_fetch_add(&shard->connections, 1, __ATOMIC_RELAXED);
+	_metrics_client_t *client = _metrics_client(metrics, clt, 1);
+	if (client != NULL)
+	{
+		__atomic_fetch_add(&shard->clients, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&shard->memory, sizeof(*client), __ATOMIC_RELAXED);
+	}
+	return client;
+}
+
+void ouistiti_clientmemory(http_client_t *clt, long size)
+{
+	_metrics_t *metrics = _metrics_get(httpclient_server(clt));
+	if (metrics != NULL)
+		__atomic_fetch_add(&_metrics_shard(metrics)->memory, size, __ATOMIC_RELAXED);
+}
+
+static void _metrics_freectx(void *arg)
+{
+	_metrics_client_t *client = (_metrics_client_t *)arg;
+	if (client == NULL)
+		return;
+	_metrics_t *metrics = client->metrics;
+	_metrics_bytes(metrics, client);
+	long memory = sizeof(*client);
+	_metrics_client_t *expected = client;
+	_metrics_client_t **entry = _metrics_entry(metrics, client->sock, 0);
+	if (entry != NULL)
+		__atomic_compare_exchange_n(entry, &expected, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	_metrics_connector_t *next = NULL;
+	for (_metrics_connector_t *connector = client->connectors; connector != NULL; connector = next)
+	{
+		next = connector->next;
+		memory += sizeof(*connector);
+		free(connector);
+	}
+	free(client);
+	_metrics_shard_t *shard = _metrics_shard(metrics);
+	__atomic_fetch_sub(&shard->clients, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&shard->memory, memory, __ATOMIC_RELAXED);
+}
+
+static const char *_metrics_typename(int type)
+{
+	switch (type)
+	{
+	case CONNECTOR_SERVER:
+		return "server";
+	case CONNECTOR_DOCUMENT:
+		return "document";
+	case CONNECTOR_FILTER:
+		return "filter";
+	case CONNECTOR_DOCFILTER:
+		return "docfilter";
+	case CONNECTOR_ERROR:
+		return "error";
+	case CONNECTOR_AUTH:
+		return "auth";
+	}
+	return "other";
+}
+
+/**
+ * sum of the shards, the counters may move during the reading
+ */
+static void _metrics_sum(const _metrics_shm_t *shm, int slot, _metrics_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < METRICS_SHARDS; i++)
+	{
+		const _metrics_stats_t *shard = &shm->shards[i].connectors[slot];
+		stats->calls += __atomic_load_n(&shard->calls, __ATOMIC_RELAXED);
+		stats->time += __atomic_load_n(&shard->time, __ATOMIC_RELAXED);
+		uint64_t max = __atomic_load_n(&shard->max, __ATOMIC_RELAXED);
+		if (max > stats->max)
+			stats->max = max;
+		for (int j = 0; j < METRICS_BUCKETS; j++)
+			stats->buckets[j] += __atomic_load_n(&shard->buckets[j], __ATOMIC_RELAXED);
+	}
+}
+
+static uint64_t _metrics_counter(const _metrics_shm_t *shm, size_t offset)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < METRICS_SHARDS; i++)
+		value += __atomic_load_n((const uint64_t *)((const char *)&shm->shards[i] + offset), __ATOMIC_RELAXED);
+	return value;
+}
+
+static int64_t _metrics_gauge(const _metrics_shm_t *shm, size_t offset)
+{
+	int64_t value = 0;
+	for (int i = 0; i < METRICS_SHARDS; i++)
+		value += __atomic_load_n((const int64_t *)((const char *)&shm->shards[i] + offset), __ATOMIC_RELAXED);
+	return value;
+}
+
+static double _metrics_percentile(const _metrics_stats_t *stats, int percent)
+{
+	if (stats->calls == 0)
+		return 0;
+	uint64_t rank = (stats->calls * percent + 99) / 100;
+	uint64_t count = 0;
+	for (int i = 0; i < METRICS_BUCKETS; i++)
+	{
+		count += stats->buckets[i];
+		if (count >= rank)
+			return _metrics_bucketmax(i) / 1e6;
+	}
+	return stats->max / 1e9;
+}
+
+typedef struct _metrics_counterinfo_s _metrics_counterinfo_t;
+struct _metrics_counterinfo_s
+{
+	const char *name;
+	const char *help;
+	size_t offset;
+};
+
+static const _metrics_counterinfo_t _metrics_counters[] =
+{
+	{"connections", "Connections accepted by the server.", offsetof(_metrics_shard_t, connections)},
+	{"requests", "Requests received by the server.", offsetof(_metrics_shard_t, requests)},
+	{"received_bytes", "Bytes received on the connections.", offsetof(_metrics_shard_t, rxbytes)},
+	{"sent_bytes", "Bytes sent and acknowledged on the connections.", offsetof(_metrics_shard_t, txbytes)},
+};
+
+static const _metrics_counterinfo_t _metrics_gauges[] =
+{
+	{"clients", "Clients connected to the server.", offsetof(_metrics_shard_t, clients)},
+	{"client_memory_bytes", "Memory held by the modules for the connected clients.", offsetof(_metrics_shard_t, memory)},
+};
+
+static void _metrics_prometheus(const _metrics_t *metrics, http_message_t *response)
+{
+	const _metrics_shm_t *shm = metrics->shm;
+	char line[METRICS_LINEMAX];
+	int length;
+
+	httpmessage_addcontent(response, "text/plain; version=0.0.4", "", -1);
+	for (int i = 0; i < sizeof(_metrics_counters) / sizeof(*_metrics_counters); i++)
+	{
+		const _metrics_counterinfo_t *counter = &_metrics_counters[i];
+		length = snprintf(line, sizeof(line),
+			"# HELP ouistiti_%s_total %s\n# TYPE ouistiti_%s_total counter\n"
+			"ouistiti_%s_total{server=\"%s\"} %llu\n",
+			counter->name, counter->help, counter->name, counter->name, metrics->label,
+			(unsigned long long)_metrics_counter(shm, counter->offset));
+		httpmessage_appendcontent(response, line, length);
+	}
+	for (int i = 0; i < sizeof(_metrics_gauges) / sizeof(*_metrics_gauges); i++)
+	{
+		const _metrics_counterinfo_t *gauge = &_metrics_gauges[i];
+		length = snprintf(line, sizeof(line),
+			"# HELP ouistiti_%s %s\n# TYPE ouistiti_%s gauge\n"
+			"ouistiti_%s{server=\"%s\"} %lld\n",
+			gauge->name, gauge->help, gauge->name, gauge->name, metrics->label,
+			(long long)_metrics_gauge(shm, gauge->offset));
+		httpmessage_appendcontent(response, line, length);
+	}
+
+	httpmessage_appendcontent(response, STRING_REF(
+		"# HELP ouistiti_connector_duration_seconds Duration of the calls of the connectors.\n"
+		"# TYPE ouistiti_connector_duration_seconds histogram\n"));
+	int nslots = __atomic_load_n(&shm->nslots, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nslots; i++)
+	{
+		_metrics_stats_t stats;
+		_metrics_sum(shm, i, &stats);
+		const char *name = shm->slots[i].name;
+		const char *type = _metrics_typename(shm->slots[i].type);
+		uint64_t count = 0;
+		/// one bucket of Prometheus for each power of 4 microseconds
+		for (int j = 0; j < METRICS_BUCKETS; j++)
+		{
+			count += stats.buckets[j];
+			if ((j & (METRICS_SUBBUCKETS - 1)) != METRICS_SUBBUCKETS - 1 || ((j >> METRICS_SUBBITS) & 1))
+				continue;
+			length = snprintf(line, sizeof(line),
+				"ouistiti_connector_duration_seconds_bucket{server=\"%s\",connector=\"%s\",type=\"%s\",le=\"%g\"} %llu\n",
+				metrics->label, name, type, _metrics_bucketmax(j) / 1e6, (unsigned long long)count);
+			httpmessage_appendcontent(response, line, length);
+		}
+		length = snprintf(line, sizeof(line),
+			"ouistiti_connector_duration_seconds_bucket{server=\"%s\",connector=\"%s\",type=\"%s\",le=\"+Inf\"} %llu\n"
+			"ouistiti_connector_duration_seconds_sum{server=\"%s\",connector=\"%s\",type=\"%s\"} %.9f\n"
+			"ouistiti_connector_duration_seconds_count{server=\"%s\",connector=\"%s\",type=\"%s\"} %llu\n",
+			metrics->label, name, type, (unsigned long long)stats.calls,
+			metrics->label, name, type, stats.time / 1e9,
+			metrics->label, name, type, (unsigned long long)stats.calls);
+		httpmessage_appendcontent(response, line, length);
+	}
+}
+
+static void _metrics_json(const _metrics_t *metrics, http_message_t *response)
+{
+	const _metrics_shm_t *shm = metrics->shm;
+	char line[METRICS_LINEMAX];
+	int length;
+
+	httpmessage_addcontent(response, utils_getmime(".json"), "", -1);
+	length = snprintf(line, sizeof(line), "{\"server\":\"%s\"", metrics->label);
+	httpmessage_appendcontent(response, line, length);
+	for (int i = 0; i < sizeof(_metrics_counters) / sizeof(*_metrics_counters); i++)
+	{
+		const _metrics_counterinfo_t *counter = &_metrics_counters[i];
+		length = snprintf(line, sizeof(line), ",\"%s\":%llu",
+			counter->name, (unsigned long long)_metrics_counter(shm, counter->offset));
+		httpmessage_appendcontent(response, line, length);
+	}
+	for (int i = 0; i < sizeof(_metrics_gauges) / sizeof(*_metrics_gauges); i++)
+	{
+		const _metrics_counterinfo_t *gauge = &_metrics_gauges[i];
+		length = snprintf(line, sizeof(line), ",\"%s\":%lld",
+			gauge->name, (long long)_metrics_gauge(shm, gauge->offset));
+		httpmessage_appendcontent(response, line, length);
+	}
+	httpmessage_appendcontent(response, STRING_REF(",\"connectors\":["));
+	int nslots = __atomic_load_n(&shm->nslots, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nslots; i++)
+	{
+		_metrics_stats_t stats;
+		_metrics_sum(shm, i, &stats);
+		length = snprintf(line, sizeof(line),
+			"%s{\"name\":\"%s\",\"type\":\"%s\",\"calls\":%llu,\"time\":%.9f,"
+			"\"max\":%.9f,\"p50\":%g,\"p90\":%g,\"p99\":%g}",
+			(i > 0)? ",": "", shm->slots[i].name, _metrics_typename(shm->slots[i].type),
+			(unsigned long long)stats.calls, stats.time / 1e9, stats.max / 1e9,
+			_metrics_percentile(&stats, 50), _metrics_percentile(&stats, 90),
+			_metrics_percentile(&stats, 99));
+		httpmessage_appendcontent(response, line, length);
+	}
+	httpmessage_appendcontent(response, STRING_REF("]}"));
+}
+
+static int _metrics_documentconnector(void *arg, http_message_t *request, http_message_t *response)
+{
+	const _metrics_t *metrics = (const _metrics_t *)arg;
+	const char *uri = httpmessage_REQUEST(request, "uri");
+	if (uri == NULL || utils_searchexp(uri, metrics->uri, NULL) != ESUCCESS)
+		return EREJECT;
+
+	const char *accept = httpmessage_REQUEST(request, "Accept");
+	if (accept != NULL && strstr(accept, "json") != NULL)
+		_metrics_json(metrics, response);
+	else
+		_metrics_prometheus(metrics, response);
+	httpmessage_addheader(response, str_cachecontrol, STRING_REF("no-store"));
+	httpmessage_result(response, RESULT_200);
+	return ESUCCESS;
+}
+
+int ouistiti_metrics(http_server_t *server, const serverconfig_t *config)
+{
+	int hasuri = (config->metrics != NULL && config->metrics[0] != '\0');
+	/// the access log uses the connectors layer to know the end of the responses
+	if ((!hasuri && config->accesslog == NULL) || _metrics_get(server) != NULL)
+		return EREJECT;
+	_metrics_shm_t *shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED)
+	{
+		err("metrics: memory allocation error %m");
+		return EREJECT;
+	}
+	_metrics_t *metrics = calloc(1, sizeof(*metrics));
+	if (metrics == NULL)
+	{
+		munmap(shm, sizeof(*shm));
+		return EREJECT;
+	}
+	metrics->server = server;
+	metrics->uri = config->metrics;
+	metrics->shm = shm;
+	snprintf(metrics->label, sizeof(metrics->label), "%s:%d",
+		config->server->hostname, config->server->port);
+	metrics->next = g_metrics;
+	g_metrics = metrics;
+
+	httpserver_addmod(server, _metrics_getctx, _metrics_freectx, metrics, str_metrics);
+	httpserver_addconnector(server, _metrics_requestconnector, metrics, CONNECTOR_SERVER, str_metrics);
+	if (!hasuri)
+		return ESUCCESS;
+	httpserver_addconnector(server, _metrics_documentconnector, metrics, CONNECTOR_DOCUMENT, str_metrics);
+	warn("metrics: %s on %s", metrics->label, metrics->uri);
+	return ESUCCESS;
+}
+
+int ouistiti_metricscomplete(http_server_t *server, http_connector_t cb, void *arg)
+{
+	_metrics_t *metrics = _metrics_get(server);
+	if (metrics == NULL)
+		return EREJECT;
+	metrics->complete = cb;
+	metrics->completearg = arg;
+	return ESUCCESS;
+}
+
+void ouistiti_freemetrics(http_server_t *server)
+{
+	for (_metrics_t **previous = &g_metrics; *previous != NULL; previous = &(*previous)->next)
+	{
+		_metrics_t *metrics = *previous;
+		if (metrics->server != server)
+			continue;
+		*previous = metrics->next;
+		_metrics_connector_t *next = NULL;
+		for (_metrics_connector_t *connector = metrics->connectors; connector != NULL; connector = next)
+		{
+			next = connector->next;
+			free(connector);
+		}
+		munmap(metrics->shm, sizeof(*metrics->shm));
+		for (int i = 0; i < METRICS_NPAGES; i++)
+			free(metrics->pages[i]);
+		free(metrics);
+		return;
+	}
+}
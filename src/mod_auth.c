@@ -73,6 +73,11 @@
 #include "authz_sqlite.h"
 #include "authz_jwt.h"
 #include "authz_totp.h"
+#ifdef AUTHZ_JWKS
+#include "authz_jwks.h"
+#endif
+
+#include "log.h"
 
 #define auth_dbg(...)
 
@@ -95,6 +100,7 @@ static void _mod_auth_freectx(void *vctx);
 static int _home_connector(void *arg, http_message_t *request, http_message_t *response);
 static int _forbidden_connector(void *arg, http_message_t *request, http_message_t *response);
 static int _authn_connector(void *arg, http_message_t *request, http_message_t *response);
+
 #ifndef AUTHZ_JWT
 static size_t authz_generatetoken(const mod_auth_t *mod, http_message_t *request, char **token);
 #endif
@@ -468,6 +474,10 @@ static mod_auth_t *_auth_config(const config_setting_t *config, server_t *server
 	 */
 	if (config_setting_lookup_string(config, "secret", &auth->secret.data) != CONFIG_FALSE)
 		auth->secret.length = strlen(auth->secret.data);
+	/**
+	 * jwks is the file of public keys to check the asymmetric signatures (see authz_jwks.c)
+	 */
+	config_setting_lookup_string(config, "jwks", &auth->jwksfile);
 
 	const char *mode = NULL;
 	config_setting_lookup_string(config, "options", &mode);
@@ -603,6 +613,15 @@ static void *mod_auth_create(http_server_t *server, mod_auth_t *config)
 		mod->authz->generatetoken = authz_generatetoken;
 #endif
 
+#ifdef AUTHZ_JWKS
+	if (config->jwksfile != NULL)
+	{
+		config->jwks = authz_jwks_create(config->jwksfile);
+		if (config->jwks == NULL)
+			err("auth: jwks %s not available", config->jwksfile);
+	}
+#endif
+
 	mod->authz->ctx = mod->authz->rules->create(server, config->authz.config);
 	if (mod->authz->ctx == NULL)
 	{
@@ -632,7 +651,7 @@ static void *mod_auth_create(http_server_t *server, mod_auth_t *config)
 	}
 	else
 	{
-		httpserver_addconnector(server, _forbidden_connector, mod, CONNECTOR_AUTH, str_auth);
+		ouistiti_addconnector(server, _forbidden_connector, mod, CONNECTOR_AUTH, str_auth);
 	}
 
 	return mod;
@@ -651,6 +670,10 @@ static void mod_auth_destroy(void *arg)
 	}
 	free(mod->authn);
 	free(mod->authz);
+#ifdef AUTHZ_JWKS
+	if (mod->config->jwks)
+		authz_jwks_destroy(mod->config->jwks);
+#endif
 #ifdef FILE_CONFIG
 	free(mod->config);
 #endif
@@ -666,8 +689,8 @@ static void *_mod_auth_getctx(void *arg, http_client_t *clt, struct sockaddr *ad
 	ctx->clt = clt;
 
 	if (mod->authz->type & AUTHZ_HOME_E)
-		httpclient_addconnector(clt, _home_connector, ctx, CONNECTOR_AUTH, str_auth);
-	httpclient_addconnector(clt, _authn_connector, ctx, CONNECTOR_AUTH, str_auth);
+		ouistiti_addclientconnector(clt, _home_connector, ctx, CONNECTOR_AUTH, str_auth);
+	ouistiti_addclientconnector(clt, _authn_connector, ctx, CONNECTOR_AUTH, str_auth);
 	/**
 	 * authn may require prioritary connector and it has to be added after this one
 	 */
@@ -807,6 +830,31 @@ int authz_checkpasswd(const char *checkpasswd,  const string_t *user,
 	return ret;
 }
 
+int authz_checkuserhash(const hash_t *hash, const char *user, size_t userlen,
+		const string_t *realm, const char *userhash, size_t userhashlen)
+{
+	/**
+	 * RFC 7616 3.4.4: username = H(unq(username) ":" unq(realm))
+	 */
+	unsigned char digest[HASH_MAX_SIZE];
+	void *ctx = hash->init();
+	hash->update(ctx, user, userlen);
+	hash->update(ctx, ":", 1);
+	hash->update(ctx, realm->data, realm->length);
+	hash->finish(ctx, (char *)digest);
+
+	if (userhashlen != hash->size * 2)
+		return EREJECT;
+	for (int i = 0; i < hash->size; i++)
+	{
+		char hex[3];
+		snprintf(hex, sizeof(hex), "%02x", digest[i]);
+		if (strncasecmp(hex, userhash + i * 2, 2))
+			return EREJECT;
+	}
+	return ESUCCESS;
+}
+
 #ifndef AUTHZ_JWT
 static size_t authz_generatetoken(const mod_auth_t *config, http_message_t *UNUSED(request), char **token)
 {
@@ -823,7 +871,7 @@ static size_t authz_generatetoken(const mod_auth_t *config, http_message_t *UNUS
 	time_t expire = (config->expire * 60);
 	if (expire == 0)
 		expire = 60 * 30;
-	expire += time(NULL);
+	expire += ouistiti_time();
 	memcpy(&_nonce[25], &expire, sizeof(time_t));
 	if (config->issuer.data != NULL)
 	{
@@ -902,14 +950,31 @@ int authn_checksignature(const char *key, size_t keylen,
 	return ESUCCESS;
 }
 
+int authn_checktokensignature(const mod_auth_t *config,
+		const char *data, size_t datalen,
+		const char *sign, size_t signlen)
+{
+#ifdef AUTHZ_JWKS
+	/**
+	 * the asymmetric tokens are checked with the public keys,
+	 * the HMAC tokens continue with the secret.
+	 */
+	if (config->jwks != NULL)
+	{
+		int ret = authz_jwks_check(config->jwks, data, datalen, sign, signlen);
+		if (ret != ECONTINUE)
+			return ret;
+	}
+#endif
+	return authn_checksignature(config->secret.data, config->secret.length, data, datalen, sign, signlen);
+}
+
 static int authn_checktoken(_mod_auth_ctx_t *ctx, authz_t *authz, const char *token, size_t tokenlen, const char *sign, size_t signlen, const char **user)
 {
 	int ret = ECONTINUE;
 	_mod_auth_t *mod = ctx->mod;
 
-	const char *key = mod->config->secret.data;
-	size_t keylen = mod->config->secret.length;
-	ret = authn_checksignature(key, keylen, token, tokenlen, sign, signlen);
+	ret = authn_checktokensignature(mod->config, token, tokenlen, sign, signlen);
 	if (ret == ESUCCESS)
 	{
 		*user = authz->rules->check(authz->ctx, NULL, NULL, token);
@@ -1165,7 +1230,12 @@ static int _authn_challenge(_mod_auth_ctx_t *ctx, http_message_t *request, http_
 	const mod_auth_t *config = mod->config;
 	const char *uri = httpmessage_REQUEST(request, "uri");
 
-	if (mod->authn->ctx)
+	/// as the check, the challenge may use the data of the client
+	if (ctx->authn.ctx)
+	{
+		ret = ctx->authn.rules->challenge(ctx->authn.ctx, request, response);
+	}
+	else if (mod->authn->ctx)
 	{
 		ret = mod->authn->rules->challenge(mod->authn->ctx, request, response);
 	}
@@ -1296,7 +1366,7 @@ static int _auth_prepareresponse(_mod_auth_ctx_t *ctx, http_message_t *request,
 	{
 		size_t ttokenlen = -1;
 		tsignlen = (int)(HASH_MAX_SIZE * 1.5) + 1;
-		tsign = calloc(1, tsignlen);
+		tsign = ouistiti_requestalloc(request, tsignlen);
 
 		ttokenlen = mod->authz->generatetoken(mod->config, request, &ttoken);
 		const char *key = mod->config->secret.data;
@@ -1325,8 +1395,7 @@ static int _auth_prepareresponse(_mod_auth_ctx_t *ctx, http_message_t *request,
 	}
 	if (ttoken)
 		free(ttoken);
-	if (tsign)
-		free(tsign);
+	ouistiti_requestfree(request, tsign);
 	return ESUCCESS;
 }
 
@@ -1429,7 +1498,7 @@ static int _authn_connector(void *arg, http_message_t *request, http_message_t *
 			if (expire_str)
 				expire = strtol(expire_str, NULL, 10);
 #ifndef DEBUG
-			time_t now = time(NULL);
+			time_t now = ouistiti_time();
 			if (mod->config->expire > 0 &&
 				(expire < now ||
 				(expire + mod->config->expire) > now))
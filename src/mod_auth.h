@@ -52,6 +52,8 @@ typedef void *(*authz_rule_setup_t)(void *arg);
 typedef const char *(*authz_rule_check_t)(void *arg, const char *user, const char *passwd, const char *token);
 typedef const int (*authz_rule_join_t)(void *arg, const char *user, const char *token, int expire);
 typedef int (*authz_rule_passwd_t)(void *arg, const char *user, const char **passwd);
+typedef struct hash_s hash_t;
+typedef const char *(*authz_rule_userhash_t)(void *arg, const hash_t *hash, const string_t *realm, const char *userhash, size_t userhashlen);
 typedef int (*authz_rule_setsession_t)(void* arg, const char *user, auth_saveinfo_t cb, void *cbarg);
 typedef void (*authz_rule_cleanup_t)(void *arg);
 typedef void (*authz_rule_destroy_t)(void *arg);
@@ -63,6 +65,7 @@ struct authz_rules_s
 	authz_rule_check_t check;
 	authz_rule_join_t join;
 	authz_rule_passwd_t passwd;
+	authz_rule_userhash_t userhash;
 	authz_rule_setsession_t setsession;
 	authz_rule_cleanup_t cleanup;
 	authz_rule_destroy_t destroy;
@@ -134,7 +137,7 @@ typedef enum
 	AUTHN_HEADER_E = 0x40,
 } authn_type_t;
 
-typedef struct hash_s hash_t;
+typedef struct authz_jwks_s authz_jwks_t;
 
 struct authn_s
 {
@@ -166,6 +169,8 @@ struct mod_auth_s
 	string_t issuer;
 	const char *protect;
 	const char *unprotect;
+	const char *jwksfile;
+	authz_jwks_t *jwks;
 	int expire;
 };
 
@@ -173,9 +178,14 @@ extern const module_t mod_auth;
 
 int authz_checkpasswd(const char *checkpasswd, const string_t *user,
 		const string_t *realm, const string_t *passwd);
+int authz_checkuserhash(const hash_t *hash, const char *user, size_t userlen,
+		const string_t *realm, const char *userhash, size_t userhashlen);
 int authn_checksignature(const char *key, size_t keylen,
 		const char *data, size_t datalen,
 		const char *sign, size_t signlen);
+int authn_checktokensignature(const mod_auth_t *config,
+		const char *data, size_t datalen,
+		const char *sign, size_t signlen);
 
 const char *auth_info(http_message_t *request, const char *key, size_t keylen);
 size_t auth_info2(http_message_t *request, const char *key, const char **value);
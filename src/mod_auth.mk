@@ -36,6 +36,13 @@ mod_auth_LIBRARY-$(AUTHZ_SQLITE)+=sqlite3
 mod_auth_SOURCES-$(AUTHZ_JWT)+=authz_jwt.c
 mod_auth_LIBRARY-$(AUTHZ_JWT)+=jansson
 
+mod_auth_SOURCES-$(AUTHZ_JWKS)+=authz_jwks.c
+mod_auth_LIBRARY-$(AUTHZ_JWKS)+=jansson
+ifeq ($(AUTHZ_JWKS),y)
+mod_auth_LIBS-$(MBEDTLS)+=mbedcrypto
+mod_auth_LIBRARY-$(OPENSSL)+=libcrypto
+endif
+
 mod_auth_SOURCES-$(AUTHZ_TOTP)+=authz_totp.c
 
 mod_auth_CFLAGS-$(MBEDTLS)+=-DTLS
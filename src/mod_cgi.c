@@ -51,6 +51,7 @@
 #include "ouistiti/utils.h"
 #include "ouistiti/log.h"
 #include "mod_cgi.h"
+#include "log.h"
 
 #define USE_EXECVEAT
 
@@ -92,6 +93,9 @@ struct mod_cgi_ctx_s
 	int fromcgi[2];
 
 	char *chunk;
+#ifdef CACHE
+	ouistiti_cachectx_t *cache;
+#endif
 };
 
 struct _mod_cgi_s
@@ -151,7 +155,7 @@ static void *mod_cgi_create(http_server_t *server, mod_cgi_config_t *modconfig)
 	mod->config = modconfig;
 	mod->server = server;
 
-	httpserver_addconnector(server, _cgi_connector, mod, CONNECTOR_DOCUMENT, str_cgi);
+	ouistiti_addconnector(server, _cgi_connector, mod, CONNECTOR_DOCUMENT, str_cgi);
 
 	return mod;
 }
@@ -167,15 +171,18 @@ static void mod_cgi_destroy(void *arg)
 	free(mod);
 }
 
-static void _cgi_freectx(mod_cgi_ctx_t *ctx)
+static void _cgi_freectx(mod_cgi_ctx_t *ctx, http_message_t *request)
 {
-	if (ctx->chunk)
-		free(ctx->chunk);
+#ifdef CACHE
+	ouistiti_cachefree(ctx->cache);
+#endif
+	ouistiti_requestfree(request, ctx->chunk);
 	if (ctx->fromcgi[0])
 		close(ctx->fromcgi[0]);
 	if (ctx->tocgi[1] > 0)
 		close(ctx->tocgi[1]);
-	free(ctx);
+	ouistiti_requestfree(request, (char *)ctx->cgi_path.data);
+	ouistiti_requestfree(request, ctx);
 }
 
 static int _mod_cgi_fork(mod_cgi_ctx_t *ctx, http_message_t *request)
@@ -282,8 +289,14 @@ static int _cgi_start(_mod_cgi_t *mod, http_message_t *request, http_message_t *
 		}
 
 		mod_cgi_ctx_t *ctx;
-		ctx = calloc(1, sizeof(*ctx));
-		char *data = calloc(1, urilen + 2);
+		ctx = ouistiti_requestalloc(request, sizeof(*ctx));
+		char *data = ouistiti_requestalloc(request, urilen + 2);
+		if (ctx == NULL || data == NULL)
+		{
+			ouistiti_requestfree(request, data);
+			ouistiti_requestfree(request, ctx);
+			return EREJECT;
+		}
 		if (path_info != NULL)
 		{
 			/**
@@ -310,7 +323,7 @@ static int _cgi_start(_mod_cgi_t *mod, http_message_t *request, http_message_t *
 		if (scriptfd < 0)
 		{
 			warn("cgi: %s error %s", ctx->cgi_path.data, strerror(errno));
-			free(ctx);
+			_cgi_freectx(ctx, request);
 			return EREJECT;
 		}
 
@@ -321,7 +334,7 @@ static int _cgi_start(_mod_cgi_t *mod, http_message_t *request, http_message_t *
 		{
 			dbg("cgi: %s is directory", uri);
 			close(scriptfd);
-			free(ctx);
+			_cgi_freectx(ctx, request);
 			return EREJECT;
 		}
 		/* at least user or group may execute the CGI */
@@ -331,18 +344,24 @@ static int _cgi_start(_mod_cgi_t *mod, http_message_t *request, http_message_t *
 			warn("cgi: %s access denied", uri);
 			warn("cgi: %s", strerror(errno));
 			close(scriptfd);
-			free(ctx);
+			_cgi_freectx(ctx, request);
 			return ESUCCESS;
 		}
 
-		dbg("cgi: run %s", uri);
 		ctx->mod = mod;
-		ctx->pid = _mod_cgi_fork(ctx, request);
-		ctx->state = STATE_INSTART;
-		ctx->chunk = malloc(config->chunksize + 1);
+		ctx->chunk = ouistiti_requestalloc(request, config->chunksize + 1);
 		httpmessage_private(request, ctx);
 		close(scriptfd);
 		ret = EINCOMPLETE;
+#ifdef CACHE
+		int cache = ouistiti_cachebegin(mod->server, request, &ctx->cache);
+		/// the CGI runs later for the waiting requests
+		if (cache == ESUCCESS || cache == EINCOMPLETE)
+			return ret;
+#endif
+		dbg("cgi: run %s", uri);
+		ctx->pid = _mod_cgi_fork(ctx, request);
+		ctx->state = STATE_INSTART;
 	}
 	return ret;
 }
@@ -434,12 +453,19 @@ static int _cgi_response(mod_cgi_ctx_t *ctx, http_message_t *response)
 		else if (size < 1)
 		{
 			dbg("cgi: died");
+#ifdef CACHE
+			/// the end of the pipe before the end of the content, the response may be truncated
+			ouistiti_cacheend(ctx->cache, EREJECT);
+#endif
 			_cgi_changestate(ctx, STATE_OUTFINISH);
 		}
 		else
 		{
 			ctx->chunk[size] = 0;
 			cgi_dbg("cgi: receive (%d)\n%s", size, ctx->chunk);
+#ifdef CACHE
+			ouistiti_cacheappend(ctx->cache, ctx->chunk, size);
+#endif
 			/**
 			 * if content_length is not null, parcgi is able to
 			 * create the content.
@@ -462,6 +488,37 @@ static int _cgi_response(mod_cgi_ctx_t *ctx, http_message_t *response)
 	}
 	return ret;
 }
+
+#ifdef CACHE
+/**
+ * the CGI is not running. The response is sent from the cache or the
+ * request waits the response of another one.
+ */
+static int _cgi_cache(mod_cgi_ctx_t *ctx, http_message_t *request, http_message_t *response)
+{
+	int ret = ouistiti_cachebegin(ctx->mod->server, request, &ctx->cache);
+	if (ret == EINCOMPLETE)
+		return EINCOMPLETE;
+	if (ret == ESUCCESS)
+	{
+		ret = ouistiti_cachereplay(ctx->cache, response);
+		if (ret == ESUCCESS)
+		{
+			_cgi_freectx(ctx, request);
+			httpmessage_private(request, NULL);
+		}
+		return ret;
+	}
+	/// the fetch of the other request is lost, this one runs the CGI
+	dbg("cgi: run %s", ctx->cgi_path.data);
+	ctx->pid = _mod_cgi_fork(ctx, request);
+	ctx->state = STATE_INSTART;
+	_cgi_request(ctx, request);
+	_cgi_changestate(ctx, STATE_OUTSTART);
+	return EINCOMPLETE;
+}
+#endif
+
 static int _cgi_connector(void *arg, http_message_t *request, http_message_t *response)
 {
 	int ret = EINCOMPLETE;
@@ -474,9 +531,17 @@ static int _cgi_connector(void *arg, http_message_t *request, http_message_t *re
 		if (ret != EINCOMPLETE)
 			return ret;
 		ctx = httpmessage_private(request, NULL);
+#ifdef CACHE
+		if (ctx->state == STATE_SETUP)
+			return _cgi_cache(ctx, request, response);
+#endif
 		_cgi_request(ctx, request);
 		_cgi_changestate(ctx, STATE_OUTSTART);
 	}
+#ifdef CACHE
+	else if (ctx->state == STATE_SETUP)
+		return _cgi_cache(ctx, request, response);
+#endif
 	else
 	{
 
@@ -514,6 +579,9 @@ static int _cgi_connector(void *arg, http_message_t *request, http_message_t *re
 		}
 		else if (outstate == STATE_CONTENTCOMPLETE)
 		{
+#ifdef CACHE
+			ouistiti_cacheend(ctx->cache, ESUCCESS);
+#endif
 			ret = httpmessage_parsecgi(response, NULL, 0);
 			ret = ECONTINUE;
 			_cgi_changestate(ctx, STATE_OUTFINISH);
@@ -527,7 +595,7 @@ static int _cgi_connector(void *arg, http_message_t *request, http_message_t *re
 		}
 		else if (ctx->state == STATE_END)
 		{
-			_cgi_freectx(ctx);
+			_cgi_freectx(ctx, request);
 			httpmessage_private(request, NULL);
 			ret = ESUCCESS;
 		}
@@ -40,6 +40,7 @@
 #include "ouistiti/log.h"
 #include "ouistiti/httpserver.h"
 #include "mod_cookie.h"
+#include "log.h"
 
 typedef struct _mod_cookie_ctx_s _mod_cookie_ctx_t;
 typedef struct _mod_cookie_s _mod_cookie_t;
@@ -84,7 +85,7 @@ static void *_mod_cookie_getctx(void *arg, http_client_t *clt, struct sockaddr *
 	ctx->clt = clt;
 	ctx->mod = mod;
 
-	httpclient_addconnector(clt, _cookie_connector, ctx, str_cookie);
+	ouistiti_addclientconnector(clt, _cookie_connector, ctx, str_cookie);
 
 	return ctx;
 }
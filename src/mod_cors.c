@@ -49,6 +49,7 @@
 #include "ouistiti/utils.h"
 #include "ouistiti/log.h"
 #include "mod_cors.h"
+#include "log.h"
 
 typedef struct _mod_cors_s _mod_cors_t;
 typedef struct _mod_cors_ctx_s _mod_cors_ctx_t;
@@ -101,10 +102,6 @@ static int _cors_connector(void *arg, http_message_t *request, http_message_t *r
 		httpmessage_result(response, 405);
 		ret = ESUCCESS;
 	}
-	else
-	{
-		httpmessage_addheader(response, "Vary", STRING_REF("Origin"));
-	}
 	return ret;
 }
 
@@ -116,7 +113,7 @@ static void *_mod_cors_getctx(void *arg, http_client_t *clt, struct sockaddr *UN
 	 * Methods must be set here, because other modules may append new methods to the server.
 	 */
 	mod->methods = httpserver_INFO(httpclient_server(clt), "methods");
-	httpclient_addconnector(clt, _cors_connector, mod, CONNECTOR_FILTER, str_cors);
+	ouistiti_addclientconnector(clt, _cors_connector, mod, CONNECTOR_FILTER, str_cors);
 
 	return mod;
 }
@@ -158,6 +155,11 @@ static void *mod_cors_create(http_server_t *server, mod_cors_t *config)
 	mod->config = config;
 
 	httpserver_addmethod(server, METHOD(str_options), 0);
+	/**
+	 * the response depends on the Origin for all the requests,
+	 * not only when the Access-Control headers are present.
+	 */
+	ouistiti_setheader(server, "Vary", STRING_REF("Origin"));
 	httpserver_addmod(server, _mod_cors_getctx, _mod_cors_freectx, mod, str_cors);
 	return mod;
 }
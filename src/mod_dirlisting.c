@@ -36,11 +36,16 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <dirent.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/syscall.h>
 
 #include "ouistiti/httpserver.h"
 #include "ouistiti/utils.h"
 #include "ouistiti/log.h"
 #include "mod_document.h"
+#include "log.h"
 
 #ifndef S_IFMT
 # define S_IFMT 0xF000
@@ -65,10 +70,27 @@ typedef struct _document_connector_s document_connector_t;
 #define DIRLISTING_LINE "{\"name\":\"%.*s\",\"size\":\"%lu %s\",\"type\":%d,\"mime\":\"%s\"},"
 #define DIRLISTING_LINE_LENGTH (sizeof(DIRLISTING_LINE))
 #define DIRLISTING_FOOTER "\
-{}],\
+{}],%s\
 \"result\":\"%s\"\
 }\n"
 
+#define DIRLISTING_CACHEMAX 32
+#define DIRLISTING_CACHEENTRIES 1024
+/// the sizes of the files are refreshed after this delay (seconds)
+#define DIRLISTING_CACHETIME 10
+#define DIRLISTING_PAGEMAX 1024
+#define DIRLISTING_BATCH 32768
+
+typedef struct _dirlisting_dirent64_s _dirlisting_dirent64_t;
+struct _dirlisting_dirent64_s
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
 #ifdef DIRLISTING_MOD
 static const char str_dirlisting[] = "dirlisting";
 #endif
@@ -81,179 +103,434 @@ static const char *_sizeunit[] = {
 	"TB",
 };
 
-static int _dirlisting_connectorheader(document_connector_t *private, http_message_t *request, http_message_t *response)
+typedef struct _dirlisting_buffer_s _dirlisting_buffer_t;
+struct _dirlisting_buffer_s
 {
-	int ret = EREJECT;
-	const char *url = private->url;
-	int fdroot = private->fdroot;
+	char *data;
+	size_t length;
+	size_t size;
+};
 
-	if (url[0] == '\0')
-		url = ".";
-	dbg("dirlisting: open /%s", private->url);
-	ret = scandirat(fdroot, url, &private->ents, NULL, alphasort);
-	if (ret >= 0)
+typedef struct _dirlisting_listing_s _dirlisting_listing_t;
+struct _dirlisting_listing_s
+{
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	time_t expire;
+	char *name;
+	char *data;
+	size_t length;
+	char etag[20];
+	int refs;
+};
+
+/// the listings of the worker, the workers are processes
+static _dirlisting_listing_t *g_listings[DIRLISTING_CACHEMAX] = {0};
+static int g_listingslock = 0;
+
+static void _dirlisting_lock(void)
+{
+	while (__atomic_exchange_n(&g_listingslock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void _dirlisting_unlock(void)
+{
+	__atomic_store_n(&g_listingslock, 0, __ATOMIC_RELEASE);
+}
+
+static void _dirlisting_release(_dirlisting_listing_t *listing)
+{
+	if (__atomic_sub_fetch(&listing->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	free(listing->name);
+	free(listing->data);
+	free(listing);
+}
+
+static int _dirlisting_reserve(_dirlisting_buffer_t *buffer, size_t length)
+{
+	if (buffer->length + length < buffer->size)
+		return ESUCCESS;
+	size_t size = buffer->size * 2;
+	if (size < buffer->length + length + 1)
+		size = buffer->length + length + 1;
+	char *data = realloc(buffer->data, size);
+	if (data == NULL)
+		return EREJECT;
+	buffer->data = data;
+	buffer->size = size;
+	return ESUCCESS;
+}
+
+static int _dirlisting_line(int fddir, const char *name, _dirlisting_buffer_t *buffer)
+{
+	unsigned int length = strlen(name);
+	if (length > MAX_NAMELENGTH)
 	{
-		private->nbents = ret;
-
-		/**
-		 * The content-length of dirlisting is unknown.
-		 * Set the content-type first without content-length.
-		 */
-		httpmessage_addcontent(response, utils_getmime(".json"), NULL, -1);
-		if (!strcmp(httpmessage_REQUEST(request, "method"), "HEAD"))
-		{
-			for (int i = 0; i < ret; i++)
-				free(private->ents[i]);
-			free(private->ents);
-			private->ents = NULL;
-			private->nbents = 0;
-			document_close(private, request);
-			ret = ESUCCESS;
-		}
-		else
-		{
-			const char *uri = NULL;
-			size_t urilen = httpmessage_REQUEST2(request,"uri", &uri);
-			char *data = calloc(1, DIRLISTING_HEADER_LENGTH + urilen + 1);
-			urilen = snprintf(data, DIRLISTING_HEADER_LENGTH + urilen, DIRLISTING_HEADER, uri);
-			httpmessage_appendcontent(response, data, urilen);
-			free(data);
-			ret = ECONTINUE;
-		}
+		warn("dirlisting: %s file name length too long", name);
 	}
-	else
+	struct stat filestat;
+	if (fstatat(fddir, name, &filestat, 0) == -1)
 	{
-		private->ents = NULL;
-		private->nbents = 0;
-		warn("dirlisting: directory not open %s %s", private->url, strerror(errno));
-		document_close(private, request);
-		httpmessage_result(response, RESULT_400);
+		/// the entry is skipped
+		err("dirlisting: %s stat error %s", name, strerror(errno));
+		return ESUCCESS;
+	}
+	size_t size = filestat.st_size;
+	int unit = 0;
+	while (size > 2000)
+	{
+		size /= 1024;
+		unit++;
 	}
+	const char *mime = "inode/directory";
+	size_t mimelen = 15;
 
-	return ret;
+	if (S_ISREG(filestat.st_mode) || S_ISLNK(filestat.st_mode))
+	{
+		mimelen = utils_getmime2(name, &mime);
+	}
+	length += mimelen;
+	length += 4 + 2 + 4 + 20;
+	if (_dirlisting_reserve(buffer, DIRLISTING_LINE_LENGTH + length) != ESUCCESS)
+		return EREJECT;
+	buffer->length += snprintf(buffer->data + buffer->length, buffer->size - buffer->length,
+			DIRLISTING_LINE, MAX_NAMELENGTH, name, size, _sizeunit[unit], ((filestat.st_mode & S_IFMT) >> 12), mime);
+	return ESUCCESS;
 }
 
-static int _dirlisting_getentity(document_connector_t *private, struct dirent *ent, http_message_t *response)
+/**
+ * The entries are read by batches with getdents64, the memory does not
+ * depend on the size of the directory. The hidden entries are skipped.
+ */
+typedef int (*_dirlisting_entry_t)(void *arg, const char *name);
+static int _dirlisting_read(int fddir, _dirlisting_entry_t cb, void *arg)
 {
-	int ret = EREJECT;
-	if (ent == NULL)
+	char batch[DIRLISTING_BATCH] __attribute__((aligned(8)));
+	if (lseek(fddir, 0, SEEK_SET) == -1)
 		return EREJECT;
-	document_dbg("dirlisting: dirlisting contains %s", ent->d_name);
-	if (ent->d_name[0] != '.')
+	long length;
+	while ((length = syscall(SYS_getdents64, fddir, batch, sizeof(batch))) > 0)
 	{
-		unsigned int length = strlen(ent->d_name);
-		if (length > MAX_NAMELENGTH)
-		{
-			warn("dirlisting: %s file name length too long", ent->d_name);
-		}
-		struct stat filestat;
-		fstatat(private->fdfile, ent->d_name, &filestat, 0);
-		size_t size = filestat.st_size;
-		if (size == -1)
-		{
-			err("dirlisting: %s stat error %s", ent->d_name, strerror(errno));
-			return EREJECT;
-		}
-		int unit = 0;
-		while (size > 2000)
+		for (long offset = 0; offset < length;)
 		{
-			size /= 1024;
-			unit++;
+			const _dirlisting_dirent64_t *ent = (const _dirlisting_dirent64_t *)(batch + offset);
+			offset += ent->d_reclen;
+			if (ent->d_name[0] == '.')
+				continue;
+			int ret = cb(arg, ent->d_name);
+			if (ret != ECONTINUE)
+				return ret;
 		}
-		const char *mime = "inode/directory";
-		size_t mimelen = 15;
+	}
+	return (length < 0)? EREJECT: ESUCCESS;
+}
+
+typedef struct _dirlisting_names_s _dirlisting_names_t;
+struct _dirlisting_names_s
+{
+	_dirlisting_buffer_t strings;
+	size_t *offsets;
+	size_t count;
+};
+
+static int _dirlisting_addname(void *arg, const char *name)
+{
+	_dirlisting_names_t *names = (_dirlisting_names_t *)arg;
+	if (names->count == DIRLISTING_CACHEENTRIES)
+		return EINCOMPLETE;
+	size_t length = strlen(name) + 1;
+	if (_dirlisting_reserve(&names->strings, length) != ESUCCESS)
+		return EREJECT;
+	names->offsets[names->count++] = names->strings.length;
+	memcpy(names->strings.data + names->strings.length, name, length);
+	names->strings.length += length;
+	return ECONTINUE;
+}
+
+/// the listing is sent in the reverse alphabetical order
+static int _dirlisting_compare(const void *a, const void *b, void *arg)
+{
+	const char *strings = (const char *)arg;
+	return strcoll(strings + *(const size_t *)b, strings + *(const size_t *)a);
+}
+
+static uint64_t _dirlisting_hash(const char *data, size_t length)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static _dirlisting_listing_t *_dirlisting_new(_dirlisting_buffer_t *buffer, const char *uri, size_t urilen)
+{
+	_dirlisting_listing_t *listing = calloc(1, sizeof(*listing));
+	if (listing == NULL)
+	{
+		free(buffer->data);
+		return NULL;
+	}
+	listing->data = buffer->data;
+	listing->length = buffer->length;
+	listing->name = strndup(uri, urilen);
+	snprintf(listing->etag, sizeof(listing->etag), "\"%016llx\"",
+		(unsigned long long)_dirlisting_hash(buffer->data, buffer->length));
+	listing->refs = 1;
+	return listing;
+}
+
+/**
+ * The whole listing is rendered once, sorted like scandir with
+ * alphasort. The directory with more than DIRLISTING_CACHEENTRIES
+ * entries is rejected with EFBIG, it is sent by pages.
+ */
+static _dirlisting_listing_t *_dirlisting_render(int fddir, const char *uri, size_t urilen)
+{
+	_dirlisting_names_t names = {0};
+	names.offsets = calloc(DIRLISTING_CACHEENTRIES, sizeof(*names.offsets));
+	if (names.offsets == NULL)
+		return NULL;
+	int ret = _dirlisting_read(fddir, _dirlisting_addname, &names);
+	if (ret != ESUCCESS)
+	{
+		free(names.offsets);
+		free(names.strings.data);
+		errno = (ret == EINCOMPLETE)? EFBIG: errno;
+		return NULL;
+	}
+	qsort_r(names.offsets, names.count, sizeof(*names.offsets), _dirlisting_compare, names.strings.data);
 
-		if (S_ISREG(filestat.st_mode) || S_ISLNK(filestat.st_mode))
+	_dirlisting_buffer_t buffer = {0};
+	ret = _dirlisting_reserve(&buffer, DIRLISTING_HEADER_LENGTH + urilen + names.count * DIRLISTING_LINE_LENGTH);
+	if (ret == ESUCCESS)
+	{
+		buffer.length = snprintf(buffer.data, buffer.size, DIRLISTING_HEADER, uri);
+		for (size_t i = 0; i < names.count && ret == ESUCCESS; i++)
 		{
-			mimelen = utils_getmime2(ent->d_name, &mime);
+			ret = _dirlisting_line(fddir, names.strings.data + names.offsets[i], &buffer);
 		}
-		length += mimelen;
-		length += 4 + 2 + 4;
-		char *data = calloc(1, DIRLISTING_LINE_LENGTH + length + 1);
-		length = snprintf(data, DIRLISTING_LINE_LENGTH + length + 1, DIRLISTING_LINE, MAX_NAMELENGTH, ent->d_name, size, _sizeunit[unit], ((filestat.st_mode & S_IFMT) >> 12), mime);
-		document_dbg("dirlisting: %s", data);
-		httpmessage_addcontent(response, NULL, data, length);
-		document_dbg("dirlisting: next");
-		free(data);
-		ret = ECONTINUE;
 	}
-	free(ent);
-	return ret;
+	if (ret == ESUCCESS)
+		ret = _dirlisting_reserve(&buffer, sizeof(DIRLISTING_FOOTER) + 20);
+	free(names.offsets);
+	free(names.strings.data);
+	if (ret != ESUCCESS)
+	{
+		free(buffer.data);
+		return NULL;
+	}
+	buffer.length += snprintf(buffer.data + buffer.length, buffer.size - buffer.length, DIRLISTING_FOOTER, "", "OK");
+	return _dirlisting_new(&buffer, uri, urilen);
 }
 
-static int _dirlisting_connectorcontent(document_connector_t *private, http_message_t *request, http_message_t *response)
+typedef struct _dirlisting_page_s _dirlisting_page_t;
+struct _dirlisting_page_s
+{
+	int fddir;
+	_dirlisting_buffer_t *buffer;
+	long skip;
+	long count;
+	int more;
+};
+
+static int _dirlisting_addline(void *arg, const char *name)
+{
+	_dirlisting_page_t *page = (_dirlisting_page_t *)arg;
+	if (page->skip > 0)
+	{
+		page->skip--;
+		return ECONTINUE;
+	}
+	if (page->count == 0)
+	{
+		page->more = 1;
+		return ESUCCESS;
+	}
+	page->count--;
+	if (_dirlisting_line(page->fddir, name, page->buffer) != ESUCCESS)
+		return EREJECT;
+	return ECONTINUE;
+}
+
+/**
+ * A page is a part of the listing in the order of the directory,
+ * the "next" field gives the "start" parameter of the next page.
+ */
+static _dirlisting_listing_t *_dirlisting_page(int fddir, const char *uri, size_t urilen, long start, long count)
 {
-	int ret = EREJECT;
-	struct dirent *ent;
+	_dirlisting_buffer_t buffer = {0};
+	if (_dirlisting_reserve(&buffer, DIRLISTING_HEADER_LENGTH + urilen + count * DIRLISTING_LINE_LENGTH) != ESUCCESS)
+		return NULL;
+	buffer.length = snprintf(buffer.data, buffer.size, DIRLISTING_HEADER, uri);
+	_dirlisting_page_t page = {.fddir = fddir, .buffer = &buffer, .skip = start, .count = count};
+	if (_dirlisting_read(fddir, _dirlisting_addline, &page) != ESUCCESS ||
+		_dirlisting_reserve(&buffer, sizeof(DIRLISTING_FOOTER) + 40) != ESUCCESS)
+	{
+		free(buffer.data);
+		return NULL;
+	}
+	char next[32] = "";
+	if (page.more)
+		snprintf(next, sizeof(next), "\"next\":%ld,", start + count);
+	buffer.length += snprintf(buffer.data + buffer.length, buffer.size - buffer.length, DIRLISTING_FOOTER, next, "OK");
+	return _dirlisting_new(&buffer, uri, urilen);
+}
 
-	errno = 0;
-	while (ret == EREJECT)
+static _dirlisting_listing_t *_dirlisting_cached(const struct stat *dirstat, const char *uri, size_t urilen)
+{
+	_dirlisting_listing_t *listing = NULL;
+	time_t now = time(NULL);
+	_dirlisting_lock();
+	for (int i = 0; i < DIRLISTING_CACHEMAX; i++)
 	{
-		document_dbg("dirlisting: entry %d", private->nbents);
-		/**
-		 * private->ents != NULL checked inside _dirlisting_connector
-		 */
-		if (private->nbents > 0)
+		_dirlisting_listing_t *it = g_listings[i];
+		if (it == NULL || it->ino != dirstat->st_ino || it->dev != dirstat->st_dev ||
+			strncmp(it->name, uri, urilen) || it->name[urilen] != '\0')
+			continue;
+		if (it->mtime.tv_sec == dirstat->st_mtim.tv_sec && it->mtime.tv_nsec == dirstat->st_mtim.tv_nsec &&
+			it->expire > now)
 		{
-			ent = private->ents[private->nbents - 1];
-			private->nbents--;
+			__atomic_add_fetch(&it->refs, 1, __ATOMIC_ACQ_REL);
+			listing = it;
 		}
 		else
-			ent = NULL;
-		if (ent)
 		{
-			ret = _dirlisting_getentity(private, ent, response);
+			/// the directory changed, the requests still sending it keep it
+			g_listings[i] = NULL;
+			_dirlisting_release(it);
 		}
-		else
+		break;
+	}
+	_dirlisting_unlock();
+	return listing;
+}
+
+static void _dirlisting_store(_dirlisting_listing_t *listing, const struct stat *dirstat)
+{
+	listing->dev = dirstat->st_dev;
+	listing->ino = dirstat->st_ino;
+	listing->mtime = dirstat->st_mtim;
+	listing->expire = time(NULL) + DIRLISTING_CACHETIME;
+	int slot = 0;
+	_dirlisting_lock();
+	for (int i = 0; i < DIRLISTING_CACHEMAX; i++)
+	{
+		if (g_listings[i] == NULL)
 		{
-			int length = sizeof(DIRLISTING_FOOTER);
-			char *data = calloc(1, length);
-			length = snprintf(data, length, DIRLISTING_FOOTER, "OK");
-			httpmessage_addcontent(response, NULL, data, length);
-			free(data);
-			close(private->fdfile);
-			private->fdfile = 0;
-			ret = ECONTINUE;
+			slot = i;
+			break;
 		}
+		if (g_listings[i]->expire < g_listings[slot]->expire)
+			slot = i;
 	}
-	return ret;
+	if (g_listings[slot] != NULL)
+		_dirlisting_release(g_listings[slot]);
+	__atomic_add_fetch(&listing->refs, 1, __ATOMIC_ACQ_REL);
+	g_listings[slot] = listing;
+	_dirlisting_unlock();
 }
 
-static int _dirlisting_connectorender(document_connector_t *private, http_message_t *request, http_message_t *response)
+static long _dirlisting_parameter(http_message_t *request, const char *name, long value)
 {
-	/**
-	 * the content length is unknown before the sending.
-	 * We must close the socket to advertise the client.
-	 */
-	document_dbg("dirlisting: socket shutdown");
-	httpclient_shutdown(httpmessage_client(request));
-	free(private->ents);
-	private->ents = NULL;
-	document_close(private, request);
-	return ESUCCESS;
+	const char *string = NULL;
+	if (httpmessage_parameter(request, name, &string) > 0 && string != NULL)
+		value = strtol(string, NULL, 10);
+	return value;
 }
 
-/**
- * this function is used by mod_document and has NOT to be static
- */
-int dirlisting_connector(void *arg, http_message_t *request, http_message_t *response)
+static int _dirlisting_connectorheader(document_connector_t *private, http_message_t *request, http_message_t *response)
 {
-	int ret = EREJECT;
-	document_connector_t *private = httpmessage_private(request, NULL);
+	const char *uri = NULL;
+	size_t urilen = httpmessage_REQUEST2(request, "uri", &uri);
+	long start = _dirlisting_parameter(request, "start", -1);
+	long count = _dirlisting_parameter(request, "count", DIRLISTING_PAGEMAX);
+	if (count <= 0 || count > DIRLISTING_PAGEMAX)
+		count = DIRLISTING_PAGEMAX;
 
-	if (private->ents == NULL)
+	dbg("dirlisting: open /%s", private->url);
+	_dirlisting_listing_t *listing = NULL;
+	struct stat dirstat;
+	if (fstat(private->fdfile, &dirstat) == 0 && start < 0)
 	{
-		ret = _dirlisting_connectorheader(private, request, response);
+		listing = _dirlisting_cached(&dirstat, uri, urilen);
+		if (listing == NULL)
+		{
+			listing = _dirlisting_render(private->fdfile, uri, urilen);
+			if (listing != NULL)
+				_dirlisting_store(listing, &dirstat);
+			else if (errno == EFBIG)
+				start = 0;
+		}
 	}
-	else if (private->fdfile > 0)
+	if (listing == NULL && start >= 0)
+		listing = _dirlisting_page(private->fdfile, uri, urilen, start, count);
+	if (listing == NULL)
 	{
-		ret = _dirlisting_connectorcontent(private, request, response);
+		warn("dirlisting: directory not open %s %s", private->url, strerror(errno));
+		document_close(private, request);
+		httpmessage_result(response, RESULT_400);
+		return ESUCCESS;
 	}
-	else
+
+	httpmessage_addheader(response, "ETag", listing->etag, -1);
+#if defined(RESULT_304)
+	const char *match = httpmessage_REQUEST(request, "If-None-Match");
+	if (match != NULL && strstr(match, listing->etag) != NULL)
 	{
-		ret = _dirlisting_connectorender(private, request, response);
+		_dirlisting_release(listing);
+		document_close(private, request);
+		httpmessage_result(response, RESULT_304);
+		return ESUCCESS;
 	}
-	return ret;
+#endif
+	/// the length is known, the connection stays alive
+	httpmessage_addcontent(response, utils_getmime(".json"), NULL, listing->length);
+	if (!strcmp(httpmessage_REQUEST(request, "method"), "HEAD"))
+	{
+		_dirlisting_release(listing);
+		document_close(private, request);
+		return ESUCCESS;
+	}
+	private->data = listing;
+	private->size = listing->length;
+	private->offset = 0;
+	return ECONTINUE;
+}
+
+static int _dirlisting_connectorcontent(document_connector_t *private, http_message_t *request, http_message_t *response)
+{
+	_dirlisting_listing_t *listing = (_dirlisting_listing_t *)private->data;
+	if (private->offset >= private->size)
+	{
+		_dirlisting_release(listing);
+		private->data = NULL;
+		document_close(private, request);
+		return ESUCCESS;
+	}
+	size_t length = private->size - private->offset;
+	if (length > CONTENTCHUNK)
+		length = CONTENTCHUNK;
+	httpmessage_addcontent(response, "none", listing->data + private->offset, length);
+	private->offset += length;
+	return ECONTINUE;
+}
+
+/**
+ * this function is used by mod_document and has NOT to be static
+ */
+int dirlisting_connector(void *arg, http_message_t *request, http_message_t *response)
+{
+	document_connector_t *private = httpmessage_private(request, NULL);
+
+	if (private->data == NULL)
+		return _dirlisting_connectorheader(private, request, response);
+	return _dirlisting_connectorcontent(private, request, response);
 }
 
 #ifdef DIRLISTING_MOD
@@ -265,7 +542,7 @@ static void *_mod_dirlisting_getctx(void *arg, http_client_t *ctl, struct sockad
 
 	ctx->mod = mod;
 	ctx->ctl = ctl;
-	httpclient_addconnector(ctl, dirlisting_connector, ctx, CONNECTOR_DOCUMENT, str_dirlisting);
+	ouistiti_addclientconnector(ctl, dirlisting_connector, ctx, CONNECTOR_DOCUMENT, str_dirlisting);
 
 	return ctx;
 }
@@ -26,6 +26,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  *****************************************************************************/
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -46,6 +47,8 @@
 #include "mod_document.h"
 #include "mod_auth.h"
 
+#include "log.h"
+
 #ifndef AT_NO_AUTOMOUNT
 #define AT_NO_AUTOMOUNT         0x800   /* Suppress terminal automount traversal */
 #endif
@@ -62,6 +65,10 @@ static int mod_send_read(document_connector_t *private, http_message_t *response
 #ifdef SENDFILE
 extern int mod_send_sendfile(document_connector_t *private, http_message_t *response);
 #endif
+#ifdef IOURING
+extern int mod_send_uring(document_connector_t *private, http_message_t *response);
+extern int mod_send_uringready(void);
+#endif
 static int _mime_connector(void *arg, http_message_t *request, http_message_t *response);
 
 static const char str_document[] = "document";
@@ -84,7 +91,7 @@ void document_close(document_connector_t *private, http_message_t *request)
 	private->fdroot = 0;
 	private->func = NULL;
 	httpmessage_private(request, NULL);
-	free(private);
+	ouistiti_requestfree(request, private);
 }
 
 #ifdef DOCUMENTHOME
@@ -223,6 +230,55 @@ static int _document_getconnnectorheader(_mod_document_mod_t *mod,
 	return fdfile;
 }
 
+/**
+ * the validators of the file and the cache policy of the uri.
+ * The function returns ESUCCESS when the client already has the file.
+ */
+static int _document_validators(_mod_document_mod_t *mod, http_message_t *request, http_message_t *response, const struct stat *filestat)
+{
+	const char *uri = httpmessage_REQUEST(request, "uri");
+	size_t controllen = 0;
+	const char *control = ouistiti_cachecontrol(mod->server, uri, &controllen);
+	if (control != NULL)
+		httpmessage_addheader(response, str_cachecontrol, control, controllen);
+
+	char etag[40];
+	int etaglen = snprintf(etag, sizeof(etag), "\"%lx-%llx\"",
+			(long)filestat->st_mtime, (unsigned long long)filestat->st_size);
+	httpmessage_addheader(response, "ETag", etag, etaglen);
+	char date[40];
+	struct tm tm;
+	gmtime_r(&filestat->st_mtime, &tm);
+	size_t datelen = strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	httpmessage_addheader(response, "Last-Modified", date, datelen);
+
+#if defined(RESULT_304)
+	/// If-None-Match has the precedence on If-Modified-Since (RFC 7232 6)
+	const char *match = httpmessage_REQUEST(request, "If-None-Match");
+	if (match != NULL && match[0] != '\0')
+	{
+		if (strstr(match, etag) != NULL || !strcmp(match, "*"))
+		{
+			httpmessage_result(response, RESULT_304);
+			return ESUCCESS;
+		}
+		return EREJECT;
+	}
+	const char *since = httpmessage_REQUEST(request, "If-Modified-Since");
+	if (since != NULL && since[0] != '\0')
+	{
+		memset(&tm, 0, sizeof(tm));
+		if (strptime(since, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL &&
+			filestat->st_mtime <= timegm(&tm))
+		{
+			httpmessage_result(response, RESULT_304);
+			return ESUCCESS;
+		}
+	}
+#endif
+	return EREJECT;
+}
+
 static int _document_connector(void *arg, http_message_t *request, http_message_t *response)
 {
 	document_connector_t *private = httpmessage_private(request, NULL);
@@ -357,6 +413,14 @@ static int _document_connector(void *arg, http_message_t *request, http_message_
 	}
 	document_dbg("document: open %s", uri);
 
+	if (!(type & DOCUMENT_REST) && S_ISREG(filestat.st_mode) &&
+		_document_validators(mod, request, response, &filestat) == ESUCCESS)
+	{
+		close(fdroot);
+		close(fdfile);
+		return ESUCCESS;
+	}
+
 #ifdef RANGEREQUEST
 	if (config->options & DOCUMENT_RANGE)
 	{
@@ -371,7 +435,13 @@ static int _document_connector(void *arg, http_message_t *request, http_message_
 		type |= DOCUMENT_DIRLISTING;
 	}
 
-	private = calloc(1, sizeof(*private));
+	private = ouistiti_requestalloc(request, sizeof(*private));
+	if (private == NULL)
+	{
+		close(fdfile);
+		close(fdroot);
+		return EREJECT;
+	}
 	httpmessage_private(request, private);
 
 	mod->transfer = mod_send_read;
@@ -380,6 +450,13 @@ static int _document_connector(void *arg, http_message_t *request, http_message_
 	{
 		mod->transfer = mod_send_sendfile;
 	}
+#endif
+#ifdef IOURING
+	/// without io_uring on the system, sendfile or read remains
+	if ((config->options & DOCUMENT_URING) && mod_send_uringready() == ESUCCESS)
+	{
+		mod->transfer = mod_send_uring;
+	}
 #endif
 	private->mod = mod;
 	private->ctl = httpmessage_client(request);
@@ -502,6 +579,7 @@ static int document_configpart(config_setting_t *config, server_t *server, int i
 	config_setting_lookup_string(config, "docroot", (const char **)&static_file->docroot);
 	config_setting_lookup_string(config, "dochome", (const char **)&static_file->dochome);
 	htaccess_config(config, &static_file->htaccess);
+	cachepolicy_config(config, &static_file->cachepolicy);
 	config_setting_lookup_string(config, "defaultpage", (const char **)&static_file->defaultpage);
 
 	char *options = NULL;
@@ -519,6 +597,15 @@ static int document_configpart(config_setting_t *config, server_t *server, int i
 			warn("sendfile configuration is not allowed with tls");
 	}
 #endif
+#ifdef IOURING
+	if (utils_searchexp("uring", options, NULL) == ESUCCESS)
+	{
+		if (!ouistiti_issecure(server))
+			static_file->options |= DOCUMENT_URING;
+		else
+			warn("uring configuration is not allowed with tls");
+	}
+#endif
 #ifdef RANGEREQUEST
 	if (utils_searchexp("range", options, NULL) == ESUCCESS)
 	{
@@ -530,6 +617,14 @@ static int document_configpart(config_setting_t *config, server_t *server, int i
 	{
 		static_file->options |= DOCUMENT_REST;
 	}
+	if (utils_searchexp("fsync", options, NULL) == ESUCCESS)
+	{
+		static_file->options |= DOCUMENT_FSYNC;
+	}
+	if (utils_searchexp("fdatasync", options, NULL) == ESUCCESS)
+	{
+		static_file->options |= DOCUMENT_FDATASYNC;
+	}
 #endif
 #ifdef DOCUMENTHOME
 	if (utils_searchexp("home", options, NULL) == ESUCCESS)
@@ -611,6 +706,7 @@ static void *mod_document_create(http_server_t *server, mod_document_t *config)
 	_mod_document_mod_t *mod = calloc(1, sizeof(*mod));
 
 	mod->config = config;
+	mod->server = server;
 	mod->fdroot = open(config->docroot, O_DIRECTORY);
 	if (mod->fdroot == -1)
 	{
@@ -642,13 +738,15 @@ static void *mod_document_create(http_server_t *server, mod_document_t *config)
 		}
 	}
 #endif
-	httpserver_addconnector(server, _document_connector, mod, CONNECTOR_DOCUMENT, str_document);
+	for (const cachepolicy_t *policy = config->cachepolicy; policy != NULL; policy = policy->next)
+		ouistiti_cachepolicy(server, policy->match, policy->mime, policy->control, -1);
+	ouistiti_addconnector(server, _document_connector, mod, CONNECTOR_DOCUMENT, str_document);
 #ifdef RANGEREQUEST
 	if (config->options & DOCUMENT_RANGE)
-		httpserver_addconnector(server, range_connector, mod, CONNECTOR_DOCUMENT, str_document);
+		ouistiti_addconnector(server, range_connector, mod, CONNECTOR_DOCUMENT, str_document);
 #endif
-	httpserver_addconnector(server, _mime_connector, mod, CONNECTOR_DOCUMENT, str_document);
-	httpserver_addconnector(server, _transfer_connector, mod, CONNECTOR_DOCUMENT, str_document);
+	ouistiti_addconnector(server, _mime_connector, mod, CONNECTOR_DOCUMENT, str_document);
+	ouistiti_addconnector(server, _transfer_connector, mod, CONNECTOR_DOCUMENT, str_document);
 
 #ifdef DOCUMENTREST
 	if (config->options & DOCUMENT_REST)
@@ -663,6 +761,7 @@ static void *mod_document_create(http_server_t *server, mod_document_t *config)
 static void mod_document_destroy(void *data)
 {
 	_mod_document_mod_t *mod = (_mod_document_mod_t *)data;
+	cachepolicy_free(mod->config->cachepolicy);
 	free(mod->config);
 	free(data);
 }
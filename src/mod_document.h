@@ -37,6 +37,9 @@
 #define DOCUMENT_REST 0x08
 #define DOCUMENT_HOME 0x10
 #define DOCUMENT_TLS 0x20
+#define DOCUMENT_FDATASYNC 0x40
+#define DOCUMENT_FSYNC 0x80
+#define DOCUMENT_URING 0x100
 
 #include "ouistiti.h"
 
@@ -52,11 +55,22 @@ struct htaccess_s
 	string_t denylast;
 };
 
+typedef struct cachepolicy_s cachepolicy_t;
+struct cachepolicy_s
+{
+	const char *match;
+	const char *mime;
+	/// the value of Cache-Control built from the configuration
+	char *control;
+	cachepolicy_t *next;
+};
+
 typedef struct mod_document_s
 {
 	const char *docroot;
 	const char *dochome;
 	htaccess_t htaccess;
+	cachepolicy_t *cachepolicy;
 	const char *defaultpage;
 	int options;
 } mod_document_t;
@@ -77,6 +91,7 @@ struct _mod_document_mod_s
 	mod_document_t *config;
 	void *vhost;
 	mod_transfer_t transfer;
+	http_server_t *server;
 	int fdroot;
 	int fdhome;
 };
@@ -90,9 +105,11 @@ struct _document_connector_s
 	const char *mime;
 	int fdfile;
 	int fdroot;
+	/// the socket of the client for the transfer with io_uring
+	int fdsocket;
 	int type;
-	struct dirent **ents;
-	int nbents;
+	/// the data of the connector: listing of dirlisting, buffer of rest
+	void *data;
 	http_connector_t func;
 	unsigned long long size;
 	unsigned long long offset;
@@ -133,7 +150,9 @@ void document_close(document_connector_t *private, http_message_t *request);
 #ifdef FILE_CONFIG
 #include <libconfig.h>
 int htaccess_config(config_setting_t *setting, htaccess_t *htaccess);
+int cachepolicy_config(config_setting_t *setting, cachepolicy_t **policies);
 #endif
+void cachepolicy_free(cachepolicy_t *policies);
 int htaccess_check(const htaccess_t *htaccess, const char *uri, const char **path_info);
 
 #ifdef __cplusplus
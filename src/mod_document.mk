@@ -2,6 +2,7 @@ modules-$(MODULES)+=mod_document
 slib-$(STATIC)+=mod_document
 mod_document_SOURCES+=mod_document.c
 mod_document_SOURCES+=document_htaccess.c
+mod_document_SOURCES+=document_cachepolicy.c
 mod_document_CFLAGS+=-DSTATIC_FILE
 mod_document_CFLAGS+=$(LIBHTTPSERVER_CFLAGS)
 mod_document_LDFLAGS+=$(LIBHTTPSERVER_LDFLAGS)
@@ -11,6 +12,9 @@ mod_document_LIBRARY+=libconfig
 
 mod_document_SOURCES-$(SENDFILE)+=mod_sendfile.c
 
+mod_document_SOURCES-$(IOURING)+=document_uring.c
+mod_document_LIBS-$(IOURING)+=pthread
+
 mod_document_SOURCES-$(DIRLISTING)+=mod_dirlisting.c
 
 mod_document_SOURCES-$(RANGEREQUEST)+=mod_range.c
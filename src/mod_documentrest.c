@@ -25,6 +25,7 @@
  * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  *****************************************************************************/
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -37,12 +38,14 @@
 #include <signal.h>
 #include <time.h>
 #include <libgen.h>
+#include <limits.h>
 
 #include "ouistiti/httpserver.h"
 #include "ouistiti/utils.h"
 #include "ouistiti/log.h"
 #include "mod_document.h"
 #include "mod_auth.h"
+#include "log.h"
 
 #ifndef AT_NO_AUTOMOUNT
 #define AT_NO_AUTOMOUNT         0x800   /* Suppress terminal automount traversal */
@@ -79,60 +82,193 @@ static int restheader_connector(http_message_t *request, http_message_t *respons
 	return ESUCCESS;
 }
 
+/**
+ * the upload is written into an anonymous file (O_TMPFILE) of the
+ * destination directory, and linked to its name when the content is
+ * complete. A broken upload leaves nothing on the disk.
+ * The content is received by the client of libhttpserver, it is
+ * gathered into large blocks before to be written.
+ */
+#define UPLOAD_BUFFERSIZE (256 * 1024)
+
+typedef struct _document_upload_s _document_upload_t;
+struct _document_upload_s
+{
+	size_t length;
+	char data[UPLOAD_BUFFERSIZE];
+};
+
+static int _document_uploaddir(const char *url, char *path, size_t size)
+{
+	const char *base = strrchr(url, '/');
+	if (base == NULL)
+		return snprintf(path, size, ".");
+	return snprintf(path, size, "%.*s", (int)(base - url), url);
+}
+
+/// the temporary name is used when the filesystem doesn't support O_TMPFILE
+static int _document_uploadname(const char *url, char *path, size_t size)
+{
+	const char *base = strrchr(url, '/');
+	int dirlen = (base != NULL)? base - url + 1: 0;
+	base = (base != NULL)? base + 1: url;
+	return snprintf(path, size, "%.*s.%s.%d.part", dirlen, url, base, getpid());
+}
+
+static int _document_uploadopen(int fdroot, const char *url)
+{
+	char path[PATH_MAX];
+	int fdfile = -1;
+#ifdef O_TMPFILE
+	_document_uploaddir(url, path, sizeof(path));
+	fdfile = openat(fdroot, path, O_TMPFILE | O_WRONLY, 0640);
+	if (fdfile != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+		return fdfile;
+#endif
+	_document_uploadname(url, path, sizeof(path));
+	fdfile = openat(fdroot, path, O_WRONLY | O_CREAT | O_EXCL, 0640);
+	return fdfile;
+}
+
+static int _document_uploadlink(int fdfile, int fdroot, const char *url)
+{
+	char path[PATH_MAX];
+	struct stat filestat;
+	if (fstat(fdfile, &filestat) == -1)
+		return -1;
+	if (filestat.st_nlink > 0)
+	{
+		_document_uploadname(url, path, sizeof(path));
+		if (linkat(fdroot, path, fdroot, url, 0) == -1)
+			return -1;
+		return unlinkat(fdroot, path, 0);
+	}
+	snprintf(path, PATH_MAX, "/proc/self/fd/%d", fdfile);
+	int ret = linkat(AT_FDCWD, path, fdroot, url, AT_SYMLINK_FOLLOW);
+	if (ret == -1 && errno == ENOENT)
+		ret = linkat(fdfile, "", fdroot, url, AT_EMPTY_PATH);
+	return ret;
+}
+
+static void _document_uploadabort(int fdfile, int fdroot, const char *url)
+{
+	char path[PATH_MAX];
+	struct stat filestat;
+	if (fstat(fdfile, &filestat) == 0 && filestat.st_nlink > 0)
+	{
+		_document_uploadname(url, path, sizeof(path));
+		unlinkat(fdroot, path, 0);
+	}
+}
+
+static int _document_uploadwrite(int fdfile, const char *data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t wret = write(fdfile, data, length);
+		if (wret < 0 && errno == EINTR)
+			continue;
+		if (wret < 0)
+			return errno;
+		length -= wret;
+		data += wret;
+	}
+	return 0;
+}
+
+static int _document_uploadcontent(document_connector_t *private, _document_upload_t *upload, const char *input, size_t inputlen)
+{
+	int error = 0;
+	if (upload->length + inputlen > UPLOAD_BUFFERSIZE)
+	{
+		error = _document_uploadwrite(private->fdfile, upload->data, upload->length);
+		upload->length = 0;
+	}
+	if (error == 0 && inputlen >= UPLOAD_BUFFERSIZE)
+		error = _document_uploadwrite(private->fdfile, input, inputlen);
+	else if (error == 0)
+	{
+		memcpy(upload->data + upload->length, input, inputlen);
+		upload->length += inputlen;
+	}
+	return error;
+}
+
+static int _document_uploadcomplete(document_connector_t *private, _document_upload_t *upload)
+{
+	int options = private->mod->config->options;
+	int error = _document_uploadwrite(private->fdfile, upload->data, upload->length);
+	upload->length = 0;
+	if (error == 0 && (options & DOCUMENT_FSYNC) && fsync(private->fdfile) == -1)
+		error = errno;
+	else if (error == 0 && (options & DOCUMENT_FDATASYNC) && fdatasync(private->fdfile) == -1)
+		error = errno;
+	if (error == 0 && _document_uploadlink(private->fdfile, private->fdroot, private->url) == -1)
+		error = errno;
+	if (error == 0 && (options & DOCUMENT_FSYNC))
+	{
+		/// the new entry of the directory is written too
+		char path[PATH_MAX];
+		_document_uploaddir(private->url, path, sizeof(path));
+		int fddir = openat(private->fdroot, path, O_DIRECTORY | O_RDONLY);
+		if (fddir != -1)
+		{
+			fsync(fddir);
+			close(fddir);
+		}
+	}
+	return error;
+}
+
 static int putfile_connector(void *arg, http_message_t *request, http_message_t *response)
 {
-	int ret =  EREJECT;
 	document_connector_t *private = httpmessage_private(request, NULL);
+	_document_upload_t *upload = private->data;
+	int error = 0;
+
+	if (upload == NULL)
+	{
+		upload = ouistiti_requestalloc(request, sizeof(*upload));
+		if (upload == NULL)
+			error = ENOMEM;
+		private->data = upload;
+	}
 
 	/**
 	 * we are into PRECONTENT, the data is no yet available
 	 * Then the first loop as to complete on the opening
 	 */
-
-	const char *input;
-	unsigned long long inputlen;
-	int error = 0;
-	/**
-	 * rest = 1 to close the connection on end of file or
-	 * on connection error
-	 */
+	const char *input = NULL;
 	size_t rest = 1;
-	inputlen = httpmessage_content(request, &input, &rest);
-	document_dbg("document: put %lld bytes into file", inputlen);
+	int inputlen = httpmessage_content(request, &input, &rest);
+	document_dbg("document: put %d bytes into file", inputlen);
 
 	/**
 	 * the function returns EINCOMPLETE to wait before to send
 	 * the response.
 	 */
-	ret = EINCOMPLETE;
-	errno = 0;
-	while (inputlen > 0)
+	if (inputlen == EINCOMPLETE && error == 0)
+		return EINCOMPLETE;
+	if (inputlen > 0 && error == 0)
 	{
-		int wret = write(private->fdfile, input, inputlen);
-		if (wret < 0)
-		{
-			err("document: access file %s error %s", private->url, strerror(errno));
-			if (errno != EAGAIN)
-			{
-				error = errno;
-				rest = -1;
-				break;
-			}
-		}
-		else if (wret > 0)
-		{
+		error = _document_uploadcontent(private, upload, input, inputlen);
+		if (error)
+			err("document: access file %s error %s", private->url, strerror(error));
 #ifdef DEBUG
-			private->datasize += wret;
+		private->datasize += inputlen;
 #endif
-			inputlen -= wret;
-			input += wret;
-		}
+		if (error == 0 && rest > 0)
+			return EINCOMPLETE;
 	}
-	if (inputlen == EREJECT)
+	else if (inputlen < 0 && error == 0)
 	{
-		rest = 0;
+		/// the connection is broken before the end of the content
+		error = ECONNRESET;
 	}
-	if (rest < 1)
+
+	if (error == 0)
+		error = _document_uploadcomplete(private, upload);
+	if (error == 0)
 	{
 #ifdef DEBUG
 		struct timespec stop;
@@ -144,32 +280,35 @@ static int putfile_connector(void *arg, http_message_t *request, http_message_t
 		dbg("document: (%llu bytes) time %ld:%03ld", private->datasize, value.tv_sec, value.tv_nsec/1000000);
 #endif
 		warn("document: %s uploaded", private->url);
-		if (private->fdfile)
-		{
-			ret = close(private->fdfile);
-#ifdef PUTTMPFILE
-			char path[PATH_MAX];
-			snprintf(path, PATH_MAX, "/proc/self/fd/%d", private->fdfile);
-			ret = linkat(mode->fdroot, path, AT_FDCWD, private->url, AT_SYMLINK_FOLLOW);
+	}
+	else
+	{
+		err("document: %s upload error %s", private->url, strerror(error));
+		_document_uploadabort(private->fdfile, private->fdroot, private->url);
+	}
+	ouistiti_requestfree(request, upload);
+	private->data = NULL;
+	document_close(private, request);
+	if (error == EEXIST)
+#ifdef RESULT_409
+		httpmessage_result(response, RESULT_409);
+#else
+		httpmessage_result(response, RESULT_400);
 #endif
-		}
-		private->fdfile = 0;
-		document_close(private, request);
-		if (rest < 0)
+	else if (error)
 #ifdef RESULT_500
-			httpmessage_result(response, RESULT_500);
+		httpmessage_result(response, RESULT_500);
 #else
-			httpmessage_result(response, RESULT_404);
+		httpmessage_result(response, RESULT_404);
 #endif
-		else
+	else
 #ifdef RESULT_201
-			httpmessage_result(response, RESULT_201);
+		httpmessage_result(response, RESULT_201);
 #else
-			httpmessage_result(response, RESULT_200);
+		httpmessage_result(response, RESULT_200);
 #endif
-		restheader_connector(request, response, error);
-	}
-	return ret;
+	restheader_connector(request, response, error);
+	return ESUCCESS;
 }
 
 int _document_getconnnectorput(_mod_document_mod_t *mod,
@@ -186,18 +325,34 @@ int _document_getconnnectorput(_mod_document_mod_t *mod,
 		fdfile = mkdirat(fdroot, url, 0777);
 		restheader_connector(request, response, errno);
 		fdfile = 0; /// The request is complete by this connector
+		return fdfile;
 	}
-	else
+	/// the file is linked at the end, but the conflict is reported before the upload
+	if (faccessat(fdroot, url, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
 	{
-		fdfile = openat(fdroot, url, O_WRONLY | O_CREAT | O_EXCL, 0640);
-		if (fdfile < 0)
-		{
-			restheader_connector(request, response, errno);
-			fdfile = 0; /// The request is complete by this connector
-		}
-		else
-			*connector = putfile_connector;
+		errno = EEXIST;
+		restheader_connector(request, response, errno);
+		return 0;
+	}
+	errno = 0;
+	fdfile = _document_uploadopen(fdroot, url);
+	if (fdfile < 0)
+	{
+		restheader_connector(request, response, errno);
+		return 0; /// The request is complete by this connector
+	}
+	const char *contentlength = httpmessage_REQUEST(request, "Content-Length");
+	off_t length = (contentlength != NULL)? strtoll(contentlength, NULL, 10): 0;
+	if (length > 0 && fallocate(fdfile, FALLOC_FL_KEEP_SIZE, 0, length) == -1 && errno == ENOSPC)
+	{
+		err("document: no space for %s (%lld bytes)", url, (long long)length);
+		_document_uploadabort(fdfile, fdroot, url);
+		close(fdfile);
+		errno = ENOSPC;
+		restheader_connector(request, response, errno);
+		return 0;
 	}
+	*connector = putfile_connector;
 	return fdfile;
 }
 
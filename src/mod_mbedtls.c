@@ -52,6 +52,7 @@
 #include <mbedtls/ssl.h>
 #include <mbedtls/version.h>
 #include <mbedtls/error.h>
+#include <mbedtls/gcm.h>
 #if MBEDTLS_VERSION_MAJOR==2 && MBEDTLS_VERSION_MINOR>=4
 #include <mbedtls/net_sockets.h>
 #elif MBEDTLS_VERSION_MAJOR==2 && MBEDTLS_VERSION_MINOR==2
@@ -67,6 +68,7 @@
 
 #include "ouistiti/log.h"
 #include "ouistiti/httpserver.h"
+#include "log.h"
 #ifdef httpserver_config
 #include "ouistiti/config.h"
 #endif
@@ -103,6 +105,12 @@ struct _mod_mbedtls_config_s
 	mbedtls_x509_crt cachain;
 	mbedtls_pk_context pkey;
 	mbedtls_dhm_context dhm;
+#if defined(MBEDTLS_SSL_ALPN)
+	char *alpnbuffer;
+	const char **alpn;
+#endif
+	tls_sessioncache_t *sessioncache;
+	tls_tickets_t *tickets;
 };
 
 static const httpclient_ops_t *_tlsclient_ops;
@@ -148,6 +156,130 @@ static int _mod_mbedtls_crtfile(_mod_mbedtls_config_t *config, mod_tls_t *modcon
 	return ret;
 }
 
+#if MBEDTLS_VERSION_NUMBER >= 0x02130000
+static int _tls_getsession(void *arg, mbedtls_ssl_session *session)
+{
+	_mod_mbedtls_config_t *mod = (_mod_mbedtls_config_t *)arg;
+	unsigned char data[TLS_SESSIONSIZE];
+	int length = tls_sessioncache_load(mod->sessioncache, session->id, session->id_len, data, sizeof(data));
+	if (length <= 0)
+		return 1;
+	mbedtls_ssl_session cached;
+	mbedtls_ssl_session_init(&cached);
+	if (mbedtls_ssl_session_load(&cached, data, length) != 0)
+	{
+		mbedtls_ssl_session_free(&cached);
+		return 1;
+	}
+	/// the buffers of the cached session are moved into the negotiated one
+	mbedtls_ssl_session_free(session);
+	memcpy(session, &cached, sizeof(*session));
+	tls_dbg("tls: session resumed");
+	return 0;
+}
+
+static int _tls_setsession(void *arg, const mbedtls_ssl_session *session)
+{
+	_mod_mbedtls_config_t *mod = (_mod_mbedtls_config_t *)arg;
+	unsigned char data[TLS_SESSIONSIZE];
+	size_t length = 0;
+	if (mbedtls_ssl_session_save(session, data, sizeof(data), &length) != 0)
+		return 1;
+	if (tls_sessioncache_store(mod->sessioncache, session->id, session->id_len, data, length) != ESUCCESS)
+		return 1;
+	return 0;
+}
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_GCM_C)
+#define TLS_TICKETIVLEN 12
+#define TLS_TICKETTAGLEN 16
+/// the name of the key, the iv and the length are authenticated with the session
+#define TLS_TICKETHEADER (TLS_TICKETNAMELEN + TLS_TICKETIVLEN + 2)
+
+static int _tls_ticketwrite(void *arg, const mbedtls_ssl_session *session,
+			unsigned char *start, const unsigned char *end, size_t *tlen, uint32_t *lifetime)
+{
+	_mod_mbedtls_config_t *mod = (_mod_mbedtls_config_t *)arg;
+	if (end - start < TLS_TICKETHEADER + TLS_TICKETTAGLEN)
+		return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+	tls_ticketkey_t ticketkey;
+	const tls_ticketkey_t *key = &ticketkey;
+	tls_tickets_current(mod->tickets, &ticketkey);
+	unsigned char *iv = start + TLS_TICKETNAMELEN;
+	unsigned char *state = start + TLS_TICKETHEADER;
+	size_t statelen = 0;
+	memcpy(start, key->name, TLS_TICKETNAMELEN);
+	int ret = mbedtls_ctr_drbg_random(&mod->ctr_drbg, iv, TLS_TICKETIVLEN);
+	if (ret == 0)
+		ret = mbedtls_ssl_session_save(session, state, end - state - TLS_TICKETTAGLEN, &statelen);
+	if (ret != 0)
+		return ret;
+	start[TLS_TICKETHEADER - 2] = statelen >> 8;
+	start[TLS_TICKETHEADER - 1] = statelen;
+
+	mbedtls_gcm_context gcm;
+	mbedtls_gcm_init(&gcm);
+	ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key->aes, TLS_TICKETKEYLEN * 8);
+	if (ret == 0)
+		ret = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, statelen, iv, TLS_TICKETIVLEN,
+				start, TLS_TICKETHEADER, state, state, TLS_TICKETTAGLEN, state + statelen);
+	mbedtls_gcm_free(&gcm);
+	if (ret != 0)
+		return ret;
+	*tlen = TLS_TICKETHEADER + statelen + TLS_TICKETTAGLEN;
+	*lifetime = mod->config->ticketrotation;
+	return 0;
+}
+
+static int _tls_ticketparse(void *arg, mbedtls_ssl_session *session, unsigned char *buf, size_t len)
+{
+	_mod_mbedtls_config_t *mod = (_mod_mbedtls_config_t *)arg;
+	if (len < TLS_TICKETHEADER + TLS_TICKETTAGLEN)
+		return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+	size_t statelen = (buf[TLS_TICKETHEADER - 2] << 8) | buf[TLS_TICKETHEADER - 1];
+	if (len != TLS_TICKETHEADER + statelen + TLS_TICKETTAGLEN)
+		return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+	int previous = 0;
+	tls_ticketkey_t ticketkey;
+	const tls_ticketkey_t *key = &ticketkey;
+	if (tls_tickets_find(mod->tickets, buf, &ticketkey, &previous) != ESUCCESS)
+		return MBEDTLS_ERR_SSL_SESSION_TICKET_EXPIRED;
+	unsigned char *state = buf + TLS_TICKETHEADER;
+
+	mbedtls_gcm_context gcm;
+	mbedtls_gcm_init(&gcm);
+	int ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key->aes, TLS_TICKETKEYLEN * 8);
+	if (ret == 0)
+		ret = mbedtls_gcm_auth_decrypt(&gcm, statelen, buf + TLS_TICKETNAMELEN, TLS_TICKETIVLEN,
+				buf, TLS_TICKETHEADER, state + statelen, TLS_TICKETTAGLEN, state, state);
+	mbedtls_gcm_free(&gcm);
+	if (ret != 0)
+		return MBEDTLS_ERR_SSL_INVALID_MAC;
+	return mbedtls_ssl_session_load(session, state, statelen);
+}
+#endif
+
+static void _mod_mbedtls_resumption(_mod_mbedtls_config_t *mod)
+{
+	mod_tls_t *config = mod->config;
+	if (config->sessioncache > 0)
+		mod->sessioncache = tls_sessioncache_create(config->sessioncache, config->sessiontimeout);
+	if (mod->sessioncache != NULL)
+		mbedtls_ssl_conf_session_cache(&mod->conf, mod, _tls_getsession, _tls_setsession);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_GCM_C)
+	if (config->tickets)
+		mod->tickets = tls_tickets_create(config->ticketkey, config->ticketrotation);
+	if (mod->tickets != NULL)
+		mbedtls_ssl_conf_session_tickets_cb(&mod->conf, _tls_ticketwrite, _tls_ticketparse, mod);
+#endif
+}
+#else
+static void _mod_mbedtls_resumption(_mod_mbedtls_config_t *mod)
+{
+	warn("tls: session resumption requires mbedtls 2.19");
+}
+#endif
+
 static int _mod_mbedtls_setup(_mod_mbedtls_config_t *mod)
 {
 	mod_tls_t *config = mod->config;
@@ -216,6 +348,31 @@ static int _mod_mbedtls_setup(_mod_mbedtls_config_t *mod)
 			return EREJECT;
 		}
 	}
+	_mod_mbedtls_resumption(mod);
+#if defined(MBEDTLS_SSL_ALPN)
+	if (config->alpn)
+	{
+		/// mbedtls keeps the NULL terminated list of the configuration
+		mod->alpnbuffer = strdup(config->alpn);
+		int nprotos = 1;
+		for (const char *it = config->alpn; *it != '\0'; it++)
+			nprotos += (*it == ',');
+		mod->alpn = calloc(nprotos + 1, sizeof(*mod->alpn));
+		char *saveptr = NULL;
+		char *proto = strtok_r(mod->alpnbuffer, ",", &saveptr);
+		for (int i = 0; proto != NULL; i++)
+		{
+			mod->alpn[i] = proto;
+			proto = strtok_r(NULL, ",", &saveptr);
+		}
+		ret = mbedtls_ssl_conf_alpn_protocols(&mod->conf, mod->alpn);
+		if (ret)
+		{
+			err("tls: alpn error 0x%X\n", -ret);
+			return EREJECT;
+		}
+	}
+#endif
 	return ESUCCESS;
 }
 
@@ -263,6 +420,12 @@ static void mod_mbedtls_destroy(void *arg)
 	mbedtls_ctr_drbg_free(&mod->ctr_drbg);
 	mbedtls_entropy_free(&mod->entropy);
 	mbedtls_ssl_config_free(&mod->conf);
+#if defined(MBEDTLS_SSL_ALPN)
+	free(mod->alpn);
+	free(mod->alpnbuffer);
+#endif
+	tls_sessioncache_destroy(mod->sessioncache);
+	tls_tickets_destroy(mod->tickets);
 	mbedtls_free(mod);
 }
 
@@ -7,6 +7,7 @@ mod_mbedtls_LDFLAGS+=$(LIBHTTPSERVER_LDFLAGS)
 mod_mbedtls_LIBS+=$(LIBHTTPSERVER_NAME)
 mod_mbedtls_LIBS+=mbedtls mbedx509 mbedcrypto
 mod_mbedtls_LIBRARY+=libconfig
+mod_mbedtls_LIBS+=ouihash
 mod_mbedtls_ALIAS-$(MODULES)+=mod_tls.so
 ifneq ($(wildcard $(sysroot)$(includedir)/httpserver/config.h),)
 mod_mbedtls_CFLAGS+=-Dhttpserver_config
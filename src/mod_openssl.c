@@ -32,19 +32,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
+#include <poll.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
 #include "ouistiti/log.h"
 #include "ouistiti/httpserver.h"
 #include "mod_tls.h"
+#include "log.h"
 
 #define tls_dbg(...)
 
 #define HANDSHAKE 0x01
 #define RECV_COMPLETE 0x02
 
+/// the maximum payload of a TLS record
+#define TLS_RECORDSIZE 16384
+/// the delay to send the end of the batch before the shutdown, in ms
+#define TLS_DISCONNECTTIMEOUT 1000
+
 typedef struct _mod_openssl_s _mod_openssl_t;
 
 typedef struct _mod_openssl_ctx_s
@@ -55,6 +70,10 @@ typedef struct _mod_openssl_ctx_s
 	void *protocol;
 	_mod_openssl_t *mod;
 	int state;
+	/// the small sendings are batched into one record
+	char *out;
+	size_t outlength;
+	size_t outsent;
 } _mod_openssl_ctx_t;
 
 struct _mod_openssl_s
@@ -62,10 +81,170 @@ struct _mod_openssl_s
 	const httpclient_ops_t *protocolops;
 	void *protocol;
 	SSL_CTX *openssl_ctx;
+	/// the protocols of ALPN in the wire format
+	unsigned char *alpn;
+	unsigned int alpnlength;
+	tls_sessioncache_t *sessioncache;
+	tls_tickets_t *tickets;
 };
 
 static const httpclient_ops_t *tlsserver_ops;
 
+static int _tls_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+			const unsigned char *in, unsigned int inlen, void *arg)
+{
+	_mod_openssl_t *mod = (_mod_openssl_t *)arg;
+	/// the preference of the server is selected
+	if (SSL_select_next_proto((unsigned char **)out, outlen, mod->alpn, mod->alpnlength,
+			in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+	tls_dbg("tls: alpn %.*s", *outlen, *out);
+	return SSL_TLSEXT_ERR_OK;
+}
+
+static unsigned char *_tls_alpnlist(const char *alpn, unsigned int *length)
+{
+	size_t alpnlen = strlen(alpn);
+	unsigned char *list = calloc(1, alpnlen + 1);
+	unsigned char *proto = list;
+	*length = 0;
+	for (size_t i = 0; i <= alpnlen; i++)
+	{
+		if (alpn[i] == ',' || alpn[i] == '\0')
+		{
+			*proto = list + *length - proto;
+			if (*proto > 0)
+				proto = list + ++(*length);
+		}
+		else
+			list[++(*length)] = alpn[i];
+	}
+	return list;
+}
+
+static int _tls_newsession(SSL *ssl, SSL_SESSION *session)
+{
+	_mod_openssl_t *mod = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	unsigned int idlen = 0;
+	const unsigned char *id = SSL_SESSION_get_id(session, &idlen);
+	int length = i2d_SSL_SESSION(session, NULL);
+	if (length <= 0 || length > TLS_SESSIONSIZE)
+		return 0;
+	unsigned char data[TLS_SESSIONSIZE];
+	unsigned char *end = data;
+	i2d_SSL_SESSION(session, &end);
+	tls_sessioncache_store(mod->sessioncache, id, idlen, data, length);
+	/// the reference of the session is not kept
+	return 0;
+}
+
+static SSL_SESSION *_tls_getsession(SSL *ssl, const unsigned char *id, int idlen, int *copy)
+{
+	_mod_openssl_t *mod = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	unsigned char data[TLS_SESSIONSIZE];
+	*copy = 0;
+	int length = tls_sessioncache_load(mod->sessioncache, id, idlen, data, sizeof(data));
+	if (length <= 0)
+		return NULL;
+	const unsigned char *start = data;
+	tls_dbg("tls: session resumed");
+	return d2i_SSL_SESSION(NULL, &start, length);
+}
+
+static void _tls_removesession(SSL_CTX *ctx, SSL_SESSION *session)
+{
+	_mod_openssl_t *mod = SSL_CTX_get_app_data(ctx);
+	unsigned int idlen = 0;
+	const unsigned char *id = SSL_SESSION_get_id(session, &idlen);
+	tls_sessioncache_remove(mod->sessioncache, id, idlen);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int _tls_ticketcb(SSL *ssl, unsigned char *name, unsigned char *iv,
+			EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *hmac, int enc)
+#else
+static int _tls_ticketcb(SSL *ssl, unsigned char *name, unsigned char *iv,
+			EVP_CIPHER_CTX *cipher, HMAC_CTX *hmac, int enc)
+#endif
+{
+	_mod_openssl_t *mod = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	tls_ticketkey_t ticketkey;
+	const tls_ticketkey_t *key = &ticketkey;
+	/// 1 to accept the ticket, 2 to accept and renew it with the current key
+	int ret = 1;
+	if (enc)
+	{
+		tls_tickets_current(mod->tickets, &ticketkey);
+		memcpy(name, key->name, TLS_TICKETNAMELEN);
+		if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0 ||
+			!EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes, iv))
+			return -1;
+	}
+	else
+	{
+		int previous = 0;
+		if (tls_tickets_find(mod->tickets, name, &ticketkey, &previous) != ESUCCESS)
+			/// unknown or expired key, the handshake is complete
+			return 0;
+		if (!EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes, iv))
+			return -1;
+		/// the tickets of TLS1.3 are used once, a new one is sent
+		if (previous || SSL_version(ssl) >= TLS1_3_VERSION)
+			ret = 2;
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[] =
+	{
+		OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void *)key->hmac, TLS_TICKETKEYLEN),
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+		OSSL_PARAM_construct_end(),
+	};
+	if (!EVP_MAC_CTX_set_params(hmac, params))
+		return -1;
+#else
+	if (!HMAC_Init_ex(hmac, key->hmac, TLS_TICKETKEYLEN, EVP_sha256(), NULL))
+		return -1;
+#endif
+	return ret;
+}
+
+static void _tls_resumption(_mod_openssl_t *mod, SSL_CTX *ctx, const mod_tls_t *modconfig, http_server_t *server)
+{
+	SSL_CTX_set_app_data(ctx, mod);
+	const char *hostname = httpserver_INFO(server, "hostname");
+	if (hostname != NULL)
+	{
+		size_t length = strlen(hostname);
+		if (length > SSL_MAX_SID_CTX_LENGTH)
+			length = SSL_MAX_SID_CTX_LENGTH;
+		SSL_CTX_set_session_id_context(ctx, (const unsigned char *)hostname, length);
+	}
+	SSL_CTX_set_timeout(ctx, modconfig->sessiontimeout);
+	if (modconfig->sessioncache > 0)
+		mod->sessioncache = tls_sessioncache_create(modconfig->sessioncache, modconfig->sessiontimeout);
+	if (mod->sessioncache != NULL)
+	{
+		/// the internal cache of each worker is replaced by the shared cache
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(ctx, _tls_newsession);
+		SSL_CTX_sess_set_get_cb(ctx, _tls_getsession);
+		SSL_CTX_sess_set_remove_cb(ctx, _tls_removesession);
+	}
+	if (!modconfig->tickets)
+	{
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		return;
+	}
+	mod->tickets = tls_tickets_create(modconfig->ticketkey, modconfig->ticketrotation);
+	if (mod->tickets == NULL)
+		return;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, _tls_ticketcb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, _tls_ticketcb);
+#endif
+}
+
 void *mod_openssl_create(http_server_t *server, mod_tls_t *modconfig)
 {
 	_mod_openssl_t *mod = NULL;
@@ -86,6 +265,14 @@ void *mod_openssl_create(http_server_t *server, mod_tls_t *modconfig)
 
 	ctx = SSL_CTX_new(method);
 	SSL_CTX_set_ecdh_auto(ctx, 1);
+	/**
+	 * SSL_write returns after each record and the buffers of the records
+	 * are freed when the connection is idle.
+	 * The server retries a large sending from its own buffer, which may
+	 * move between the calls.
+	 */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_RELEASE_BUFFERS |
+			SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 	if (modconfig->crtfile)
 	{
 		int ret = SSL_CTX_use_certificate_file(ctx, (const char *) modconfig->crtfile, SSL_FILETYPE_PEM);
@@ -116,6 +303,12 @@ void *mod_openssl_create(http_server_t *server, mod_tls_t *modconfig)
 	{
 		mod = calloc(1, sizeof(*mod));
 		mod->openssl_ctx = ctx;
+		if (modconfig->alpn)
+		{
+			mod->alpn = _tls_alpnlist(modconfig->alpn, &mod->alpnlength);
+			SSL_CTX_set_alpn_select_cb(ctx, _tls_alpn, mod);
+		}
+		_tls_resumption(mod, ctx, modconfig, server);
 
 		mod->protocolops = httpserver_changeprotocol(server, tlsserver_ops, mod);
 		mod->protocol = server;
@@ -129,6 +322,9 @@ void mod_openssl_destroy(void *arg)
 	_mod_openssl_t *mod = (_mod_openssl_t *)arg;
 
 	SSL_CTX_free(mod->openssl_ctx);
+	tls_sessioncache_destroy(mod->sessioncache);
+	tls_tickets_destroy(mod->tickets);
+	free(mod->alpn);
 	free(mod);
 }
 void mod_tls_destroy(void *arg) __attribute__ ((weak, alias ("mod_openssl_destroy")));
@@ -159,10 +355,15 @@ static void *_tlsserver_create(void *arg, http_client_t *clt)
 
 	SSL_set_fd(ctx->ssl, sock);
 	int ret = SSL_accept(ctx->ssl);
+	int error = SSL_ERROR_NONE;
 	if (ret <= 0)
+		error = SSL_get_error(ctx->ssl, ret);
+	/// the handshake continues with the first reading
+	if (error != SSL_ERROR_NONE &&
+		error != SSL_ERROR_WANT_READ &&
+		error != SSL_ERROR_WANT_WRITE)
 	{
-		int error = SSL_get_error(ctx->ssl, ret);
-		err("tls: create error %d %s", error, ERR_reason_error_string(error));
+		err("tls: create error %d %s", error, ERR_reason_error_string(ERR_get_error()));
 		_tls_disconnect(ctx);
 		_tls_destroy(ctx);
 		return NULL;
@@ -182,12 +383,50 @@ static int _tls_connect(void *vctx, const char *addr, int port)
 }
 #endif
 
+static int _tls_push(_mod_openssl_ctx_t *ctx);
+
+static long _tls_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * The end of the batch is pushed before the shutdown, the socket is
+ * polled until TLS_DISCONNECTTIMEOUT for a client which reads slowly.
+ */
+static int _tls_drain(_mod_openssl_ctx_t *ctx)
+{
+	long deadline = _tls_clock() + TLS_DISCONNECTTIMEOUT;
+	int ret;
+	while ((ret = _tls_push(ctx)) == EINCOMPLETE)
+	{
+		long timeout = deadline - _tls_clock();
+		if (timeout <= 0)
+			break;
+		struct pollfd poll_set = {
+			.fd = SSL_get_fd(ctx->ssl),
+			.events = SSL_want_read(ctx->ssl)? POLLIN: POLLOUT,
+		};
+		int nfds = poll(&poll_set, 1, timeout);
+		if (nfds < 0 && errno == EINTR)
+			continue;
+		if (nfds <= 0 || (poll_set.revents & (POLLERR | POLLHUP | POLLNVAL)))
+			break;
+	}
+	return ret;
+}
+
 static void _tls_disconnect(void *vctx)
 {
 	_mod_openssl_ctx_t *ctx = (_mod_openssl_ctx_t *)vctx;
 	if (ctx->ssl == NULL)
 		return;
 	dbg("tls: disconnect");
+	/// the socket accepts the end of the batch or the connection is lost
+	if (ctx->outlength > 0 && _tls_drain(ctx) == EINCOMPLETE)
+		warn("tls: disconnect with %d bytes pending", (int)(ctx->outlength - ctx->outsent));
 	SSL_shutdown(ctx->ssl);
 	SSL_free(ctx->ssl);
 	ctx->ssl = NULL;
@@ -199,44 +438,73 @@ static void _tls_destroy(void *vctx)
 	_mod_openssl_ctx_t *ctx = (_mod_openssl_ctx_t *)vctx;
 	dbg("tls: complete");
 	ctx->protocolops->destroy(ctx->protocol);
+	if (ctx->out != NULL)
+	{
+		ouistiti_clientmemory(ctx->clt, -TLS_RECORDSIZE);
+		free(ctx->out);
+	}
 	free(ctx);
 }
 
+static int _tls_error(_mod_openssl_ctx_t *ctx, int ret, const char *action)
+{
+	int error = SSL_get_error(ctx->ssl, ret);
+	if (error == SSL_ERROR_WANT_READ ||
+		error == SSL_ERROR_WANT_WRITE ||
+		error == SSL_ERROR_WANT_X509_LOOKUP)
+		return EINCOMPLETE;
+	if (error != SSL_ERROR_ZERO_RETURN)
+		err("tls: %s error(%d) %s", action, error, ERR_reason_error_string(ERR_get_error()));
+	return EREJECT;
+}
+
+/**
+ * The records waiting in the batch are written.
+ * EINCOMPLETE is returned when the socket is full. The batch keeps its
+ * address until the end, as required by OpenSSL to retry the writing.
+ */
+static int _tls_push(_mod_openssl_ctx_t *ctx)
+{
+	while (ctx->outsent < ctx->outlength)
+	{
+		int ret = SSL_write(ctx->ssl, ctx->out + ctx->outsent, ctx->outlength - ctx->outsent);
+		tls_dbg("tls: push %d", ret);
+		if (ret <= 0)
+			return _tls_error(ctx, ret, "send");
+		ctx->outsent += ret;
+	}
+	/// the batch is freed with the buffers of OpenSSL
+	if (ctx->out != NULL)
+	{
+		ouistiti_clientmemory(ctx->clt, -TLS_RECORDSIZE);
+		free(ctx->out);
+	}
+	ctx->out = NULL;
+	ctx->outlength = 0;
+	ctx->outsent = 0;
+	return ESUCCESS;
+}
+
 static int _tls_recv(void *vctx, char *data, size_t size)
 {
 	int ret;
 	_mod_openssl_ctx_t *ctx = (_mod_openssl_ctx_t *)vctx;
 
-//	do {
-		ret = SSL_read(ctx->ssl, (unsigned char *)data, size);
-		tls_dbg("tls: recv %d %.*s", ret, ret, data);
-		if (ret < 0)
-		{
-			int error = SSL_get_error(ctx->ssl, ret);
-			if (error == SSL_ERROR_WANT_READ ||
-				error == SSL_ERROR_WANT_WRITE ||
-				error == SSL_ERROR_WANT_X509_LOOKUP)
-			{
-				ret = EINCOMPLETE;
-				sched_yield();
-			}
-			else
-			{
-				err("tls: recv error(%d)", error);
-				ret = EREJECT;
-				ctx->state |= RECV_COMPLETE;
-			}
-		}
-		else if (ret == 0)
-		{
-			ret = EREJECT;
+	/// the response must be sent before to read the next request
+	if (ctx->outlength > 0 && _tls_push(ctx) == EREJECT)
+		return EREJECT;
+	ret = SSL_read(ctx->ssl, (unsigned char *)data, size);
+	tls_dbg("tls: recv %d %.*s", ret, ret, data);
+	if (ret <= 0)
+	{
+		ret = _tls_error(ctx, ret, "recv");
+		if (ret == EREJECT)
 			ctx->state |= RECV_COMPLETE;
-		}
-		else
-		{
-			ctx->state &= ~RECV_COMPLETE;
-		}
-//	} while (ret == EINCOMPLETE);
+	}
+	else
+	{
+		ctx->state &= ~RECV_COMPLETE;
+	}
 	return ret;
 }
 
@@ -245,46 +513,65 @@ static int _tls_send(void *vctx, const char *data, size_t size)
 	int ret = 0;
 	_mod_openssl_ctx_t *ctx = (_mod_openssl_ctx_t *)vctx;
 
-	do {
+	if (ctx->outlength + size > TLS_RECORDSIZE)
+	{
+		ret = _tls_push(ctx);
+		if (ret != ESUCCESS)
+			return ret;
+	}
+	if (size >= TLS_RECORDSIZE)
+	{
+		/**
+		 * the large sending is written without copy, one record at a time.
+		 * On EINCOMPLETE, the server calls again with the same data.
+		 */
 		ret = SSL_write(ctx->ssl, (unsigned char *)data, size);
 		tls_dbg("tls: send %d %.*s", ret, (int)size, data);
-		if (ret < 0)
-		{
-			warn("tls: send %d %.*s", ret, (int)size, data);
-			int error = SSL_get_error(ctx->ssl, ret);
-			if (error == SSL_ERROR_WANT_WRITE ||
-				error == SSL_ERROR_WANT_READ ||
-				error == SSL_ERROR_WANT_X509_LOOKUP)
-			{
-				err("tls: send error(%d) WANT_DATA", error);
-				ret = EINCOMPLETE;
-				sched_yield();
-			}
-			else
-			{
-				err("tls: send error(%d)", error);
-				ret = EREJECT;
-			}
-		}
-	} while (ret == EINCOMPLETE);
-	return ret;
+		if (ret <= 0)
+			ret = _tls_error(ctx, ret, "send");
+		return ret;
+	}
+	if (ctx->out == NULL)
+	{
+		ctx->out = malloc(TLS_RECORDSIZE);
+		if (ctx->out == NULL)
+			return EREJECT;
+		ouistiti_clientmemory(ctx->clt, TLS_RECORDSIZE);
+	}
+	memcpy(ctx->out + ctx->outlength, data, size);
+	ctx->outlength += size;
+	/// the data is accepted, the end of a full batch is sent later
+	if (ctx->outlength == TLS_RECORDSIZE && _tls_push(ctx) == EREJECT)
+		return EREJECT;
+	return size;
 }
 
 static int tls_wait(void *vctx, int options)
 {
 	_mod_openssl_ctx_t *ctx = (_mod_openssl_ctx_t *)vctx;
-	int ret = ESUCCESS;
 	tls_dbg("tls: wait %x", options);
 	tls_dbg("tls: wait %x", ctx->state);
-	if (!(options & WAIT_SEND) && SSL_want_read(ctx->ssl))
+	if (ctx->outlength > 0 && _tls_push(ctx) == EINCOMPLETE)
 	{
-		tls_dbg("tls: wait continue");
-		ret = ctx->protocolops->wait(ctx->protocol, options);
+		/// the client may wait the response before to send more data
+		options |= WAIT_SEND;
 	}
-	return ret;
+	else if (options & WAIT_SEND)
+	{
+		/// a record of the handshake is expected before to write
+		if (SSL_want_read(ctx->ssl))
+			options &= ~WAIT_SEND;
+	}
+	else if (SSL_pending(ctx->ssl) > 0)
+	{
+		/// the data is already decrypted, the socket may stay empty
+		return ESUCCESS;
+	}
+	else if (SSL_want_write(ctx->ssl))
+		options |= WAIT_SEND;
+	return ctx->protocolops->wait(ctx->protocol, options);
 }
 
-
 static int _tls_status(void *vctx)
 {
 	_mod_openssl_ctx_t *ctx = (_mod_openssl_ctx_t *)vctx;
@@ -295,10 +582,16 @@ static int _tls_status(void *vctx)
 	return ESUCCESS;
 }
 
+/**
+ * The flush does not wait the socket: on EINCOMPLETE, the batch stays
+ * and tls_wait pushes it when the server waits the client.
+ */
 static void _tls_flush(void *vctx)
 {
 	_mod_openssl_ctx_t *ctx = (_mod_openssl_ctx_t *)vctx;
-	return ctx->protocolops->flush(ctx->protocol);
+	if (ctx->outlength > 0 && _tls_push(ctx) != ESUCCESS)
+		return;
+	ctx->protocolops->flush(ctx->protocol);
 }
 
 static const httpclient_ops_t *tlsserver_ops = &(httpclient_ops_t)
@@ -43,13 +43,7 @@
 #include "ouistiti/utils.h"
 #include "mod_redirect.h"
 
-#define err(format, ...) fprintf(stderr, "\x1B[31m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#define warn(format, ...) fprintf(stderr, "\x1B[35m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#ifdef DEBUG
-#define dbg(format, ...) fprintf(stderr, "\x1B[32m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#else
-#define dbg(...)
-#endif
+#include "log.h"
 
 #define redirect_dbg(...)
 
@@ -171,6 +165,8 @@ static void *redirect_config(config_setting_t *iterator, server_t *server)
 		char *mode = NULL;
 		config_setting_lookup_string(config, "options", (const char **)&mode);
 		conf->options = redirect_mode(mode);
+		if (ouistiti_issecure(server))
+			conf->options |= REDIRECT_SECURE;
 
 		config_setting_t *configlinks = config_setting_lookup(config, "links");
 		if (configlinks)
@@ -214,8 +210,11 @@ static void *mod_redirect_create(http_server_t *server, mod_redirect_t *config)
 	else
 		mod->result = RESULT_302;
 
-	httpserver_addconnector(server, _mod_redirect_connector, mod, CONNECTOR_DOCFILTER, str_redirect);
-	httpserver_addconnector(server, _mod_redirect_connectorerror, mod, CONNECTOR_ERROR, str_redirect);
+	/// RFC 6797 7.2: the header is not sent on the insecure connections
+	if ((config->options & REDIRECT_HSTS) && (config->options & REDIRECT_SECURE))
+		ouistiti_setheader(server, "Strict-Transport-Security", STRING_REF("max-age=31536000; includeSubDomains"));
+	ouistiti_addconnector(server, _mod_redirect_connector, mod, CONNECTOR_DOCFILTER, str_redirect);
+	ouistiti_addconnector(server, _mod_redirect_connectorerror, mod, CONNECTOR_ERROR, str_redirect);
 	return mod;
 }
 
@@ -370,10 +369,6 @@ static int _mod_redirect_connector(void *arg, http_message_t *request, http_mess
 		{
 			return _mod_redirect_hsts(mod, request, response, str_https, sizeof(str_https) - 1, uri, urilen);
 		}
-		else
-		{
-			httpmessage_addheader(response, "Strict-Transport-Security", STRING_REF("max-age=31536000; includeSubDomains"));
-		}
 	}
 	if (config->options & REDIRECT_GENERATE204)
 	{
@@ -53,6 +53,8 @@ struct mod_redirect_link_s
 #define REDIRECT_TEMPORARY		0x0010
 #define REDIRECT_ERROR			0x0020
 #define REDIRECT_QUERY			0x0040
+/// set by the configuration when the server uses TLS
+#define REDIRECT_SECURE			0x0080
 typedef struct mod_redirect_s
 {
 	int options;
@@ -39,13 +39,7 @@
 #include "ouistiti/utils.h"
 #include "mod_redirect404.h"
 
-#define err(format, ...) fprintf(stderr, "\x1B[31m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#define warn(format, ...) fprintf(stderr, "\x1B[35m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#ifdef DEBUG
-#define dbg(format, ...) fprintf(stderr, "\x1B[32m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#else
-#define dbg(...)
-#endif
+#include "log.h"
 
 typedef struct _mod_redirect404_s _mod_redirect404_t;
 
@@ -60,7 +54,7 @@ struct _mod_redirect404_s
 
 static void *mod_redirect404_create(http_server_t *server, mod_redirect404_t *config)
 {
-	httpserver_addconnector(server, _mod_redirect404_connector, config, 9, str_redirect404);
+	ouistiti_addconnector(server, _mod_redirect404_connector, config, 9, str_redirect404);
 	return config;
 }
 
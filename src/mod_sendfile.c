@@ -40,13 +40,7 @@
 #include "ouistiti/httpserver.h"
 #include "mod_document.h"
 
-#define err(format, ...) fprintf(stderr, "\x1B[31m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#define warn(format, ...) fprintf(stderr, "\x1B[35m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#ifdef DEBUG
-#define dbg(format, ...) fprintf(stderr, "\x1B[32m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#else
-#define dbg(...)
-#endif
+#include "log.h"
 
 #define sighandler_t __sighandler_t
 
@@ -82,19 +76,23 @@ int mod_send_sendfile(document_connector_t *private, http_message_t *response)
 	handler_old = signal(SIGPIPE, SIG_IGN);
 #endif
 
-	do
-	{
-		ret = httpclient_wait(httpmessage_client(response), 1);
-	}
-	while (ret == EINCOMPLETE);
-	if (ret > 0)
+	ret = ouistiti_sendfile(httpmessage_client(response), private->fdfile, size);
+	if (ret == ECONTINUE)
 	{
 		do
 		{
-			int sock = ret;
-			ret = sendfile(sock, private->fdfile, NULL, size);
+			ret = httpclient_wait(httpmessage_client(response), 1);
+		}
+		while (ret == EINCOMPLETE);
+		if (ret > 0)
+		{
+			do
+			{
+				int sock = ret;
+				ret = sendfile(sock, private->fdfile, NULL, size);
+			}
+			while (ret < 0 && errno == EINTR);
 		}
-		while (ret < 0 && errno == EINTR);
 	}
 	if (ret >= 0)
 #ifdef HAVE_SIGACTION
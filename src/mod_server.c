@@ -44,13 +44,7 @@
 #include "ouistiti/utils.h"
 #include "mod_server.h"
 
-#define err(format, ...) fprintf(stderr, "\x1B[31m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#define warn(format, ...) fprintf(stderr, "\x1B[35m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#ifdef DEBUG
-#define dbg(format, ...) fprintf(stderr, "\x1B[32m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#else
-#define dbg(...)
-#endif
+#include "log.h"
 
 static const char str_server[] = "server";
 
@@ -97,75 +91,102 @@ static void *mod_server_config(void *iterator, server_t *server)
 static int _server_connector(void *arg, http_message_t *request, http_message_t *response)
 {
 	_mod_server_t *mod = (_mod_server_t *)arg;
-	mod_security_t *config = mod->config;
 	int ret = EREJECT;
-	int options = 0;
 
-	const char *software = httpmessage_SERVER(request, "software");
-	httpmessage_addheader(response, "Server", software, -1);
-	if (config)
-	{
-		options = config->options;
-	}
-	if (!(options & SECURITY_FRAME))
+#ifndef SECURITY_UNCHECKORIGIN
+	const char *origin = NULL;
+	size_t originlen = httpmessage_REQUEST2(request, "Origin", &origin);
+	if (origin != NULL)
 	{
-		httpmessage_addheader(response, "X-Frame-Options", STRING_REF("DENY"));
+		const char *host = NULL;
+		size_t hostlen = httpserver_INFO2(mod->server, "hostname", &host);
+		const char *refererhost = strstr(origin, "://");
+		if (refererhost == NULL)
+			refererhost = origin;
+		else
+			originlen -= refererhost - origin;
+		char *end = strchr(refererhost, '/');
+		int len;
+		if (end == NULL)
+			len = originlen;
+		else
+			len = end - refererhost;
+		if ((hostlen != len) || strncmp(refererhost, host, len))
+		{
+			httpmessage_result(response, RESULT_403);
+			ret = ESUCCESS;
+		}
 	}
-	if (!(options & SECURITY_CACHE))
+#else
+# warning "request origin is not check"
+#endif
+	return ret;
+}
+
+/**
+ * the responses without cache policy are not storable.
+ * The policies are the ones of the server of the client, a vhost
+ * sends the headers with its own mod_server.
+ */
+static int _server_cacheconnector(void *arg, http_message_t *request, http_message_t *response)
+{
+	const _mod_server_t *mod = (const _mod_server_t *)arg;
+	http_server_t *server = httpclient_server(httpmessage_client(request));
+	if (server != mod->server)
+		return EREJECT;
+	const char *uri = httpmessage_REQUEST(request, "uri");
+
+	/// mod_document sends the Cache-Control of the policy
+	if (ouistiti_cachecontrol(server, uri, NULL) == NULL)
 	{
-		httpmessage_addheader(response, "Cache-Control", STRING_REF("no-cache,no-store,max-age=0,must-revalidate"));
+		httpmessage_addheader(response, str_cachecontrol, STRING_REF("no-cache,no-store,max-age=0,must-revalidate"));
 		httpmessage_addheader(response, "Pragma", STRING_REF("no-cache"));
 		httpmessage_addheader(response, "Expires", STRING_REF("0"));
 	}
+	return EREJECT;
+}
+
+/**
+ * the headers don't depend on the request,
+ * the options are tested once to build the headers of the server.
+ */
+static void _server_setheaders(http_server_t *server, int options)
+{
+	const char *software = httpserver_INFO(server, "software");
+	if (software == NULL || software[0] == '\0')
+		software = str_servername;
+	ouistiti_setheader(server, "Server", software, -1);
+	if (!(options & SECURITY_FRAME))
+	{
+		ouistiti_setheader(server, "X-Frame-Options", STRING_REF("DENY"));
+	}
 	if (!(options & SECURITY_CONTENTTYPE))
 	{
-		httpmessage_addheader(response, "X-Content-Type-Options", STRING_REF("nosniff"));
+		ouistiti_setheader(server, "X-Content-Type-Options", STRING_REF("nosniff"));
 	}
 	if (!(options & SECURITY_OTHERORIGIN))
 	{
 		if (options & SECURITY_FRAME)
-			httpmessage_addheader(response, "X-Frame-Options", STRING_REF("SAMEORIGIN"));
-
-		httpmessage_addheader(response, "Referrer-Policy", STRING_REF("origin-when-cross-origin"));
+			ouistiti_setheader(server, "X-Frame-Options", STRING_REF("SAMEORIGIN"));
 
-#ifndef SECURITY_UNCHECKORIGIN
-		const char *origin = NULL;
-		size_t originlen = httpmessage_REQUEST2(request, "Origin", &origin);
-		if (origin != NULL)
-		{
-			const char *host = NULL;
-			size_t hostlen = httpserver_INFO2(mod->server, "hostname", &host);
-			const char *refererhost = strstr(origin, "://");
-			if (refererhost == NULL)
-				refererhost = origin;
-			else
-				originlen -= refererhost - origin;
-			char *end = strchr(refererhost, '/');
-			int len;
-			if (end == NULL)
-				len = originlen;
-			else
-				len = end - refererhost;
-			if ((hostlen != len) || strncmp(refererhost, host, len))
-			{
-				httpmessage_result(response, RESULT_403);
-				ret = ESUCCESS;
-			}
-		}
-#else
-# warning "request origin is not check"
-#endif
+		ouistiti_setheader(server, "Referrer-Policy", STRING_REF("origin-when-cross-origin"));
 	}
-	return ret;
 }
 
 static void *mod_server_create(http_server_t *server, void *config)
 {
 	_mod_server_t *mod = calloc(1, sizeof(*mod));
+	int options = 0;
 
 	mod->config = config;
 	mod->server = server;
-	httpserver_addconnector(server, _server_connector, mod, CONNECTOR_SERVER, str_server);
+	if (mod->config)
+		options = mod->config->options;
+	_server_setheaders(server, options);
+	if (!(options & SECURITY_CACHE))
+		ouistiti_addconnector(server, _server_cacheconnector, mod, CONNECTOR_SERVER, str_server);
+	if (!(options & SECURITY_OTHERORIGIN))
+		ouistiti_addconnector(server, _server_connector, mod, CONNECTOR_SERVER, str_server);
 
 	return mod;
 }
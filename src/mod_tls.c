@@ -29,6 +29,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 
 #ifdef FILE_CONFIG
 #include <libconfig.h>
@@ -36,6 +41,8 @@
 
 #include "ouistiti/log.h"
 #include "ouistiti/httpserver.h"
+#include "ouistiti/hash.h"
+#include "log.h"
 #ifdef httpserver_config
 #include "ouistiti/config.h"
 #endif
@@ -62,6 +69,23 @@ void *tls_config(void *arg, server_t *server)
 		config_setting_lookup_string(configtls, "keyfile", (const char **)&tls->keyfile);
 		config_setting_lookup_string(configtls, "cachain", (const char **)&tls->cachain);
 		config_setting_lookup_string(configtls, "dhmfile", (const char **)&tls->dhmfile);
+		config_setting_lookup_string(configtls, "alpn", (const char **)&tls->alpn);
+		tls->sessiontimeout = TLS_SESSIONTIMEOUT;
+		tls->tickets = 1;
+		tls->ticketrotation = TLS_TICKETROTATION;
+		config_setting_lookup_int(configtls, "sessioncache", &tls->sessioncache);
+		config_setting_lookup_int(configtls, "sessiontimeout", &tls->sessiontimeout);
+		config_setting_lookup_bool(configtls, "tickets", &tls->tickets);
+		config_setting_lookup_string(configtls, "ticketkey", (const char **)&tls->ticketkey);
+		config_setting_lookup_int(configtls, "ticketrotation", &tls->ticketrotation);
+		if (tls->ticketrotation <= 0)
+			tls->ticketrotation = TLS_TICKETROTATION;
+#if LIBCONFIG_VER_MINOR < 5
+		if (tls->alpn == NULL && config_setting_get_member(iterator, "http2") != NULL)
+#else
+		if (tls->alpn == NULL && config_setting_lookup(iterator, "http2") != NULL)
+#endif
+			tls->alpn = "h2,http/1.1";
 	}
 	return tls;
 }
@@ -71,6 +95,12 @@ static const mod_tls_t g_tls_config = {
 	.keyfile = SYSCONFDIR"/ouistiti_srv.key",
 	.cachain = SYSCONFDIR"/ouistiti_ca.crt",
 	.dhmfile = SYSCONFDIR"/ouistiti_dhparam.crt",
+#ifdef HTTP2
+	.alpn = "h2,http/1.1",
+#endif
+	.sessiontimeout = TLS_SESSIONTIMEOUT,
+	.tickets = 1,
+	.ticketrotation = TLS_TICKETROTATION,
 };
 
 void *tls_config(void *arg, server_t *server)
@@ -83,3 +113,277 @@ void *tls_config(void *arg, server_t *server)
 	return NULL;
 }
 #endif
+
+/**
+ * the cache is a table of sessions indexed by the hash of the id,
+ * a new session replaces the previous one of its slot. The slots are
+ * protected by a set of locks, the workers lock only one stripe.
+ */
+#define TLS_STRIPES 16
+
+typedef struct _tls_session_s _tls_session_t;
+struct _tls_session_s
+{
+	unsigned char id[TLS_SESSIONIDLEN];
+	size_t idlen;
+	time_t expires;
+	size_t length;
+	unsigned char data[TLS_SESSIONSIZE];
+};
+
+struct tls_sessioncache_s
+{
+	int nsessions;
+	int timeout;
+	size_t size;
+	int locks[TLS_STRIPES];
+	_tls_session_t sessions[];
+};
+
+static void _tls_lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void _tls_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static uint32_t _tls_hash(const unsigned char *id, size_t idlen)
+{
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < idlen; i++)
+	{
+		hash ^= id[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+tls_sessioncache_t *tls_sessioncache_create(int nsessions, int timeout)
+{
+	if (nsessions <= 0)
+		return NULL;
+	size_t size = sizeof(tls_sessioncache_t) + sizeof(_tls_session_t) * nsessions;
+	/// the pages of the sessions are allocated on the first use
+	tls_sessioncache_t *cache = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (cache == MAP_FAILED)
+	{
+		err("tls: session cache allocation error %m");
+		return NULL;
+	}
+	cache->nsessions = nsessions;
+	cache->timeout = (timeout > 0)? timeout: TLS_SESSIONTIMEOUT;
+	cache->size = size;
+	return cache;
+}
+
+void tls_sessioncache_destroy(tls_sessioncache_t *cache)
+{
+	if (cache != NULL)
+		munmap(cache, cache->size);
+}
+
+static _tls_session_t *_tls_sessionslot(tls_sessioncache_t *cache, const unsigned char *id, size_t idlen, int **lock)
+{
+	uint32_t index = _tls_hash(id, idlen) % cache->nsessions;
+	*lock = &cache->locks[index % TLS_STRIPES];
+	return &cache->sessions[index];
+}
+
+int tls_sessioncache_store(tls_sessioncache_t *cache, const unsigned char *id, size_t idlen, const unsigned char *data, size_t length)
+{
+	if (idlen == 0 || idlen > TLS_SESSIONIDLEN || length > TLS_SESSIONSIZE)
+		return EREJECT;
+	int *lock = NULL;
+	_tls_session_t *session = _tls_sessionslot(cache, id, idlen, &lock);
+	_tls_lock(lock);
+	memcpy(session->id, id, idlen);
+	session->idlen = idlen;
+	memcpy(session->data, data, length);
+	session->length = length;
+	session->expires = ouistiti_time() + cache->timeout;
+	_tls_unlock(lock);
+	return ESUCCESS;
+}
+
+int tls_sessioncache_load(tls_sessioncache_t *cache, const unsigned char *id, size_t idlen, unsigned char *data, size_t size)
+{
+	if (idlen == 0 || idlen > TLS_SESSIONIDLEN)
+		return EREJECT;
+	int ret = EREJECT;
+	int *lock = NULL;
+	_tls_session_t *session = _tls_sessionslot(cache, id, idlen, &lock);
+	_tls_lock(lock);
+	if (session->idlen == idlen && !memcmp(session->id, id, idlen) &&
+		session->expires > ouistiti_time() && session->length <= size)
+	{
+		memcpy(data, session->data, session->length);
+		ret = session->length;
+	}
+	_tls_unlock(lock);
+	return ret;
+}
+
+void tls_sessioncache_remove(tls_sessioncache_t *cache, const unsigned char *id, size_t idlen)
+{
+	if (idlen == 0 || idlen > TLS_SESSIONIDLEN)
+		return;
+	int *lock = NULL;
+	_tls_session_t *session = _tls_sessionslot(cache, id, idlen, &lock);
+	_tls_lock(lock);
+	if (session->idlen == idlen && !memcmp(session->id, id, idlen))
+		session->idlen = 0;
+	_tls_unlock(lock);
+}
+
+#define TLS_TICKETMASTERLEN 64
+
+struct tls_tickets_s
+{
+	unsigned char master[TLS_TICKETMASTERLEN];
+	size_t masterlen;
+	int rotation;
+	/// the threads of the worker rotate the keys under the lock
+	int lock;
+	long period;
+	/// the key of the current period and the previous one
+	tls_ticketkey_t keys[2];
+};
+
+static int _tls_derive(tls_tickets_t *tickets, long period, const char *label, unsigned char *out, size_t length)
+{
+	char info[32];
+	int infolen = snprintf(info, sizeof(info), "%s:%ld", label, period);
+	unsigned char digest[32];
+	void *ctx = hash_macsha256->initkey((const char *)tickets->master, tickets->masterlen);
+	if (ctx == NULL)
+		return EREJECT;
+	hash_macsha256->update(ctx, info, infolen);
+	hash_macsha256->finish(ctx, (char *)digest);
+	memcpy(out, digest, length);
+	return ESUCCESS;
+}
+
+static int _tls_ticketkey(tls_tickets_t *tickets, long period, tls_ticketkey_t *key)
+{
+	if (_tls_derive(tickets, period, "name", key->name, sizeof(key->name)) != ESUCCESS ||
+		_tls_derive(tickets, period, "hmac", key->hmac, sizeof(key->hmac)) != ESUCCESS ||
+		_tls_derive(tickets, period, "aes", key->aes, sizeof(key->aes)) != ESUCCESS)
+		return EREJECT;
+	return ESUCCESS;
+}
+
+/**
+ * the keys are derived outside of the lock, the lock is taken only
+ * to check the period and to copy the keys.
+ * Must be called with the lock, returns with the lock.
+ */
+static void _tls_tickets_update(tls_tickets_t *tickets)
+{
+	long period = ouistiti_time() / tickets->rotation;
+	if (period == tickets->period)
+		return;
+	_tls_unlock(&tickets->lock);
+	tls_ticketkey_t keys[2];
+	int ret = _tls_ticketkey(tickets, period, &keys[0]);
+	if (ret == ESUCCESS)
+		ret = _tls_ticketkey(tickets, period - 1, &keys[1]);
+	_tls_lock(&tickets->lock);
+	/// another thread may rotate the keys during the derivation
+	if (ret == ESUCCESS && period > tickets->period)
+	{
+		tickets->keys[0] = keys[0];
+		tickets->keys[1] = keys[1];
+		tickets->period = period;
+		tls_dbg("tls: ticket keys of period %ld", period);
+	}
+	memset(keys, 0, sizeof(keys));
+}
+
+tls_tickets_t *tls_tickets_create(const char *keyfile, int rotation)
+{
+	if (hash_macsha256 == NULL)
+	{
+		warn("tls: ticket keys rotation requires hmac-sha256");
+		return NULL;
+	}
+	tls_tickets_t *tickets = calloc(1, sizeof(*tickets));
+	if (tickets == NULL)
+		return NULL;
+	if (keyfile != NULL)
+	{
+		FILE *file = fopen(keyfile, "r");
+		if (file != NULL)
+		{
+			tickets->masterlen = fread(tickets->master, 1, sizeof(tickets->master), file);
+			fclose(file);
+		}
+		if (tickets->masterlen < TLS_TICKETKEYLEN)
+		{
+			err("tls: ticket key %s must contain %d bytes", keyfile, TLS_TICKETKEYLEN);
+			free(tickets);
+			return NULL;
+		}
+	}
+	/// the secret is generated before the fork of the workers
+	else if (getrandom(tickets->master, TLS_TICKETKEYLEN, 0) == TLS_TICKETKEYLEN)
+		tickets->masterlen = TLS_TICKETKEYLEN;
+	else
+	{
+		err("tls: ticket key generation error %m");
+		free(tickets);
+		return NULL;
+	}
+	tickets->rotation = (rotation > 0)? rotation: TLS_TICKETROTATION;
+	tickets->period = -1;
+	_tls_lock(&tickets->lock);
+	_tls_tickets_update(tickets);
+	_tls_unlock(&tickets->lock);
+	if (tickets->period == -1)
+	{
+		err("tls: ticket keys derivation error");
+		tls_tickets_destroy(tickets);
+		return NULL;
+	}
+	return tickets;
+}
+
+void tls_tickets_destroy(tls_tickets_t *tickets)
+{
+	if (tickets == NULL)
+		return;
+	memset(tickets, 0, sizeof(*tickets));
+	free(tickets);
+}
+
+int tls_tickets_current(tls_tickets_t *tickets, tls_ticketkey_t *key)
+{
+	_tls_lock(&tickets->lock);
+	_tls_tickets_update(tickets);
+	*key = tickets->keys[0];
+	_tls_unlock(&tickets->lock);
+	return ESUCCESS;
+}
+
+int tls_tickets_find(tls_tickets_t *tickets, const unsigned char *name, tls_ticketkey_t *key, int *previous)
+{
+	int ret = EREJECT;
+	_tls_lock(&tickets->lock);
+	_tls_tickets_update(tickets);
+	for (int i = 0; i < 2; i++)
+	{
+		if (!memcmp(tickets->keys[i].name, name, TLS_TICKETNAMELEN))
+		{
+			*previous = i;
+			*key = tickets->keys[i];
+			ret = ESUCCESS;
+			break;
+		}
+	}
+	_tls_unlock(&tickets->lock);
+	return ret;
+}
@@ -45,8 +45,66 @@ struct mod_tls_s
 	char *keyfile;
 	char *cachain;
 	char *dhmfile;
+	/** comma separated protocols of ALPN in the order of preference */
+	char *alpn;
+	/** number of sessions of the cache shared by the workers, 0 to disable */
+	int sessioncache;
+	int sessiontimeout;
+	/** the session tickets are enabled by default */
+	int tickets;
+	/** master secret of the ticket keys, a random secret without file */
+	char *ticketkey;
+	/** period of the ticket keys in seconds */
+	int ticketrotation;
 };
 
+#define TLS_SESSIONTIMEOUT 300
+#define TLS_TICKETROTATION 43200
+#define TLS_SESSIONIDLEN 32
+#define TLS_SESSIONSIZE 2048
+
+/**
+ * the sessions are serialized by the TLS library and stored into
+ * a shared memory allocated before the fork of the workers.
+ */
+typedef struct tls_sessioncache_s tls_sessioncache_t;
+tls_sessioncache_t *tls_sessioncache_create(int nsessions, int timeout);
+void tls_sessioncache_destroy(tls_sessioncache_t *cache);
+int tls_sessioncache_store(tls_sessioncache_t *cache, const unsigned char *id, size_t idlen, const unsigned char *data, size_t length);
+/**
+ * returns the length of the session or EREJECT
+ */
+int tls_sessioncache_load(tls_sessioncache_t *cache, const unsigned char *id, size_t idlen, unsigned char *data, size_t size);
+void tls_sessioncache_remove(tls_sessioncache_t *cache, const unsigned char *id, size_t idlen);
+
+#define TLS_TICKETNAMELEN 16
+#define TLS_TICKETKEYLEN 32
+typedef struct tls_ticketkey_s tls_ticketkey_t;
+struct tls_ticketkey_s
+{
+	unsigned char name[TLS_TICKETNAMELEN];
+	unsigned char hmac[TLS_TICKETKEYLEN];
+	unsigned char aes[TLS_TICKETKEYLEN];
+};
+
+/**
+ * the keys of the tickets are derived from the master secret for each
+ * period of rotation. All the workers and the servers sharing the same
+ * file compute the same keys without synchronization.
+ */
+typedef struct tls_tickets_s tls_tickets_t;
+tls_tickets_t *tls_tickets_create(const char *keyfile, int rotation);
+void tls_tickets_destroy(tls_tickets_t *tickets);
+/**
+ * copies the key of the current period
+ */
+int tls_tickets_current(tls_tickets_t *tickets, tls_ticketkey_t *key);
+/**
+ * copies the key of the name or returns EREJECT,
+ * previous is set when the ticket has to be renewed
+ */
+int tls_tickets_find(tls_tickets_t *tickets, const unsigned char *name, tls_ticketkey_t *key, int *previous);
+
 extern const module_t mod_tls;
 
 extern const httpclient_ops_t *tlsclient_ops;
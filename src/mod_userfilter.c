@@ -46,6 +46,7 @@
 #include "ouistiti/log.h"
 #include "mod_auth.h"
 #include "mod_userfilter.h"
+#include "log.h"
 
 #define userfilter_dbg(...)
 
@@ -731,10 +732,10 @@ void *mod_userfilter_create(http_server_t *server, void *arg)
 	mod->db = db;
 	httpserver_addmethod(server, METHOD(str_put), MESSAGE_ALLOW_CONTENT | MESSAGE_PROTECTED);
 	httpserver_addmethod(server, METHOD(str_delete), MESSAGE_ALLOW_CONTENT | MESSAGE_PROTECTED);
-	httpserver_addconnector(server, userfilter_connector, mod, \
+	ouistiti_addconnector(server, userfilter_connector, mod, \
 			CONNECTOR_DOCFILTER, str_userfilter);
 	if (config->configuri != NULL)
-		httpserver_addconnector(server, rootgenerator_connector, mod, \
+		ouistiti_addconnector(server, rootgenerator_connector, mod, \
 				CONNECTOR_DOCUMENT, str_userfilter);
 
 	return mod;
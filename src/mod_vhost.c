@@ -31,6 +31,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <ctype.h>
 
 #ifdef MODULES
 #include <dlfcn.h>
@@ -43,16 +44,13 @@
 #include "ouistiti/ouistiti.h"
 #include "mod_vhost.h"
 
-#define err(format, ...) fprintf(stderr, "\x1B[31m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#define warn(format, ...) fprintf(stderr, "\x1B[35m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#ifdef DEBUG
-#define dbg(format, ...) fprintf(stderr, "\x1B[32m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#else
-#define dbg(...)
-#endif
+#include "log.h"
 
 static const char str_vhost[] = "vhost";
 
+#define VHOST_TABLEMIN 16
+#define VHOST_NAMEMAX 256
+
 struct mod_vhost_s
 {
 	/** @param name of the server */
@@ -64,22 +62,145 @@ struct mod_vhost_s
 };
 
 typedef struct _mod_vhost_s _mod_vhost_t;
+typedef struct _vhost_dispatcher_s _vhost_dispatcher_t;
 
 struct _mod_vhost_s
 {
 	mod_vhost_t	*config;
 	http_server_t *vserver;
 	mod_t *modules;
+	/** normalized hostname, a wildcard is stored without the '*' */
+	char key[VHOST_NAMEMAX];
+	size_t keylen;
+	int wildcard;
+	_vhost_dispatcher_t *dispatcher;
+	_mod_vhost_t *next;
+};
+
+/**
+ * One dispatcher per server, it owns the table of all the vhosts
+ * of the server. The table is open addressing with linear probing,
+ * and is rebuilt when it is half full.
+ */
+struct _vhost_dispatcher_s
+{
+	http_server_t *server;
+	_mod_vhost_t **table;
+	unsigned int size;
+	unsigned int count;
+	_mod_vhost_t *vhosts;
+	_vhost_dispatcher_t *next;
 };
 
+static _vhost_dispatcher_t *g_dispatchers = NULL;
+
+static unsigned int _vhost_hash(const char *key, size_t keylen)
+{
+	/// FNV-1a
+	unsigned int hash = 2166136261U;
+	for (size_t i = 0; i < keylen; i++)
+	{
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/**
+ * the hostname is compared without the case, the port and the final dot
+ */
+static int _vhost_normalize(const char *host, size_t hostlen, char *key, size_t size)
+{
+	const char *end = host + hostlen;
+	if (host[0] == '[')
+	{
+		const char *bracket = memchr(host, ']', hostlen);
+		if (bracket != NULL)
+			end = bracket + 1;
+	}
+	else
+	{
+		const char *colon = memchr(host, ':', hostlen);
+		if (colon != NULL)
+			end = colon;
+	}
+	if (end > host && end[-1] == '.')
+		end--;
+	size_t keylen = end - host;
+	if (keylen == 0 || keylen >= size)
+		return -1;
+	for (size_t i = 0; i < keylen; i++)
+		key[i] = tolower((unsigned char)host[i]);
+	key[keylen] = '\0';
+	return keylen;
+}
+
+static _mod_vhost_t *_vhost_lookup(const _vhost_dispatcher_t *dispatcher, const char *key, size_t keylen)
+{
+	unsigned int mask = dispatcher->size - 1;
+	unsigned int index = _vhost_hash(key, keylen) & mask;
+	for (_mod_vhost_t *entry = dispatcher->table[index]; entry != NULL; entry = dispatcher->table[index])
+	{
+		if (entry->keylen == keylen && !memcmp(entry->key, key, keylen))
+			return entry;
+		index = (index + 1) & mask;
+	}
+	return NULL;
+}
+
+/**
+ * the exact name first, then the wildcards from the longest suffix.
+ * "a.b.example.com" looks for "a.b.example.com", "*.b.example.com",
+ * "*.example.com" and "*.com".
+ */
+static _mod_vhost_t *_vhost_match(const _vhost_dispatcher_t *dispatcher, const char *key, size_t keylen)
+{
+	_mod_vhost_t *entry = _vhost_lookup(dispatcher, key, keylen);
+	const char *suffix = key;
+	while (entry == NULL && (suffix = memchr(suffix + 1, '.', keylen - (suffix + 1 - key))) != NULL)
+	{
+		entry = _vhost_lookup(dispatcher, suffix, keylen - (suffix - key));
+		if (entry != NULL && !entry->wildcard)
+			entry = NULL;
+	}
+	return entry;
+}
+
+static int _vhost_rebuild(_vhost_dispatcher_t *dispatcher, unsigned int size)
+{
+	_mod_vhost_t **table = calloc(size, sizeof(*table));
+	if (table == NULL)
+		return EREJECT;
+	free(dispatcher->table);
+	dispatcher->table = table;
+	dispatcher->size = size;
+	dispatcher->count = 0;
+	for (_mod_vhost_t *vhost = dispatcher->vhosts; vhost != NULL; vhost = vhost->next)
+	{
+		unsigned int index = _vhost_hash(vhost->key, vhost->keylen) & (size - 1);
+		while (table[index] != NULL)
+			index = (index + 1) & (size - 1);
+		table[index] = vhost;
+		dispatcher->count++;
+	}
+	return ESUCCESS;
+}
+
 static int _vhost_connector(void *arg, http_message_t *request, http_message_t *response)
 {
-	_mod_vhost_t *mod = (_mod_vhost_t *)arg;
+	const _vhost_dispatcher_t *dispatcher = (const _vhost_dispatcher_t *)arg;
 
 	const char *vhost = httpmessage_REQUEST(request, "host");
-	if (vhost == NULL || strcmp(vhost, mod->config->vserver.hostname))
+	if (vhost == NULL || vhost[0] == '\0')
 		return EREJECT;
-	warn("vhost: connection on %s", mod->config->vserver.hostname);
+	char key[VHOST_NAMEMAX];
+	int keylen = _vhost_normalize(vhost, strlen(vhost), key, sizeof(key));
+	if (keylen < 0)
+		return EREJECT;
+	_mod_vhost_t *mod = _vhost_match(dispatcher, key, keylen);
+	if (mod == NULL)
+		return EREJECT;
+	dbg("vhost: connection on %s", mod->config->vserver.hostname);
 	return httpserver_reloadclient(mod->vserver, httpmessage_client(request));
 }
 
@@ -88,7 +209,11 @@ static int _vhost_vconnector(void *arg, http_message_t *request, http_message_t
 	_mod_vhost_t *mod = (_mod_vhost_t *)arg;
 
 	const char *vhost = httpmessage_REQUEST(request, "host");
-	if (vhost == NULL || strcmp(vhost, mod->config->vserver.hostname))
+	char key[VHOST_NAMEMAX];
+	int keylen = -1;
+	if (vhost != NULL)
+		keylen = _vhost_normalize(vhost, strlen(vhost), key, sizeof(key));
+	if (keylen < 0 || _vhost_match(mod->dispatcher, key, keylen) != mod)
 	{
 		err("vhost: accesss to another host on the same client");
 		httpmessage_result(response, RESULT_500);
@@ -97,6 +222,102 @@ static int _vhost_vconnector(void *arg, http_message_t *request, http_message_t
 	return EREJECT;
 }
 
+static void _vhost_release(void *arg)
+{
+	_vhost_dispatcher_t *dispatcher = (_vhost_dispatcher_t *)arg;
+	for (_vhost_dispatcher_t **it = &g_dispatchers; *it != NULL; it = &(*it)->next)
+	{
+		if (*it == dispatcher)
+		{
+			*it = dispatcher->next;
+			break;
+		}
+	}
+	free(dispatcher->table);
+	free(dispatcher);
+}
+
+static _vhost_dispatcher_t *_vhost_dispatcher(http_server_t *server)
+{
+	_vhost_dispatcher_t *dispatcher;
+	for (dispatcher = g_dispatchers; dispatcher != NULL; dispatcher = dispatcher->next)
+	{
+		if (dispatcher->server == server)
+			return dispatcher;
+	}
+	dispatcher = calloc(1, sizeof(*dispatcher));
+	if (dispatcher == NULL)
+		return NULL;
+	dispatcher->server = server;
+	if (_vhost_rebuild(dispatcher, VHOST_TABLEMIN) != ESUCCESS ||
+		ouistiti_atrelease(server, _vhost_release, dispatcher) != ESUCCESS)
+	{
+		free(dispatcher->table);
+		free(dispatcher);
+		return NULL;
+	}
+	dispatcher->next = g_dispatchers;
+	g_dispatchers = dispatcher;
+	ouistiti_addconnector(server, _vhost_connector, dispatcher, CONNECTOR_SERVER, str_vhost);
+	return dispatcher;
+}
+
+static int _vhost_register(_vhost_dispatcher_t *dispatcher, _mod_vhost_t *mod)
+{
+	const char *hostname = mod->config->vserver.hostname;
+	if (hostname[0] == '*' && hostname[1] == '.')
+	{
+		mod->wildcard = 1;
+		hostname++;
+	}
+	int keylen = _vhost_normalize(hostname, strlen(hostname), mod->key, sizeof(mod->key));
+	if (keylen < 0)
+	{
+		err("vhost: hostname %s not allowed", mod->config->vserver.hostname);
+		return EREJECT;
+	}
+	mod->keylen = keylen;
+	if (_vhost_lookup(dispatcher, mod->key, mod->keylen) != NULL)
+	{
+		err("vhost: hostname %s defined twice", mod->config->vserver.hostname);
+		return EREJECT;
+	}
+	mod->dispatcher = dispatcher;
+	mod->next = dispatcher->vhosts;
+	dispatcher->vhosts = mod;
+	unsigned int size = dispatcher->size;
+	if ((dispatcher->count + 1) * 2 > size)
+		size *= 2;
+	return _vhost_rebuild(dispatcher, size);
+}
+
+/**
+ * the connector of the dispatcher stays registered on the server until
+ * its destruction, the dispatcher without vhost rejects the requests and
+ * it is freed by the release of the server.
+ */
+static void _vhost_unregister(_mod_vhost_t *mod)
+{
+	_vhost_dispatcher_t *dispatcher = mod->dispatcher;
+	if (dispatcher == NULL)
+		return;
+	for (_mod_vhost_t **it = &dispatcher->vhosts; *it != NULL; it = &(*it)->next)
+	{
+		if (*it == mod)
+		{
+			*it = mod->next;
+			break;
+		}
+	}
+	mod->dispatcher = NULL;
+	if (_vhost_rebuild(dispatcher, dispatcher->size) != ESUCCESS)
+	{
+		/// the table must not keep the vhost
+		memset(dispatcher->table, 0, dispatcher->size * sizeof(*dispatcher->table));
+		dispatcher->count = 0;
+	}
+}
+
 #ifdef FILE_CONFIG
 static mod_vhost_t *_vhost_config(config_setting_t *config, server_t *server, config_t *configfile)
 {
@@ -131,13 +352,29 @@ static int vhost_config(config_setting_t *iterator, server_t *server, int index,
 #else
 	config_setting_t *config = config_setting_lookup(iterator, "vhost");
 #endif
+	int count = 0;
+	if (config && config_setting_is_list(config))
+		count = config_setting_length(config);
+	else if (config)
+		count = 1;
+	serverconfig_t *merged = ouistiti_serverconfig(server)->vhosts;
+	if (index >= count)
+	{
+		/// the other servers on the same port are loaded as vhosts
+		for (int i = count; merged != NULL && i < index; i++)
+			merged = merged->next;
+		if (merged == NULL)
+			return EREJECT;
+		*modconfig = _vhost_config(merged->modulesconfig, server, NULL);
+		return ECONTINUE;
+	}
 	if (config && config_setting_is_list(config))
 	{
-			if (index >= config_setting_length(config))
-				return EREJECT;
 			config = config_setting_get_elem(config, index);
 			ret = ECONTINUE;
 	}
+	else if (merged != NULL)
+		ret = ECONTINUE;
 	if (config && config_setting_type(config) ==  CONFIG_TYPE_STRING)
 	{
 		const char *filepath = config_setting_get_string(config);
@@ -229,12 +466,20 @@ static void *mod_vhost_create(http_server_t *server, mod_vhost_t *config)
 	if (!config)
 		return NULL;
 
+	_vhost_dispatcher_t *dispatcher = _vhost_dispatcher(server);
+	if (dispatcher == NULL)
+		return NULL;
+
 	mod = calloc(1, sizeof(*mod));
 	mod->config = config;
+	if (_vhost_register(dispatcher, mod) != ESUCCESS)
+	{
+		free(mod);
+		return NULL;
+	}
 
 	mod->vserver = httpserver_dup(server, &config->vserver);
-	httpserver_addconnector(server, _vhost_connector, mod, CONNECTOR_SERVER, str_vhost);
-	httpserver_addconnector(mod->vserver, _vhost_vconnector, mod, CONNECTOR_SERVER, str_vhost);
+	ouistiti_addconnector(mod->vserver, _vhost_vconnector, mod, CONNECTOR_SERVER, str_vhost);
 
 	char *cwd = NULL;
 	if (config->root != NULL && config->root[0] != '\0' )
@@ -276,6 +521,9 @@ static void *mod_vhost_create(http_server_t *server, mod_vhost_t *config)
 void mod_vhost_destroy(void *arg)
 {
 	_mod_vhost_t *mod = (_mod_vhost_t *)arg;
+	_vhost_unregister(mod);
+	ouistiti_freeheaders(mod->vserver);
+	ouistiti_freecachepolicy(mod->vserver);
 	httpserver_destroy(mod->vserver);
 	mod_t *module = mod->modules;
 	while (module)
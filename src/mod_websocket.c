@@ -58,6 +58,7 @@
 #include "mod_document.h"
 #include "ouistiti/utils.h"
 #include "ouistiti/websocket.h"
+#include "log.h"
 
 typedef int (*mod_websocket_run_t)(void *arg, int socket, int wssock, http_message_t *request);
 int default_websocket_run(void *arg, int socket, int wssock, http_message_t *request);
@@ -294,17 +295,25 @@ static int websocket_connector_init(_mod_websocket_ctx_t *ctx, http_message_t *r
 static int websocket_connector(void *arg, http_message_t *request, http_message_t *response)
 {
 	int ret = EREJECT;
-	_mod_websocket_ctx_t *ctx = (_mod_websocket_ctx_t *)arg;
+	http_client_t *clt = httpmessage_client(request);
+	_mod_websocket_ctx_t *ctx = ouistiti_clientctx(clt, &mod_websocket, 0);
 	const char *connection = httpmessage_REQUEST(request, str_connection);
 	const char *upgrade = httpmessage_REQUEST(request, str_upgrade);
 
-	if (ctx->socket == 0 &&
+	if (ctx == NULL &&
 		connection != NULL && (strcasestr(connection, str_upgrade) != NULL) &&
 		upgrade != NULL && (strcasestr(upgrade, str_websocket) != NULL))
 	{
+		/// the context exists only for the upgraded connection
+		ctx = ouistiti_clientctx(clt, &mod_websocket, sizeof(*ctx));
+		if (ctx == NULL)
+			return EREJECT;
+		ctx->mod = (_mod_websocket_t *)arg;
 		ret = websocket_connector_init(ctx, request, response);
+		if (ret != ECONTINUE)
+			ouistiti_freeclientctx(clt, &mod_websocket);
 	}
-	else if (ctx->socket > 0 && ctx->fdfile > 0)
+	else if (ctx != NULL && ctx->socket > 0 && ctx->fdfile > 0)
 	{
 		ctx->pid = ctx->mod->run(ctx->mod->runarg, ctx->socket, ctx->fdfile, request);
 		ret = ESUCCESS;
@@ -316,17 +325,18 @@ static void *_mod_websocket_getctx(void *arg, http_client_t *ctl, struct sockadd
 {
 	_mod_websocket_t *mod = (_mod_websocket_t *)arg;
 
-	_mod_websocket_ctx_t *ctx = calloc(1, sizeof(*ctx));
-	ctx->mod = mod;
-	httpclient_addconnector(ctl, websocket_connector, ctx, CONNECTOR_DOCUMENT, str_websocket);
-
-	return ctx;
+	ouistiti_addclientconnector(ctl, websocket_connector, mod, CONNECTOR_DOCUMENT, str_websocket);
+	/// the context is allocated by the upgrade of the connection
+	return ctl;
 }
 
 static void _mod_websocket_freectx(void *arg)
 {
-	_mod_websocket_ctx_t *ctx = (_mod_websocket_ctx_t *)arg;
+	http_client_t *clt = (http_client_t *)arg;
+	_mod_websocket_ctx_t *ctx = ouistiti_clientctx(clt, &mod_websocket, 0);
 
+	if (ctx == NULL)
+		return;
 	if (ctx->pid > 0)
 	{
 #ifdef VTHREAD
@@ -344,7 +354,7 @@ static void _mod_websocket_freectx(void *arg)
 		sigaction(SIGCHLD, &action, NULL);
 #endif
 	}
-	free(ctx);
+	ouistiti_freeclientctx(clt, &mod_websocket);
 }
 
 #ifdef FILE_CONFIG
@@ -54,13 +54,7 @@
 
 extern int ouistiti_websocket_run(void *arg, int sock, int wssock, http_message_t *request);
 
-#define err(format, ...) fprintf(stderr, "\x1B[31m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#define warn(format, ...) fprintf(stderr, "\x1B[35m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#ifdef DEBUG
-#define dbg(format, ...) fprintf(stderr, "\x1B[32m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#else
-#define dbg(...)
-#endif
+#include "log.h"
 
 #define webstream_dbg(...)
 
@@ -78,6 +72,7 @@ struct mod_webstream_s
 	htaccess_t htaccess;
 	int options;
 	int fps;
+	webstream_segmenter_t *segmenters;
 };
 
 typedef struct _mod_webstream_s _mod_webstream_t;
@@ -170,11 +165,12 @@ char *mkrndstr(size_t length)
 static int _webstream_connector(void *arg, http_message_t *request, http_message_t *response)
 {
 	int ret = EREJECT;
-	_mod_webstream_ctx_t *ctx = (_mod_webstream_ctx_t *)arg;
-	_mod_webstream_t *mod = ctx->mod;
+	_mod_webstream_t *mod = (_mod_webstream_t *)arg;
 	mod_webstream_t *config = (mod_webstream_t *)mod->config;
+	http_client_t *clt = httpmessage_client(request);
+	_mod_webstream_ctx_t *ctx = ouistiti_clientctx(clt, &mod_webstream, 0);
 
-	if (ctx->client == 0)
+	if (ctx == NULL)
 	{
 		const char *path_info = NULL;
 		const char *uri = httpmessage_REQUEST(request, "uri");
@@ -194,44 +190,51 @@ static int _webstream_connector(void *arg, http_message_t *request, http_message
 		fstat(fdfile, &filestat);
 		close(fdfile);
 
-		if (S_ISSOCK(filestat.st_mode))
+		if (!S_ISSOCK(filestat.st_mode))
+			return EREJECT;
+		/// the context exists only for the streamed connection
+		ctx = ouistiti_clientctx(clt, &mod_webstream, sizeof(*ctx));
+		if (ctx == NULL)
+			return EREJECT;
+		ctx->mod = mod;
+		ctx->clt = clt;
+		ctx->socket = httpmessage_lock(response);
+		ctx->mime = utils_getmime(uri);
+		if (config->options & WEBSTREAM_MULTIPART)
 		{
-			ctx->socket = httpmessage_lock(response);
-			ctx->mime = utils_getmime(uri);
-			if (config->options & WEBSTREAM_MULTIPART)
-			{
-				ctx->boundary = mkrndstr(16);
-				char mime[256];
-				mime[255] = 0;
-				snprintf(mime, 255, "%s; boundary=%s", str_multipart_replace, ctx->boundary);
-				httpmessage_addcontent(response, mime, NULL, -1);
-			}
-			else
-				httpmessage_addcontent(response, ctx->mime, NULL, -1);
+			ctx->boundary = mkrndstr(16);
+			char mime[256];
+			mime[255] = 0;
+			snprintf(mime, 255, "%s; boundary=%s", str_multipart_replace, ctx->boundary);
+			httpmessage_addcontent(response, mime, NULL, -1);
+		}
+		else
+			httpmessage_addcontent(response, ctx->mime, NULL, -1);
 
-			if (fchdir(ctx->mod->fdroot) == -1)
-				warn("webstream: impossible to change directory");
-			int wssock;
-			wssock = _webstream_socket(ctx, ctx->socket, uri);
+		if (fchdir(ctx->mod->fdroot) == -1)
+			warn("webstream: impossible to change directory");
+		int wssock;
+		wssock = _webstream_socket(ctx, ctx->socket, uri);
 #ifdef WEBSOCKET_RT
-			if (config->options & WEBSTREAM_REALTIME)
-			{
-				if (ouistiti_websocket_run(ctx, ctx->socket, wssock, request) == ESUCCESS)
-					wssock = 0;
-			}
+		if (config->options & WEBSTREAM_REALTIME)
+		{
+			if (ouistiti_websocket_run(ctx, ctx->socket, wssock, request) == ESUCCESS)
+				wssock = 0;
+		}
 #endif
-				
 
-			if (wssock > 0)
-			{
-				ctx->client = wssock;
-				ret = ECONTINUE;
-			}
+		if (wssock > 0)
+		{
+			ctx->client = wssock;
+			ret = ECONTINUE;
 		}
 
 		if (ctx->client <= 0)
 		{
 			httpmessage_result(response, RESULT_400);
+			if (ctx->boundary)
+				free(ctx->boundary);
+			ouistiti_freeclientctx(clt, &mod_webstream);
 			ret = ESUCCESS;
 		}
 		else
@@ -251,18 +254,18 @@ static int _webstream_connector(void *arg, http_message_t *request, http_message
 static void *_mod_webstream_getctx(void *arg, http_client_t *clt, struct sockaddr *addr, int addrsize)
 {
 	_mod_webstream_t *mod = (_mod_webstream_t *)arg;
-	_mod_webstream_ctx_t *ctx = calloc(1, sizeof(*ctx));
-	ctx->mod = mod;
-	ctx->clt = clt;
-	httpclient_addconnector(clt, _webstream_connector, ctx, CONNECTOR_DOCUMENT, str_webstream);
+	ouistiti_addclientconnector(clt, _webstream_connector, mod, CONNECTOR_DOCUMENT, str_webstream);
 
-	return ctx;
+	return clt;
 }
 
 static void _mod_webstream_freectx(void *arg)
 {
-	_mod_webstream_ctx_t *ctx = (_mod_webstream_ctx_t *)arg;
+	http_client_t *clt = (http_client_t *)arg;
+	_mod_webstream_ctx_t *ctx = ouistiti_clientctx(clt, &mod_webstream, 0);
 
+	if (ctx == NULL)
+		return;
 	if (ctx->pid > 0)
 	{
 #ifdef VTHREAD
@@ -285,7 +288,7 @@ static void _mod_webstream_freectx(void *arg)
 		if (ctx->boundary)
 			free(ctx->boundary);
 	}
-	free(ctx);
+	ouistiti_freeclientctx(clt, &mod_webstream);
 }
 
 #ifdef FILE_CONFIG
@@ -320,6 +323,7 @@ static int webstream_config(config_setting_t *iterator, server_t *server, int in
 			conf->options |= WEBSTREAM_MULTIPART;
 		if (utils_searchexp("date", mode, NULL) == ESUCCESS)
 			conf->options |= WEBSTREAM_MULTIPART_DATE;
+		segmenter_config(config, &conf->segmenters);
 	}
 	else
 		conf_ret = EREJECT;
@@ -355,6 +359,7 @@ static void *mod_webstream_create(http_server_t *server, mod_webstream_t *config
 	mod->config = config;
 	mod->fdroot = fdroot;
 	httpserver_addmod(server, _mod_webstream_getctx, _mod_webstream_freectx, mod, str_webstream);
+	segmenter_start(config->segmenters, fdroot);
 	srandom(time(NULL));
 	return mod;
 }
@@ -362,6 +367,7 @@ static void *mod_webstream_create(http_server_t *server, mod_webstream_t *config
 static void mod_webstream_destroy(void *data)
 {
 	_mod_webstream_t *mod = (_mod_webstream_t *)data;
+	segmenter_stop(mod->config->segmenters);
 #ifdef FILE_CONFIG
 	free(mod->config);
 #endif
@@ -424,12 +430,9 @@ static void *_webstream_main(void *arg)
 				info->sendresp(info->ctx, buffer, ret);
 				if (config->options & WEBSTREAM_MULTIPART_DATE)
 				{
-					time_t t;
-					struct tm *tmp;
-
-					t = time(NULL);
-					tmp = gmtime(&t);
-					ret = snprintf(buffer, 255, "%s: %s\r\n", str_date, asctime(tmp));
+					char date[30];
+					size_t datelen = ouistiti_date(date, sizeof(date));
+					ret = snprintf(buffer, 255, "%s: %.*s\r\n", str_date, (int)datelen, date);
 					info->sendresp(info->ctx, buffer, ret);
 				}
 				info->sendresp(info->ctx, "\r\n", 2);
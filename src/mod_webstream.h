@@ -38,6 +38,32 @@ extern "C"
 
 extern const module_t mod_webstream;
 
+#define SEGMENTER_TS   0x01
+#define SEGMENTER_FMP4 0x02
+
+typedef struct webstream_segmenter_s webstream_segmenter_t;
+struct webstream_segmenter_s
+{
+	/// the name of the socket of the stream into the docroot
+	const char *stream;
+	/// the directory of the playlist and the segments
+	const char *path;
+	/// the user of the server, the owner of the segmenter
+	const char *user;
+	int format;
+	int duration;
+	int segments;
+	pid_t pid;
+	pid_t parent;
+	webstream_segmenter_t *next;
+};
+
+#ifdef FILE_CONFIG
+int segmenter_config(config_setting_t *config, webstream_segmenter_t **segmenters);
+#endif
+int segmenter_start(webstream_segmenter_t *segmenters, int fdroot);
+void segmenter_stop(webstream_segmenter_t *segmenters);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,6 +1,7 @@
 modules-$(MODULES)+=mod_webstream
 slib-$(STATIC)+=mod_webstream
 mod_webstream_SOURCES-$(SERVERHEADER)+=mod_webstream.c
+mod_webstream_SOURCES-$(SERVERHEADER)+=webstream_segmenter.c
 mod_webstream_CFLAGS+=-I$(srcdir)src
 mod_webstream_CFLAGS+=$(LIBHTTPSERVER_CFLAGS)
 mod_webstream_LDFLAGS+=$(LIBHTTPSERVER_LDFLAGS)
@@ -31,6 +31,7 @@
 #include "ouistiti/httpserver.h"
 #include "ouistiti/log.h"
 #include "ouistiti.h"
+#include "log.h"
 
 #include "mod_clientfilter.h"
 #include "mod_tls.h"
@@ -50,9 +51,15 @@
 #include "mod_redirect.h"
 #include "mod_tinysvcmdns.h"
 #include "mod_upgrade.h"
+#include "mod_http2.h"
+#include "mod_forward.h"
 
 static const module_t *default_modules[] =
 {
+/// the modules are loaded in reverse order, mod_http2 is above mod_tls
+#if defined HTTP2
+	&mod_http2,
+#endif
 #if defined TLS
 	&mod_tls,
 #endif
@@ -80,6 +87,9 @@ static const module_t *default_modules[] =
 #if defined SERVERHEADER
 	&mod_server,
 #endif
+#if defined FORWARD
+	&mod_forward,
+#endif
 #if defined CGI
 	&mod_cgi,
 #endif
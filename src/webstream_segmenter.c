@@ -0,0 +1,939 @@
+/*****************************************************************************
+ * webstream_segmenter.c: HLS playlist and segments of a live stream
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    One process by segmenter reads the stream of the socket once, and
+    cuts it into files of a directory (by default in memory /dev/shm).
+    The clients download the playlist and the segments with mod_document
+    (sendfile, cachepolicy), then the number of viewers does not change
+    the load of the source.
+     - MPEG-TS: the stream is cut between two packets of 188 bytes, on a
+       random access point after the duration, or after two durations.
+       The PAT and the PMT are repeated at the start of each segment.
+       The durations come from the PCR of the program.
+     - fragmented MP4: the "ftyp" and "moov" boxes are the init segment,
+       the stream is cut before a "moof" (or "styp") box. The fragment
+       is kept until the end of "moof", its "tfdt" gives the time of
+       the cut with the timescale of the first track.
+    The time of the system measures only the streams without clock.
+    A segment is written before its entry into the playlist, and the
+    playlist is replaced with a rename. A lock on the directory forbids
+    two segmenters (after a reload) in the same directory.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <pwd.h>
+#include <grp.h>
+
+#ifdef FILE_CONFIG
+#include <libconfig.h>
+#endif
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/utils.h"
+#include "ouistiti/log.h"
+#include "mod_webstream.h"
+#include "log.h"
+#include "../compliant.h"
+
+#define SEGMENTER_DEFAULTPATH "/dev/shm/webstream"
+#define SEGMENTER_DEFAULTDURATION 4
+#define SEGMENTER_DEFAULTSEGMENTS 6
+/// the segments removed from the playlist stay on the disk for the late clients
+#define SEGMENTER_LATESEGMENTS 2
+#define SEGMENTER_SEGMENTSMAX 32
+#define SEGMENTER_BUFFERSIZE (64 * 1024)
+#define SEGMENTER_INITMAX (1024 * 1024)
+#define SEGMENTER_PLAYLISTMAX (4096)
+/// a larger step of the clock of the stream is a discontinuity of the source
+#define SEGMENTER_CLOCKJUMP 60.0
+
+/// the random access points of the source arrive with a jitter
+#define SEGMENTER_JITTER 0.9
+
+#define TS_PACKETSIZE 188
+#define TS_SYNC 0x47
+#define TS_CLOCK 90000
+#define TS_PCRMASK ((1ULL << 33) - 1)
+
+typedef enum
+{
+	SEGMENTER_DROP,
+	SEGMENTER_INIT,
+	SEGMENTER_SEGMENT,
+	SEGMENTER_FRAGMENT,
+} _segmenter_target_t;
+
+typedef struct _segmenter_s _segmenter_t;
+struct _segmenter_s
+{
+	const webstream_segmenter_t *config;
+	char name[64];
+	int fddir;
+	int fdsegment;
+	/// the sequence of the current segment and the first of the playlist
+	unsigned int sequence;
+	unsigned int first;
+	unsigned int discontinuities;
+	double durations[SEGMENTER_SEGMENTSMAX];
+	char discontinuity[SEGMENTER_SEGMENTSMAX];
+	int nextdiscontinuity;
+	struct timespec start;
+	/// the clock of the stream in seconds, and its value at the start of the segment
+	double clock;
+	double clockstart;
+	uint64_t ticks;
+	int hasclock;
+	uint8_t out[SEGMENTER_BUFFERSIZE];
+	size_t outlength;
+	/// MPEG-TS
+	uint8_t packet[TS_PACKETSIZE];
+	size_t packetlength;
+	uint8_t pat[TS_PACKETSIZE];
+	uint8_t pmt[TS_PACKETSIZE];
+	int pmtpid;
+	int pcrpid;
+	int haspmt;
+	/// fragmented MP4
+	uint8_t box[16];
+	size_t boxlength;
+	uint64_t boxrest;
+	_segmenter_target_t target;
+	int moov;
+	int moof;
+	uint8_t *init;
+	size_t initlength;
+	int hasinit;
+	uint32_t timescale;
+	uint8_t *fragment;
+	size_t fragmentlength;
+};
+
+#ifdef FILE_CONFIG
+int segmenter_config(config_setting_t *config, webstream_segmenter_t **segmenters)
+{
+	config_setting_t *settings = config_setting_get_member(config, "segmenter");
+	if (settings == NULL)
+		return ESUCCESS;
+	/// one segmenter may be a group instead of a list
+	int nbsettings = config_setting_is_group(settings)? 1: config_setting_length(settings);
+	/// the user of the server is a setting of the root
+	config_setting_t *root = config;
+	while (config_setting_parent(root) != NULL)
+		root = config_setting_parent(root);
+	const char *user = NULL;
+	config_setting_lookup_string(root, str_user, &user);
+
+	webstream_segmenter_t **last = segmenters;
+	for (int i = 0; i < nbsettings; i++)
+	{
+		config_setting_t *setting = config_setting_is_group(settings)? settings: config_setting_get_elem(settings, i);
+		if (setting == NULL || !config_setting_is_group(setting))
+			continue;
+		webstream_segmenter_t *segmenter = calloc(1, sizeof(*segmenter));
+		if (segmenter == NULL)
+			return EREJECT;
+		segmenter->path = SEGMENTER_DEFAULTPATH;
+		segmenter->duration = SEGMENTER_DEFAULTDURATION;
+		segmenter->segments = SEGMENTER_DEFAULTSEGMENTS;
+		segmenter->format = SEGMENTER_TS;
+		const char *format = NULL;
+		config_setting_lookup_string(setting, "stream", &segmenter->stream);
+		config_setting_lookup_string(setting, "path", &segmenter->path);
+		config_setting_lookup_string(setting, "format", &format);
+		config_setting_lookup_int(setting, "duration", &segmenter->duration);
+		config_setting_lookup_int(setting, "segments", &segmenter->segments);
+		segmenter->user = user;
+		if (format != NULL && utils_searchexp(format, "fmp4,mp4,cmaf", NULL) == ESUCCESS)
+			segmenter->format = SEGMENTER_FMP4;
+		if (segmenter->duration < 1)
+			segmenter->duration = SEGMENTER_DEFAULTDURATION;
+		if (segmenter->segments < 1 || segmenter->segments > SEGMENTER_SEGMENTSMAX - SEGMENTER_LATESEGMENTS - 1)
+			segmenter->segments = SEGMENTER_DEFAULTSEGMENTS;
+		if (segmenter->stream == NULL)
+		{
+			err("webstream: segmenter without stream");
+			free(segmenter);
+			continue;
+		}
+		*last = segmenter;
+		last = &segmenter->next;
+	}
+	return ESUCCESS;
+}
+#endif
+
+static double _segmenter_elapsed(_segmenter_t *segmenter)
+{
+	if (segmenter->hasclock)
+		return segmenter->clock - segmenter->clockstart;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - segmenter->start.tv_sec) + (now.tv_nsec - segmenter->start.tv_nsec) / 1e9;
+}
+
+/**
+ * the clock of the stream advances with the timestamps (PCR or tfdt),
+ * the mask is the wrap of the timestamps.
+ */
+static void _segmenter_clock(_segmenter_t *segmenter, uint64_t ticks, uint32_t scale, uint64_t mask)
+{
+	if (!segmenter->hasclock)
+	{
+		/// the segment in progress measures its duration from the first timestamp
+		segmenter->hasclock = 1;
+		segmenter->clockstart = segmenter->clock;
+	}
+	else
+	{
+		double delta = ((ticks - segmenter->ticks) & mask) / (double)scale;
+		if (delta < SEGMENTER_CLOCKJUMP)
+			segmenter->clock += delta;
+	}
+	segmenter->ticks = ticks;
+}
+
+static const char *_segmenter_extension(_segmenter_t *segmenter)
+{
+	return (segmenter->config->format == SEGMENTER_FMP4)? "m4s": "ts";
+}
+
+static int _segmenter_writefile(int fd, const uint8_t *data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t ret = write(fd, data, length);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return EREJECT;
+		data += ret;
+		length -= ret;
+	}
+	return ESUCCESS;
+}
+
+/**
+ * the files visible by the clients are written with another name,
+ * and renamed when they are complete.
+ */
+static int _segmenter_replace(_segmenter_t *segmenter, const char *name, const uint8_t *data, size_t length)
+{
+	char tmpname[sizeof(segmenter->name) + 16];
+	snprintf(tmpname, sizeof(tmpname), ".%s", name);
+	int fd = openat(segmenter->fddir, tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		err("webstream: segmenter %s error %m", tmpname);
+		return EREJECT;
+	}
+	int ret = _segmenter_writefile(fd, data, length);
+	close(fd);
+	if (ret == ESUCCESS && renameat(segmenter->fddir, tmpname, segmenter->fddir, name) != 0)
+		ret = EREJECT;
+	if (ret != ESUCCESS)
+	{
+		err("webstream: segmenter %s error %m", name);
+		unlinkat(segmenter->fddir, tmpname, 0);
+	}
+	return ret;
+}
+
+static void _segmenter_flush(_segmenter_t *segmenter)
+{
+	if (segmenter->fdsegment != -1 && segmenter->outlength > 0 &&
+		_segmenter_writefile(segmenter->fdsegment, segmenter->out, segmenter->outlength) != ESUCCESS)
+		err("webstream: segmenter write error %m");
+	segmenter->outlength = 0;
+}
+
+static void _segmenter_output(_segmenter_t *segmenter, const uint8_t *data, size_t length)
+{
+	if (segmenter->outlength + length > sizeof(segmenter->out))
+		_segmenter_flush(segmenter);
+	if (length > sizeof(segmenter->out))
+	{
+		if (_segmenter_writefile(segmenter->fdsegment, data, length) != ESUCCESS)
+			err("webstream: segmenter write error %m");
+		return;
+	}
+	memcpy(segmenter->out + segmenter->outlength, data, length);
+	segmenter->outlength += length;
+}
+
+static void _segmenter_playlist(_segmenter_t *segmenter)
+{
+	char playlist[SEGMENTER_PLAYLISTMAX];
+	int length = 0;
+	int fmp4 = (segmenter->config->format == SEGMENTER_FMP4);
+	int target = segmenter->config->duration;
+	for (unsigned int i = segmenter->first; i != segmenter->sequence; i++)
+	{
+		/// the durations are rounded to the nearest second (RFC8216 4.3.3.1)
+		int duration = (int)(segmenter->durations[i % SEGMENTER_SEGMENTSMAX] + 0.5);
+		if (duration > target)
+			target = duration;
+	}
+
+	length += snprintf(playlist + length, sizeof(playlist) - length,
+			"#EXTM3U\n#EXT-X-VERSION:%d\n#EXT-X-TARGETDURATION:%d\n"
+			"#EXT-X-MEDIA-SEQUENCE:%u\n#EXT-X-DISCONTINUITY-SEQUENCE:%u\n",
+			fmp4? 7: 3, target, segmenter->first, segmenter->discontinuities);
+	if (fmp4)
+		length += snprintf(playlist + length, sizeof(playlist) - length,
+				"#EXT-X-MAP:URI=\"%s.mp4\"\n", segmenter->name);
+	for (unsigned int i = segmenter->first; i != segmenter->sequence && length < (int)sizeof(playlist); i++)
+	{
+		if (segmenter->discontinuity[i % SEGMENTER_SEGMENTSMAX])
+			length += snprintf(playlist + length, sizeof(playlist) - length, "#EXT-X-DISCONTINUITY\n");
+		length += snprintf(playlist + length, sizeof(playlist) - length, "#EXTINF:%.3f,\n%s%u.%s\n",
+				segmenter->durations[i % SEGMENTER_SEGMENTSMAX], segmenter->name, i, _segmenter_extension(segmenter));
+	}
+	if (length >= (int)sizeof(playlist))
+	{
+		err("webstream: segmenter playlist too long");
+		return;
+	}
+	char name[sizeof(segmenter->name) + 8];
+	snprintf(name, sizeof(name), "%s.m3u8", segmenter->name);
+	_segmenter_replace(segmenter, name, (uint8_t *)playlist, length);
+}
+
+static void _segmenter_open(_segmenter_t *segmenter)
+{
+	char name[sizeof(segmenter->name) + 16];
+	snprintf(name, sizeof(name), "%s%u.%s", segmenter->name, segmenter->sequence, _segmenter_extension(segmenter));
+	segmenter->fdsegment = openat(segmenter->fddir, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (segmenter->fdsegment == -1)
+	{
+		err("webstream: segmenter %s error %m", name);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &segmenter->start);
+	segmenter->clockstart = segmenter->clock;
+	segmenter->outlength = 0;
+	segmenter->discontinuity[segmenter->sequence % SEGMENTER_SEGMENTSMAX] = segmenter->nextdiscontinuity;
+	segmenter->nextdiscontinuity = 0;
+}
+
+static void _segmenter_publish(_segmenter_t *segmenter)
+{
+	if (segmenter->fdsegment == -1)
+		return;
+	_segmenter_flush(segmenter);
+	close(segmenter->fdsegment);
+	segmenter->fdsegment = -1;
+	segmenter->durations[segmenter->sequence % SEGMENTER_SEGMENTSMAX] = _segmenter_elapsed(segmenter);
+	segmenter->sequence++;
+
+	while (segmenter->sequence - segmenter->first > (unsigned int)segmenter->config->segments)
+	{
+		if (segmenter->discontinuity[segmenter->first % SEGMENTER_SEGMENTSMAX])
+			segmenter->discontinuities++;
+		segmenter->first++;
+		char name[sizeof(segmenter->name) + 16];
+		snprintf(name, sizeof(name), "%s%u.%s", segmenter->name,
+				segmenter->first - SEGMENTER_LATESEGMENTS - 1, _segmenter_extension(segmenter));
+		unlinkat(segmenter->fddir, name, 0);
+	}
+	_segmenter_playlist(segmenter);
+}
+
+static void _segmenter_tspacket(_segmenter_t *segmenter)
+{
+	const uint8_t *packet = segmenter->packet;
+	int pid = ((packet[1] & 0x1F) << 8) | packet[2];
+	int pusi = packet[1] & 0x40;
+	int adaptation = packet[3] & 0x20;
+
+	if (pid == 0 && pusi)
+	{
+		memcpy(segmenter->pat, packet, TS_PACKETSIZE);
+		/// the first program of the PAT gives the pid of the PMT
+		int offset = 5 + packet[4] + 8;
+		for (; offset + 4 <= TS_PACKETSIZE - 4; offset += 4)
+		{
+			int program = (packet[offset] << 8) | packet[offset + 1];
+			if (program == 0)
+				continue;
+			segmenter->pmtpid = ((packet[offset + 2] & 0x1F) << 8) | packet[offset + 3];
+			break;
+		}
+	}
+	else if (pid == segmenter->pmtpid && pusi)
+	{
+		memcpy(segmenter->pmt, packet, TS_PACKETSIZE);
+		segmenter->haspmt = 1;
+		/// the PCR_PID follows the header of the section
+		int section = 5 + packet[4];
+		if (section + 10 <= TS_PACKETSIZE)
+			segmenter->pcrpid = ((packet[section + 8] & 0x1F) << 8) | packet[section + 9];
+	}
+
+	if (adaptation && packet[4] >= 7 && (packet[5] & 0x10) &&
+		(segmenter->pcrpid == -1 || pid == segmenter->pcrpid))
+	{
+		/// the base of the PCR is enough at 90 kHz
+		uint64_t base = ((uint64_t)packet[6] << 25) | ((uint64_t)packet[7] << 17) |
+						((uint64_t)packet[8] << 9) | ((uint64_t)packet[9] << 1) | (packet[10] >> 7);
+		_segmenter_clock(segmenter, base, TS_CLOCK, TS_PCRMASK);
+	}
+
+	int rap = adaptation && packet[4] > 0 && (packet[5] & 0x40);
+	if (segmenter->fdsegment != -1)
+	{
+		double elapsed = _segmenter_elapsed(segmenter);
+		if ((rap && elapsed >= segmenter->config->duration * SEGMENTER_JITTER) ||
+			elapsed >= 2 * segmenter->config->duration)
+			_segmenter_publish(segmenter);
+	}
+	if (segmenter->fdsegment == -1)
+	{
+		_segmenter_open(segmenter);
+		if (segmenter->fdsegment == -1)
+			return;
+		if (segmenter->haspmt && pid != 0)
+		{
+			_segmenter_output(segmenter, segmenter->pat, TS_PACKETSIZE);
+			_segmenter_output(segmenter, segmenter->pmt, TS_PACKETSIZE);
+		}
+	}
+	_segmenter_output(segmenter, packet, TS_PACKETSIZE);
+}
+
+static void _segmenter_ts(_segmenter_t *segmenter, const uint8_t *data, size_t length)
+{
+	while (length > 0)
+	{
+		/// the stream resynchronizes on the sync byte after an error
+		if (segmenter->packetlength == 0 && *data != TS_SYNC)
+		{
+			const uint8_t *sync = memchr(data, TS_SYNC, length);
+			if (sync == NULL)
+				return;
+			length -= sync - data;
+			data = sync;
+		}
+		size_t chunk = TS_PACKETSIZE - segmenter->packetlength;
+		if (chunk > length)
+			chunk = length;
+		memcpy(segmenter->packet + segmenter->packetlength, data, chunk);
+		segmenter->packetlength += chunk;
+		data += chunk;
+		length -= chunk;
+		if (segmenter->packetlength == TS_PACKETSIZE)
+		{
+			_segmenter_tspacket(segmenter);
+			segmenter->packetlength = 0;
+		}
+	}
+}
+
+static int _segmenter_append(uint8_t **buffer, size_t *bufferlength, const uint8_t *data, size_t length)
+{
+	if (*bufferlength + length > SEGMENTER_INITMAX)
+		return EREJECT;
+	uint8_t *newbuffer = realloc(*buffer, *bufferlength + length);
+	if (newbuffer == NULL)
+		return EREJECT;
+	*buffer = newbuffer;
+	memcpy(*buffer + *bufferlength, data, length);
+	*bufferlength += length;
+	return ESUCCESS;
+}
+
+static void _segmenter_emit(_segmenter_t *segmenter, const uint8_t *data, size_t length)
+{
+	switch (segmenter->target)
+	{
+	case SEGMENTER_INIT:
+		if (_segmenter_append(&segmenter->init, &segmenter->initlength, data, length) != ESUCCESS)
+		{
+			err("webstream: segmenter init segment too large");
+			segmenter->target = SEGMENTER_DROP;
+		}
+	break;
+	case SEGMENTER_FRAGMENT:
+		if (_segmenter_append(&segmenter->fragment, &segmenter->fragmentlength, data, length) != ESUCCESS)
+		{
+			err("webstream: segmenter fragment too large");
+			segmenter->target = SEGMENTER_DROP;
+		}
+	break;
+	case SEGMENTER_SEGMENT:
+		_segmenter_output(segmenter, data, length);
+	break;
+	default:
+	break;
+	}
+}
+
+/**
+ * returns the content of the first box of the type into a list of boxes
+ */
+static const uint8_t *_segmenter_findbox(const uint8_t *data, size_t length, const char *type, size_t *boxlength)
+{
+	size_t offset = 0;
+	while (offset + 8 <= length)
+	{
+		uint64_t size = ((uint32_t)data[offset] << 24) | (data[offset + 1] << 16) |
+						(data[offset + 2] << 8) | data[offset + 3];
+		size_t header = 8;
+		if (size == 1 && offset + 16 <= length)
+		{
+			size = 0;
+			for (int i = 8; i < 16; i++)
+				size = (size << 8) | data[offset + i];
+			header = 16;
+		}
+		else if (size == 0)
+			size = length - offset;
+		if (size < header || size > length - offset)
+			return NULL;
+		if (!memcmp(data + offset + 4, type, 4))
+		{
+			*boxlength = size - header;
+			return data + offset + header;
+		}
+		offset += size;
+	}
+	return NULL;
+}
+
+/// the timescale of the first track: moov/trak/mdia/mdhd
+static uint32_t _segmenter_timescale(const uint8_t *init, size_t length)
+{
+	const char *path[] = {"moov", "trak", "mdia", "mdhd"};
+	const uint8_t *box = init;
+	for (int i = 0; i < 4 && box != NULL; i++)
+		box = _segmenter_findbox(box, length, path[i], &length);
+	/// version, flags, then the creation and modification times of 32 or 64 bits
+	size_t offset = (box != NULL && box[0] == 1)? 20: 12;
+	if (box == NULL || length < offset + 4)
+		return 0;
+	return ((uint32_t)box[offset] << 24) | (box[offset + 1] << 16) | (box[offset + 2] << 8) | box[offset + 3];
+}
+
+/// the decode time of the first track of the fragment: moof/traf/tfdt
+static int _segmenter_decodetime(const uint8_t *fragment, size_t length, uint64_t *time)
+{
+	const char *path[] = {"moof", "traf", "tfdt"};
+	const uint8_t *box = fragment;
+	for (int i = 0; i < 3 && box != NULL; i++)
+		box = _segmenter_findbox(box, length, path[i], &length);
+	size_t size = (box != NULL && box[0] == 1)? 8: 4;
+	if (box == NULL || length < 4 + size)
+		return EREJECT;
+	*time = 0;
+	for (size_t i = 0; i < size; i++)
+		*time = (*time << 8) | box[4 + i];
+	return ESUCCESS;
+}
+
+/**
+ * the fragment is complete with its moof: the segment in progress is
+ * published when the decode time of the fragment reaches the duration
+ */
+static void _segmenter_fragmentdone(_segmenter_t *segmenter)
+{
+	if (segmenter->target != SEGMENTER_FRAGMENT)
+		return;
+	uint64_t time = 0;
+	if (segmenter->timescale > 0 &&
+		_segmenter_decodetime(segmenter->fragment, segmenter->fragmentlength, &time) == ESUCCESS)
+		_segmenter_clock(segmenter, time, segmenter->timescale, UINT64_MAX);
+	if (segmenter->fdsegment != -1 &&
+		_segmenter_elapsed(segmenter) >= segmenter->config->duration * SEGMENTER_JITTER)
+		_segmenter_publish(segmenter);
+	if (segmenter->fdsegment == -1 && segmenter->hasinit)
+		_segmenter_open(segmenter);
+	segmenter->target = SEGMENTER_DROP;
+	if (segmenter->fdsegment != -1)
+	{
+		_segmenter_output(segmenter, segmenter->fragment, segmenter->fragmentlength);
+		segmenter->target = SEGMENTER_SEGMENT;
+	}
+	segmenter->fragmentlength = 0;
+}
+
+static void _segmenter_box(_segmenter_t *segmenter, uint64_t size)
+{
+	const char *type = (const char *)segmenter->box + 4;
+	segmenter->moov = 0;
+	segmenter->moof = 0;
+	if (!memcmp(type, "ftyp", 4))
+	{
+		/// a new init segment starts
+		segmenter->initlength = 0;
+		segmenter->target = SEGMENTER_INIT;
+	}
+	else if (!memcmp(type, "moov", 4))
+	{
+		segmenter->target = SEGMENTER_INIT;
+		segmenter->moov = 1;
+	}
+	else if (!memcmp(type, "styp", 4) || !memcmp(type, "moof", 4))
+	{
+		/// the styp stays with the next moof
+		if (segmenter->target != SEGMENTER_FRAGMENT)
+			segmenter->fragmentlength = 0;
+		segmenter->target = SEGMENTER_FRAGMENT;
+		segmenter->moof = !memcmp(type, "moof", 4);
+	}
+	else if (segmenter->target == SEGMENTER_INIT)
+		/// the boxes between moov and the first fragment are dropped
+		segmenter->target = (segmenter->fdsegment != -1)? SEGMENTER_SEGMENT: SEGMENTER_DROP;
+	_segmenter_emit(segmenter, segmenter->box, segmenter->boxlength);
+	segmenter->boxrest = size - segmenter->boxlength;
+	segmenter->boxlength = 0;
+}
+
+static void _segmenter_initdone(_segmenter_t *segmenter)
+{
+	if (segmenter->target != SEGMENTER_INIT)
+		return;
+	char name[sizeof(segmenter->name) + 8];
+	snprintf(name, sizeof(name), "%s.mp4", segmenter->name);
+	if (_segmenter_replace(segmenter, name, segmenter->init, segmenter->initlength) == ESUCCESS)
+	{
+		segmenter->timescale = _segmenter_timescale(segmenter->init, segmenter->initlength);
+		/// the segments of a new init are not decoded with the previous one
+		if (segmenter->hasinit)
+			segmenter->nextdiscontinuity = 1;
+		segmenter->hasinit = 1;
+	}
+	segmenter->target = SEGMENTER_DROP;
+}
+
+static void _segmenter_fmp4(_segmenter_t *segmenter, const uint8_t *data, size_t length)
+{
+	while (length > 0)
+	{
+		if (segmenter->boxrest == 0)
+		{
+			/// the header of the box: size, type and optional 64 bits size
+			size_t header = (segmenter->boxlength < 8)? 8: 16;
+			size_t chunk = header - segmenter->boxlength;
+			if (chunk > length)
+				chunk = length;
+			memcpy(segmenter->box + segmenter->boxlength, data, chunk);
+			segmenter->boxlength += chunk;
+			data += chunk;
+			length -= chunk;
+			if (segmenter->boxlength < 8)
+				continue;
+			uint64_t size = ((uint32_t)segmenter->box[0] << 24) | (segmenter->box[1] << 16) |
+							(segmenter->box[2] << 8) | segmenter->box[3];
+			if (size == 1)
+			{
+				if (segmenter->boxlength < 16)
+					continue;
+				size = 0;
+				for (int i = 8; i < 16; i++)
+					size = (size << 8) | segmenter->box[i];
+			}
+			if (size < segmenter->boxlength)
+			{
+				err("webstream: segmenter bad box");
+				segmenter->boxlength = 0;
+				segmenter->target = SEGMENTER_DROP;
+				continue;
+			}
+			_segmenter_box(segmenter, size);
+		}
+		else
+		{
+			size_t chunk = length;
+			if (chunk > segmenter->boxrest)
+				chunk = segmenter->boxrest;
+			_segmenter_emit(segmenter, data, chunk);
+			segmenter->boxrest -= chunk;
+			data += chunk;
+			length -= chunk;
+		}
+		if (segmenter->boxrest == 0 && segmenter->boxlength == 0 && segmenter->moov)
+		{
+			segmenter->moov = 0;
+			_segmenter_initdone(segmenter);
+		}
+		if (segmenter->boxrest == 0 && segmenter->boxlength == 0 && segmenter->moof)
+		{
+			segmenter->moof = 0;
+			_segmenter_fragmentdone(segmenter);
+		}
+	}
+}
+
+static int _segmenter_connect(int fdroot, const char *stream)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", stream);
+	if (fchdir(fdroot) != 0)
+		return -1;
+
+	/// the streamer may be a stream or a packet socket
+	int types[] = {SOCK_STREAM, SOCK_SEQPACKET};
+	for (int i = 0; i < (int)(sizeof(types) / sizeof(*types)); i++)
+	{
+		int sock = socket(AF_UNIX, types[i] | SOCK_CLOEXEC, 0);
+		if (sock == -1)
+			return -1;
+		if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+			return sock;
+		close(sock);
+		if (errno != EPROTOTYPE)
+			break;
+	}
+	return -1;
+}
+
+static void _segmenter_reset(_segmenter_t *segmenter)
+{
+	_segmenter_publish(segmenter);
+	segmenter->nextdiscontinuity = 1;
+	segmenter->packetlength = 0;
+	segmenter->boxlength = 0;
+	segmenter->boxrest = 0;
+	segmenter->moov = 0;
+	segmenter->moof = 0;
+	segmenter->fragmentlength = 0;
+	/// the timestamps of the next connection start again
+	segmenter->hasclock = 0;
+	segmenter->target = SEGMENTER_DROP;
+}
+
+/**
+ * The segmenter is forked before the server changes its owner. It gives
+ * the directory created here to the user of the server and leaves root
+ * for this user without way back, the workers run with the same user.
+ */
+static int _segmenter_setowner(const webstream_segmenter_t *config, int fddir, int created)
+{
+#ifdef HAVE_PWD
+	if (config->user == NULL || getuid() != 0)
+		return ESUCCESS;
+	struct passwd *pw = getpwnam(config->user);
+	if (pw == NULL)
+	{
+		err("webstream: segmenter user %s not found", config->user);
+		return EREJECT;
+	}
+	/// after a reload the effective user is already the one of the server
+	if (geteuid() != 0 && seteuid(0) != 0)
+	{
+		err("webstream: segmenter change owner error %m");
+		return EREJECT;
+	}
+	if (created && fchown(fddir, pw->pw_uid, pw->pw_gid) != 0)
+		warn("webstream: segmenter directory %s owner error %m", config->path);
+	if (initgroups(pw->pw_name, pw->pw_gid) != 0 ||
+		setgid(pw->pw_gid) != 0 || setuid(pw->pw_uid) != 0)
+	{
+		err("webstream: segmenter change owner error %m");
+		return EREJECT;
+	}
+#endif
+	return ESUCCESS;
+}
+
+static int _segmenter_directory(const webstream_segmenter_t *config)
+{
+	int created = (mkdir(config->path, 0755) == 0);
+	if (!created && errno != EEXIST)
+	{
+		err("webstream: segmenter directory %s error %m", config->path);
+		return -1;
+	}
+	int fddir = open(config->path, O_DIRECTORY | O_CLOEXEC);
+	if (fddir == -1)
+	{
+		err("webstream: segmenter directory %s error %m", config->path);
+		return -1;
+	}
+	if (_segmenter_setowner(config, fddir, created) != ESUCCESS)
+	{
+		close(fddir);
+		return -1;
+	}
+	int fdlock = openat(fddir, ".lock", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fdlock == -1 || flock(fdlock, LOCK_EX) != 0)
+	{
+		err("webstream: segmenter lock of %s error %m", config->path);
+		close(fddir);
+		return -1;
+	}
+	/// the lock is kept until the end of the process
+	return fddir;
+}
+
+/// the segments of a previous segmenter are not into the new playlist
+static void _segmenter_clean(_segmenter_t *segmenter)
+{
+	int fd = dup(segmenter->fddir);
+	DIR *dir = (fd != -1)? fdopendir(fd): NULL;
+	if (dir == NULL)
+	{
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	size_t namelength = strlen(segmenter->name);
+	const char *ext = _segmenter_extension(segmenter);
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		/// only the names of the segments: <name><sequence>.<ext>
+		if (strncmp(entry->d_name, segmenter->name, namelength))
+			continue;
+		const char *sequence = entry->d_name + namelength;
+		const char *dot = sequence;
+		while (*dot >= '0' && *dot <= '9')
+			dot++;
+		if (dot != sequence && *dot == '.' && !strcmp(dot + 1, ext))
+			unlinkat(segmenter->fddir, entry->d_name, 0);
+	}
+	closedir(dir);
+}
+
+static void _segmenter_main(const webstream_segmenter_t *config, int fdroot)
+{
+	int fddir = _segmenter_directory(config);
+	if (fddir == -1)
+		return;
+	_segmenter_t *segmenter = calloc(1, sizeof(*segmenter));
+	uint8_t *buffer = malloc(SEGMENTER_BUFFERSIZE);
+	if (segmenter == NULL || buffer == NULL)
+		return;
+	segmenter->config = config;
+	segmenter->fddir = fddir;
+	segmenter->fdsegment = -1;
+	segmenter->pmtpid = -1;
+	segmenter->pcrpid = -1;
+	/// the sequence continues after a restart of the server
+	segmenter->sequence = time(NULL);
+	segmenter->first = segmenter->sequence;
+	char *stream = strdup(config->stream);
+	snprintf(segmenter->name, sizeof(segmenter->name), "%s", basename(stream));
+	char *ext = strrchr(segmenter->name, '.');
+	if (ext != NULL && ext != segmenter->name)
+		*ext = '\0';
+	free(stream);
+	_segmenter_clean(segmenter);
+
+	while (1)
+	{
+		int sock = _segmenter_connect(fdroot, config->stream);
+		if (sock == -1)
+		{
+			sleep(1);
+			continue;
+		}
+		warn("webstream: segmenter %s connected", config->stream);
+		ssize_t length;
+		while ((length = recv(sock, buffer, SEGMENTER_BUFFERSIZE, 0)) != 0)
+		{
+			if (length < 0 && errno == EINTR)
+				continue;
+			if (length < 0)
+				break;
+			if (config->format == SEGMENTER_FMP4)
+				_segmenter_fmp4(segmenter, buffer, length);
+			else
+				_segmenter_ts(segmenter, buffer, length);
+		}
+		close(sock);
+		warn("webstream: segmenter %s disconnected", config->stream);
+		/// the next segment follows a break of the stream
+		_segmenter_reset(segmenter);
+		sleep(1);
+	}
+}
+
+int segmenter_start(webstream_segmenter_t *segmenters, int fdroot)
+{
+	pid_t parent = getpid();
+	for (webstream_segmenter_t *segmenter = segmenters; segmenter != NULL; segmenter = segmenter->next)
+	{
+		segmenter->parent = parent;
+		segmenter->pid = fork();
+		if (segmenter->pid == -1)
+		{
+			err("webstream: segmenter %s error %m", segmenter->stream);
+			return EREJECT;
+		}
+		if (segmenter->pid == 0)
+		{
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGINT, SIG_DFL);
+			signal(SIGHUP, SIG_DFL);
+			signal(SIGPIPE, SIG_IGN);
+			/// the segmenter stops with the server
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			if (getppid() != parent)
+				exit(0);
+			_segmenter_main(segmenter, fdroot);
+			exit(-1);
+		}
+		dbg("webstream: segmenter %s into %s (%d)", segmenter->stream, segmenter->path, segmenter->pid);
+	}
+	return ESUCCESS;
+}
+
+void segmenter_stop(webstream_segmenter_t *segmenters)
+{
+	webstream_segmenter_t *next = NULL;
+	for (webstream_segmenter_t *segmenter = segmenters; segmenter != NULL; segmenter = next)
+	{
+		next = segmenter->next;
+		/// the workers inherit the segmenters of the master
+		if (segmenter->pid > 0 && segmenter->parent == getpid())
+		{
+			kill(segmenter->pid, SIGTERM);
+			waitpid(segmenter->pid, NULL, 0);
+		}
+		free(segmenter);
+	}
+}
@@ -0,0 +1,609 @@
+/*****************************************************************************
+ * workers.c: SO_REUSEPORT workers of the servers
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2024
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    The listening sockets are created by libhttpserver during
+    httpserver_connect. In workers mode each listener is replaced by a
+    group of SO_REUSEPORT sockets, one per worker, bound to the same
+    address. The master keeps the whole group opened, then the index of
+    each socket into the group stays the same when a worker is respawned
+    and the pending connections of a dead worker wait for the new one.
+    Each worker moves its socket onto the file descriptor known by
+    libhttpserver and closes the others.
+    When there is one worker per CPU allowed to the master, the worker i
+    is pinned on the i-th CPU of the set and a classic BPF program selects
+    the socket of the worker of the CPU which receives the connection.
+    The listening sockets are given by the servers, libhttpserver keeps
+    them private and workers_listeners finds the new ones after
+    httpserver_connect.
+    After a reload, a new worker starts with the new servers on the same
+    socket, and the previous one drains: it replaces its listeners with
+    sockets which never receive a connection, ends its clients in
+    progress and exits. The master stops it after WORKERS_DRAINTIMEOUT.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <linux/filter.h>
+#endif
+
+#include "workers.h"
+
+#include "log.h"
+
+#define WORKERS_MAXLISTENERS 16
+
+typedef struct _workers_listener_s _workers_listener_t;
+struct _workers_listener_s
+{
+	int fd;
+	int *group;
+};
+
+typedef struct _workers_s _workers_t;
+struct _workers_s
+{
+	int nworkers;
+	int affinity;
+	/// the CPU of each worker, taken from the affinity of the master
+	int *cpus;
+	pid_t *pids;
+	time_t *starts;
+	/// the previous workers ending their clients after a reload
+	pid_t *drains;
+	time_t *ends;
+	int nlisteners;
+	_workers_listener_t listeners[WORKERS_MAXLISTENERS];
+};
+
+static _workers_t *g_workers = NULL;
+
+/// the listeners stopped by the drain of the process
+static int g_stoppedfds[WORKERS_MAXLISTENERS];
+static int g_nstopped = 0;
+
+static int _workers_islistener(int fd, struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	int value = 0;
+	socklen_t length = sizeof(value);
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &value, &length) < 0 || !value)
+		return 0;
+	length = sizeof(value);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &value, &length) < 0 || value != SOCK_STREAM)
+		return 0;
+	if (getsockname(fd, (struct sockaddr *)addr, addrlen) < 0)
+		return 0;
+	return (addr->ss_family == AF_INET || addr->ss_family == AF_INET6);
+}
+
+typedef struct _workers_options_s _workers_options_t;
+struct _workers_options_s
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int fdflags;
+	int flflags;
+	int v6only;
+};
+
+static int _workers_socket(const _workers_options_t *options, int reuseport)
+{
+	int sock = socket(options->addr.ss_family, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	/// the new socket keeps the options of the libhttpserver's one
+	fcntl(sock, F_SETFD, options->fdflags);
+	fcntl(sock, F_SETFL, options->flflags);
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+	{
+		err("workers: SO_REUSEPORT not supported %s", strerror(errno));
+		close(sock);
+		return -1;
+	}
+	if (options->addr.ss_family == AF_INET6)
+		setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &options->v6only, sizeof(options->v6only));
+	if (bind(sock, (const struct sockaddr *)&options->addr, options->addrlen) < 0 ||
+		listen(sock, SOMAXCONN) < 0)
+	{
+		err("workers: bind error %s", strerror(errno));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static void _workers_affinity(const _workers_t *workers, int sock)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+	/**
+	 * the index of the socket into the group is the index of the CPU
+	 * into the set of the master. The other CPUs return an index out of
+	 * the group and the kernel falls back to the hash of the connection.
+	 */
+	int length = 2 * workers->nworkers + 2;
+	struct sock_filter *code = calloc(length, sizeof(*code));
+	if (code == NULL)
+		return;
+	int pc = 0;
+	code[pc++] = (struct sock_filter){ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+	for (int i = 0; i < workers->nworkers; i++)
+	{
+		code[pc++] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, workers->cpus[i] };
+		code[pc++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, i };
+	}
+	code[pc++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, workers->nworkers };
+	struct sock_fprog prog =
+	{
+		.len = pc,
+		.filter = code,
+	};
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+		warn("workers: cpu affinity not supported %s", strerror(errno));
+	free(code);
+#endif
+}
+
+static int _workers_group(_workers_t *workers, int fd)
+{
+	_workers_options_t options = {0};
+	options.addrlen = sizeof(options.addr);
+	if (!_workers_islistener(fd, &options.addr, &options.addrlen))
+		return -1;
+	if (workers->nlisteners == WORKERS_MAXLISTENERS)
+	{
+		err("workers: too many listeners");
+		return -1;
+	}
+	options.fdflags = fcntl(fd, F_GETFD);
+	options.flflags = fcntl(fd, F_GETFL);
+	if (options.addr.ss_family == AF_INET6)
+	{
+		socklen_t length = sizeof(options.v6only);
+		getsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &options.v6only, &length);
+	}
+
+	_workers_listener_t *listener = &workers->listeners[workers->nlisteners];
+	listener->group = calloc(workers->nworkers, sizeof(*listener->group));
+	if (listener->group == NULL)
+		return -1;
+	listener->fd = fd;
+	/**
+	 * the libhttpserver's socket is not created with SO_REUSEPORT.
+	 * It is released to allow the group to bind the same address.
+	 */
+	close(fd);
+	for (int i = 0; i < workers->nworkers; i++)
+	{
+		listener->group[i] = _workers_socket(&options, 1);
+		if (listener->group[i] < 0)
+		{
+			while (i-- > 0)
+				close(listener->group[i]);
+			free(listener->group);
+			/// restore a simple listener for libhttpserver
+			int sock = _workers_socket(&options, 0);
+			if (sock >= 0 && sock != fd)
+			{
+				dup2(sock, fd);
+				close(sock);
+			}
+			return -1;
+		}
+	}
+	/// the first worker's socket takes the place of the libhttpserver's one
+	if (listener->group[0] != fd)
+	{
+		dup2(listener->group[0], fd);
+		close(listener->group[0]);
+		listener->group[0] = fd;
+	}
+	if (workers->affinity)
+		_workers_affinity(workers, fd);
+	workers->nlisteners++;
+	return 0;
+}
+
+static void _workers_free(_workers_t *workers)
+{
+	for (int i = 0; i < workers->nlisteners; i++)
+	{
+		for (int j = 1; j < workers->nworkers; j++)
+			close(workers->listeners[i].group[j]);
+		free(workers->listeners[i].group);
+	}
+	free(workers->cpus);
+	free(workers->pids);
+	free(workers->starts);
+	free(workers->drains);
+	free(workers->ends);
+	free(workers);
+}
+
+/**
+ * the sockets of the other workers are not visible from libhttpserver
+ */
+static int _workers_isgroup(int fd)
+{
+	_workers_t *workers = g_workers;
+	if (workers == NULL)
+		return 0;
+	for (int i = 0; i < workers->nlisteners; i++)
+	{
+		for (int j = 1; j < workers->nworkers; j++)
+		{
+			if (workers->listeners[i].group[j] == fd)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static int _workers_isstopped(int fd)
+{
+	for (int i = 0; i < g_nstopped; i++)
+	{
+		if (g_stoppedfds[i] == fd)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * libhttpserver doesn't give its sockets: the listeners created by
+ * httpserver_connect are the new ones of the process. The servers keep
+ * them, the other functions use the sockets of the servers.
+ */
+int workers_listeners(int *fds, int max)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	if (dir == NULL)
+	{
+		err("workers: listeners not found %s", strerror(errno));
+		return -1;
+	}
+	int nfds = 0;
+	for (struct dirent *entry = readdir(dir); entry != NULL && nfds < max; entry = readdir(dir))
+	{
+		int fd = atoi(entry->d_name);
+		if (entry->d_name[0] == '.' || fd == dirfd(dir))
+			continue;
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+		if (_workers_islistener(fd, &addr, &addrlen) && !_workers_isgroup(fd) &&
+			!_workers_isstopped(fd))
+			fds[nfds++] = fd;
+	}
+	closedir(dir);
+	return nfds;
+}
+
+static void _workers_cpus(_workers_t *workers)
+{
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	if (sched_getaffinity(0, sizeof(cpuset), &cpuset) < 0 ||
+		CPU_COUNT(&cpuset) != workers->nworkers)
+		return;
+	workers->cpus = calloc(workers->nworkers, sizeof(*workers->cpus));
+	if (workers->cpus == NULL)
+		return;
+	int id = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE && id < workers->nworkers; cpu++)
+	{
+		if (CPU_ISSET(cpu, &cpuset))
+			workers->cpus[id++] = cpu;
+	}
+	workers->affinity = 1;
+}
+
+int workers_create(int nworkers, const int *fds, int nfds)
+{
+	if (nworkers < 2)
+		return -1;
+	_workers_t *workers = calloc(1, sizeof(*workers));
+	if (workers == NULL)
+		return -1;
+	workers->nworkers = nworkers;
+	workers->pids = calloc(nworkers, sizeof(*workers->pids));
+	workers->starts = calloc(nworkers, sizeof(*workers->starts));
+	workers->drains = calloc(nworkers, sizeof(*workers->drains));
+	workers->ends = calloc(nworkers, sizeof(*workers->ends));
+	if (workers->pids == NULL || workers->starts == NULL ||
+		workers->drains == NULL || workers->ends == NULL)
+	{
+		_workers_free(workers);
+		return -1;
+	}
+	/// one worker per CPU allowed to the master
+	_workers_cpus(workers);
+
+	for (int i = 0; i < nfds; i++)
+		_workers_group(workers, fds[i]);
+
+	if (workers->nlisteners == 0)
+	{
+		err("workers: no listener");
+		_workers_free(workers);
+		return -1;
+	}
+	warn("workers: %d workers on %d listeners%s", nworkers, workers->nlisteners,
+		(workers->affinity)? " with cpu affinity": "");
+	g_workers = workers;
+	return 0;
+}
+
+static pid_t _workers_start(_workers_t *workers, int id)
+{
+	pid_t pid = fork();
+	if (pid != 0)
+	{
+		if (pid < 0)
+			err("workers: fork error %s", strerror(errno));
+		workers->pids[id] = pid;
+		workers->starts[id] = time(NULL);
+		return pid;
+	}
+#ifdef __linux__
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+	/// only the master reloads the configuration
+	signal(SIGHUP, SIG_IGN);
+	if (workers->affinity)
+	{
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(workers->cpus[id], &cpuset);
+		if (sched_setaffinity(0, sizeof(cpuset), &cpuset) < 0)
+			warn("workers: affinity error %s", strerror(errno));
+	}
+	for (int i = 0; i < workers->nlisteners; i++)
+	{
+		_workers_listener_t *listener = &workers->listeners[i];
+		if (id > 0)
+			dup2(listener->group[id], listener->fd);
+		for (int j = 1; j < workers->nworkers; j++)
+			close(listener->group[j]);
+	}
+	return 0;
+}
+
+void workers_movelistener(int oldfd, int newfd)
+{
+	_workers_t *workers = g_workers;
+	if (workers == NULL)
+		return;
+	for (int i = 0; i < workers->nlisteners; i++)
+	{
+		if (workers->listeners[i].fd == oldfd)
+		{
+			workers->listeners[i].fd = newfd;
+			workers->listeners[i].group[0] = newfd;
+		}
+	}
+}
+
+/**
+ * the listener keeps its file descriptor for libhttpserver, but the socket
+ * is bound to a free port of the loopback and nobody connects on it.
+ * The socket of the group stays opened by the master and the new worker.
+ */
+int workers_stoplistener(int fd)
+{
+	_workers_options_t options = {0};
+	options.addrlen = sizeof(options.addr);
+	if (!_workers_islistener(fd, &options.addr, &options.addrlen))
+		return -1;
+	if (g_nstopped == WORKERS_MAXLISTENERS)
+		return -1;
+	options.fdflags = fcntl(fd, F_GETFD);
+	options.flflags = fcntl(fd, F_GETFL);
+	if (options.addr.ss_family == AF_INET6)
+	{
+		struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&options.addr;
+		addr->sin6_addr = in6addr_loopback;
+		addr->sin6_port = 0;
+	}
+	else
+	{
+		struct sockaddr_in *addr = (struct sockaddr_in *)&options.addr;
+		addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr->sin_port = 0;
+	}
+	int sock = _workers_socket(&options, 0);
+	if (sock < 0)
+		return -1;
+	dup2(sock, fd);
+	close(sock);
+	g_stoppedfds[g_nstopped] = fd;
+	g_nstopped++;
+	return 0;
+}
+
+static void _workers_drain(_workers_t *workers, int id)
+{
+	/// a worker still draining from a previous reload is stopped now
+	if (workers->drains[id] > 0)
+		kill(workers->drains[id], SIGTERM);
+	workers->drains[id] = workers->pids[id];
+	workers->ends[id] = time(NULL) + WORKERS_DRAINTIMEOUT;
+	workers->pids[id] = 0;
+	kill(workers->drains[id], SIGQUIT);
+}
+
+/**
+ * a draining worker is stopped at the end of the timeout,
+ * and killed one second later.
+ */
+static int _workers_draining(_workers_t *workers)
+{
+	int count = 0;
+	time_t now = time(NULL);
+	for (int i = 0; i < workers->nworkers; i++)
+	{
+		if (workers->drains[i] <= 0)
+			continue;
+		if (now > workers->ends[i])
+			kill(workers->drains[i], SIGKILL);
+		else if (now == workers->ends[i])
+		{
+			warn("workers: worker %d drain timeout", i);
+			kill(workers->drains[i], SIGTERM);
+		}
+		count++;
+	}
+	return count;
+}
+
+static int _workers_reaped(_workers_t *workers, pid_t pid)
+{
+	for (int i = 0; i < workers->nworkers; i++)
+	{
+		if (workers->drains[i] == pid)
+		{
+			dbg("workers: worker %d drained", i);
+			workers->drains[i] = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int _workers_alive(pid_t *pid)
+{
+	if (*pid <= 0)
+		return 0;
+	if (waitpid(*pid, NULL, WNOHANG) != 0)
+	{
+		*pid = 0;
+		return 0;
+	}
+	return 1;
+}
+
+static void _workers_pause(void)
+{
+	struct timespec pause = {0, 100000000};
+	nanosleep(&pause, NULL);
+}
+
+int workers_run(const char *run)
+{
+	_workers_t *workers = g_workers;
+	if (workers == NULL)
+		return -1;
+
+	for (int i = 0; i < workers->nworkers; i++)
+	{
+		/**
+		 * after a reload, the previous worker ends its clients
+		 * while the new one accepts with the new servers.
+		 */
+		if (workers->pids[i] > 0)
+			_workers_drain(workers, i);
+		if (_workers_start(workers, i) == 0)
+			return i;
+	}
+
+	while (*run != 'q' && *run != 'd')
+	{
+		int status = 0;
+		int draining = _workers_draining(workers);
+		pid_t pid = waitpid(-1, &status, (draining > 0)? WNOHANG: 0);
+		if (*run == 'r')
+			return WORKERS_RELOAD;
+		if (pid == 0)
+		{
+			_workers_pause();
+			continue;
+		}
+		if (pid < 0 && errno == ECHILD)
+			break;
+		if (pid < 0 || _workers_reaped(workers, pid))
+			continue;
+		for (int i = 0; i < workers->nworkers && *run != 'q'; i++)
+		{
+			if (workers->pids[i] != pid)
+				continue;
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				err("workers: worker %d stopped (%d)", i, status);
+			/// a worker which crashes at the startup is not restarted in loop
+			if (time(NULL) - workers->starts[i] < 1)
+				sleep(1);
+			if (_workers_start(workers, i) == 0)
+				return i;
+		}
+	}
+
+	/// SIGQUIT stops the workers after their clients
+	for (int i = 0; i < workers->nworkers; i++)
+	{
+		if (workers->pids[i] > 0 && *run == 'd')
+			_workers_drain(workers, i);
+		else if (workers->pids[i] > 0)
+			kill(workers->pids[i], SIGTERM);
+		if (workers->drains[i] > 0 && *run != 'd')
+			kill(workers->drains[i], SIGTERM);
+	}
+	while (1)
+	{
+		int alive = 0;
+		for (int i = 0; i < workers->nworkers; i++)
+		{
+			alive += _workers_alive(&workers->pids[i]);
+			alive += _workers_alive(&workers->drains[i]);
+		}
+		if (alive == 0)
+			break;
+		_workers_draining(workers);
+		_workers_pause();
+	}
+	return -1;
+}
+
+void workers_destroy(void)
+{
+	if (g_workers == NULL)
+		return;
+	_workers_free(g_workers);
+	g_workers = NULL;
+}
@@ -0,0 +1,19 @@
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#define WORKERS_RELOAD -2
+/// seconds given to the clients in progress of a previous configuration
+#define WORKERS_DRAINTIMEOUT 10
+
+int workers_listeners(int *fds, int max);
+int workers_create(int nworkers, const int *fds, int nfds);
+int workers_run(const char *run);
+void workers_movelistener(int oldfd, int newfd);
+/**
+ * the drain of a process: the listener stops to accept the connections,
+ * the clients still connected stay on their sockets.
+ */
+int workers_stoplistener(int fd);
+void workers_destroy(void);
+
+#endif
@@ -46,6 +46,7 @@
 #include "mod_authmngt.h"
 #include "authz_sqlite.h"
 #include "authmngt_sqlite.h"
+#include "log.h"
 
 #define auth_dbg(...)
 
@@ -0,0 +1,641 @@
+/*****************************************************************************
+ * hpack.c: HTTP/2 header compression (RFC7541)
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/**
+    The static table and the Huffman code are constant and shared by all
+    the connections. Each connection owns two dynamic tables, one for the
+    decoding of the requests and one for the encoding of the responses.
+    A dynamic table is a ring of entries, the newest entry is the first
+    index after the static table.
+    The encoder indexes the fields which are repeated from a response to
+    the next one (server, content-type...), the values changing at each
+    response are sent without indexing.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/log.h"
+#include "log.h"
+
+#include "hpack.h"
+
+#define hpack_dbg(...)
+
+#define HPACK_FIELDMAX 8192
+#define HPACK_ENTRYOVERHEAD 32
+#define HPACK_HUFFMANMAX 30
+#define HPACK_EOS 256
+
+typedef struct hpack_field_s hpack_field_t;
+struct hpack_field_s
+{
+	const char *name;
+	size_t namelen;
+	const char *value;
+	size_t valuelen;
+};
+
+typedef struct hpack_entry_s hpack_entry_t;
+struct hpack_entry_s
+{
+	char *name;
+	size_t namelen;
+	char *value;
+	size_t valuelen;
+};
+
+struct hpack_table_s
+{
+	hpack_entry_t *entries;
+	unsigned int capacity;
+	unsigned int first;
+	unsigned int count;
+	size_t size;
+	size_t maxsize;
+	/// the size allowed by the settings
+	size_t limit;
+	/// the encoder has to send the new size
+	int update;
+};
+
+#define HPACK_FIELD(name, value) {name, sizeof(name) - 1, value, sizeof(value) - 1}
+static const hpack_field_t hpack_static[] =
+{
+	HPACK_FIELD(":authority", ""),
+	HPACK_FIELD(":method", "GET"),
+	HPACK_FIELD(":method", "POST"),
+	HPACK_FIELD(":path", "/"),
+	HPACK_FIELD(":path", "/index.html"),
+	HPACK_FIELD(":scheme", "http"),
+	HPACK_FIELD(":scheme", "https"),
+	HPACK_FIELD(":status", "200"),
+	HPACK_FIELD(":status", "204"),
+	HPACK_FIELD(":status", "206"),
+	HPACK_FIELD(":status", "304"),
+	HPACK_FIELD(":status", "400"),
+	HPACK_FIELD(":status", "404"),
+	HPACK_FIELD(":status", "500"),
+	HPACK_FIELD("accept-charset", ""),
+	HPACK_FIELD("accept-encoding", "gzip, deflate"),
+	HPACK_FIELD("accept-language", ""),
+	HPACK_FIELD("accept-ranges", ""),
+	HPACK_FIELD("accept", ""),
+	HPACK_FIELD("access-control-allow-origin", ""),
+	HPACK_FIELD("age", ""),
+	HPACK_FIELD("allow", ""),
+	HPACK_FIELD("authorization", ""),
+	HPACK_FIELD("cache-control", ""),
+	HPACK_FIELD("content-disposition", ""),
+	HPACK_FIELD("content-encoding", ""),
+	HPACK_FIELD("content-language", ""),
+	HPACK_FIELD("content-length", ""),
+	HPACK_FIELD("content-location", ""),
+	HPACK_FIELD("content-range", ""),
+	HPACK_FIELD("content-type", ""),
+	HPACK_FIELD("cookie", ""),
+	HPACK_FIELD("date", ""),
+	HPACK_FIELD("etag", ""),
+	HPACK_FIELD("expect", ""),
+	HPACK_FIELD("expires", ""),
+	HPACK_FIELD("from", ""),
+	HPACK_FIELD("host", ""),
+	HPACK_FIELD("if-match", ""),
+	HPACK_FIELD("if-modified-since", ""),
+	HPACK_FIELD("if-none-match", ""),
+	HPACK_FIELD("if-range", ""),
+	HPACK_FIELD("if-unmodified-since", ""),
+	HPACK_FIELD("last-modified", ""),
+	HPACK_FIELD("link", ""),
+	HPACK_FIELD("location", ""),
+	HPACK_FIELD("max-forwards", ""),
+	HPACK_FIELD("proxy-authenticate", ""),
+	HPACK_FIELD("proxy-authorization", ""),
+	HPACK_FIELD("range", ""),
+	HPACK_FIELD("referer", ""),
+	HPACK_FIELD("refresh", ""),
+	HPACK_FIELD("retry-after", ""),
+	HPACK_FIELD("server", ""),
+	HPACK_FIELD("set-cookie", ""),
+	HPACK_FIELD("strict-transport-security", ""),
+	HPACK_FIELD("transfer-encoding", ""),
+	HPACK_FIELD("user-agent", ""),
+	HPACK_FIELD("vary", ""),
+	HPACK_FIELD("via", ""),
+	HPACK_FIELD("www-authenticate", ""),
+};
+#define HPACK_STATICCOUNT (sizeof(hpack_static) / sizeof(hpack_static[0]))
+
+/// the values changing at each response are not indexed
+static const char *hpack_noindex[] =
+{
+	"content-length",
+	"date",
+	"age",
+	"etag",
+	"last-modified",
+	"expires",
+	"content-range",
+	"location",
+	NULL
+};
+
+/// the values must not be compressed by an intermediary
+static const char *hpack_sensitive[] =
+{
+	"set-cookie",
+	"authorization",
+	"www-authenticate",
+	NULL
+};
+
+typedef struct hpack_huffman_s hpack_huffman_t;
+struct hpack_huffman_s
+{
+	uint32_t code;
+	uint8_t length;
+};
+
+static const hpack_huffman_t hpack_huffman[HPACK_EOS + 1] =
+{
+	{0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+	{0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28}, {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+	{0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+	{0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+	{0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+	{0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+	{0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+	{0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+	{0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+	{0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+	{0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+	{0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+	{0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+	{0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+	{0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+	{0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+	{0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+	{0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+	{0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+	{0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+	{0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+	{0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+	{0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+	{0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+	{0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+	{0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+	{0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+	{0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+	{0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+	{0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+	{0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+	{0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+	{0x3fffffff, 30},
+};
+
+/// canonical decoding tables, built by hpack_init
+static uint32_t hpack_huffmanfirst[HPACK_HUFFMANMAX + 1];
+static uint16_t hpack_huffmancount[HPACK_HUFFMANMAX + 1];
+static uint16_t hpack_huffmanoffset[HPACK_HUFFMANMAX + 1];
+static uint16_t hpack_huffmansymbols[HPACK_EOS + 1];
+
+void hpack_init(void)
+{
+	if (hpack_huffmancount[hpack_huffman[0].length] > 0)
+		return;
+	/**
+	 * the code is canonical: the codes of the same length are
+	 * consecutive and sorted like the symbols
+	 */
+	uint16_t offset = 0;
+	for (int length = 1; length <= HPACK_HUFFMANMAX; length++)
+	{
+		hpack_huffmanoffset[length] = offset;
+		for (int symbol = 0; symbol <= HPACK_EOS; symbol++)
+		{
+			if (hpack_huffman[symbol].length != length)
+				continue;
+			if (hpack_huffmancount[length] == 0)
+				hpack_huffmanfirst[length] = hpack_huffman[symbol].code;
+			hpack_huffmansymbols[offset++] = symbol;
+			hpack_huffmancount[length]++;
+		}
+	}
+}
+
+static int _hpack_huffmandecode(const unsigned char *data, size_t length, char *out, size_t size)
+{
+	size_t outlen = 0;
+	uint32_t code = 0;
+	int codelen = 0;
+	for (size_t i = 0; i < length; i++)
+	{
+		for (int bit = 7; bit >= 0; bit--)
+		{
+			code = (code << 1) | ((data[i] >> bit) & 0x01);
+			codelen++;
+			if (codelen > HPACK_HUFFMANMAX)
+				return EREJECT;
+			uint32_t rank = code - hpack_huffmanfirst[codelen];
+			if (code < hpack_huffmanfirst[codelen] || rank >= hpack_huffmancount[codelen])
+				continue;
+			uint16_t symbol = hpack_huffmansymbols[hpack_huffmanoffset[codelen] + rank];
+			if (symbol == HPACK_EOS || outlen == size)
+				return EREJECT;
+			out[outlen++] = symbol;
+			code = 0;
+			codelen = 0;
+		}
+	}
+	/// the padding is the beginning of EOS, shorter than one byte
+	if (codelen > 7 || code != (uint32_t)((1 << codelen) - 1))
+		return EREJECT;
+	return outlen;
+}
+
+static size_t _hpack_huffmanlength(const char *data, size_t length)
+{
+	size_t bits = 0;
+	for (size_t i = 0; i < length; i++)
+		bits += hpack_huffman[(unsigned char)data[i]].length;
+	return (bits + 7) / 8;
+}
+
+static size_t _hpack_huffmanencode(const char *data, size_t length, unsigned char *out)
+{
+	uint64_t bits = 0;
+	int nbits = 0;
+	size_t outlen = 0;
+	for (size_t i = 0; i < length; i++)
+	{
+		const hpack_huffman_t *huffman = &hpack_huffman[(unsigned char)data[i]];
+		bits = (bits << huffman->length) | huffman->code;
+		nbits += huffman->length;
+		while (nbits >= 8)
+		{
+			nbits -= 8;
+			out[outlen++] = bits >> nbits;
+		}
+	}
+	if (nbits > 0)
+	{
+		/// the padding with the most significant bits of EOS
+		bits = (bits << (8 - nbits)) | (0xff >> nbits);
+		out[outlen++] = bits;
+	}
+	return outlen;
+}
+
+static int _hpack_intdecode(const unsigned char **data, const unsigned char *end, int prefix, size_t *value)
+{
+	const unsigned char *it = *data;
+	size_t mask = (1 << prefix) - 1;
+	*value = *it & mask;
+	it++;
+	if (*value == mask)
+	{
+		int shift = 0;
+		do
+		{
+			if (it == end || shift > 28)
+				return EREJECT;
+			*value += (size_t)(*it & 0x7f) << shift;
+			shift += 7;
+		} while (*it++ & 0x80);
+	}
+	*data = it;
+	return ESUCCESS;
+}
+
+static int _hpack_intencode(size_t value, int prefix, unsigned char flags, unsigned char *out, size_t size)
+{
+	size_t mask = (1 << prefix) - 1;
+	size_t length = 0;
+	if (size == 0)
+		return EREJECT;
+	if (value < mask)
+	{
+		out[length++] = flags | value;
+		return length;
+	}
+	out[length++] = flags | mask;
+	value -= mask;
+	while (value >= 0x80)
+	{
+		if (length == size)
+			return EREJECT;
+		out[length++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	if (length == size)
+		return EREJECT;
+	out[length++] = value;
+	return length;
+}
+
+static int _hpack_stringdecode(const unsigned char **data, const unsigned char *end, char *out, size_t size)
+{
+	if (*data == end)
+		return EREJECT;
+	int huffman = **data & 0x80;
+	size_t length = 0;
+	if (_hpack_intdecode(data, end, 7, &length) != ESUCCESS)
+		return EREJECT;
+	if (length > (size_t)(end - *data))
+		return EREJECT;
+	int ret;
+	if (huffman)
+		ret = _hpack_huffmandecode(*data, length, out, size);
+	else if (length <= size)
+	{
+		memcpy(out, *data, length);
+		ret = length;
+	}
+	else
+		ret = EREJECT;
+	*data += length;
+	return ret;
+}
+
+static int _hpack_stringencode(const char *data, size_t length, unsigned char *out, size_t size)
+{
+	size_t huffmanlength = _hpack_huffmanlength(data, length);
+	int ret;
+	if (huffmanlength < length)
+	{
+		ret = _hpack_intencode(huffmanlength, 7, 0x80, out, size);
+		if (ret < 0 || ret + huffmanlength > size)
+			return EREJECT;
+		ret += _hpack_huffmanencode(data, length, out + ret);
+	}
+	else
+	{
+		ret = _hpack_intencode(length, 7, 0x00, out, size);
+		if (ret < 0 || ret + length > size)
+			return EREJECT;
+		memcpy(out + ret, data, length);
+		ret += length;
+	}
+	return ret;
+}
+
+hpack_table_t *hpack_create(size_t maxsize)
+{
+	hpack_table_t *table = calloc(1, sizeof(*table));
+	if (table == NULL)
+		return NULL;
+	table->capacity = maxsize / HPACK_ENTRYOVERHEAD + 1;
+	table->entries = calloc(table->capacity, sizeof(*table->entries));
+	if (table->entries == NULL)
+	{
+		free(table);
+		return NULL;
+	}
+	table->maxsize = maxsize;
+	table->limit = maxsize;
+	return table;
+}
+
+static void _hpack_evict(hpack_table_t *table, size_t maxsize)
+{
+	while (table->count > 0 && table->size > maxsize)
+	{
+		unsigned int last = (table->first + table->count - 1) % table->capacity;
+		hpack_entry_t *entry = &table->entries[last];
+		table->size -= entry->namelen + entry->valuelen + HPACK_ENTRYOVERHEAD;
+		free(entry->name);
+		entry->name = NULL;
+		table->count--;
+	}
+}
+
+void hpack_destroy(hpack_table_t *table)
+{
+	_hpack_evict(table, 0);
+	free(table->entries);
+	free(table);
+}
+
+void hpack_resize(hpack_table_t *table, size_t maxsize)
+{
+	if (maxsize > table->limit)
+		maxsize = table->limit;
+	if (maxsize == table->maxsize)
+		return;
+	_hpack_evict(table, maxsize);
+	table->maxsize = maxsize;
+	table->update = 1;
+}
+
+static void _hpack_insert(hpack_table_t *table, const char *name, size_t namelen, const char *value, size_t valuelen)
+{
+	size_t size = namelen + valuelen + HPACK_ENTRYOVERHEAD;
+	/// a field larger than the table empties it
+	_hpack_evict(table, (size > table->maxsize)? 0: table->maxsize - size);
+	if (size > table->maxsize || table->count == table->capacity)
+		return;
+	table->first = (table->first + table->capacity - 1) % table->capacity;
+	hpack_entry_t *entry = &table->entries[table->first];
+	entry->name = malloc(namelen + valuelen + 1);
+	memcpy(entry->name, name, namelen);
+	entry->namelen = namelen;
+	entry->value = entry->name + namelen;
+	memcpy(entry->value, value, valuelen);
+	entry->valuelen = valuelen;
+	table->size += size;
+	table->count++;
+}
+
+static int _hpack_field(const hpack_table_t *table, size_t index, hpack_field_t *field)
+{
+	if (index == 0)
+		return EREJECT;
+	if (index <= HPACK_STATICCOUNT)
+	{
+		*field = hpack_static[index - 1];
+		return ESUCCESS;
+	}
+	index -= HPACK_STATICCOUNT + 1;
+	if (index >= table->count)
+		return EREJECT;
+	const hpack_entry_t *entry = &table->entries[(table->first + index) % table->capacity];
+	field->name = entry->name;
+	field->namelen = entry->namelen;
+	field->value = entry->value;
+	field->valuelen = entry->valuelen;
+	return ESUCCESS;
+}
+
+int hpack_decode(hpack_table_t *table, const unsigned char *data, size_t length, hpack_header_t cb, void *arg)
+{
+	const unsigned char *end = data + length;
+	char buffer[HPACK_FIELDMAX];
+	int fields = 0;
+	while (data < end)
+	{
+		size_t index = 0;
+		hpack_field_t field = {0};
+		if (*data & 0x80)
+		{
+			/// indexed field
+			if (_hpack_intdecode(&data, end, 7, &index) != ESUCCESS ||
+				_hpack_field(table, index, &field) != ESUCCESS)
+				return EREJECT;
+		}
+		else if ((*data & 0xe0) == 0x20)
+		{
+			/// dynamic table size update, only before the first field
+			if (_hpack_intdecode(&data, end, 5, &index) != ESUCCESS ||
+				fields > 0 || index > table->limit)
+				return EREJECT;
+			_hpack_evict(table, index);
+			table->maxsize = index;
+			continue;
+		}
+		else
+		{
+			int indexing = (*data & 0xc0) == 0x40;
+			int prefix = indexing? 6: 4;
+			if (_hpack_intdecode(&data, end, prefix, &index) != ESUCCESS)
+				return EREJECT;
+			size_t offset = 0;
+			if (index > 0)
+			{
+				if (_hpack_field(table, index, &field) != ESUCCESS ||
+					field.namelen > sizeof(buffer))
+					return EREJECT;
+				/// the table may evict the entry of the name
+				memcpy(buffer, field.name, field.namelen);
+				field.name = buffer;
+				offset = field.namelen;
+			}
+			else
+			{
+				int ret = _hpack_stringdecode(&data, end, buffer, sizeof(buffer));
+				if (ret < 0)
+					return EREJECT;
+				field.name = buffer;
+				field.namelen = ret;
+				offset = ret;
+			}
+			int ret = _hpack_stringdecode(&data, end, buffer + offset, sizeof(buffer) - offset);
+			if (ret < 0)
+				return EREJECT;
+			field.value = buffer + offset;
+			field.valuelen = ret;
+			if (indexing)
+				_hpack_insert(table, field.name, field.namelen, field.value, field.valuelen);
+		}
+		hpack_dbg("hpack: %.*s: %.*s", (int)field.namelen, field.name, (int)field.valuelen, field.value);
+		fields++;
+		if (cb(arg, field.name, field.namelen, field.value, field.valuelen) != ESUCCESS)
+			return EREJECT;
+	}
+	return ESUCCESS;
+}
+
+static int _hpack_listed(const char *list[], const char *name, size_t namelen)
+{
+	for (int i = 0; list[i] != NULL; i++)
+	{
+		if (!strncmp(list[i], name, namelen) && list[i][namelen] == '\0')
+			return 1;
+	}
+	return 0;
+}
+
+static size_t _hpack_search(const hpack_table_t *table, const char *name, size_t namelen, const char *value, size_t valuelen, size_t *nameindex)
+{
+	*nameindex = 0;
+	for (size_t index = 1; index <= HPACK_STATICCOUNT + table->count; index++)
+	{
+		hpack_field_t field;
+		_hpack_field(table, index, &field);
+		if (field.namelen != namelen || memcmp(field.name, name, namelen))
+			continue;
+		if (field.valuelen == valuelen && !memcmp(field.value, value, valuelen))
+			return index;
+		if (*nameindex == 0)
+			*nameindex = index;
+	}
+	return 0;
+}
+
+int hpack_encode(hpack_table_t *table, const char *name, size_t namelen, const char *value, size_t valuelen, unsigned char *out, size_t size)
+{
+	int length = 0;
+	int ret;
+	if (table->update)
+	{
+		ret = _hpack_intencode(table->maxsize, 5, 0x20, out, size);
+		if (ret < 0)
+			return EREJECT;
+		length += ret;
+		table->update = 0;
+	}
+	size_t nameindex = 0;
+	size_t index = _hpack_search(table, name, namelen, value, valuelen, &nameindex);
+	if (index > 0)
+	{
+		ret = _hpack_intencode(index, 7, 0x80, out + length, size - length);
+		if (ret < 0)
+			return EREJECT;
+		return length + ret;
+	}
+	int indexing = 0;
+	unsigned char flags = 0x00;
+	int prefix = 4;
+	if (_hpack_listed(hpack_sensitive, name, namelen))
+		flags = 0x10;
+	else if (!_hpack_listed(hpack_noindex, name, namelen) &&
+			(namelen + valuelen + HPACK_ENTRYOVERHEAD) * 4 <= table->maxsize)
+	{
+		indexing = 1;
+		flags = 0x40;
+		prefix = 6;
+	}
+	ret = _hpack_intencode(nameindex, prefix, flags, out + length, size - length);
+	if (ret < 0)
+		return EREJECT;
+	length += ret;
+	if (nameindex == 0)
+	{
+		ret = _hpack_stringencode(name, namelen, out + length, size - length);
+		if (ret < 0)
+			return EREJECT;
+		length += ret;
+	}
+	ret = _hpack_stringencode(value, valuelen, out + length, size - length);
+	if (ret < 0)
+		return EREJECT;
+	length += ret;
+	if (indexing)
+		_hpack_insert(table, name, namelen, value, valuelen);
+	return length;
+}
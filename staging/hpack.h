@@ -0,0 +1,75 @@
+/*****************************************************************************
+ * hpack.h: HTTP/2 header compression (RFC7541)
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define HPACK_TABLESIZE 4096
+
+typedef struct hpack_table_s hpack_table_t;
+
+typedef int (*hpack_header_t)(void *arg, const char *name, size_t namelen, const char *value, size_t valuelen);
+
+/**
+ * build the decoding tables of the Huffman code
+ * it has to be called once before to fork the workers
+ */
+void hpack_init(void);
+
+hpack_table_t *hpack_create(size_t maxsize);
+void hpack_destroy(hpack_table_t *table);
+/**
+ * change the maximum size of the dynamic table
+ * for the encoder the next block starts with the size update
+ */
+void hpack_resize(hpack_table_t *table, size_t maxsize);
+
+/**
+ * decode a complete header block and call the callback for each field
+ * returns EREJECT on compression error
+ */
+int hpack_decode(hpack_table_t *table, const unsigned char *data, size_t length, hpack_header_t cb, void *arg);
+
+/**
+ * encode one field at the end of the buffer
+ * returns the length of the representation or EREJECT if the buffer is too short
+ */
+int hpack_encode(hpack_table_t *table, const char *name, size_t namelen, const char *value, size_t valuelen, unsigned char *out, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -43,6 +43,7 @@
 #include "ouistiti/utils.h"
 #include "ouistiti/hash.h"
 #include "ouistiti/log.h"
+#include "log.h"
 
 #include "mod_auth.h"
 #include "mod_authmngt.h"
@@ -185,7 +186,7 @@ static void *mod_authmngt_create(http_server_t *server, mod_authmngt_t *config)
 	httpserver_addmethod(server, METHOD(str_post), MESSAGE_ALLOW_CONTENT | MESSAGE_PROTECTED);
 	httpserver_addmethod(server, METHOD(str_put), MESSAGE_ALLOW_CONTENT | MESSAGE_PROTECTED);
 	httpserver_addmethod(server, METHOD(str_delete), MESSAGE_ALLOW_CONTENT | MESSAGE_PROTECTED);
-	httpserver_addconnector(server, _authmngt_connector, mod, CONNECTOR_DOCUMENT, "authmngt");
+	ouistiti_addconnector(server, _authmngt_connector, mod, CONNECTOR_DOCUMENT, "authmngt");
 
 	return mod;
 }
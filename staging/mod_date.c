@@ -28,19 +28,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <time.h>
 
 #include "ouistiti/log.h"
 #include "ouistiti/httpserver.h"
 #include "mod_date.h"
+#include "log.h"
 
 static int _date_connector(void *arg, http_message_t *request, http_message_t *response);
 
 void *mod_date_create(http_server_t *server)
 {
-	httpserver_addconnector(server, _date_connector, NULL, CONNECTOR_DOCFILTER, str_date);
+	ouistiti_addconnector(server, _date_connector, NULL, CONNECTOR_DOCFILTER, str_date);
 
-	return -1;
+	return (void *)-1;
 }
 
 void mod_date_destroy(void *mod)
@@ -49,20 +49,12 @@ void mod_date_destroy(void *mod)
 
 static int _date_connector(void *arg, http_message_t *request, http_message_t *response)
 {
-	time_t t;
-	struct tm *tmp;
+	/// the date is formatted once per second by the clock of the servers
+	char timestring[30];
+	size_t len = ouistiti_date(timestring, sizeof(timestring));
 
-	t = time(NULL);
-	tmp = gmtime(&t);
-	char timestring[26];
-	int len = -1;
-#ifdef USE_ASCTIME
-	asctime_r(tm, timestring);
-#else
-	len = strftime(timestring, 25, "%a, %d %b %Y %T GMT", tmp);
-#endif
-
-	httpmessage_addheader(response, str_date, timestring, len);
+	if (len > 0)
+		httpmessage_addheader(response, str_date, timestring, len);
 	/* reject the request to allow other connectors to set the response */
 	return EREJECT;
 }
@@ -71,7 +63,7 @@ const module_t mod_date =
 {
 	.name = str_date,
 	.create = (module_create_t)mod_date_create,
-	.destroy = mod_datte_destroy,
+	.destroy = mod_date_destroy,
 };
 #ifdef MODULES
 extern module_t mod_info __attribute__ ((weak, alias ("mod_date")));
@@ -38,6 +38,7 @@
 #include "ouistiti/httpserver.h"
 #include "ouistiti/dbentry.h"
 #include "mod_form_urlencoded.h"
+#include "log.h"
 
 typedef struct _mod_form_urlencoded_config_s _mod_form_urlencoded_config_t;
 typedef struct _mod_form_urlencoded_s _mod_form_urlencoded_t;
@@ -28,79 +28,346 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  *****************************************************************************/
 
+/**
+    The module is a reverse proxy. Each link sends the requests matching
+    its origin to one of its backends, with all the methods and the
+    contents streamed in both directions.
+    The upstream sockets are non-blocking. The connector does what the
+    sockets accept and returns ECONTINUE to the server loop, or
+    EINCOMPLETE when nothing moved: the connector never waits and the
+    loop of the client calls it again.
+    The connections are kept alive into a pool by backend and by process.
+    The number of requests in progress on each backend and its health are
+    inside a shared memory, the balancing uses the least connections or
+    a consistent hash of the client address. A backend failing is
+    avoided during "interval" seconds, then one request tries it again.
+    With a "health" URI, a thread of the main process checks the
+    backends every "interval" seconds.
+    With CACHE, the responses of the backends are copied into the cache
+    of the server and the next requests of the same resource are sent
+    from it without backend.
+ */
 #define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/time.h>
-#include <sys/wait.h>
-#include <libgen.h>
+#include <poll.h>
+#include <netdb.h>
 #include <netinet/in.h>
-#include <sched.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 
 #ifdef FILE_CONFIG
 #include <libconfig.h>
 #endif
 
-#ifndef HTTPCLIENT_FEATURES
-#error MOD_FORWARD needs HTTPCLIENT_FEATURES to compile
-#endif
 #include "ouistiti/httpserver.h"
 #include "ouistiti/utils.h"
 #include "ouistiti/log.h"
+#include "log.h"
 
 #include "ouistiti.h"
+#include "mod_forward.h"
 
 #define forward_dbg(...)
 
+#define FORWARD_POOLSIZE 16
+#define FORWARD_KEEPALIVE 4
+#define FORWARD_VNODES 64
+#define FORWARD_HEADERMAX 8192
+#define FORWARD_CHUNKSIZE 4096
+#define FORWARD_TIMEOUT 10
+#define FORWARD_INTERVAL 5
+#define FORWARD_CONTENTTYPE 128
+
+#ifndef RESULT_502
+#define RESULT_502 RESULT_500
+#endif
+#ifndef RESULT_504
+#define RESULT_504 RESULT_500
+#endif
+
 static const char str_forward[] = "forward";
+static const char str_patch[] = "PATCH";
 
+typedef struct mod_forward_state_s mod_forward_state_t;
+typedef struct mod_forward_backend_s mod_forward_backend_t;
+typedef struct mod_forward_vnode_s mod_forward_vnode_t;
 typedef struct mod_forward_link_s mod_forward_link_t;
+typedef struct mod_forward_config_s mod_forward_config_t;
+typedef struct mod_forward_s mod_forward_t;
+typedef struct mod_forward_ctx_s mod_forward_ctx_t;
+
+/// shared by the processes
+struct mod_forward_state_s
+{
+	int active;
+	int down;
+	time_t retry;
+};
+
+struct mod_forward_backend_s
+{
+	char *host;
+	char *service;
+	char *hostport;
+	char *path;
+	size_t pathlen;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	mod_forward_state_t *state;
+	/// the pool is inside the memory of the process
+	pthread_mutex_t lock;
+	int idle[FORWARD_POOLSIZE];
+	int nidle;
+	mod_forward_backend_t *next;
+};
+
+struct mod_forward_vnode_s
+{
+	uint32_t hash;
+	mod_forward_backend_t *backend;
+};
+
 struct mod_forward_link_s
 {
 	char *origin;
-	const char *destination;
+	enum
+	{
+		BALANCE_LEASTCONN,
+		BALANCE_HASH,
+	} balance;
+	char *health;
+	mod_forward_backend_t *backends;
+	int nbackends;
+	mod_forward_vnode_t *ring;
+	int nvnodes;
 	mod_forward_link_t *next;
 };
 
-typedef struct mod_forward_config_s
+struct mod_forward_config_s
 {
 	int options;
+	int keepalive;
+	int timeout;
+	int interval;
 	mod_forward_link_t *links;
-} mod_forward_config_t;
-
-typedef struct mod_forward_config_s mod_forward_config_t;
-typedef struct mod_forward_s mod_forward_t;
-typedef struct mod_forward_ctx_s mod_forward_ctx_t;
+};
 
-static int _forward_connector(void *arg, http_message_t *request, http_message_t *response);
+struct mod_forward_s
+{
+	http_server_t *server;
+	mod_forward_config_t *config;
+	mod_forward_state_t *states;
+	int nstates;
+	pthread_t health;
+	int run;
+};
 
 struct mod_forward_ctx_s
 {
 	mod_forward_t *mod;
-	http_client_t *ctl;
+	http_client_t *clt;
 
-	http_message_t *request;
-	http_client_t *client;
-	http_message_t *response;
+	enum
+	{
+		STATE_SETUP = 0,
+		STATE_CONNECT,
+		STATE_SEND,
+		STATE_HEADER,
+		STATE_CONTENT,
+		STATE_END,
+		STATE_CACHE,
+	} state;
+	mod_forward_link_t *link;
+	mod_forward_backend_t *backend;
+	int sock;
+	int reused;
+	int attempts;
+	time_t last;
+
+	char *out;
+	size_t outlength;
+	size_t outoffset;
+	size_t outsize;
+	size_t headlength;
+	long long contentlength;
+	long long contentrest;
 
-	int toforward[2];
+	char *in;
+	size_t inlength;
+	int head;
+	int keepalive;
+	enum
+	{
+		FRAMING_NONE,
+		FRAMING_LENGTH,
+		FRAMING_CHUNKED,
+		FRAMING_CLOSE,
+	} framing;
+	enum
+	{
+		CHUNK_SIZE,
+		CHUNK_DATA,
+		CHUNK_CRLF,
+		CHUNK_TRAILER,
+	} chunk;
+	long long rest;
+	int contentstarted;
+	char contenttype[FORWARD_CONTENTTYPE];
+#ifdef CACHE
+	ouistiti_cachectx_t *cache;
+#endif
 };
 
-struct mod_forward_s
+static int _forward_connector(void *arg, http_message_t *request, http_message_t *response);
+
+static uint32_t _forward_hash(const char *data, size_t length)
 {
-	http_server_t *server;
-	mod_forward_config_t *config;
-	int rootfd;
-};
+	/// FNV-1a
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static int _forward_resolve(mod_forward_backend_t *backend, int flags)
+{
+	if (backend->addrlen > 0)
+		return ESUCCESS;
+	struct addrinfo hints = {0};
+	struct addrinfo *result = NULL;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = flags;
+	if (getaddrinfo(backend->host, backend->service, &hints, &result) != 0 || result == NULL)
+		return EREJECT;
+	memcpy(&backend->addr, result->ai_addr, result->ai_addrlen);
+	backend->addrlen = result->ai_addrlen;
+	freeaddrinfo(result);
+	return ESUCCESS;
+}
+
+/**
+ * destination: http://host[:port][/path]
+ */
+static mod_forward_backend_t *_forward_backend(const char *destination)
+{
+	if (strncmp(destination, "http://", 7))
+	{
+		err("forward: %s only http backends are available", destination);
+		return NULL;
+	}
+	const char *host = destination + 7;
+	const char *path = strchr(host, '/');
+	if (path == NULL)
+		path = host + strlen(host);
+	const char *hostend = path;
+	const char *port = NULL;
+	if (host[0] == '[')
+	{
+		hostend = memchr(host, ']', path - host);
+		if (hostend == NULL)
+			return NULL;
+		if (hostend + 1 < path && hostend[1] == ':')
+			port = hostend + 2;
+		host++;
+	}
+	else
+	{
+		port = memchr(host, ':', path - host);
+		if (port != NULL)
+		{
+			hostend = port;
+			port++;
+		}
+	}
+	if (hostend == host)
+		return NULL;
+
+	mod_forward_backend_t *backend = calloc(1, sizeof(*backend));
+	backend->host = strndup(host, hostend - host);
+	if (port != NULL && port < path)
+		backend->service = strndup(port, path - port);
+	else
+		backend->service = strdup("80");
+	/// the Host header keeps the brackets of IPv6
+	const char *authority = destination + 7;
+	backend->hostport = strndup(authority, path - authority);
+	backend->path = strdup(path);
+	backend->pathlen = strlen(path);
+	pthread_mutex_init(&backend->lock, NULL);
+	/// the names are resolved on the first request, after the fork
+	_forward_resolve(backend, AI_NUMERICHOST | AI_NUMERICSERV);
+	return backend;
+}
+
+static void _forward_freebackend(mod_forward_backend_t *backend)
+{
+	for (int i = 0; i < backend->nidle; i++)
+		close(backend->idle[i]);
+	pthread_mutex_destroy(&backend->lock);
+	free(backend->host);
+	free(backend->service);
+	free(backend->hostport);
+	free(backend->path);
+	free(backend);
+}
+
+static int _forward_vnodecmp(const void *a, const void *b)
+{
+	const mod_forward_vnode_t *va = (const mod_forward_vnode_t *)a;
+	const mod_forward_vnode_t *vb = (const mod_forward_vnode_t *)b;
+	return (va->hash > vb->hash) - (va->hash < vb->hash);
+}
+
+static void _forward_buildring(mod_forward_link_t *link)
+{
+	link->ring = calloc(link->nbackends * FORWARD_VNODES, sizeof(*link->ring));
+	if (link->ring == NULL)
+		return;
+	int nvnodes = 0;
+	for (mod_forward_backend_t *backend = link->backends; backend != NULL; backend = backend->next)
+	{
+		for (int i = 0; i < FORWARD_VNODES; i++)
+		{
+			char vnode[300];
+			int length = snprintf(vnode, sizeof(vnode), "%s#%d", backend->hostport, i);
+			link->ring[nvnodes].hash = _forward_hash(vnode, length);
+			link->ring[nvnodes].backend = backend;
+			nvnodes++;
+		}
+	}
+	qsort(link->ring, nvnodes, sizeof(*link->ring), _forward_vnodecmp);
+	link->nvnodes = nvnodes;
+}
+
+static int _forward_addbackend(mod_forward_link_t *link, const char *destination)
+{
+	mod_forward_backend_t *backend = _forward_backend(destination);
+	if (backend == NULL)
+		return EREJECT;
+	mod_forward_backend_t **last = &link->backends;
+	while (*last != NULL)
+		last = &(*last)->next;
+	*last = backend;
+	link->nbackends++;
+	return ESUCCESS;
+}
 
 #ifdef FILE_CONFIG
-static mod_forward_link_t *redirect_linkconfig(config_setting_t *iterator)
+static mod_forward_link_t *forward_linkconfig(config_setting_t *iterator)
 {
 	mod_forward_link_t *link = NULL;
 	const char *origin = NULL;
@@ -113,28 +380,61 @@ static mod_forward_link_t *redirect_linkconfig(config_setting_t *iterator)
 		link = calloc(1, sizeof(*link));
 		link->origin = strdup(origin);
 
-		const char *destination = NULL;
-		config_setting_lookup_string(iterator, "destination", (const char **)&destination);
-		if (destination != NULL && destination[0] != '\0')
-			link->destination = destination;
+		config_setting_t *destinations = config_setting_lookup(iterator, "destination");
+		if (destinations && (config_setting_is_list(destinations) || config_setting_is_array(destinations)))
+		{
+			int count = config_setting_length(destinations);
+			for (int i = 0; i < count; i++)
+			{
+				const char *destination = config_setting_get_string_elem(destinations, i);
+				if (destination != NULL && destination[0] != '\0')
+					_forward_addbackend(link, destination);
+			}
+		}
+		else if (destinations)
+		{
+			const char *destination = config_setting_get_string(destinations);
+			if (destination != NULL && destination[0] != '\0')
+				_forward_addbackend(link, destination);
+		}
+
+		const char *balance = NULL;
+		config_setting_lookup_string(iterator, "balance", &balance);
+		if (balance != NULL && !strcmp(balance, "hash"))
+			link->balance = BALANCE_HASH;
+		const char *health = NULL;
+		config_setting_lookup_string(iterator, "health", &health);
+		if (health != NULL && health[0] != '\0')
+			link->health = strdup(health);
+		if (link->balance == BALANCE_HASH)
+			_forward_buildring(link);
 	}
 	return link;
 }
 
-static int redirect_linksconfig(config_setting_t *configlinks, mod_forward_config_t *conf)
+static int forward_linksconfig(config_setting_t *configlinks, mod_forward_config_t *conf)
 {
 	int count = config_setting_length(configlinks);
 	int i;
+	/// the links are checked in the order of the configuration
+	mod_forward_link_t **last = &conf->links;
 	for (i = 0; i < count; i++)
 	{
 		config_setting_t *iterator = config_setting_get_elem(configlinks, i);
 		if (iterator)
 		{
-			mod_forward_link_t *link = redirect_linkconfig(iterator);
-			if (link != NULL)
+			mod_forward_link_t *link = forward_linkconfig(iterator);
+			if (link != NULL && link->nbackends > 0)
+			{
+				*last = link;
+				last = &link->next;
+			}
+			else if (link != NULL)
 			{
-				link->next = conf->links;
-				conf->links = link;
+				err("forward: %s without backend", link->origin);
+				free(link->origin);
+				free(link->health);
+				free(link);
 			}
 		}
 	}
@@ -152,18 +452,29 @@ static void *forward_config(config_setting_t *iterator, server_t *server)
 	if (config)
 	{
 		conf = calloc(1, sizeof(*conf));
+		conf->keepalive = FORWARD_KEEPALIVE;
+		conf->timeout = FORWARD_TIMEOUT;
+		conf->interval = FORWARD_INTERVAL;
+		config_setting_lookup_int(config, "keepalive", &conf->keepalive);
+		if (conf->keepalive > FORWARD_POOLSIZE)
+			conf->keepalive = FORWARD_POOLSIZE;
+		config_setting_lookup_int(config, "timeout", &conf->timeout);
+		config_setting_lookup_int(config, "interval", &conf->interval);
 
 		config_setting_t *configlinks = config_setting_lookup(config, "links");
 		if (configlinks)
 		{
-			redirect_linksconfig(configlinks, conf);
+			forward_linksconfig(configlinks, conf);
 		}
 	}
 	return conf;
 }
 #else
-static const mod_forward_config_t g_forward_config =
+static mod_forward_config_t g_forward_config =
 {
+	.keepalive = FORWARD_KEEPALIVE,
+	.timeout = FORWARD_TIMEOUT,
+	.interval = FORWARD_INTERVAL,
 };
 
 static void *forward_config(void *iterator, server_t *server)
@@ -172,134 +483,1091 @@ static void *forward_config(void *iterator, server_t *server)
 }
 #endif
 
-static void *mod_forward_create(http_server_t *server, mod_forward_config_t *modconfig)
+static time_t _forward_now(void)
 {
-	mod_forward_t *mod = NULL;
+	return ouistiti_monotonic();
+}
 
-	if (!modconfig)
-		return NULL;
+static void _forward_up(mod_forward_backend_t *backend)
+{
+	if (__atomic_load_n(&backend->state->down, __ATOMIC_RELAXED))
+	{
+		warn("forward: %s is up", backend->hostport);
+		__atomic_store_n(&backend->state->down, 0, __ATOMIC_RELAXED);
+	}
+}
 
-	mod = calloc(1, sizeof(*mod));
-	mod->config = modconfig;
-	mod->server = server;
+static void _forward_down(mod_forward_t *mod, mod_forward_backend_t *backend)
+{
+	if (!__atomic_exchange_n(&backend->state->down, 1, __ATOMIC_RELAXED))
+		err("forward: %s is down", backend->hostport);
+	__atomic_store_n(&backend->state->retry, _forward_now() + mod->config->interval, __ATOMIC_RELAXED);
+}
 
-	httpserver_addconnector(server, _forward_connector, mod, CONNECTOR_DOCUMENT, str_forward);
+/**
+ * a backend down is tried again by one request after the interval
+ */
+static int _forward_available(mod_forward_t *mod, mod_forward_backend_t *backend)
+{
+	if (!__atomic_load_n(&backend->state->down, __ATOMIC_RELAXED))
+		return 1;
+	time_t now = _forward_now();
+	time_t retry = __atomic_load_n(&backend->state->retry, __ATOMIC_RELAXED);
+	if (retry > now)
+		return 0;
+	return __atomic_compare_exchange_n(&backend->state->retry, &retry, now + mod->config->interval,
+				0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
 
-	return mod;
+static mod_forward_backend_t *_forward_leastconn(mod_forward_t *mod, mod_forward_link_t *link,
+					const mod_forward_backend_t *exclude)
+{
+	mod_forward_backend_t *best = NULL;
+	int bestactive = 0;
+	for (mod_forward_backend_t *backend = link->backends; backend != NULL; backend = backend->next)
+	{
+		if (backend == exclude)
+			continue;
+		int active = __atomic_load_n(&backend->state->active, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&backend->state->down, __ATOMIC_RELAXED))
+			continue;
+		if (best == NULL || active < bestactive)
+		{
+			best = backend;
+			bestactive = active;
+		}
+	}
+	if (best != NULL)
+		return best;
+	/// all the backends are down, one of them may be tried again
+	for (mod_forward_backend_t *backend = link->backends; backend != NULL; backend = backend->next)
+	{
+		if (backend != exclude && _forward_available(mod, backend))
+			return backend;
+	}
+	return NULL;
 }
 
-static void mod_forward_destroy(void *arg)
+static mod_forward_backend_t *_forward_consistenthash(mod_forward_t *mod, mod_forward_link_t *link,
+					const mod_forward_backend_t *exclude, http_message_t *request)
 {
-	mod_forward_t *mod = (mod_forward_t *)arg;
-	// nothing to do
-	free(mod->config);
-	free(mod);
+	const char *addr = NULL;
+	size_t addrlen = httpmessage_REQUEST2(request, "remote_addr", &addr);
+	if (link->nvnodes == 0 || addr == NULL)
+		return _forward_leastconn(mod, link, exclude);
+	uint32_t hash = _forward_hash(addr, addrlen);
+	int first = 0;
+	int last = link->nvnodes;
+	while (first < last)
+	{
+		int middle = (first + last) / 2;
+		if (link->ring[middle].hash < hash)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+	/// the next vnodes of the ring replace a backend down
+	for (int i = 0; i < link->nvnodes; i++)
+	{
+		mod_forward_backend_t *backend = link->ring[(first + i) % link->nvnodes].backend;
+		if (backend != exclude && _forward_available(mod, backend))
+			return backend;
+	}
+	return NULL;
 }
 
+static mod_forward_backend_t *_forward_balance(mod_forward_ctx_t *ctx, http_message_t *request)
+{
+	mod_forward_link_t *link = ctx->link;
+	const mod_forward_backend_t *exclude = ctx->backend;
+	if (link->nbackends == 1)
+		exclude = NULL;
+	if (link->balance == BALANCE_HASH)
+		return _forward_consistenthash(ctx->mod, link, exclude, request);
+	return _forward_leastconn(ctx->mod, link, exclude);
+}
 
-static mod_forward_ctx_t * _mod_forward_connectorlink(mod_forward_t *mod, http_message_t *request,
-									http_message_t *response, mod_forward_link_t *link,
-									const char *uri, size_t urilen)
+static int _forward_socket(mod_forward_backend_t *backend)
 {
-	mod_forward_ctx_t *ctx = NULL;
-	const char *path_info = NULL;
-	if (utils_searchexp(uri, link->origin, &path_info) == ESUCCESS)
+	if (_forward_resolve(backend, 0) != ESUCCESS)
+	{
+		err("forward: %s unknown host", backend->hostport);
+		return -1;
+	}
+	int sock = socket(backend->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	int nodelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	if (connect(sock, (struct sockaddr *)&backend->addr, backend->addrlen) < 0 && errno != EINPROGRESS)
 	{
-		ctx = calloc(1, sizeof(*ctx));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
 
-		ctx->request = httpmessage_create();
-		const char *query = httpmessage_REQUEST(request, "query");
-		warn("forward: run %s => %s%s?%s", uri, link->destination, path_info, query);
-		if (path_info != NULL && query != NULL && query[0] != '\0')
+/**
+ * an idle connection closed by the backend is readable
+ */
+static int _forward_pooled(mod_forward_backend_t *backend)
+{
+	int sock = -1;
+	pthread_mutex_lock(&backend->lock);
+	while (sock == -1 && backend->nidle > 0)
+	{
+		sock = backend->idle[--backend->nidle];
+		char c;
+		if (recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) != -1 || errno != EAGAIN)
 		{
-			ctx->client = httpmessage_request(ctx->request, "GET", link->destination, path_info, "?", query, NULL);
+			close(sock);
+			sock = -1;
 		}
-		else if (path_info != NULL)
+	}
+	pthread_mutex_unlock(&backend->lock);
+	return sock;
+}
+
+static void _forward_release(mod_forward_ctx_t *ctx)
+{
+	mod_forward_backend_t *backend = ctx->backend;
+	if (ctx->sock < 0)
+		return;
+	int pooled = 0;
+	if (ctx->state == STATE_END && ctx->keepalive)
+	{
+		pthread_mutex_lock(&backend->lock);
+		if (backend->nidle < ctx->mod->config->keepalive)
 		{
-			ctx->client = httpmessage_request(ctx->request, "GET", link->destination, path_info, NULL);
+			backend->idle[backend->nidle++] = ctx->sock;
+			pooled = 1;
 		}
-		else if (query != NULL && query[0] != '\0')
+		pthread_mutex_unlock(&backend->lock);
+	}
+	if (!pooled)
+		close(ctx->sock);
+	ctx->sock = -1;
+	__atomic_fetch_sub(&backend->state->active, 1, __ATOMIC_RELAXED);
+}
+
+static int _forward_connect(mod_forward_ctx_t *ctx, http_message_t *request)
+{
+	mod_forward_link_t *link = ctx->link;
+	while (ctx->attempts < link->nbackends)
+	{
+		mod_forward_backend_t *backend = _forward_balance(ctx, request);
+		if (backend == NULL)
+			break;
+		ctx->attempts++;
+		ctx->backend = backend;
+		ctx->reused = 1;
+		ctx->sock = _forward_pooled(backend);
+		if (ctx->sock == -1)
 		{
-			ctx->client = httpmessage_request(ctx->request, "GET", link->destination, "?", query, NULL);
+			ctx->reused = 0;
+			ctx->sock = _forward_socket(backend);
 		}
-		else
+		if (ctx->sock != -1)
 		{
-			ctx->client = httpmessage_request(ctx->request, "GET", link->destination, NULL);
+			__atomic_fetch_add(&backend->state->active, 1, __ATOMIC_RELAXED);
+			ctx->state = (ctx->reused)? STATE_SEND: STATE_CONNECT;
+			ctx->last = _forward_now();
+			return ESUCCESS;
 		}
-		if (ctx->client != NULL)
+		_forward_down(ctx->mod, backend);
+	}
+	return EREJECT;
+}
+
+static int _forward_append(mod_forward_ctx_t *ctx, const char *data, size_t length)
+{
+	if (ctx->outlength + length > ctx->outsize)
+	{
+		size_t size = ctx->outsize + FORWARD_CHUNKSIZE;
+		while (size < ctx->outlength + length)
+			size += FORWARD_CHUNKSIZE;
+		char *out = realloc(ctx->out, size);
+		if (out == NULL)
+			return EREJECT;
+		ctx->out = out;
+		ctx->outsize = size;
+	}
+	memcpy(ctx->out + ctx->outlength, data, length);
+	ctx->outlength += length;
+	return ESUCCESS;
+}
+
+static int _forward_appendheader(mod_forward_ctx_t *ctx, const char *key, const char *value, size_t length)
+{
+	if (value == NULL || length == 0)
+		return ESUCCESS;
+	_forward_append(ctx, key, strlen(key));
+	_forward_append(ctx, STRING_REF(": "));
+	_forward_append(ctx, value, length);
+	return _forward_append(ctx, STRING_REF("\r\n"));
+}
+
+/// the end-to-end headers of the request sent to the backend
+static const char *g_forward_headers[] =
+{
+	"Accept",
+	"Accept-Encoding",
+	"Accept-Language",
+	"Authorization",
+	"Cache-Control",
+	"Content-Type",
+	"Cookie",
+	"If-Match",
+	"If-Modified-Since",
+	"If-None-Match",
+	"If-Range",
+	"If-Unmodified-Since",
+	"Origin",
+	"Range",
+	"Referer",
+	"User-Agent",
+	"X-Requested-With",
+	NULL,
+};
+
+/**
+ * the request line and the headers are kept into the buffer until the
+ * first byte of the response, a connection of the pool closed by the
+ * backend is replaced and the request is sent again.
+ */
+static int _forward_buildrequest(mod_forward_ctx_t *ctx, http_message_t *request, const char *path_info)
+{
+	mod_forward_backend_t *backend = ctx->backend;
+	const char *method = NULL;
+	size_t methodlen = httpmessage_REQUEST2(request, "method", &method);
+	const char *query = NULL;
+	size_t querylen = httpmessage_REQUEST2(request, "query", &query);
+
+	_forward_append(ctx, method, methodlen);
+	_forward_append(ctx, STRING_REF(" "));
+	if (backend->pathlen > 0)
+		_forward_append(ctx, backend->path, backend->pathlen);
+	if (path_info != NULL)
+	{
+		if (path_info[0] != '/' && (backend->pathlen == 0 || backend->path[backend->pathlen - 1] != '/'))
+			_forward_append(ctx, STRING_REF("/"));
+		_forward_append(ctx, path_info, strlen(path_info));
+	}
+	else if (backend->pathlen == 0)
+		_forward_append(ctx, STRING_REF("/"));
+	if (query != NULL && querylen > 0)
+	{
+		_forward_append(ctx, STRING_REF("?"));
+		_forward_append(ctx, query, querylen);
+	}
+	_forward_append(ctx, STRING_REF(" HTTP/1.1\r\n"));
+	_forward_appendheader(ctx, "Host", backend->hostport, strlen(backend->hostport));
+	for (int i = 0; g_forward_headers[i] != NULL; i++)
+	{
+		const char *value = NULL;
+		size_t length = httpmessage_REQUEST2(request, g_forward_headers[i], &value);
+		_forward_appendheader(ctx, g_forward_headers[i], value, length);
+	}
+
+	const char *value = NULL;
+	size_t length = httpmessage_REQUEST2(request, "X-Forwarded-For", &value);
+	const char *addr = NULL;
+	size_t addrlen = httpmessage_REQUEST2(request, "remote_addr", &addr);
+	if (value != NULL && length > 0)
+	{
+		_forward_append(ctx, STRING_REF("X-Forwarded-For: "));
+		_forward_append(ctx, value, length);
+		_forward_append(ctx, STRING_REF(", "));
+		_forward_append(ctx, addr, addrlen);
+		_forward_append(ctx, STRING_REF("\r\n"));
+	}
+	else
+		_forward_appendheader(ctx, "X-Forwarded-For", addr, addrlen);
+	length = httpmessage_REQUEST2(request, "Host", &value);
+	_forward_appendheader(ctx, "X-Forwarded-Host", value, length);
+	length = httpmessage_REQUEST2(request, "scheme", &value);
+	_forward_appendheader(ctx, "X-Forwarded-Proto", value, length);
+
+	length = httpmessage_REQUEST2(request, "Content-Length", &value);
+	if (value != NULL && length > 0)
+	{
+		ctx->contentlength = strtoll(value, NULL, 10);
+		_forward_appendheader(ctx, "Content-Length", value, length);
+	}
+	ctx->contentrest = ctx->contentlength;
+	if (_forward_append(ctx, STRING_REF("Connection: keep-alive\r\n\r\n")) != ESUCCESS)
+		return EREJECT;
+	ctx->headlength = ctx->outlength;
+	return ESUCCESS;
+}
+
+#ifdef CACHE
+static void _forward_cacheheader(mod_forward_ctx_t *ctx, const char *key, const char *value, size_t length)
+{
+	ouistiti_cacheappend(ctx->cache, key, strlen(key));
+	ouistiti_cacheappend(ctx->cache, STRING_REF(": "));
+	ouistiti_cacheappend(ctx->cache, value, length);
+	ouistiti_cacheappend(ctx->cache, STRING_REF("\r\n"));
+}
+#endif
+
+/**
+ * the header of the response is copied into the response message
+ * without the hop-by-hop headers.
+ */
+static int _forward_parseheader(mod_forward_ctx_t *ctx, http_message_t *request, http_message_t *response, size_t length)
+{
+	char *line = ctx->in;
+	char *end = memchr(line, '\n', length);
+	if (end == NULL || strncmp(line, "HTTP/1.", 7) || end - line < 12)
+		return EREJECT;
+	int status = strtol(line + 9, NULL, 10);
+	if (status < 100 || status > 999)
+		return EREJECT;
+	ctx->keepalive = (line[7] == '1');
+	ctx->framing = FRAMING_CLOSE;
+	httpmessage_result(response, status);
+#ifdef CACHE
+	char statusline[16];
+	ouistiti_cacheappend(ctx->cache, statusline, snprintf(statusline, sizeof(statusline), "Status: %d\r\n", status));
+#endif
+
+	long long contentlength = -1;
+	int chunked = 0;
+	line = end + 1;
+	while (line < ctx->in + length)
+	{
+		end = memchr(line, '\n', ctx->in + length - line);
+		if (end == NULL)
+			break;
+		char *lineend = end;
+		if (lineend > line && lineend[-1] == '\r')
+			lineend--;
+		if (lineend == line)
+			break;
+		char *colon = memchr(line, ':', lineend - line);
+		if (colon != NULL)
 		{
-			httpmessage_appendheader(ctx->request, "User-Agent", STRING_REF(PACKAGE_NAME "/" PACKAGE_VERSION));
+			*colon = '\0';
+			char *value = colon + 1;
+			while (value < lineend && (*value == ' ' || *value == '\t'))
+				value++;
+			size_t valuelen = lineend - value;
+			if (!strcasecmp(line, "Content-Length"))
+				contentlength = strtoll(value, NULL, 10);
+			else if (!strcasecmp(line, "Transfer-Encoding"))
+				chunked = (strncasecmp(value, "chunked", 7) == 0);
+			else if (!strcasecmp(line, "Connection"))
+			{
+				if (!strncasecmp(value, "close", 5))
+					ctx->keepalive = 0;
+				else if (!strncasecmp(value, "keep-alive", 10))
+					ctx->keepalive = 1;
+			}
+			else if (!strcasecmp(line, "Content-Type"))
+			{
+				if (valuelen >= sizeof(ctx->contenttype))
+					valuelen = sizeof(ctx->contenttype) - 1;
+				memcpy(ctx->contenttype, value, valuelen);
+				ctx->contenttype[valuelen] = '\0';
+			}
+			else if (strcasecmp(line, "Keep-Alive") && strcasecmp(line, "Proxy-Connection") &&
+					strcasecmp(line, "Proxy-Authenticate") && strcasecmp(line, "TE") &&
+					strcasecmp(line, "Trailer") && strcasecmp(line, "Upgrade") &&
+					strcasecmp(line, "Date") && strcasecmp(line, "Server"))
+			{
+				httpmessage_addheader(response, line, value, valuelen);
+#ifdef CACHE
+				_forward_cacheheader(ctx, line, value, valuelen);
+#endif
+			}
 		}
+		line = end + 1;
 	}
-	return ctx;
+
+	const char *method = httpmessage_REQUEST(request, "method");
+	if ((method != NULL && !strcmp(method, str_head)) ||
+		status < 200 || status == 204 || status == 304)
+		ctx->framing = FRAMING_NONE;
+	else if (chunked)
+	{
+		ctx->framing = FRAMING_CHUNKED;
+		ctx->chunk = CHUNK_SIZE;
+	}
+	else if (contentlength >= 0)
+	{
+		ctx->framing = FRAMING_LENGTH;
+		ctx->rest = contentlength;
+		if (contentlength > 0)
+		{
+			httpmessage_addcontent(response, (ctx->contenttype[0])? ctx->contenttype: "none", NULL, contentlength);
+			ctx->contentstarted = 1;
+		}
+		else
+			ctx->framing = FRAMING_NONE;
+	}
+	else
+		ctx->keepalive = 0;
+#ifdef CACHE
+	if (ctx->contenttype[0] != '\0')
+		_forward_cacheheader(ctx, str_contenttype, ctx->contenttype, strlen(ctx->contenttype));
+	if (ctx->framing == FRAMING_LENGTH)
+	{
+		char length[24];
+		_forward_cacheheader(ctx, str_contentlength, length, snprintf(length, sizeof(length), "%lld", contentlength));
+	}
+	ouistiti_cacheappend(ctx->cache, STRING_REF("\r\n"));
+#endif
+	return ESUCCESS;
 }
 
-static int _forward_start(mod_forward_t *mod, http_message_t *request, http_message_t *response)
+static void _forward_content(mod_forward_ctx_t *ctx, http_message_t *response, const char *data, size_t length)
 {
-	const mod_forward_config_t *config = mod->config;
-	int ret = EREJECT;
-	const char *uri = NULL;
-	size_t urilen = httpmessage_REQUEST2(request,"uri", &uri);
+	if (length == 0)
+		return;
+#ifdef CACHE
+	ouistiti_cacheappend(ctx->cache, data, length);
+#endif
+	if (!ctx->contentstarted && ctx->contenttype[0] != '\0')
+		httpmessage_addcontent(response, ctx->contenttype, data, length);
+	else
+		httpmessage_addcontent(response, "none", data, length);
+	ctx->contentstarted = 1;
+}
 
-	if (uri)
+/**
+ * the content is sent without the chunked encoding of the backend,
+ * the server encodes it again for its client.
+ * returns the number of bytes used, the rest waits the next data.
+ */
+static size_t _forward_chunked(mod_forward_ctx_t *ctx, http_message_t *response, const char *data, size_t length)
+{
+	size_t offset = 0;
+	while (offset < length && ctx->state == STATE_CONTENT)
 	{
-		mod_forward_link_t *link = config->links;
-		mod_forward_ctx_t *ctx = NULL;
-		while (link != NULL)
+		const char *end = NULL;
+		switch (ctx->chunk)
 		{
-			ctx = _mod_forward_connectorlink(mod, request, response, link, uri, urilen);
-			if (ctx != NULL)
+		case CHUNK_SIZE:
+		case CHUNK_TRAILER:
+			end = memchr(data + offset, '\n', length - offset);
+			if (end == NULL)
+				return offset;
+			if (ctx->chunk == CHUNK_SIZE)
 			{
-				ret = EINCOMPLETE;
-				break;
+				ctx->rest = strtoll(data + offset, NULL, 16);
+				ctx->chunk = (ctx->rest > 0)? CHUNK_DATA: CHUNK_TRAILER;
 			}
-			link = link->next;
+			else if (end == data + offset || (end == data + offset + 1 && data[offset] == '\r'))
+				ctx->state = STATE_END;
+			offset = end - data + 1;
+		break;
+		case CHUNK_DATA:
+		{
+			size_t size = length - offset;
+			if ((long long)size > ctx->rest)
+				size = ctx->rest;
+			_forward_content(ctx, response, data + offset, size);
+			ctx->rest -= size;
+			offset += size;
+			if (ctx->rest == 0)
+				ctx->chunk = CHUNK_CRLF;
+		}
+		break;
+		case CHUNK_CRLF:
+			end = memchr(data + offset, '\n', length - offset);
+			if (end == NULL)
+				return length;
+			offset = end - data + 1;
+			ctx->chunk = CHUNK_SIZE;
+		break;
 		}
-		httpmessage_private(request, ctx);
 	}
-	return ret;
+	return offset;
 }
 
-static int _forward_request(mod_forward_ctx_t *ctx, http_message_t *response)
+static size_t _forward_body(mod_forward_ctx_t *ctx, http_message_t *response, const char *data, size_t length)
 {
-	int ret = EREJECT;
+	switch (ctx->framing)
+	{
+	case FRAMING_NONE:
+		ctx->state = STATE_END;
+		return length;
+	case FRAMING_LENGTH:
+		if ((long long)length > ctx->rest)
+			length = ctx->rest;
+		_forward_content(ctx, response, data, length);
+		ctx->rest -= length;
+		if (ctx->rest == 0)
+			ctx->state = STATE_END;
+		return length;
+	case FRAMING_CHUNKED:
+		return _forward_chunked(ctx, response, data, length);
+	case FRAMING_CLOSE:
+		_forward_content(ctx, response, data, length);
+		return length;
+	}
+	return length;
+}
+
+/**
+ * the backend may have run a request before closing the connection,
+ * only the idempotent methods are sent twice (RFC 9110 9.2.2).
+ */
+static int _forward_idempotent(http_message_t *request)
+{
+	const char *method = httpmessage_REQUEST(request, "method");
+	if (method == NULL)
+		return 0;
+	return !strcmp(method, str_get) || !strcmp(method, str_head) ||
+		!strcmp(method, str_put) || !strcmp(method, str_delete);
+}
+
+/**
+ * the connection of the pool was closed by the backend before the
+ * response, the request is sent again on a new connection.
+ */
+static int _forward_retry(mod_forward_ctx_t *ctx, http_message_t *request)
+{
+	if (!ctx->reused || ctx->inlength > 0 || ctx->outoffset > ctx->headlength ||
+		ctx->contentrest != ctx->contentlength)
+		return EREJECT;
+	if (!_forward_idempotent(request))
+		return EREJECT;
+	close(ctx->sock);
+	ctx->sock = _forward_socket(ctx->backend);
+	ctx->reused = 0;
+	if (ctx->sock == -1)
+	{
+		__atomic_fetch_sub(&ctx->backend->state->active, 1, __ATOMIC_RELAXED);
+		return EREJECT;
+	}
+	ctx->outoffset = 0;
+	ctx->state = STATE_CONNECT;
+	return ESUCCESS;
+}
+
+/**
+ * the connection failed before the request was sent, another backend
+ * may receive it.
+ */
+static int _forward_failover(mod_forward_ctx_t *ctx, http_message_t *request)
+{
+	if (ctx->outoffset > 0)
+		return EREJECT;
+	_forward_down(ctx->mod, ctx->backend);
+	close(ctx->sock);
+	ctx->sock = -1;
+	__atomic_fetch_sub(&ctx->backend->state->active, 1, __ATOMIC_RELAXED);
+	if (_forward_connect(ctx, request) != ESUCCESS)
+		return EREJECT;
+	/// the request line depends on the path of the backend
+	ctx->outlength = 0;
+	ctx->outoffset = 0;
+	return ECONTINUE;
+}
 
-	do
+static int _forward_send(mod_forward_ctx_t *ctx, http_message_t *request)
+{
+	while (ctx->outoffset < ctx->outlength)
+	{
+		ssize_t ret = send(ctx->sock, ctx->out + ctx->outoffset, ctx->outlength - ctx->outoffset, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EAGAIN)
+			return EINCOMPLETE;
+		if (ret <= 0)
+			return EREJECT;
+		ctx->outoffset += ret;
+		ctx->last = _forward_now();
+	}
+	if (ctx->contentrest <= 0)
+		return ESUCCESS;
+
+	const char *input = NULL;
+	size_t rest = 1;
+	int inputlen = httpmessage_content(request, &input, &rest);
+	if (inputlen == EINCOMPLETE)
+		return ECONTINUE;
+	if (inputlen <= 0)
 	{
-		ret = httpclient_sendrequest(ctx->client, ctx->request, response);
-	} while (ret == EINCOMPLETE);
+		err("forward: request content truncated");
+		return EREJECT;
+	}
+	/// the header is not required anymore for a retry
+	ctx->outlength = 0;
+	ctx->outoffset = 0;
+	ctx->headlength = 0;
+	_forward_append(ctx, input, inputlen);
+	ctx->contentrest -= inputlen;
+	return ECONTINUE;
+}
 
+static int _forward_recv(mod_forward_ctx_t *ctx, http_message_t *request, http_message_t *response)
+{
+	if (ctx->inlength >= FORWARD_HEADERMAX)
+	{
+		err("forward: %s header too long", ctx->backend->hostport);
+		return EREJECT;
+	}
+	ssize_t ret = recv(ctx->sock, ctx->in + ctx->inlength, FORWARD_HEADERMAX - ctx->inlength, MSG_DONTWAIT);
+	if (ret < 0 && errno == EAGAIN)
+		return EINCOMPLETE;
+	if (ret < 0)
+		return EREJECT;
+	if (ret == 0)
+	{
+		ctx->keepalive = 0;
+		if (ctx->state == STATE_CONTENT && ctx->framing == FRAMING_CLOSE)
+		{
+			ctx->state = STATE_END;
+			return ESUCCESS;
+		}
+		return EREJECT;
+	}
+	ctx->last = _forward_now();
+	ctx->inlength += ret;
+	if (ctx->state == STATE_HEADER)
+	{
+		char *end = memmem(ctx->in, ctx->inlength, "\r\n\r\n", 4);
+		size_t headerlength = 4;
+		if (end == NULL)
+		{
+			end = memmem(ctx->in, ctx->inlength, "\n\n", 2);
+			headerlength = 2;
+		}
+		if (end == NULL)
+			return ECONTINUE;
+		headerlength += end - ctx->in;
+		if (_forward_parseheader(ctx, request, response, headerlength) != ESUCCESS)
+		{
+			err("forward: %s bad response", ctx->backend->hostport);
+			return EREJECT;
+		}
+		_forward_up(ctx->backend);
+		ctx->head = 1;
+		ctx->state = STATE_CONTENT;
+		ctx->inlength -= headerlength;
+		memmove(ctx->in, ctx->in + headerlength, ctx->inlength);
+		if (ctx->framing == FRAMING_NONE)
+			ctx->state = STATE_END;
+	}
+	if (ctx->state == STATE_CONTENT)
+	{
+		size_t used = _forward_body(ctx, response, ctx->in, ctx->inlength);
+		ctx->inlength -= used;
+		memmove(ctx->in, ctx->in + used, ctx->inlength);
+	}
+	if (ctx->state == STATE_END && ctx->inlength > 0)
+		/// the backend sent more than the response
+		ctx->keepalive = 0;
+	return ECONTINUE;
+}
+
+static void _forward_close(mod_forward_ctx_t *ctx, http_message_t *request)
+{
+	_forward_release(ctx);
+	free(ctx->out);
+	ctx->out = NULL;
+	ctx->outlength = 0;
+	ctx->outoffset = 0;
+	ctx->outsize = 0;
+	ouistiti_requestfree(request, ctx->in);
+	ctx->in = NULL;
+	ctx->inlength = 0;
+	ctx->link = NULL;
+	ctx->backend = NULL;
+	ctx->state = STATE_SETUP;
+#ifdef CACHE
+	ouistiti_cachefree(ctx->cache);
+	ctx->cache = NULL;
+#endif
+	httpmessage_private(request, NULL);
+}
+
+static int _forward_error(mod_forward_ctx_t *ctx, http_message_t *request, http_message_t *response, int result)
+{
+	int head = ctx->head;
+	if (ctx->backend != NULL && !head)
+		_forward_down(ctx->mod, ctx->backend);
+	ctx->keepalive = 0;
+	_forward_close(ctx, request);
+	if (head)
+		/// it is too late to change the response
+		return EREJECT;
+	httpmessage_result(response, result);
+	return ESUCCESS;
+}
+
+static int _forward_fetch(mod_forward_ctx_t *ctx, http_message_t *request, http_message_t *response, const char *path_info)
+{
+	mod_forward_link_t *link = ctx->link;
+	ctx->backend = NULL;
+	ctx->attempts = 0;
+	ctx->head = 0;
+	ctx->keepalive = 0;
+	ctx->contentstarted = 0;
+	ctx->contenttype[0] = '\0';
+	ctx->contentlength = 0;
+	ctx->inlength = 0;
+	ctx->in = ouistiti_requestalloc(request, FORWARD_HEADERMAX);
+	if (ctx->in == NULL || _forward_connect(ctx, request) != ESUCCESS)
+	{
+		ouistiti_requestfree(request, ctx->in);
+		ctx->in = NULL;
+#ifdef CACHE
+		ouistiti_cachefree(ctx->cache);
+		ctx->cache = NULL;
+#endif
+		err("forward: %s no backend available", link->origin);
+		httpmessage_result(response, RESULT_502);
+		return ESUCCESS;
+	}
+	dbg("forward: %s => %s", httpmessage_REQUEST(request, "uri"), ctx->backend->hostport);
+	if (_forward_buildrequest(ctx, request, path_info) != ESUCCESS)
+		return _forward_error(ctx, request, response, RESULT_500);
+	httpmessage_private(request, ctx);
+	return EINCOMPLETE;
+}
+
+static int _forward_start(mod_forward_ctx_t *ctx, http_message_t *request, http_message_t *response)
+{
+	const mod_forward_config_t *config = ctx->mod->config;
+	const char *uri = NULL;
+	size_t urilen = httpmessage_REQUEST2(request,"uri", &uri);
+
+	if (uri == NULL || urilen == 0)
+		return EREJECT;
+	const char *path_info = NULL;
+	mod_forward_link_t *link = config->links;
+	while (link != NULL)
+	{
+		if (utils_searchexp(uri, link->origin, &path_info) == ESUCCESS)
+			break;
+		link = link->next;
+	}
+	if (link == NULL)
+		return EREJECT;
+
+	ctx->link = link;
+#ifdef CACHE
+	int cache = ouistiti_cachebegin(ctx->mod->server, request, &ctx->cache);
+	if (cache == ESUCCESS || cache == EINCOMPLETE)
+	{
+		ctx->state = STATE_CACHE;
+		httpmessage_private(request, ctx);
+		return EINCOMPLETE;
+	}
+#endif
+	return _forward_fetch(ctx, request, response, path_info);
+}
+
+/**
+ * the state of the socket without wait
+ */
+static int _forward_ready(mod_forward_ctx_t *ctx, short events)
+{
+	struct pollfd pfd = { .fd = ctx->sock, .events = events };
+	return poll(&pfd, 1, 0);
+}
+
+#ifdef CACHE
+/**
+ * the response is sent from the cache or the request waits the
+ * response of another one.
+ */
+static int _forward_cache(mod_forward_ctx_t *ctx, http_message_t *request, http_message_t *response)
+{
+	int ret = ouistiti_cachebegin(ctx->mod->server, request, &ctx->cache);
+	if (ret == EINCOMPLETE)
+		return EINCOMPLETE;
 	if (ret == ESUCCESS)
 	{
-		httpclient_destroy(ctx->client);
-		ctx->client = NULL;
-		httpmessage_destroy(ctx->request);
-		free(ctx);
+		ret = ouistiti_cachereplay(ctx->cache, response);
+		if (ret == ESUCCESS)
+			_forward_close(ctx, request);
+		return ret;
+	}
+	/// the fetch of the other request is lost, this one calls the backend
+	const char *path_info = NULL;
+	const char *uri = httpmessage_REQUEST(request, "uri");
+	utils_searchexp(uri, ctx->link->origin, &path_info);
+	ctx->state = STATE_SETUP;
+	ret = _forward_fetch(ctx, request, response, path_info);
+	if (ret != EINCOMPLETE)
+		return ret;
+	return ECONTINUE;
+}
+#endif
+
+static int _forward_run(mod_forward_ctx_t *ctx, http_message_t *request, http_message_t *response)
+{
+	int ret = ECONTINUE;
+	switch (ctx->state)
+	{
+#ifdef CACHE
+	case STATE_CACHE:
+		return _forward_cache(ctx, request, response);
+#endif
+	case STATE_CONNECT:
+	{
+		if (_forward_ready(ctx, POLLOUT) < 1)
+		{
+			ret = EINCOMPLETE;
+			break;
+		}
+		int error = 0;
+		socklen_t length = sizeof(error);
+		getsockopt(ctx->sock, SOL_SOCKET, SO_ERROR, &error, &length);
+		if (error != 0)
+		{
+			warn("forward: %s connection error %s", ctx->backend->hostport, strerror(error));
+			/// the request line is built again for the new backend
+			const char *path_info = NULL;
+			const char *uri = httpmessage_REQUEST(request, "uri");
+			if (_forward_failover(ctx, request) != ECONTINUE)
+				return _forward_error(ctx, request, response, RESULT_502);
+			utils_searchexp(uri, ctx->link->origin, &path_info);
+			_forward_buildrequest(ctx, request, path_info);
+			return ECONTINUE;
+		}
+		ctx->state = STATE_SEND;
+		ctx->last = _forward_now();
+	}
+	/* fall through */
+	case STATE_SEND:
+		ret = _forward_send(ctx, request);
+		if (ret == EREJECT)
+		{
+			if (_forward_retry(ctx, request) == ESUCCESS)
+				return ECONTINUE;
+			return _forward_error(ctx, request, response, RESULT_502);
+		}
+		else if (ret == ESUCCESS)
+		{
+			ctx->state = STATE_HEADER;
+			ret = ECONTINUE;
+		}
+	break;
+	case STATE_HEADER:
+	case STATE_CONTENT:
+		ret = _forward_recv(ctx, request, response);
+		if (ret == EREJECT)
+		{
+			if (ctx->state == STATE_HEADER && _forward_retry(ctx, request) == ESUCCESS)
+				return ECONTINUE;
+			return _forward_error(ctx, request, response, RESULT_502);
+		}
+	break;
+	default:
+	break;
+	}
+	if (ctx->state == STATE_END)
+	{
+		forward_dbg("forward: %s complete", ctx->backend->hostport);
+#ifdef CACHE
+		ouistiti_cacheend(ctx->cache, ESUCCESS);
+#endif
+		_forward_close(ctx, request);
+		return ESUCCESS;
+	}
+	if (_forward_now() - ctx->last > ctx->mod->config->timeout)
+	{
+		err("forward: %s timeout", ctx->backend->hostport);
+		return _forward_error(ctx, request, response, RESULT_504);
 	}
+	/// the server reads the content of the request for the next call
+	if (ctx->state <= STATE_SEND && ctx->contentrest > 0)
+		ret = EINCOMPLETE;
 	return ret;
 }
 
 static int _forward_connector(void *arg, http_message_t *request, http_message_t *response)
 {
+	mod_forward_ctx_t *ctx = (mod_forward_ctx_t *)arg;
+	mod_forward_ctx_t *private = httpmessage_private(request, NULL);
+
+	if (private == NULL)
+	{
+		int ret = _forward_start(ctx, request, response);
+		if (ret != EINCOMPLETE)
+			return ret;
+	}
+	else if (private != ctx)
+		return EREJECT;
+	return _forward_run(ctx, request, response);
+}
+
+static void *_mod_forward_getctx(void *arg, http_client_t *clt, struct sockaddr *addr, int addrsize)
+{
+	mod_forward_t *mod = (mod_forward_t *)arg;
+	mod_forward_ctx_t *ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+	ctx->mod = mod;
+	ctx->clt = clt;
+	ctx->sock = -1;
+	ouistiti_addclientconnector(clt, _forward_connector, ctx, CONNECTOR_DOCUMENT, str_forward);
+	return ctx;
+}
+
+static void _mod_forward_freectx(void *vctx)
+{
+	mod_forward_ctx_t *ctx = (mod_forward_ctx_t *)vctx;
+	/// the client left during a response
+	ctx->keepalive = 0;
+	_forward_release(ctx);
+#ifdef CACHE
+	ouistiti_cachefree(ctx->cache);
+#endif
+	free(ctx->out);
+	/// the buffer of the response is released with the arena of the client
+	free(ctx);
+}
+
+static int _forward_probe(mod_forward_t *mod, mod_forward_link_t *link, mod_forward_backend_t *backend)
+{
+	int sock = _forward_socket(backend);
+	if (sock < 0)
+		return EREJECT;
 	int ret = EREJECT;
+	char buffer[256];
+	int length = snprintf(buffer, sizeof(buffer), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+				link->health, backend->hostport);
+	struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+	if (poll(&pfd, 1, 1000) == 1 && send(sock, buffer, length, MSG_NOSIGNAL) == length)
+	{
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, mod->config->timeout * 1000) == 1)
+		{
+			length = recv(sock, buffer, sizeof(buffer) - 1, 0);
+			/// the status 2xx and 3xx are healthy
+			if (length > 12 && !strncmp(buffer, "HTTP/1.", 7) &&
+				(buffer[9] == '2' || buffer[9] == '3'))
+				ret = ESUCCESS;
+		}
+	}
+	close(sock);
+	return ret;
+}
+
+static void *_forward_health(void *arg)
+{
 	mod_forward_t *mod = (mod_forward_t *)arg;
-	mod_forward_ctx_t *ctx = httpmessage_private(request, NULL);
+	int elapsed = mod->config->interval * 10;
+	while (__atomic_load_n(&mod->run, __ATOMIC_ACQUIRE))
+	{
+		if (elapsed++ < mod->config->interval * 10)
+		{
+			usleep(100000);
+			continue;
+		}
+		elapsed = 0;
+		for (mod_forward_link_t *link = mod->config->links; link != NULL; link = link->next)
+		{
+			if (link->health == NULL)
+				continue;
+			for (mod_forward_backend_t *backend = link->backends; backend != NULL; backend = backend->next)
+			{
+				if (_forward_probe(mod, link, backend) == ESUCCESS)
+					_forward_up(backend);
+				else
+					_forward_down(mod, backend);
+			}
+		}
+	}
+	return NULL;
+}
 
-	if (ctx == NULL)
+static void *mod_forward_create(http_server_t *server, mod_forward_config_t *modconfig)
+{
+	mod_forward_t *mod = NULL;
+
+	if (!modconfig)
+		return NULL;
+
+	int nstates = 0;
+	int health = 0;
+	for (mod_forward_link_t *link = modconfig->links; link != NULL; link = link->next)
 	{
-		ret = _forward_start(mod, request, response);
+		nstates += link->nbackends;
+		if (link->health != NULL)
+			health = 1;
 	}
-	else if (ctx->client != NULL)
+	if (nstates == 0)
 	{
-		ret = _forward_request(ctx, response);
+		err("forward: no backend");
+		return NULL;
 	}
-	else
+	/// the counters are shared by the processes forked after
+	mod_forward_state_t *states = mmap(NULL, sizeof(*states) * nstates, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (states == MAP_FAILED)
 	{
-		httpmessage_result(response, 400);
-		httpmessage_destroy(ctx->request);
-		free(ctx);
+		err("forward: memory allocation error %m");
+		return NULL;
 	}
-	return ret;
+	int i = 0;
+	for (mod_forward_link_t *link = modconfig->links; link != NULL; link = link->next)
+	{
+		for (mod_forward_backend_t *backend = link->backends; backend != NULL; backend = backend->next)
+			backend->state = &states[i++];
+	}
+
+	mod = calloc(1, sizeof(*mod));
+	mod->config = modconfig;
+	mod->server = server;
+	mod->states = states;
+	mod->nstates = nstates;
+
+	if (health)
+	{
+		mod->run = 1;
+		if (pthread_create(&mod->health, NULL, _forward_health, mod) != 0)
+		{
+			err("forward: health thread error %m");
+			mod->run = 0;
+		}
+	}
+
+	httpserver_addmethod(server, METHOD(str_post), MESSAGE_ALLOW_CONTENT);
+	httpserver_addmethod(server, METHOD(str_put), MESSAGE_ALLOW_CONTENT);
+	httpserver_addmethod(server, METHOD(str_patch), MESSAGE_ALLOW_CONTENT);
+	httpserver_addmethod(server, METHOD(str_delete), MESSAGE_ALLOW_CONTENT);
+	httpserver_addmethod(server, METHOD(str_options), 0);
+	httpserver_addmod(server, _mod_forward_getctx, _mod_forward_freectx, mod, str_forward);
+
+	return mod;
+}
+
+static void mod_forward_destroy(void *arg)
+{
+	mod_forward_t *mod = (mod_forward_t *)arg;
+	if (mod->run)
+	{
+		__atomic_store_n(&mod->run, 0, __ATOMIC_RELEASE);
+		pthread_join(mod->health, NULL);
+	}
+#ifdef FILE_CONFIG
+	mod_forward_link_t *link = mod->config->links;
+	while (link != NULL)
+	{
+		mod_forward_link_t *next = link->next;
+		mod_forward_backend_t *backend = link->backends;
+		while (backend != NULL)
+		{
+			mod_forward_backend_t *nextbackend = backend->next;
+			_forward_freebackend(backend);
+			backend = nextbackend;
+		}
+		free(link->ring);
+		free(link->health);
+		free(link->origin);
+		free(link);
+		link = next;
+	}
+	free(mod->config);
+#endif
+	munmap(mod->states, sizeof(*mod->states) * mod->nstates);
+	free(mod);
 }
 
 const module_t mod_forward =
@@ -6,5 +6,6 @@ mod_forward_LDFLAGS+=$(LIBHTTPSERVER_LDFLAGS)
 mod_forward_LIBS+=$(LIBHTTPSERVER_NAME)
 mod_forward_LIBRARY+=libconfig
 mod_forward_LIBS+=ouiutils
+mod_forward_LIBS+=pthread
 
 mod_forward_CFLAGS-$(DEBUG)+=-g -DDEBUG
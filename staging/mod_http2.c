@@ -0,0 +1,1973 @@
+/*****************************************************************************
+ * mod_http2.c: HTTP/2 protocol module
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *
+ * follow RFC9113 : https://tools.ietf.org/html/rfc9113
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/**
+    The module is a protocol layer like the TLS modules. It is set after
+    the TLS module and it reads the first bytes of each connection:
+     - the preface of HTTP/2 (after the ALPN "h2" or with the prior
+       knowledge on the clear text) starts the framing.
+     - a first request with "Upgrade: h2c" receives "101 Switching
+       Protocols" and becomes the stream 1.
+     - any other request continues in HTTP/1.1 without copy.
+    With the framing, the header blocks are decoded with HPACK and each
+    stream is rewritten into an HTTP/1.1 request for the connectors. The
+    requests are given to the server one after the other, the next
+    stream is chosen with its urgency (priority header) and its weight
+    (PRIORITY frame). The responses of the server come back in the same
+    order and are cut into HEADERS and DATA frames, the chunked encoding
+    is removed.
+    The flow control is done on both directions: the WINDOW_UPDATE frames
+    are sent when the server reads the content of a stream. While the
+    window of the client is closed, the response is deferred: the send
+    returns to the loop of the client, which waits the WINDOW_UPDATE.
+    On the clear text, mod_document may send a file with sendfile: the
+    module writes the header of each DATA frame and lets the kernel copy
+    the content, the rest of a frame is sent by the next calls.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+
+#ifdef FILE_CONFIG
+#include <libconfig.h>
+#endif
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/utils.h"
+#include "ouistiti/hash.h"
+#include "ouistiti/log.h"
+#include "log.h"
+
+#include "ouistiti.h"
+#include "mod_http2.h"
+#include "hpack.h"
+
+#define http2_dbg(...)
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACELEN (sizeof(HTTP2_PREFACE) - 1)
+#define HTTP2_FRAMEHEADER 9
+#define HTTP2_FRAMESIZE 16384
+#define HTTP2_MAXFRAMESIZE 16777215
+#define HTTP2_WINDOW 65535
+#define HTTP2_MAXWINDOW 0x7fffffff
+#define HTTP2_MAXSTREAMS 100
+#define HTTP2_HEADERMAX 16384
+/// the content without Content-Length is stored before to be given to the server
+#define HTTP2_BODYMAX (1024 * 1024)
+#define HTTP2_CHUNKSIZE 1024
+/// the number of waits of the server without WINDOW_UPDATE
+
+#define HTTP2_DATA 0x0
+#define HTTP2_HEADERS 0x1
+#define HTTP2_PRIORITY 0x2
+#define HTTP2_RST_STREAM 0x3
+#define HTTP2_SETTINGS 0x4
+#define HTTP2_PUSH_PROMISE 0x5
+#define HTTP2_PING 0x6
+#define HTTP2_GOAWAY 0x7
+#define HTTP2_WINDOW_UPDATE 0x8
+#define HTTP2_CONTINUATION 0x9
+
+#define HTTP2_FLAG_END_STREAM 0x01
+#define HTTP2_FLAG_ACK 0x01
+#define HTTP2_FLAG_END_HEADERS 0x04
+#define HTTP2_FLAG_PADDED 0x08
+#define HTTP2_FLAG_PRIORITY 0x20
+
+#define HTTP2_NO_ERROR 0x0
+#define HTTP2_PROTOCOL_ERROR 0x1
+#define HTTP2_INTERNAL_ERROR 0x2
+#define HTTP2_FLOW_CONTROL_ERROR 0x3
+#define HTTP2_STREAM_CLOSED 0x5
+#define HTTP2_FRAME_SIZE_ERROR 0x6
+#define HTTP2_REFUSED_STREAM 0x7
+#define HTTP2_CANCEL 0x8
+#define HTTP2_COMPRESSION_ERROR 0x9
+
+#define HTTP2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define HTTP2_SETTINGS_ENABLE_PUSH 0x2
+#define HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define HTTP2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define HTTP2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define HTTP2_DEFAULTWEIGHT 16
+#define HTTP2_DEFAULTURGENCY 3
+
+static const char str_http2[] = "http2";
+
+typedef enum
+{
+	HTTP2_SNIFF,
+	HTTP2_HTTP1,
+	HTTP2_PREFACE_E,
+	HTTP2_FRAMES,
+	HTTP2_CLOSED,
+} http2_mode_t;
+
+typedef enum
+{
+	RESPONSE_HEADER,
+	RESPONSE_BODY,
+	RESPONSE_CHUNKSIZE,
+	RESPONSE_CHUNKDATA,
+	RESPONSE_CHUNKEND,
+	RESPONSE_TRAILER,
+	RESPONSE_CLOSE,
+} http2_response_t;
+
+/// the request is complete enough to be given to the server
+#define STREAM_READY 0x0001
+/// the request is given to the server
+#define STREAM_FED 0x0002
+#define STREAM_REMOTECLOSED 0x0004
+#define STREAM_DELIVERED 0x0008
+#define STREAM_RESPONDED 0x0010
+#define STREAM_RESET 0x0020
+#define STREAM_HEAD 0x0040
+
+typedef struct _mod_http2_s _mod_http2_t;
+typedef struct http2_stream_s http2_stream_t;
+typedef struct http2_ctx_s http2_ctx_t;
+
+struct _mod_http2_s
+{
+	mod_http2_t *config;
+	const httpclient_ops_t *protocolops;
+	void *protocol;
+	int secure;
+};
+
+struct http2_stream_s
+{
+	uint32_t id;
+	int flags;
+	int32_t sendwindow;
+	int32_t recvwindow;
+	uint32_t consumed;
+	uint32_t parent;
+	int weight;
+	int urgency;
+	/// the HTTP/1.1 request for the server
+	char *request;
+	size_t length;
+	size_t size;
+	size_t offset;
+	/// the end of the header before STREAM_READY, its remaining length after
+	size_t header;
+	ssize_t contentlength;
+	size_t received;
+	http2_stream_t *next;
+	http2_stream_t *rnext;
+};
+
+struct http2_ctx_s
+{
+	_mod_http2_t *mod;
+	http_client_t *clt;
+	const httpclient_ops_t *protocolops;
+	void *protocol;
+	http2_mode_t mode;
+	unsigned char *in;
+	size_t inlength;
+	size_t insize;
+	unsigned char *out;
+	hpack_table_t *decoder;
+	hpack_table_t *encoder;
+	/// the header block waiting its CONTINUATION frames
+	unsigned char *block;
+	size_t blocklength;
+	uint32_t blockstream;
+	int blockflags;
+	unsigned char blockpriority[5];
+	http2_stream_t *streams;
+	int nstreams;
+	http2_stream_t *feeding;
+	http2_stream_t *responses;
+	http2_stream_t *lastresponse;
+	uint32_t lastid;
+	uint32_t lastfed;
+	int32_t sendwindow;
+	int32_t recvwindow;
+	uint32_t consumed;
+	int32_t initialwindow;
+	uint32_t framesize;
+	http2_response_t rstate;
+	char *rheader;
+	size_t rheaderlength;
+	size_t rremain;
+	/// the content of the DATA frame in progress with sendfile
+	size_t rframe;
+	/// the response waits a WINDOW_UPDATE
+	int windowwait;
+	char rline[20];
+	size_t rlinelength;
+	http2_ctx_t *next;
+};
+
+/// the clients of the process in HTTP/2 for the sendfile
+static http2_ctx_t *g_http2_clients = NULL;
+static pthread_mutex_t g_http2_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int _http2_frames(http2_ctx_t *ctx);
+
+#ifdef FILE_CONFIG
+static void *http2_config(config_setting_t *iterator, server_t *server)
+{
+	mod_http2_t *conf = NULL;
+#if LIBCONFIG_VER_MINOR < 5
+	config_setting_t *config = config_setting_get_member(iterator, str_http2);
+#else
+	config_setting_t *config = config_setting_lookup(iterator, str_http2);
+#endif
+	if (config)
+	{
+		conf = calloc(1, sizeof(*conf));
+		conf->maxstreams = HTTP2_MAXSTREAMS;
+		conf->window = HTTP2_WINDOW;
+		conf->framesize = HTTP2_FRAMESIZE;
+		conf->headertable = HPACK_TABLESIZE;
+		config_setting_lookup_int(config, "maxstreams", &conf->maxstreams);
+		config_setting_lookup_int(config, "window", &conf->window);
+		config_setting_lookup_int(config, "framesize", &conf->framesize);
+		config_setting_lookup_int(config, "headertable", &conf->headertable);
+		const char *options = NULL;
+		config_setting_lookup_string(config, "options", &options);
+		if (utils_searchexp("h2c", options, NULL) == ESUCCESS)
+			conf->options |= HTTP2_H2C;
+		if (conf->framesize < HTTP2_FRAMESIZE || conf->framesize > HTTP2_MAXFRAMESIZE)
+			conf->framesize = HTTP2_FRAMESIZE;
+		if (conf->window <= 0)
+			conf->window = HTTP2_WINDOW;
+		if (conf->maxstreams <= 0)
+			conf->maxstreams = HTTP2_MAXSTREAMS;
+		if (conf->headertable < 0)
+			conf->headertable = HPACK_TABLESIZE;
+	}
+	return conf;
+}
+#else
+static const mod_http2_t g_http2_config =
+{
+	.maxstreams = HTTP2_MAXSTREAMS,
+	.window = HTTP2_WINDOW,
+	.framesize = HTTP2_FRAMESIZE,
+	.headertable = HPACK_TABLESIZE,
+	.options = 0,
+};
+
+static void *http2_config(void *iterator, server_t *server)
+{
+	http_server_t *httpserver = ouistiti_httpserver(server);
+	const char *port = httpserver_INFO(httpserver, "port");
+
+	/// like mod_tls, the default configuration is only for https
+	if (strstr(port, "443") != NULL)
+		return (void *)&g_http2_config;
+	return NULL;
+}
+#endif
+
+static uint32_t _http2_get32(const unsigned char *data)
+{
+	return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static void _http2_set32(unsigned char *data, uint32_t value)
+{
+	data[0] = value >> 24;
+	data[1] = value >> 16;
+	data[2] = value >> 8;
+	data[3] = value;
+}
+
+static void _http2_frameheader(unsigned char *header, size_t length, int type, int flags, uint32_t id)
+{
+	header[0] = length >> 16;
+	header[1] = length >> 8;
+	header[2] = length;
+	header[3] = type;
+	header[4] = flags;
+	_http2_set32(header + 5, id & 0x7fffffff);
+}
+
+static int _http2_write(http2_ctx_t *ctx, const unsigned char *data, size_t length)
+{
+	while (length > 0)
+	{
+		int ret = ctx->protocolops->sendresp(ctx->protocol, (const char *)data, length);
+		if (ret == EINCOMPLETE)
+		{
+			if (ctx->protocolops->wait(ctx->protocol, WAIT_SEND) == EREJECT)
+				return EREJECT;
+			continue;
+		}
+		if (ret <= 0)
+			return EREJECT;
+		data += ret;
+		length -= ret;
+	}
+	return ESUCCESS;
+}
+
+/**
+ * The buffers are released while the connection is idle, and allocated
+ * again by the next frame.
+ */
+static void _http2_freein(http2_ctx_t *ctx)
+{
+	if (ctx->in == NULL)
+		return;
+	ouistiti_clientmemory(ctx->clt, -(long)ctx->insize);
+	free(ctx->in);
+	ctx->in = NULL;
+	ctx->insize = 0;
+}
+
+static void _http2_freeout(http2_ctx_t *ctx)
+{
+	if (ctx->out == NULL)
+		return;
+	ouistiti_clientmemory(ctx->clt, -(HTTP2_FRAMEHEADER + HTTP2_FRAMESIZE));
+	free(ctx->out);
+	ctx->out = NULL;
+}
+
+static int _http2_sendframe(http2_ctx_t *ctx, int type, int flags, uint32_t id, const void *payload, size_t length)
+{
+	if (ctx->out == NULL)
+	{
+		ctx->out = malloc(HTTP2_FRAMEHEADER + HTTP2_FRAMESIZE);
+		if (ctx->out == NULL)
+			return EREJECT;
+		ouistiti_clientmemory(ctx->clt, HTTP2_FRAMEHEADER + HTTP2_FRAMESIZE);
+	}
+	_http2_frameheader(ctx->out, length, type, flags, id);
+	if (length > 0)
+		memcpy(ctx->out + HTTP2_FRAMEHEADER, payload, length);
+	return _http2_write(ctx, ctx->out, HTTP2_FRAMEHEADER + length);
+}
+
+static int _http2_goaway(http2_ctx_t *ctx, uint32_t error)
+{
+	if (ctx->mode == HTTP2_CLOSED)
+		return EREJECT;
+	if (error != HTTP2_NO_ERROR)
+		warn("http2: connection error %u", error);
+	unsigned char payload[8];
+	_http2_set32(payload, ctx->lastfed);
+	_http2_set32(payload + 4, error);
+	_http2_sendframe(ctx, HTTP2_GOAWAY, 0, 0, payload, sizeof(payload));
+	ctx->mode = HTTP2_CLOSED;
+	return EREJECT;
+}
+
+static int _http2_rststream(http2_ctx_t *ctx, uint32_t id, uint32_t error)
+{
+	unsigned char payload[4];
+	_http2_set32(payload, error);
+	return _http2_sendframe(ctx, HTTP2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+static int _http2_windowupdate(http2_ctx_t *ctx, uint32_t id, uint32_t increment)
+{
+	unsigned char payload[4];
+	_http2_set32(payload, increment);
+	return _http2_sendframe(ctx, HTTP2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+static void _http2_addclient(http2_ctx_t *ctx)
+{
+	pthread_mutex_lock(&g_http2_mutex);
+	ctx->next = g_http2_clients;
+	g_http2_clients = ctx;
+	pthread_mutex_unlock(&g_http2_mutex);
+}
+
+static void _http2_removeclient(http2_ctx_t *ctx)
+{
+	pthread_mutex_lock(&g_http2_mutex);
+	for (http2_ctx_t **it = &g_http2_clients; *it != NULL; it = &(*it)->next)
+	{
+		if (*it == ctx)
+		{
+			*it = ctx->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_http2_mutex);
+}
+
+static int _http2_start(http2_ctx_t *ctx)
+{
+	const mod_http2_t *config = ctx->mod->config;
+	ctx->decoder = hpack_create(config->headertable);
+	ctx->encoder = hpack_create(HPACK_TABLESIZE);
+	if (ctx->decoder == NULL || ctx->encoder == NULL)
+	{
+		if (ctx->decoder != NULL)
+			hpack_destroy(ctx->decoder);
+		if (ctx->encoder != NULL)
+			hpack_destroy(ctx->encoder);
+		ctx->decoder = NULL;
+		ctx->encoder = NULL;
+		err("http2: memory allocation error");
+		return EREJECT;
+	}
+	if (ctx->insize < HTTP2_FRAMEHEADER + (size_t)config->framesize)
+	{
+		unsigned char *in = realloc(ctx->in, HTTP2_FRAMEHEADER + config->framesize);
+		if (in == NULL)
+			return EREJECT;
+		ouistiti_clientmemory(ctx->clt, (long)(HTTP2_FRAMEHEADER + config->framesize - ctx->insize));
+		ctx->in = in;
+		ctx->insize = HTTP2_FRAMEHEADER + config->framesize;
+	}
+	ctx->sendwindow = HTTP2_WINDOW;
+	ctx->recvwindow = HTTP2_WINDOW;
+	_http2_addclient(ctx);
+
+	unsigned char payload[5 * 6];
+	const uint32_t settings[][2] =
+	{
+		{HTTP2_SETTINGS_HEADER_TABLE_SIZE, config->headertable},
+		{HTTP2_SETTINGS_ENABLE_PUSH, 0},
+		{HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, config->maxstreams},
+		{HTTP2_SETTINGS_INITIAL_WINDOW_SIZE, config->window},
+		{HTTP2_SETTINGS_MAX_FRAME_SIZE, config->framesize},
+	};
+	for (int i = 0; i < 5; i++)
+	{
+		payload[i * 6] = settings[i][0] >> 8;
+		payload[i * 6 + 1] = settings[i][0];
+		_http2_set32(payload + i * 6 + 2, settings[i][1]);
+	}
+	int ret = _http2_sendframe(ctx, HTTP2_SETTINGS, 0, 0, payload, sizeof(payload));
+	/// the window of the connection is not a setting
+	if (ret == ESUCCESS && config->window > HTTP2_WINDOW)
+	{
+		ret = _http2_windowupdate(ctx, 0, config->window - HTTP2_WINDOW);
+		ctx->recvwindow = config->window;
+	}
+	http2_dbg("http2: start");
+	return ret;
+}
+
+static void _http2_consume(http2_ctx_t *ctx, size_t length)
+{
+	ctx->inlength -= length;
+	if (ctx->inlength > 0)
+		memmove(ctx->in, ctx->in + length, ctx->inlength);
+}
+
+static int _http2_fill(http2_ctx_t *ctx)
+{
+	if (ctx->in == NULL)
+	{
+		/// the frames of the connection may be larger than the first header
+		size_t size = HTTP2_HEADERMAX;
+		if (ctx->decoder != NULL)
+			size = HTTP2_FRAMEHEADER + ctx->mod->config->framesize;
+		ctx->in = malloc(size);
+		if (ctx->in == NULL)
+			return EREJECT;
+		ctx->insize = size;
+		ouistiti_clientmemory(ctx->clt, size);
+	}
+	if (ctx->inlength == ctx->insize)
+		return EREJECT;
+	int ret = ctx->protocolops->recvreq(ctx->protocol, (char *)ctx->in + ctx->inlength, ctx->insize - ctx->inlength);
+	if (ret > 0)
+		ctx->inlength += ret;
+	else if (ret == 0)
+		ret = EREJECT;
+	return ret;
+}
+
+static http2_stream_t *_http2_stream(http2_ctx_t *ctx, uint32_t id)
+{
+	for (http2_stream_t *stream = ctx->streams; stream != NULL; stream = stream->next)
+	{
+		if (stream->id == id)
+			return stream;
+	}
+	return NULL;
+}
+
+static http2_stream_t *_http2_newstream(http2_ctx_t *ctx, uint32_t id)
+{
+	http2_stream_t *stream = calloc(1, sizeof(*stream));
+	stream->id = id;
+	stream->sendwindow = ctx->initialwindow;
+	stream->recvwindow = ctx->mod->config->window;
+	stream->weight = HTTP2_DEFAULTWEIGHT;
+	stream->urgency = HTTP2_DEFAULTURGENCY;
+	stream->contentlength = -1;
+	stream->next = ctx->streams;
+	ctx->streams = stream;
+	ctx->nstreams++;
+	if (id > ctx->lastid)
+		ctx->lastid = id;
+	return stream;
+}
+
+static void _http2_freestream(http2_ctx_t *ctx, http2_stream_t *stream)
+{
+	for (http2_stream_t **it = &ctx->streams; *it != NULL; it = &(*it)->next)
+	{
+		if (*it == stream)
+		{
+			*it = stream->next;
+			ctx->nstreams--;
+			break;
+		}
+	}
+	free(stream->request);
+	free(stream);
+}
+
+/**
+ * a stream is freed after its response and the delivery of its request,
+ * or when it is reset before to be given to the server
+ */
+static void _http2_closestream(http2_ctx_t *ctx, http2_stream_t *stream)
+{
+	if ((stream->flags & STREAM_FED) &&
+		!((stream->flags & STREAM_RESPONDED) && (stream->flags & STREAM_DELIVERED)))
+		return;
+	if (ctx->feeding == stream)
+		ctx->feeding = NULL;
+	_http2_freestream(ctx, stream);
+}
+
+static int _http2_append(char **buffer, size_t *length, size_t *size, const char *data, size_t datalen)
+{
+	if (*length + datalen > *size)
+	{
+		size_t newsize = *size + HTTP2_CHUNKSIZE;
+		while (newsize < *length + datalen)
+			newsize += HTTP2_CHUNKSIZE;
+		char *newbuffer = realloc(*buffer, newsize);
+		if (newbuffer == NULL)
+			return EREJECT;
+		*buffer = newbuffer;
+		*size = newsize;
+	}
+	memcpy(*buffer + *length, data, datalen);
+	*length += datalen;
+	return ESUCCESS;
+}
+
+static void _http2_credit(http2_ctx_t *ctx, http2_stream_t *stream, uint32_t length)
+{
+	uint32_t threshold = ctx->mod->config->window / 2;
+	ctx->consumed += length;
+	if (ctx->consumed > 0 && ctx->consumed >= threshold)
+	{
+		_http2_windowupdate(ctx, 0, ctx->consumed);
+		ctx->recvwindow += ctx->consumed;
+		ctx->consumed = 0;
+	}
+	if (stream == NULL || (stream->flags & STREAM_REMOTECLOSED))
+		return;
+	stream->consumed += length;
+	if (stream->consumed > 0 && stream->consumed >= threshold)
+	{
+		_http2_windowupdate(ctx, stream->id, stream->consumed);
+		stream->recvwindow += stream->consumed;
+		stream->consumed = 0;
+	}
+}
+
+/**
+ * the header is closed with the Content-Length of the content
+ * received until END_STREAM when the client did not send it
+ */
+static int _http2_ready(http2_stream_t *stream)
+{
+	char contentlength[48] = {0};
+	int length = 0;
+	if (stream->contentlength < 0 && stream->received > 0)
+		length = snprintf(contentlength, sizeof(contentlength), "Content-Length: %zu\r\n", stream->received);
+	length += 2;
+	strcat(contentlength, "\r\n");
+	if (stream->length + length > stream->size)
+	{
+		char *request = realloc(stream->request, stream->length + length);
+		if (request == NULL)
+			return EREJECT;
+		stream->request = request;
+		stream->size = stream->length + length;
+	}
+	memmove(stream->request + stream->header + length, stream->request + stream->header,
+			stream->length - stream->header);
+	memcpy(stream->request + stream->header, contentlength, length);
+	stream->length += length;
+	stream->header += length;
+	stream->flags |= STREAM_READY;
+	return ESUCCESS;
+}
+
+typedef struct http2_request_s http2_request_t;
+struct http2_request_s
+{
+	http2_stream_t *stream;
+	char method[32];
+	char *path;
+	char authority[256];
+	char *headers;
+	size_t length;
+	size_t size;
+	char *cookie;
+	size_t cookielength;
+	size_t cookiesize;
+	int regular;
+	int host;
+	int malformed;
+};
+
+static const char *http2_hopbyhop[] =
+{
+	"connection",
+	"keep-alive",
+	"proxy-connection",
+	"transfer-encoding",
+	"upgrade",
+	"te",
+	"http2-settings",
+	NULL
+};
+
+static int _http2_hopbyhop(const char *name, size_t namelen)
+{
+	for (int i = 0; http2_hopbyhop[i] != NULL; i++)
+	{
+		if (!strncasecmp(http2_hopbyhop[i], name, namelen) && http2_hopbyhop[i][namelen] == '\0')
+			return 1;
+	}
+	return 0;
+}
+
+/// CR, LF and NUL would split the HTTP/1.1 request
+static int _http2_unsafe(const char *data, size_t length, int space)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		if (data[i] == '\r' || data[i] == '\n' || data[i] == '\0' || (space && data[i] == ' '))
+			return 1;
+	}
+	return 0;
+}
+
+static int _http2_requestheader(void *arg, const char *name, size_t namelen, const char *value, size_t valuelen)
+{
+	http2_request_t *req = (http2_request_t *)arg;
+	if (_http2_unsafe(name, namelen, 1) || _http2_unsafe(value, valuelen, 0) || namelen == 0)
+	{
+		req->malformed = 1;
+		return ESUCCESS;
+	}
+	if (name[0] == ':')
+	{
+		if (req->regular)
+			req->malformed = 1;
+		else if (namelen == 7 && !memcmp(name, ":method", 7) && valuelen < sizeof(req->method))
+			snprintf(req->method, sizeof(req->method), "%.*s", (int)valuelen, value);
+		else if (namelen == 5 && !memcmp(name, ":path", 5) && req->path == NULL &&
+				!_http2_unsafe(value, valuelen, 1))
+			req->path = strndup(value, valuelen);
+		else if (namelen == 10 && !memcmp(name, ":authority", 10) && valuelen < sizeof(req->authority))
+			snprintf(req->authority, sizeof(req->authority), "%.*s", (int)valuelen, value);
+		else if (namelen != 7 || memcmp(name, ":scheme", 7))
+			req->malformed = 1;
+		return ESUCCESS;
+	}
+	req->regular = 1;
+	if (_http2_hopbyhop(name, namelen))
+		return ESUCCESS;
+	if (namelen == 6 && !memcmp(name, "cookie", 6))
+	{
+		/// the cookie is split into several fields (RFC9113 8.2.3)
+		if (req->cookielength > 0)
+			_http2_append(&req->cookie, &req->cookielength, &req->cookiesize, "; ", 2);
+		_http2_append(&req->cookie, &req->cookielength, &req->cookiesize, value, valuelen);
+		return ESUCCESS;
+	}
+	if (namelen == 14 && !memcmp(name, "content-length", 14))
+		req->stream->contentlength = strtol(value, NULL, 10);
+	else if (namelen == 4 && !memcmp(name, "host", 4))
+		req->host = 1;
+	else if (namelen == 8 && !memcmp(name, "priority", 8))
+	{
+		/// RFC9218 urgency
+		const char *urgency = strstr(value, "u=");
+		if (urgency != NULL && (size_t)(urgency - value) + 2 < valuelen &&
+			urgency[2] >= '0' && urgency[2] <= '7')
+			req->stream->urgency = urgency[2] - '0';
+	}
+	/// the names of HTTP/1.1 are capitalized
+	char canonical[256];
+	if (namelen >= sizeof(canonical))
+	{
+		req->malformed = 1;
+		return ESUCCESS;
+	}
+	for (size_t i = 0; i < namelen; i++)
+	{
+		canonical[i] = name[i];
+		if (i == 0 || name[i - 1] == '-')
+			canonical[i] = toupper(name[i]);
+	}
+	_http2_append(&req->headers, &req->length, &req->size, canonical, namelen);
+	_http2_append(&req->headers, &req->length, &req->size, ": ", 2);
+	_http2_append(&req->headers, &req->length, &req->size, value, valuelen);
+	_http2_append(&req->headers, &req->length, &req->size, "\r\n", 2);
+	return ESUCCESS;
+}
+
+static int _http2_trailer(void *arg, const char *name, size_t namelen, const char *value, size_t valuelen)
+{
+	/// the trailers are decoded for the dynamic table and dropped
+	return ESUCCESS;
+}
+
+static int _http2_request(http2_ctx_t *ctx, http2_stream_t *stream, int endstream)
+{
+	http2_request_t req = {0};
+	req.stream = stream;
+	int ret = hpack_decode(ctx->decoder, ctx->block, ctx->blocklength, _http2_requestheader, &req);
+	if (ret != ESUCCESS)
+	{
+		free(req.path);
+		free(req.headers);
+		free(req.cookie);
+		return _http2_goaway(ctx, HTTP2_COMPRESSION_ERROR);
+	}
+	if (req.malformed || req.method[0] == '\0' || req.path == NULL)
+	{
+		warn("http2: stream %u malformed", stream->id);
+		_http2_rststream(ctx, stream->id, HTTP2_PROTOCOL_ERROR);
+		free(req.path);
+		free(req.headers);
+		free(req.cookie);
+		_http2_freestream(ctx, stream);
+		return ESUCCESS;
+	}
+	if (!strcmp(req.method, "HEAD"))
+		stream->flags |= STREAM_HEAD;
+	char line[HTTP2_CHUNKSIZE];
+	int length = snprintf(line, sizeof(line), "%s %s HTTP/1.1\r\n", req.method, req.path);
+	if (length < (int)sizeof(line))
+		_http2_append(&stream->request, &stream->length, &stream->size, line, length);
+	else
+	{
+		_http2_append(&stream->request, &stream->length, &stream->size, req.method, strlen(req.method));
+		_http2_append(&stream->request, &stream->length, &stream->size, " ", 1);
+		_http2_append(&stream->request, &stream->length, &stream->size, req.path, strlen(req.path));
+		_http2_append(&stream->request, &stream->length, &stream->size, " HTTP/1.1\r\n", 11);
+	}
+	if (!req.host && req.authority[0] != '\0')
+	{
+		length = snprintf(line, sizeof(line), "Host: %s\r\n", req.authority);
+		_http2_append(&stream->request, &stream->length, &stream->size, line, length);
+	}
+	if (req.length > 0)
+		_http2_append(&stream->request, &stream->length, &stream->size, req.headers, req.length);
+	if (req.cookielength > 0)
+	{
+		_http2_append(&stream->request, &stream->length, &stream->size, "Cookie: ", 8);
+		_http2_append(&stream->request, &stream->length, &stream->size, req.cookie, req.cookielength);
+		_http2_append(&stream->request, &stream->length, &stream->size, "\r\n", 2);
+	}
+	free(req.path);
+	free(req.headers);
+	free(req.cookie);
+	stream->header = stream->length;
+	http2_dbg("http2: stream %u request %.*s", stream->id, (int)stream->length, stream->request);
+
+	if (endstream)
+		stream->flags |= STREAM_REMOTECLOSED;
+	if (endstream || stream->contentlength >= 0)
+		return _http2_ready(stream);
+	return ESUCCESS;
+}
+
+static int _http2_headersframe(http2_ctx_t *ctx, int flags, uint32_t id)
+{
+	int endstream = ctx->blockflags & HTTP2_FLAG_END_STREAM;
+	http2_stream_t *stream = _http2_stream(ctx, id);
+	if (stream != NULL)
+	{
+		/// trailers
+		if (!endstream || (stream->flags & STREAM_REMOTECLOSED))
+			return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		if (hpack_decode(ctx->decoder, ctx->block, ctx->blocklength, _http2_trailer, NULL) != ESUCCESS)
+			return _http2_goaway(ctx, HTTP2_COMPRESSION_ERROR);
+		stream->flags |= STREAM_REMOTECLOSED;
+		if (!(stream->flags & STREAM_READY))
+			return _http2_ready(stream);
+		return ESUCCESS;
+	}
+	if (id <= ctx->lastid || !(id & 0x01))
+	{
+		/// the stream is closed and forgotten
+		if (hpack_decode(ctx->decoder, ctx->block, ctx->blocklength, _http2_trailer, NULL) != ESUCCESS)
+			return _http2_goaway(ctx, HTTP2_COMPRESSION_ERROR);
+		return _http2_goaway(ctx, HTTP2_STREAM_CLOSED);
+	}
+	stream = _http2_newstream(ctx, id);
+	stream->parent = ctx->blockstream;
+	if (ctx->nstreams > ctx->mod->config->maxstreams)
+	{
+		if (hpack_decode(ctx->decoder, ctx->block, ctx->blocklength, _http2_trailer, NULL) != ESUCCESS)
+			return _http2_goaway(ctx, HTTP2_COMPRESSION_ERROR);
+		_http2_rststream(ctx, id, HTTP2_REFUSED_STREAM);
+		_http2_freestream(ctx, stream);
+		return ESUCCESS;
+	}
+	return _http2_request(ctx, stream, endstream);
+}
+
+static void _http2_priority(http2_ctx_t *ctx, uint32_t id, const unsigned char *payload)
+{
+	http2_stream_t *stream = _http2_stream(ctx, id);
+	if (stream == NULL)
+		return;
+	stream->parent = _http2_get32(payload) & 0x7fffffff;
+	if (stream->parent == id)
+		stream->parent = 0;
+	stream->weight = payload[4] + 1;
+}
+
+static int _http2_blockstart(http2_ctx_t *ctx, int flags, uint32_t id, const unsigned char *payload, size_t length)
+{
+	if (id == 0)
+		return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+	size_t pad = 0;
+	if (flags & HTTP2_FLAG_PADDED)
+	{
+		if (length < 1)
+			return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		pad = payload[0];
+		payload++;
+		length--;
+	}
+	uint32_t parent = 0;
+	unsigned char priority[5] = {0};
+	if (flags & HTTP2_FLAG_PRIORITY)
+	{
+		if (length < 5)
+			return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		memcpy(priority, payload, 5);
+		parent = _http2_get32(payload) & 0x7fffffff;
+		payload += 5;
+		length -= 5;
+	}
+	if (pad > length)
+		return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+	length -= pad;
+	free(ctx->block);
+	ctx->block = malloc(length + 1);
+	memcpy(ctx->block, payload, length);
+	ctx->blocklength = length;
+	ctx->blockflags = flags;
+	/// the parent is kept with the block until the stream creation
+	ctx->blockstream = parent;
+	int ret = ESUCCESS;
+	if (flags & HTTP2_FLAG_END_HEADERS)
+	{
+		ret = _http2_headersframe(ctx, flags, id);
+		if (ret == ESUCCESS && (flags & HTTP2_FLAG_PRIORITY))
+			_http2_priority(ctx, id, priority);
+		free(ctx->block);
+		ctx->block = NULL;
+		ctx->blocklength = 0;
+		ctx->blockstream = 0;
+	}
+	else
+		memcpy(ctx->blockpriority, priority, sizeof(priority));
+	return ret;
+}
+
+static int _http2_dataframe(http2_ctx_t *ctx, int flags, uint32_t id, const unsigned char *payload, size_t length)
+{
+	size_t framelength = length;
+	if (id == 0)
+		return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+	ctx->recvwindow -= framelength;
+	if (ctx->recvwindow < 0)
+		return _http2_goaway(ctx, HTTP2_FLOW_CONTROL_ERROR);
+	size_t pad = 0;
+	if (flags & HTTP2_FLAG_PADDED)
+	{
+		if (length < 1 || payload[0] >= length)
+			return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		pad = payload[0] + 1;
+		payload++;
+		length -= pad;
+	}
+	http2_stream_t *stream = _http2_stream(ctx, id);
+	if (stream == NULL || (stream->flags & (STREAM_REMOTECLOSED | STREAM_RESET)))
+	{
+		if (id > ctx->lastid)
+			return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		_http2_credit(ctx, NULL, framelength);
+		return _http2_rststream(ctx, id, HTTP2_STREAM_CLOSED);
+	}
+	stream->recvwindow -= framelength;
+	if (stream->recvwindow < 0)
+		return _http2_goaway(ctx, HTTP2_FLOW_CONTROL_ERROR);
+	stream->received += length;
+	if ((stream->contentlength >= 0 && stream->received > (size_t)stream->contentlength) ||
+		(stream->contentlength < 0 && stream->received > HTTP2_BODYMAX))
+	{
+		_http2_credit(ctx, NULL, framelength);
+		if (stream->flags & STREAM_FED)
+			/// the server waits a content which is not coming
+			return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		_http2_rststream(ctx, id, HTTP2_PROTOCOL_ERROR);
+		_http2_freestream(ctx, stream);
+		return ESUCCESS;
+	}
+	_http2_append(&stream->request, &stream->length, &stream->size, (const char *)payload, length);
+	/// the padding is never read by the server
+	_http2_credit(ctx, stream, pad);
+	/// the content stored until END_STREAM must not wait the server
+	if (!(stream->flags & STREAM_READY))
+		_http2_credit(ctx, stream, length);
+	if (flags & HTTP2_FLAG_END_STREAM)
+	{
+		stream->flags |= STREAM_REMOTECLOSED;
+		if (!(stream->flags & STREAM_READY))
+			return _http2_ready(stream);
+	}
+	return ESUCCESS;
+}
+
+static int _http2_rststreamframe(http2_ctx_t *ctx, uint32_t id, size_t length)
+{
+	if (id == 0 || length != 4)
+		return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+	http2_stream_t *stream = _http2_stream(ctx, id);
+	if (stream == NULL)
+		return ESUCCESS;
+	http2_dbg("http2: stream %u reset", id);
+	stream->flags |= STREAM_RESET;
+	if (!(stream->flags & STREAM_FED))
+	{
+		_http2_freestream(ctx, stream);
+		return ESUCCESS;
+	}
+	/// the server has to receive the end of the request
+	if (!(stream->flags & STREAM_REMOTECLOSED))
+		return _http2_goaway(ctx, HTTP2_NO_ERROR);
+	return ESUCCESS;
+}
+
+static int _http2_settingsframe(http2_ctx_t *ctx, int flags, uint32_t id, const unsigned char *payload, size_t length)
+{
+	if (id != 0 || length % 6)
+		return _http2_goaway(ctx, (id != 0)? HTTP2_PROTOCOL_ERROR: HTTP2_FRAME_SIZE_ERROR);
+	if (flags & HTTP2_FLAG_ACK)
+		return (length == 0)? ESUCCESS: _http2_goaway(ctx, HTTP2_FRAME_SIZE_ERROR);
+	for (size_t i = 0; i < length; i += 6)
+	{
+		int identifier = (payload[i] << 8) | payload[i + 1];
+		uint32_t value = _http2_get32(payload + i + 2);
+		switch (identifier)
+		{
+		case HTTP2_SETTINGS_HEADER_TABLE_SIZE:
+			if (ctx->encoder != NULL)
+				hpack_resize(ctx->encoder, value);
+		break;
+		case HTTP2_SETTINGS_ENABLE_PUSH:
+			if (value > 1)
+				return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		break;
+		case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+		{
+			if (value > HTTP2_MAXWINDOW)
+				return _http2_goaway(ctx, HTTP2_FLOW_CONTROL_ERROR);
+			int32_t delta = value - ctx->initialwindow;
+			for (http2_stream_t *stream = ctx->streams; stream != NULL; stream = stream->next)
+				stream->sendwindow += delta;
+			ctx->initialwindow = value;
+		}
+		break;
+		case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+			if (value < HTTP2_FRAMESIZE || value > HTTP2_MAXFRAMESIZE)
+				return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+			/// the frames are built into a buffer of HTTP2_FRAMESIZE
+			ctx->framesize = HTTP2_FRAMESIZE;
+		break;
+		default:
+		break;
+		}
+	}
+	if (ctx->decoder == NULL)
+		/// HTTP2-Settings of the upgrade
+		return ESUCCESS;
+	return _http2_sendframe(ctx, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+}
+
+static int _http2_windowupdateframe(http2_ctx_t *ctx, uint32_t id, const unsigned char *payload, size_t length)
+{
+	if (length != 4)
+		return _http2_goaway(ctx, HTTP2_FRAME_SIZE_ERROR);
+	uint32_t increment = _http2_get32(payload) & 0x7fffffff;
+	if (id == 0)
+	{
+		if (increment == 0 || (int64_t)ctx->sendwindow + increment > HTTP2_MAXWINDOW)
+			return _http2_goaway(ctx, (increment == 0)? HTTP2_PROTOCOL_ERROR: HTTP2_FLOW_CONTROL_ERROR);
+		ctx->sendwindow += increment;
+		return ESUCCESS;
+	}
+	http2_stream_t *stream = _http2_stream(ctx, id);
+	if (stream == NULL)
+		return ESUCCESS;
+	if (increment == 0 || (int64_t)stream->sendwindow + increment > HTTP2_MAXWINDOW)
+		return _http2_rststream(ctx, id, (increment == 0)? HTTP2_PROTOCOL_ERROR: HTTP2_FLOW_CONTROL_ERROR);
+	stream->sendwindow += increment;
+	return ESUCCESS;
+}
+
+static int _http2_frame(http2_ctx_t *ctx, int type, int flags, uint32_t id, const unsigned char *payload, size_t length)
+{
+	http2_dbg("http2: frame %d flags %x stream %u length %zu", type, flags, id, length);
+	if (ctx->block != NULL && type != HTTP2_CONTINUATION)
+		return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+	switch (type)
+	{
+	case HTTP2_DATA:
+		return _http2_dataframe(ctx, flags, id, payload, length);
+	case HTTP2_HEADERS:
+		return _http2_blockstart(ctx, flags, id, payload, length);
+	case HTTP2_PRIORITY:
+		if (id == 0 || length != 5)
+			return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		_http2_priority(ctx, id, payload);
+	break;
+	case HTTP2_RST_STREAM:
+		return _http2_rststreamframe(ctx, id, length);
+	case HTTP2_SETTINGS:
+		return _http2_settingsframe(ctx, flags, id, payload, length);
+	case HTTP2_PUSH_PROMISE:
+		return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+	case HTTP2_PING:
+		if (id != 0 || length != 8)
+			return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		if (!(flags & HTTP2_FLAG_ACK))
+			return _http2_sendframe(ctx, HTTP2_PING, HTTP2_FLAG_ACK, 0, payload, length);
+	break;
+	case HTTP2_GOAWAY:
+		/// the streams in progress are completed, the next ones are refused
+		ctx->lastid = HTTP2_MAXWINDOW;
+	break;
+	case HTTP2_WINDOW_UPDATE:
+		return _http2_windowupdateframe(ctx, id, payload, length);
+	case HTTP2_CONTINUATION:
+	{
+		if (ctx->block == NULL || id == 0)
+			return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		if (ctx->blocklength + length > HTTP2_HEADERMAX * 4)
+			return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		unsigned char *block = realloc(ctx->block, ctx->blocklength + length + 1);
+		memcpy(block + ctx->blocklength, payload, length);
+		ctx->block = block;
+		ctx->blocklength += length;
+		if (flags & HTTP2_FLAG_END_HEADERS)
+		{
+			int ret = _http2_headersframe(ctx, ctx->blockflags, id);
+			if (ret == ESUCCESS && (ctx->blockflags & HTTP2_FLAG_PRIORITY))
+				_http2_priority(ctx, id, ctx->blockpriority);
+			free(ctx->block);
+			ctx->block = NULL;
+			ctx->blocklength = 0;
+			ctx->blockstream = 0;
+			return ret;
+		}
+	}
+	break;
+	default:
+		/// the unknown frames are ignored
+	break;
+	}
+	return ESUCCESS;
+}
+
+static int _http2_frames(http2_ctx_t *ctx)
+{
+	if (ctx->mode == HTTP2_PREFACE_E)
+	{
+		size_t length = (ctx->inlength < HTTP2_PREFACELEN)? ctx->inlength: HTTP2_PREFACELEN;
+		if (memcmp(ctx->in, HTTP2_PREFACE, length))
+			return _http2_goaway(ctx, HTTP2_PROTOCOL_ERROR);
+		if (length < HTTP2_PREFACELEN)
+			return ESUCCESS;
+		_http2_consume(ctx, HTTP2_PREFACELEN);
+		ctx->mode = HTTP2_FRAMES;
+	}
+	size_t offset = 0;
+	int ret = ESUCCESS;
+	while (ret == ESUCCESS && ctx->inlength - offset >= HTTP2_FRAMEHEADER)
+	{
+		const unsigned char *header = ctx->in + offset;
+		size_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+		if (length > (size_t)ctx->mod->config->framesize)
+		{
+			ret = _http2_goaway(ctx, HTTP2_FRAME_SIZE_ERROR);
+			break;
+		}
+		if (ctx->inlength - offset < HTTP2_FRAMEHEADER + length)
+			break;
+		uint32_t id = _http2_get32(header + 5) & 0x7fffffff;
+		ret = _http2_frame(ctx, header[3], header[4], id, header + HTTP2_FRAMEHEADER, length);
+		offset += HTTP2_FRAMEHEADER + length;
+	}
+	if (offset > 0 && ctx->mode != HTTP2_CLOSED)
+		_http2_consume(ctx, offset);
+	return ret;
+}
+
+static size_t _http2_headerline(const char *line, size_t length, const char *name, const char **value)
+{
+	size_t namelen = strlen(name);
+	if (length <= namelen || strncasecmp(line, name, namelen) || line[namelen] != ':')
+		return 0;
+	const char *it = line + namelen + 1;
+	while (*it == ' ' || *it == '\t')
+		it++;
+	*value = it;
+	return length - (it - line);
+}
+
+/**
+ * the HTTP/1.1 request is the stream 1 after "101 Switching Protocols"
+ * only the requests without content are upgraded
+ */
+static int _http2_upgrade(http2_ctx_t *ctx, size_t headerlength)
+{
+	const char *header = (const char *)ctx->in;
+	const char *settings = NULL;
+	size_t settingslen = 0;
+	int upgrade = 0;
+	int content = 0;
+	const char *end = header + headerlength;
+	const char *line = strstr(header, "\r\n");
+	while (line != NULL && line + 2 < end)
+	{
+		line += 2;
+		const char *next = strstr(line, "\r\n");
+		size_t length = next - line;
+		const char *value = NULL;
+		size_t valuelen;
+		if ((valuelen = _http2_headerline(line, length, "Upgrade", &value)) > 0)
+			upgrade = (memmem(value, valuelen, "h2c", 3) != NULL);
+		else if ((valuelen = _http2_headerline(line, length, "HTTP2-Settings", &value)) > 0)
+		{
+			settings = value;
+			settingslen = valuelen;
+		}
+		else if ((valuelen = _http2_headerline(line, length, "Content-Length", &value)) > 0)
+			content = (strtol(value, NULL, 10) > 0);
+		else if (_http2_headerline(line, length, "Transfer-Encoding", &value) > 0)
+			content = 1;
+		line = next;
+	}
+	if (!upgrade || settings == NULL || content)
+	{
+		ctx->mode = HTTP2_HTTP1;
+		return ESUCCESS;
+	}
+	unsigned char payload[256];
+	int payloadlen = base64_urlencoding->decode(settings, settingslen, (char *)payload, sizeof(payload));
+	if (payloadlen < 0 || _http2_settingsframe(ctx, 0, 0, payload, payloadlen) != ESUCCESS)
+	{
+		ctx->mode = HTTP2_HTTP1;
+		return ESUCCESS;
+	}
+	warn("http2: upgrade h2c");
+	static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	if (_http2_write(ctx, (const unsigned char *)switching, sizeof(switching) - 1) != ESUCCESS)
+		return EREJECT;
+	ctx->mode = HTTP2_PREFACE_E;
+
+	http2_stream_t *stream = _http2_newstream(ctx, 1);
+	stream->flags |= STREAM_REMOTECLOSED;
+	if (!strncmp(header, "HEAD ", 5))
+		stream->flags |= STREAM_HEAD;
+	/// the headers of the upgrade are removed, the last empty line is cut
+	line = header;
+	while (line < end - 2)
+	{
+		const char *next = strstr(line, "\r\n") + 2;
+		const char *value = NULL;
+		size_t length = next - line;
+		if (length > 2 &&
+			!_http2_headerline(line, length, "Upgrade", &value) &&
+			!_http2_headerline(line, length, "HTTP2-Settings", &value) &&
+			!_http2_headerline(line, length, "Connection", &value))
+			_http2_append(&stream->request, &stream->length, &stream->size, line, length);
+		line = next;
+	}
+	stream->header = stream->length;
+	_http2_consume(ctx, headerlength);
+	if (_http2_start(ctx) != ESUCCESS)
+		return EREJECT;
+	return _http2_ready(stream);
+}
+
+static int _http2_sniff(http2_ctx_t *ctx)
+{
+	size_t length = (ctx->inlength < HTTP2_PREFACELEN)? ctx->inlength: HTTP2_PREFACELEN;
+	if (!memcmp(ctx->in, HTTP2_PREFACE, length))
+	{
+		if (length < HTTP2_PREFACELEN)
+			return ESUCCESS;
+		_http2_consume(ctx, HTTP2_PREFACELEN);
+		ctx->mode = HTTP2_FRAMES;
+		http2_dbg("http2: preface");
+		return _http2_start(ctx);
+	}
+	if (ctx->mod->secure || !(ctx->mod->config->options & HTTP2_H2C))
+	{
+		ctx->mode = HTTP2_HTTP1;
+		return ESUCCESS;
+	}
+	unsigned char *end = memmem(ctx->in, ctx->inlength, "\r\n\r\n", 4);
+	if (end == NULL)
+	{
+		if (ctx->inlength == ctx->insize)
+			ctx->mode = HTTP2_HTTP1;
+		return ESUCCESS;
+	}
+	/// the strings functions stop at the end of the header
+	end[2] = '\0';
+	int ret = _http2_upgrade(ctx, end + 4 - ctx->in);
+	if (ctx->mode == HTTP2_HTTP1)
+		end[2] = '\r';
+	return ret;
+}
+
+static http2_stream_t *_http2_select(http2_ctx_t *ctx)
+{
+	http2_stream_t *best = NULL;
+	http2_stream_t *first = NULL;
+	for (http2_stream_t *stream = ctx->streams; stream != NULL; stream = stream->next)
+	{
+		if (!(stream->flags & STREAM_READY) || (stream->flags & STREAM_FED))
+			continue;
+		if (first == NULL || stream->id < first->id)
+			first = stream;
+		/// a stream waits its parent if it is not yet given to the server
+		http2_stream_t *parent = (stream->parent != 0)? _http2_stream(ctx, stream->parent): NULL;
+		if (parent != NULL && !(parent->flags & STREAM_FED))
+			continue;
+		if (best == NULL || stream->urgency < best->urgency ||
+			(stream->urgency == best->urgency && stream->weight > best->weight) ||
+			(stream->urgency == best->urgency && stream->weight == best->weight && stream->id < best->id))
+			best = stream;
+	}
+	/// the dependencies may be a loop
+	if (best == NULL)
+		best = first;
+	return best;
+}
+
+static int _http2_deliver(http2_ctx_t *ctx, char *data, size_t size)
+{
+	while (1)
+	{
+		if (ctx->feeding == NULL)
+		{
+			http2_stream_t *stream = _http2_select(ctx);
+			if (stream == NULL)
+				return EINCOMPLETE;
+			stream->flags |= STREAM_FED;
+			if (stream->id > ctx->lastfed)
+				ctx->lastfed = stream->id;
+			if (ctx->lastresponse != NULL)
+				ctx->lastresponse->rnext = stream;
+			else
+				ctx->responses = stream;
+			ctx->lastresponse = stream;
+			ctx->feeding = stream;
+			http2_dbg("http2: stream %u to the server", stream->id);
+		}
+		http2_stream_t *stream = ctx->feeding;
+		size_t length = stream->length - stream->offset;
+		if (length == 0)
+		{
+			if (!(stream->flags & STREAM_REMOTECLOSED))
+				return EINCOMPLETE;
+			stream->flags |= STREAM_DELIVERED;
+			ctx->feeding = NULL;
+			_http2_closestream(ctx, stream);
+			continue;
+		}
+		if (length > size)
+			length = size;
+		memcpy(data, stream->request + stream->offset, length);
+		size_t header = (length < stream->header)? length: stream->header;
+		stream->header -= header;
+		stream->offset += length;
+		if (stream->offset == stream->length)
+		{
+			stream->offset = 0;
+			stream->length = 0;
+		}
+		_http2_credit(ctx, stream, length - header);
+		return length;
+	}
+}
+
+static int _http2_passthrough(http2_ctx_t *ctx, char *data, size_t size)
+{
+	if (ctx->inlength == 0)
+		return ctx->protocolops->recvreq(ctx->protocol, data, size);
+	size_t length = (ctx->inlength < size)? ctx->inlength: size;
+	memcpy(data, ctx->in, length);
+	_http2_consume(ctx, length);
+	if (ctx->inlength == 0)
+		_http2_freein(ctx);
+	return length;
+}
+
+static int _http2_recv(void *vctx, char *data, size_t size)
+{
+	http2_ctx_t *ctx = (http2_ctx_t *)vctx;
+	int ret = EINCOMPLETE;
+	while (ret == EINCOMPLETE)
+	{
+		if (ctx->mode == HTTP2_HTTP1)
+			return _http2_passthrough(ctx, data, size);
+		if (ctx->mode == HTTP2_CLOSED)
+			return EREJECT;
+		ret = _http2_deliver(ctx, data, size);
+		if (ret != EINCOMPLETE)
+			break;
+		ret = _http2_fill(ctx);
+		if (ret < 0)
+			break;
+		if (ctx->mode == HTTP2_SNIFF)
+			ret = _http2_sniff(ctx);
+		else
+			ret = _http2_frames(ctx);
+		if (ret == EREJECT)
+			break;
+		ret = EINCOMPLETE;
+	}
+	return ret;
+}
+
+/**
+ * the frames already received may open the window, otherwise the
+ * response is deferred with EINCOMPLETE and _http2_wait waits the
+ * WINDOW_UPDATE of the client.
+ */
+static int _http2_window(http2_ctx_t *ctx, http2_stream_t *stream)
+{
+	while (!(stream->flags & STREAM_RESET) &&
+		(ctx->sendwindow <= 0 || stream->sendwindow <= 0))
+	{
+		int ret = _http2_fill(ctx);
+		if (ret == EINCOMPLETE)
+		{
+			ctx->windowwait = 1;
+			return EINCOMPLETE;
+		}
+		if (ret <= 0 || _http2_frames(ctx) == EREJECT)
+			return EREJECT;
+	}
+	ctx->windowwait = 0;
+	return ESUCCESS;
+}
+
+static int _http2_senddata(http2_ctx_t *ctx, http2_stream_t *stream, const char *data, size_t length, int end)
+{
+	size_t sent = 0;
+	do
+	{
+		if (stream->flags & STREAM_RESET)
+			return length;
+		size_t chunk = length - sent;
+		if (chunk > 0)
+		{
+			int ret = _http2_window(ctx, stream);
+			if (ret == EINCOMPLETE)
+				return (sent > 0)? (int)sent: EINCOMPLETE;
+			if (ret != ESUCCESS)
+				return EREJECT;
+			if (stream->flags & STREAM_RESET)
+				return length;
+			if (chunk > (size_t)ctx->sendwindow)
+				chunk = ctx->sendwindow;
+			if (chunk > (size_t)stream->sendwindow)
+				chunk = stream->sendwindow;
+			if (chunk > ctx->framesize)
+				chunk = ctx->framesize;
+		}
+		int flags = (end && sent + chunk == length)? HTTP2_FLAG_END_STREAM: 0;
+		if (_http2_sendframe(ctx, HTTP2_DATA, flags, stream->id, data + sent, chunk) != ESUCCESS)
+			return EREJECT;
+		ctx->sendwindow -= chunk;
+		stream->sendwindow -= chunk;
+		sent += chunk;
+	} while (sent < length);
+	return sent;
+}
+
+static int _http2_sendheaders(http2_ctx_t *ctx, http2_stream_t *stream, const unsigned char *block, size_t length, int end)
+{
+	int type = HTTP2_HEADERS;
+	size_t sent = 0;
+	do
+	{
+		size_t chunk = length - sent;
+		if (chunk > ctx->framesize)
+			chunk = ctx->framesize;
+		int flags = (type == HTTP2_HEADERS && end)? HTTP2_FLAG_END_STREAM: 0;
+		if (sent + chunk == length)
+			flags |= HTTP2_FLAG_END_HEADERS;
+		if (_http2_sendframe(ctx, type, flags, stream->id, block + sent, chunk) != ESUCCESS)
+			return EREJECT;
+		sent += chunk;
+		type = HTTP2_CONTINUATION;
+	} while (sent < length);
+	return ESUCCESS;
+}
+
+static void _http2_endresponse(http2_ctx_t *ctx, http2_stream_t *stream)
+{
+	http2_dbg("http2: stream %u response complete", stream->id);
+	ctx->responses = stream->rnext;
+	if (ctx->responses == NULL)
+		ctx->lastresponse = NULL;
+	stream->flags |= STREAM_RESPONDED;
+	ctx->rstate = RESPONSE_HEADER;
+	ctx->rremain = 0;
+	_http2_closestream(ctx, stream);
+}
+
+/**
+ * the header of a reset stream is only parsed for the framing of its
+ * content, which is dropped until its end. The encoder must not change
+ * for a stream without response.
+ */
+static int _http2_responseheader(http2_ctx_t *ctx, http2_stream_t *stream, const char *header, size_t headerlength)
+{
+	if (headerlength < 12 || strncmp(header, "HTTP/1.", 7))
+		return _http2_goaway(ctx, HTTP2_INTERNAL_ERROR);
+	int reset = (stream->flags & STREAM_RESET);
+	const char *status = header + 9;
+	int code = strtol(status, NULL, 10);
+	ssize_t contentlength = -1;
+	int chunked = 0;
+	size_t blocksize = headerlength * 2 + 64;
+	unsigned char *block = NULL;
+	size_t length = 0;
+	int ret = 1;
+	if (!reset)
+	{
+		block = malloc(blocksize);
+		if (block == NULL)
+			return _http2_goaway(ctx, HTTP2_INTERNAL_ERROR);
+		ret = hpack_encode(ctx->encoder, ":status", 7, status, 3, block, blocksize);
+		if (ret > 0)
+			length += ret;
+	}
+	const char *end = header + headerlength;
+	const char *line = memmem(header, headerlength, "\r\n", 2);
+	while (line != NULL && ret > 0)
+	{
+		line += 2;
+		const char *next = memmem(line, end - line, "\r\n", 2);
+		if (next == NULL || next == line)
+			break;
+		const char *separator = memchr(line, ':', next - line);
+		if (separator == NULL || separator - line >= 256)
+		{
+			line = next;
+			continue;
+		}
+		char name[256];
+		size_t namelen = separator - line;
+		for (size_t i = 0; i < namelen; i++)
+			name[i] = tolower(line[i]);
+		const char *value = separator + 1;
+		while (value < next && (*value == ' ' || *value == '\t'))
+			value++;
+		size_t valuelen = next - value;
+		if (namelen == 17 && !memcmp(name, "transfer-encoding", 17))
+			chunked = (memmem(value, valuelen, "chunked", 7) != NULL);
+		else if (namelen == 14 && !memcmp(name, "content-length", 14))
+			contentlength = strtol(value, NULL, 10);
+		if (!reset && !_http2_hopbyhop(name, namelen))
+		{
+			ret = hpack_encode(ctx->encoder, name, namelen, value, valuelen, block + length, blocksize - length);
+			if (ret > 0)
+				length += ret;
+		}
+		line = next;
+	}
+	if (ret < 0)
+	{
+		free(block);
+		return _http2_goaway(ctx, HTTP2_INTERNAL_ERROR);
+	}
+	int endstream = 0;
+	if (code < 200)
+		ctx->rstate = RESPONSE_HEADER;
+	else if ((stream->flags & STREAM_HEAD) || code == 204 || code == 304 || contentlength == 0)
+		endstream = 1;
+	else if (chunked)
+		ctx->rstate = RESPONSE_CHUNKSIZE;
+	else if (contentlength > 0)
+	{
+		ctx->rstate = RESPONSE_BODY;
+		ctx->rremain = contentlength;
+	}
+	else
+		ctx->rstate = RESPONSE_CLOSE;
+	ctx->rlinelength = 0;
+	http2_dbg("http2: stream %u response %d", stream->id, code);
+	ret = ESUCCESS;
+	if (!reset)
+		ret = _http2_sendheaders(ctx, stream, block, length, endstream);
+	free(block);
+	if (ret != ESUCCESS)
+		return EREJECT;
+	if (endstream)
+		_http2_endresponse(ctx, stream);
+	return ESUCCESS;
+}
+
+/**
+ * returns the length of the line in rline or 0 until the end of line
+ */
+static size_t _http2_chunkline(http2_ctx_t *ctx, const char *data, size_t size, size_t *used)
+{
+	size_t i = 0;
+	while (i < size)
+	{
+		char c = data[i++];
+		if (c == '\n')
+		{
+			*used = i;
+			ctx->rline[ctx->rlinelength] = '\0';
+			size_t length = ctx->rlinelength + 1;
+			ctx->rlinelength = 0;
+			return length;
+		}
+		if (c != '\r' && ctx->rlinelength < sizeof(ctx->rline) - 1)
+			ctx->rline[ctx->rlinelength++] = c;
+	}
+	*used = i;
+	return 0;
+}
+
+static int _http2_response(http2_ctx_t *ctx, http2_stream_t *stream, const char *data, size_t size)
+{
+	int ret = EREJECT;
+	size_t used = 0;
+	size_t line;
+	switch (ctx->rstate)
+	{
+	case RESPONSE_HEADER:
+	{
+		size_t start = (ctx->rheaderlength > 3)? ctx->rheaderlength - 3: 0;
+		size_t rheadersize = ctx->rheaderlength;
+		if (_http2_append(&ctx->rheader, &ctx->rheaderlength, &rheadersize, data, size) != ESUCCESS)
+			return EREJECT;
+		char *end = memmem(ctx->rheader + start, ctx->rheaderlength - start, "\r\n\r\n", 4);
+		if (end == NULL)
+		{
+			if (ctx->rheaderlength > HTTP2_HEADERMAX)
+				return _http2_goaway(ctx, HTTP2_INTERNAL_ERROR);
+			return size;
+		}
+		size_t headerlength = end + 4 - ctx->rheader;
+		used = headerlength - (ctx->rheaderlength - size);
+		ctx->rheaderlength = 0;
+		ret = _http2_responseheader(ctx, stream, ctx->rheader, headerlength);
+		free(ctx->rheader);
+		ctx->rheader = NULL;
+		if (ret != ESUCCESS)
+			return EREJECT;
+		return used;
+	}
+	case RESPONSE_BODY:
+		used = (size < ctx->rremain)? size: ctx->rremain;
+		ret = _http2_senddata(ctx, stream, data, used, used == ctx->rremain);
+		if (ret < 0)
+			return ret;
+		used = ret;
+		ctx->rremain -= used;
+		if (ctx->rremain == 0)
+			_http2_endresponse(ctx, stream);
+		return used;
+	case RESPONSE_CHUNKSIZE:
+		line = _http2_chunkline(ctx, data, size, &used);
+		if (line > 1)
+		{
+			ctx->rremain = strtoul(ctx->rline, NULL, 16);
+			ctx->rstate = (ctx->rremain > 0)? RESPONSE_CHUNKDATA: RESPONSE_TRAILER;
+		}
+		return used;
+	case RESPONSE_CHUNKDATA:
+		used = (size < ctx->rremain)? size: ctx->rremain;
+		ret = _http2_senddata(ctx, stream, data, used, 0);
+		if (ret < 0)
+			return ret;
+		used = ret;
+		ctx->rremain -= used;
+		if (ctx->rremain == 0)
+			ctx->rstate = RESPONSE_CHUNKEND;
+		return used;
+	case RESPONSE_CHUNKEND:
+		line = _http2_chunkline(ctx, data, size, &used);
+		if (line > 0)
+			ctx->rstate = RESPONSE_CHUNKSIZE;
+		return used;
+	case RESPONSE_TRAILER:
+		line = _http2_chunkline(ctx, data, size, &used);
+		if (line == 1)
+		{
+			/// the last chunk
+			if (_http2_senddata(ctx, stream, NULL, 0, 1) < 0)
+				return EREJECT;
+			_http2_endresponse(ctx, stream);
+		}
+		return used;
+	case RESPONSE_CLOSE:
+		return _http2_senddata(ctx, stream, data, size, 0);
+	}
+	return ret;
+}
+
+static int _http2_send(void *vctx, const char *data, size_t size)
+{
+	http2_ctx_t *ctx = (http2_ctx_t *)vctx;
+	if (ctx->mode == HTTP2_HTTP1 || ctx->mode == HTTP2_SNIFF)
+		return ctx->protocolops->sendresp(ctx->protocol, data, size);
+	if (ctx->mode == HTTP2_CLOSED)
+		return EREJECT;
+	size_t done = 0;
+	while (done < size)
+	{
+		http2_stream_t *stream = ctx->responses;
+		if (stream == NULL)
+		{
+			err("http2: response without stream");
+			return _http2_goaway(ctx, HTTP2_INTERNAL_ERROR);
+		}
+		int ret = _http2_response(ctx, stream, data + done, size - done);
+		if (ret == EINCOMPLETE)
+			/// the server sends the rest after _http2_wait
+			return (done > 0)? (int)done: EINCOMPLETE;
+		if (ret < 0)
+			return EREJECT;
+		done += ret;
+	}
+	return done;
+}
+
+/**
+ * the sendfile of mod_document writes the content of the current
+ * response into DATA frames, the kernel copies the file
+ */
+static int _http2_sendfile(void *arg, http_client_t *clt, int fd, size_t size)
+{
+	http2_ctx_t *ctx = NULL;
+	pthread_mutex_lock(&g_http2_mutex);
+	for (ctx = g_http2_clients; ctx != NULL; ctx = ctx->next)
+	{
+		if (ctx->clt == clt)
+			break;
+	}
+	pthread_mutex_unlock(&g_http2_mutex);
+	if (ctx == NULL || ctx->mode == HTTP2_HTTP1)
+		return ECONTINUE;
+	http2_stream_t *stream = ctx->responses;
+	if (ctx->mode != HTTP2_FRAMES || stream == NULL || ctx->rstate != RESPONSE_BODY)
+	{
+		errno = EPIPE;
+		return -1;
+	}
+	if (ctx->rframe == 0 && (stream->flags & STREAM_RESET))
+	{
+		/// the file is dropped like the content of a reset stream
+		char buffer[HTTP2_CHUNKSIZE];
+		ssize_t length = read(fd, buffer, (size < sizeof(buffer))? size: sizeof(buffer));
+		if (length > 0)
+			_http2_response(ctx, stream, buffer, length);
+		return length;
+	}
+	if (ctx->rframe == 0)
+	{
+		int ret = _http2_window(ctx, stream);
+		if (ret == EINCOMPLETE)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+		if (ret != ESUCCESS)
+		{
+			errno = EPIPE;
+			return -1;
+		}
+		size_t chunk = (size < ctx->rremain)? size: ctx->rremain;
+		if (chunk > (size_t)ctx->sendwindow)
+			chunk = ctx->sendwindow;
+		if (chunk > (size_t)stream->sendwindow)
+			chunk = stream->sendwindow;
+		if (chunk > ctx->framesize)
+			chunk = ctx->framesize;
+		int flags = (chunk == ctx->rremain)? HTTP2_FLAG_END_STREAM: 0;
+		unsigned char header[HTTP2_FRAMEHEADER];
+		_http2_frameheader(header, chunk, HTTP2_DATA, flags, stream->id);
+		if (_http2_write(ctx, header, sizeof(header)) != ESUCCESS)
+		{
+			errno = EPIPE;
+			return -1;
+		}
+		ctx->sendwindow -= chunk;
+		stream->sendwindow -= chunk;
+		ctx->rremain -= chunk;
+		ctx->rframe = chunk;
+	}
+	/// the frame must be complete before the next one, the next calls send its rest
+	int sock = httpclient_socket(clt);
+	size_t length = (size < ctx->rframe)? size: ctx->rframe;
+	ssize_t ret = sendfile(sock, fd, NULL, length);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	if (ret <= 0)
+	{
+		ctx->mode = HTTP2_CLOSED;
+		errno = EPIPE;
+		return -1;
+	}
+	ctx->rframe -= ret;
+	if (ctx->rframe == 0 && ctx->rremain == 0)
+		_http2_endresponse(ctx, stream);
+	return ret;
+}
+
+static int _http2_pending(http2_ctx_t *ctx)
+{
+	if (ctx->mode == HTTP2_HTTP1 || ctx->mode == HTTP2_SNIFF)
+		return (ctx->inlength > 0);
+	if (ctx->feeding != NULL)
+		return (ctx->feeding->length > ctx->feeding->offset ||
+				(ctx->feeding->flags & STREAM_REMOTECLOSED));
+	for (http2_stream_t *stream = ctx->streams; stream != NULL; stream = stream->next)
+	{
+		if ((stream->flags & STREAM_READY) && !(stream->flags & STREAM_FED))
+			return 1;
+	}
+	return 0;
+}
+
+static int _http2_wait(void *vctx, int options)
+{
+	http2_ctx_t *ctx = (http2_ctx_t *)vctx;
+	/// the server does not poll the socket for the data already received
+	if (!(options & WAIT_SEND) && _http2_pending(ctx))
+		return ESUCCESS;
+	/// the deferred response waits the WINDOW_UPDATE of the client
+	if ((options & WAIT_SEND) && ctx->windowwait)
+		return ctx->protocolops->wait(ctx->protocol, options & ~WAIT_SEND);
+	/// the idle connection keeps only its HPACK tables
+	if (!(options & WAIT_SEND) && ctx->mode == HTTP2_FRAMES &&
+		ctx->streams == NULL && ctx->inlength == 0 && ctx->block == NULL)
+	{
+		_http2_freein(ctx);
+		_http2_freeout(ctx);
+	}
+	return ctx->protocolops->wait(ctx->protocol, options);
+}
+
+static int _http2_status(void *vctx)
+{
+	http2_ctx_t *ctx = (http2_ctx_t *)vctx;
+	if (ctx->mode != HTTP2_HTTP1 && _http2_pending(ctx))
+		return ESUCCESS;
+	return ctx->protocolops->status(ctx->protocol);
+}
+
+static void _http2_flush(void *vctx)
+{
+	http2_ctx_t *ctx = (http2_ctx_t *)vctx;
+	ctx->protocolops->flush(ctx->protocol);
+}
+
+static void _http2_disconnect(void *vctx)
+{
+	http2_ctx_t *ctx = (http2_ctx_t *)vctx;
+	if (ctx->mode == HTTP2_FRAMES || ctx->mode == HTTP2_PREFACE_E)
+	{
+		/// the response without length ends with the connection
+		if (ctx->responses != NULL && ctx->rstate == RESPONSE_CLOSE &&
+			!(ctx->responses->flags & STREAM_RESET))
+			_http2_senddata(ctx, ctx->responses, NULL, 0, 1);
+		_http2_goaway(ctx, HTTP2_NO_ERROR);
+	}
+	ctx->protocolops->disconnect(ctx->protocol);
+}
+
+static void _http2_destroy(void *vctx)
+{
+	http2_ctx_t *ctx = (http2_ctx_t *)vctx;
+	if (ctx->decoder != NULL)
+	{
+		_http2_removeclient(ctx);
+		hpack_destroy(ctx->decoder);
+		hpack_destroy(ctx->encoder);
+	}
+	while (ctx->streams != NULL)
+		_http2_freestream(ctx, ctx->streams);
+	free(ctx->block);
+	free(ctx->rheader);
+	_http2_freein(ctx);
+	_http2_freeout(ctx);
+	ctx->protocolops->destroy(ctx->protocol);
+	free(ctx);
+}
+
+static void *_http2_create(void *arg, http_client_t *clt)
+{
+	_mod_http2_t *mod = (_mod_http2_t *)arg;
+	http2_ctx_t *ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+	ctx->protocolops = mod->protocolops;
+	ctx->protocol = ctx->protocolops->create(mod->protocol, clt);
+	if (ctx->protocol == NULL)
+	{
+		free(ctx);
+		return NULL;
+	}
+	ctx->mod = mod;
+	ctx->clt = clt;
+	ctx->mode = HTTP2_SNIFF;
+	ctx->initialwindow = HTTP2_WINDOW;
+	ctx->framesize = HTTP2_FRAMESIZE;
+	return ctx;
+}
+
+static const httpclient_ops_t *http2server_ops;
+static const httpclient_ops_t *http2secureserver_ops;
+
+static void *mod_http2_create(http_server_t *server, mod_http2_t *config)
+{
+	if (config == NULL)
+		return NULL;
+	const char *secure = httpserver_INFO(server, "secure");
+	int issecure = (secure != NULL && !strcmp(secure, "true"));
+	if (!issecure && !(config->options & HTTP2_H2C))
+	{
+		warn("http2: h2c option is required without tls");
+		return NULL;
+	}
+	hpack_init();
+	_mod_http2_t *mod = calloc(1, sizeof(*mod));
+	if (mod == NULL)
+		return NULL;
+	mod->config = config;
+	mod->secure = issecure;
+	mod->protocolops = httpserver_changeprotocol(server, (issecure)? http2secureserver_ops: http2server_ops, mod);
+	mod->protocol = server;
+	ouistiti_setsendfile(_http2_sendfile, mod);
+	warn("http2: enables on %s %s", httpserver_INFO(server, "hostname"), httpserver_INFO(server, "port"));
+	return mod;
+}
+
+static void mod_http2_destroy(void *arg)
+{
+	_mod_http2_t *mod = (_mod_http2_t *)arg;
+#ifdef FILE_CONFIG
+	free(mod->config);
+#endif
+	free(mod);
+}
+
+static const httpclient_ops_t *http2server_ops = &(httpclient_ops_t)
+{
+	.scheme = "http",
+	.default_port = 80,
+	.create = &_http2_create,
+	.recvreq = &_http2_recv,
+	.sendresp = &_http2_send,
+	.wait = &_http2_wait,
+	.status = &_http2_status,
+	.flush = &_http2_flush,
+	.disconnect = &_http2_disconnect,
+	.destroy = &_http2_destroy,
+};
+
+/// the layer keeps the type of the TLS layer for ouistiti_issecure
+static const httpclient_ops_t *http2secureserver_ops = &(httpclient_ops_t)
+{
+	.scheme = "https",
+	.default_port = 443,
+	.type = HTTPCLIENT_TYPE_SECURE,
+	.create = &_http2_create,
+	.recvreq = &_http2_recv,
+	.sendresp = &_http2_send,
+	.wait = &_http2_wait,
+	.status = &_http2_status,
+	.flush = &_http2_flush,
+	.disconnect = &_http2_disconnect,
+	.destroy = &_http2_destroy,
+};
+
+const module_t mod_http2 =
+{
+	.name = str_http2,
+	.configure = (module_configure_t)&http2_config,
+	.create = (module_create_t)&mod_http2_create,
+	.destroy = &mod_http2_destroy
+};
+
+#ifdef MODULES
+extern module_t mod_info __attribute__ ((weak, alias ("mod_http2")));
+#endif
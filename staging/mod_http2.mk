@@ -0,0 +1,13 @@
+modules-$(MODULES)+=mod_http2
+slib-$(STATIC)+=mod_http2
+mod_http2_SOURCES+=mod_http2.c
+mod_http2_SOURCES+=hpack.c
+mod_http2_CFLAGS+=$(LIBHTTPSERVER_CFLAGS)
+mod_http2_LDFLAGS+=$(LIBHTTPSERVER_LDFLAGS)
+mod_http2_LIBS+=$(LIBHTTPSERVER_NAME)
+mod_http2_LIBRARY+=libconfig
+mod_http2_LIBS+=ouiutils
+mod_http2_LIBS+=ouihash
+mod_http2_LIBS+=pthread
+
+mod_http2_CFLAGS-$(DEBUG)+=-g -DDEBUG
@@ -41,13 +41,7 @@
 
 #warning METHODLOCK is deprecated
 
-#define err(format, ...) fprintf(stderr, "\x1B[31m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#define warn(format, ...) fprintf(stderr, "\x1B[35m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#ifdef DEBUG
-#define dbg(format, ...) fprintf(stderr, "\x1B[32m"format"\x1B[0m\n",  ##__VA_ARGS__)
-#else
-#define dbg(...)
-#endif
+#include "log.h"
 
 static const char str_methodlock[] = "methodlock";
 
@@ -131,7 +125,7 @@ static void *_mod_methodlock_getctx(void *arg, http_client_t *ctl, struct sockad
 {
 	_mod_methodlock_t *mod = (_mod_methodlock_t *)arg;
 
-	httpclient_addconnector(ctl, methodlock_connector, mod, CONNECTOR_DOCFILTER, str_methodlock);
+	ouistiti_addclientconnector(ctl, methodlock_connector, mod, CONNECTOR_DOCFILTER, str_methodlock);
 
 	return arg;
 }
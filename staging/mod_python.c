@@ -53,28 +53,48 @@
 #include "ouistiti/utils.h"
 #include "ouistiti/log.h"
 #include "mod_cgi.h"
+#include "log.h"
 
 #define python_dbg(...)
 
 static const char str_python[] = "python";
 
-typedef struct mod_cgi_config_s mod_python_config_t;
+#if PY_VERSION_HEX >= 0x030C0000
+/// the sub-interpreters with their own GIL run the scripts in parallel
+#define PYTHON_WORKERS
+#endif
+
+typedef struct mod_python_config_s mod_python_config_t;
 typedef struct _mod_python_s _mod_python_t;
+typedef struct _mod_python_worker_s _mod_python_worker_t;
 typedef struct mod_python_ctx_s mod_python_ctx_t;
 
 static int _python_connector(void *arg, http_message_t *request, http_message_t *response);
 
+struct mod_python_config_s
+{
+	mod_cgi_config_t *cgi;
+	int workers;
+};
+
 struct mod_python_ctx_s
 {
 	_mod_python_t *mod;
 	http_client_t *ctl;
+	_mod_python_worker_t *worker;
+	PyThreadState *tstate;
+	PyGILState_STATE gil;
 
 	PyObject *pyfunc;
 	PyObject *pyenv;
 	PyObject *pyresult;
 	PyObject *pycontent;
 	PyObject *pymodule;
+	PyObject *pybody;
 	ssize_t contentread;
+	char *body;
+	size_t bodylength;
+	size_t bodysize;
 
 	enum
 	{
@@ -97,16 +117,31 @@ struct _mod_python_script_s
 	PyObject *pymodule;
 	_mod_python_script_t *next;
 };
+
+/**
+ * each worker is an interpreter with its own modules.
+ * The scripts are imported once by worker and kept into "scripts".
+ */
+struct _mod_python_worker_s
+{
+	PyInterpreterState *interp;
+	PyThreadState *tstate;
+	_mod_python_script_t *scripts;
+	int clients;
+};
+
 struct _mod_python_s
 {
 	http_server_t *server;
 	mod_python_config_t *config;
 	int rootfd;
-	_mod_python_script_t *scripts;
+	_mod_python_worker_t main;
+	_mod_python_worker_t *workers;
+	int nbworkers;
 };
 
 #ifdef FILE_CONFIG
-static int _python_configscript(config_setting_t *setting, mod_python_config_t *python)
+static int _python_configscript(config_setting_t *setting, mod_cgi_config_t *python)
 {
 	const char *data = config_setting_get_string(setting);
 	if (data == NULL)
@@ -129,17 +164,24 @@ static void *python_config(config_setting_t *iterator, server_t *server)
 #endif
 	if (configpython)
 	{
-		cgienv_config(iterator, configpython, server, &python, _python_configscript);
+		python = calloc(1, sizeof(*python));
+		cgienv_config(iterator, configpython, server, &python->cgi, _python_configscript);
+		config_setting_lookup_int(configpython, "workers", &python->workers);
 	}
 	return python;
 }
 #else
-static const mod_python_config_t g_python_config =
+static mod_cgi_config_t g_python_cgiconfig =
 {
 	.docroot = "/srv/www""/python",
 	.deny = "*",
 	.allow = "*.py*",
 };
+static const mod_python_config_t g_python_config =
+{
+	.cgi = &g_python_cgiconfig,
+	.workers = 0,
+};
 
 static void *python_config(void *iterator, server_t *server)
 {
@@ -166,54 +208,145 @@ static PyObject *_mod_python_modulize(const char *uri, size_t urilen)
 	return pymodule;
 }
 
+/**
+ * the worker's interpreter must be the current one
+ */
+static PyObject *_python_module(_mod_python_worker_t *worker, const char *uri, size_t urilen)
+{
+	_mod_python_script_t *script = worker->scripts;
+	while (script)
+	{
+		if (((size_t)urilen == script->path.length) && !strncasecmp(script->path.data, uri, urilen))
+			return script->pymodule;
+		script = script->next;
+	}
+	PyObject *pymodule = _mod_python_modulize(uri, urilen);
+	if (pymodule)
+	{
+		_mod_python_script_t *pscript = calloc(1, sizeof(*pscript));
+		pscript->pymodule = pymodule;
+		pscript->path.data = strndup(uri, urilen);
+		pscript->path.length = urilen;
+		pscript->next = worker->scripts;
+		worker->scripts = pscript;
+	}
+	return pymodule;
+}
+
+static void _python_workersetup(_mod_python_worker_t *worker, const mod_cgi_config_t *config)
+{
+	PyObject *sys = PyImport_ImportModule("sys");
+	PyObject *path = PyObject_GetAttrString(sys, "path");
+	PyObject *pwd = PyUnicode_FromString(config->docroot);
+	PyList_Append(path, pwd);
+	Py_DECREF(sys);
+	Py_DECREF(path);
+	Py_DECREF(pwd);
+
+	const mod_cgi_config_script_t *script = config->scripts;
+	while (script)
+	{
+		_python_module(worker, script->path.data, script->path.length);
+		script = script->next;
+	}
+	PyErr_Clear();
+}
+
+static void _python_workercleanup(_mod_python_worker_t *worker)
+{
+	_mod_python_script_t *script = worker->scripts;
+	while (script)
+	{
+		_mod_python_script_t *next = script->next;
+		Py_XDECREF(script->pymodule);
+		free((char *)script->path.data);
+		free(script);
+		script = next;
+	}
+	worker->scripts = NULL;
+}
+
+#ifdef PYTHON_WORKERS
+static int _python_workercreate(_mod_python_worker_t *worker, const mod_cgi_config_t *config)
+{
+	const PyInterpreterConfig pyconfig =
+	{
+		.use_main_obmalloc = 0,
+		.allow_fork = 0,
+		.allow_exec = 0,
+		.allow_threads = 1,
+		.allow_daemon_threads = 0,
+		.check_multi_interp_extensions = 1,
+		.gil = PyInterpreterConfig_OWN_GIL,
+	};
+	PyThreadState *mainstate = PyThreadState_Get();
+	PyThreadState *tstate = NULL;
+	PyStatus status = Py_NewInterpreterFromConfig(&tstate, &pyconfig);
+	if (PyStatus_Exception(status))
+	{
+		err("python: sub-interpreter not available");
+		PyThreadState_Swap(mainstate);
+		return EREJECT;
+	}
+	worker->tstate = tstate;
+	worker->interp = PyThreadState_GetInterpreter(tstate);
+	_python_workersetup(worker, config);
+	/// the swap releases the GIL of the worker
+	PyThreadState_Swap(mainstate);
+	return ESUCCESS;
+}
+
+static void _python_workerdestroy(_mod_python_worker_t *worker)
+{
+	PyThreadState *mainstate = PyThreadState_Swap(worker->tstate);
+	_python_workercleanup(worker);
+	Py_EndInterpreter(worker->tstate);
+	PyThreadState_Swap(mainstate);
+}
+#endif
+
 static void *mod_python_create(http_server_t *server, mod_python_config_t *modconfig)
 {
 	_mod_python_t *mod;
 
 	if (!modconfig)
 		return NULL;
+	const mod_cgi_config_t *config = modconfig->cgi;
 
-	if (access(modconfig->docroot, R_OK) == -1)
+	if (access(config->docroot, R_OK) == -1)
 	{
-		err("python: %s access denied", modconfig->docroot);
+		err("python: %s access denied", config->docroot);
 		return NULL;
 	}
-	int rootfd = open(modconfig->docroot, O_PATH | O_DIRECTORY);
+	int rootfd = open(config->docroot, O_PATH | O_DIRECTORY);
 	struct stat rootstat;
 	if (fstat(rootfd, &rootstat) == -1 || !S_ISDIR(rootstat.st_mode))
 	{
-		err("python: %s not a directory", modconfig->docroot);
+		err("python: %s not a directory", config->docroot);
 		return NULL;
 	}
-	PyObject *sys = PyImport_ImportModule("sys");
-	PyObject *path = PyObject_GetAttrString(sys, "path");
-	PyObject *pwd = PyUnicode_FromString(modconfig->docroot);
-	PyList_Append(path, pwd);
-	Py_DECREF(sys);
-	Py_DECREF(path);
-	Py_DECREF(pwd);
 
 	mod = calloc(1, sizeof(*mod));
 	mod->config = modconfig;
 	mod->server = server;
 	mod->rootfd = rootfd;
 
-	mod_cgi_config_script_t *script = modconfig->scripts;
-	while (script)
+	PyGILState_STATE gil = PyGILState_Ensure();
+	_python_workersetup(&mod->main, config);
+#ifdef PYTHON_WORKERS
+	if (modconfig->workers > 0)
+		mod->workers = calloc(modconfig->workers, sizeof(*mod->workers));
+	for (int i = 0; i < modconfig->workers; i++)
 	{
-		PyObject *pymodule = _mod_python_modulize(script->path.data, script->path.length);
-		if (pymodule)
-		{
-			_mod_python_script_t *pscript = calloc(1, sizeof(*pscript));
-			pscript->pymodule = pymodule;
-			_string_store(&pscript->path, script->path.data, script->path.length);
-			pscript->next = mod->scripts;
-			mod->scripts = pscript;
-		}
-		script = script->next;
+		if (_python_workercreate(&mod->workers[mod->nbworkers], config) == ESUCCESS)
+			mod->nbworkers++;
 	}
-	PyErr_Clear();
-	httpserver_addconnector(server, _python_connector, mod, CONNECTOR_DOCUMENT, str_python);
+#else
+	if (modconfig->workers > 0)
+		warn("python: workers require Python 3.12, the main interpreter is used");
+#endif
+	PyGILState_Release(gil);
+	ouistiti_addconnector(server, _python_connector, mod, CONNECTOR_DOCUMENT, str_python);
 
 	return mod;
 }
@@ -222,20 +355,117 @@ static void mod_python_destroy(void *arg)
 {
 	_mod_python_t *mod = (_mod_python_t *)arg;
 
-	if (mod->config->env)
-		free(mod->config->env);
+	PyGILState_STATE gil = PyGILState_Ensure();
+#ifdef PYTHON_WORKERS
+	for (int i = 0; i < mod->nbworkers; i++)
+		_python_workerdestroy(&mod->workers[i]);
+#endif
+	_python_workercleanup(&mod->main);
+	PyGILState_Release(gil);
+	free(mod->workers);
+	if (mod->config->cgi->env)
+		free(mod->config->cgi->env);
+	free(mod->config->cgi);
 	free(mod->config);
+	close(mod->rootfd);
 	free(mod);
 }
 
+/**
+ * the client uses the worker with the fewest clients.
+ * Each call into Python takes the GIL of this worker only.
+ */
+static void _python_attach(_mod_python_t *mod, mod_python_ctx_t *ctx)
+{
+	ctx->worker = &mod->main;
+	for (int i = 0; i < mod->nbworkers; i++)
+	{
+		_mod_python_worker_t *worker = &mod->workers[i];
+		if (ctx->worker == &mod->main ||
+			__atomic_load_n(&worker->clients, __ATOMIC_RELAXED) <
+			__atomic_load_n(&ctx->worker->clients, __ATOMIC_RELAXED))
+			ctx->worker = worker;
+	}
+	__atomic_add_fetch(&ctx->worker->clients, 1, __ATOMIC_RELAXED);
+	if (ctx->worker->interp != NULL)
+		ctx->tstate = PyThreadState_New(ctx->worker->interp);
+}
+
+static void _python_enter(mod_python_ctx_t *ctx)
+{
+	if (ctx->tstate != NULL)
+		PyEval_AcquireThread(ctx->tstate);
+	else
+		ctx->gil = PyGILState_Ensure();
+}
+
+static void _python_leave(mod_python_ctx_t *ctx)
+{
+	if (ctx->tstate != NULL)
+		PyEval_ReleaseThread(ctx->tstate);
+	else
+		PyGILState_Release(ctx->gil);
+}
+
 static void _python_freectx(mod_python_ctx_t *ctx)
 {
+	_python_enter(ctx);
+	if (ctx->pybody)
+	{
+		/// the scripts may keep a reference on the body, but not on the buffer
+		PyObject *pyret = PyObject_CallMethod(ctx->pybody, "release", NULL);
+		Py_XDECREF(pyret);
+		Py_DECREF(ctx->pybody);
+	}
+	Py_XDECREF(ctx->pycontent);
+	Py_XDECREF(ctx->pyresult);
+	Py_XDECREF(ctx->pyenv);
+	Py_XDECREF(ctx->pyfunc);
+	PyErr_Clear();
+	if (ctx->tstate != NULL)
+	{
+		PyThreadState_Clear(ctx->tstate);
+		PyThreadState_DeleteCurrent();
+	}
+	else
+		PyGILState_Release(ctx->gil);
+	__atomic_sub_fetch(&ctx->worker->clients, 1, __ATOMIC_RELAXED);
+	free(ctx->body);
 	free(ctx);
 }
 
+static PyObject *_python_buildenv(const mod_cgi_config_t *config, http_message_t *request, const char *uri, size_t urilen)
+{
+	char **env = cgi_buildenv(config, request, uri, urilen, NULL, 0);
+	PyObject *pyenv = PyDict_New();
+	for (int count = 0; env[count] != NULL; count++)
+	{
+		PyObject *key = NULL;
+		PyObject *value = NULL;
+		char *separator = strchr(env[count], '=');
+		if (separator != NULL)
+		{
+			key = PyUnicode_FromStringAndSize(env[count], separator - env[count]);
+			value = PyUnicode_FromString(separator + 1);
+		}
+		else
+		{
+			key = PyUnicode_FromString(env[count]);
+			value = Py_NewRef(Py_None);
+		}
+		if (key != NULL && value != NULL)
+			PyDict_SetItem(pyenv, key, value);
+		Py_XDECREF(key);
+		Py_XDECREF(value);
+		free(env[count]);
+	}
+	free(env);
+	return pyenv;
+}
+
 static int _python_start(_mod_python_t *mod, http_message_t *request, http_message_t *response)
 {
-	const mod_python_config_t *config = mod->config;
+	const mod_cgi_config_t *config = mod->config->cgi;
 	int ret = EREJECT;
 	const char *uri = NULL;
 	size_t urilen = httpmessage_REQUEST2(request,"uri", &uri);
@@ -277,21 +507,13 @@ static int _python_start(_mod_python_t *mod, http_message_t *request, http_messa
 
 		python_dbg("python: new uri %.*s", (int)urilen, uri);
 		python_dbg("python: function %s", function);
-		PyObject *pymodule = NULL;
-		_mod_python_script_t *script = mod->scripts;
-		while (script)
-		{
-			if (((size_t)urilen == script->path.length) && !strncasecmp(script->path.data, uri, urilen))
-			{
-				pymodule = script->pymodule;
-				break;
-			}
-			script = script->next;
-		}
-		if (pymodule == NULL)
-		{
-			pymodule = _mod_python_modulize(uri, urilen);
-		}
+		mod_python_ctx_t *ctx;
+		ctx = calloc(1, sizeof(*ctx));
+		ctx->mod = mod;
+		_python_attach(mod, ctx);
+		_python_enter(ctx);
+
+		PyObject *pymodule = _python_module(ctx->worker, uri, urilen);
 		PyObject *pyfunc = NULL;
 		if (pymodule != NULL)
 		{
@@ -302,33 +524,17 @@ static int _python_start(_mod_python_t *mod, http_message_t *request, http_messa
 			httpmessage_result(response, RESULT_403);
 			err("python: unable to instanciate %s", function);
 			PyErr_Print();
+			Py_XDECREF(pyfunc);
+			_python_leave(ctx);
+			_python_freectx(ctx);
 			return ESUCCESS;
 		}
 
-		mod_python_ctx_t *ctx;
-		ctx = calloc(1, sizeof(*ctx));
-		ctx->mod = mod;
 		ctx->pymodule = pymodule;
 		ctx->pyfunc = pyfunc;
-		char **env = cgi_buildenv(config, request, uri, urilen, NULL, 0);
-		int count = 0;
-		ctx->pyenv = PyDict_New();
-		for (;env[count] != NULL; count++)
-		{
-			PyObject *key = NULL;
-			PyObject *value = NULL;
-			char *separator = strchr(env[count], '=');
-			if (separator != NULL)
-			{
-				*separator = '\0';
-				key = PyUnicode_FromStringAndSize(env[count], separator - env[count]);
-				value = PyUnicode_FromString(separator + 1);
-			}
-			else
-				key = PyUnicode_FromString(env[count]);
-			PyDict_SetItem(ctx->pyenv, key, value);
-		}
+		ctx->pyenv = _python_buildenv(config, request, uri, urilen);
 		ctx->pycontent = NULL;
+		_python_leave(ctx);
 
 		httpmessage_private(request, ctx);
 		ret = EINCOMPLETE;
@@ -336,6 +542,10 @@ static int _python_start(_mod_python_t *mod, http_message_t *request, http_messa
 	return ret;
 }
 
+/**
+ * the body is stored into one buffer growing by power of 2,
+ * and it is given to the script as memoryview without copy.
+ */
 static int _python_request(mod_python_ctx_t *ctx, http_message_t *request)
 {
 	const char *input = NULL;
@@ -345,18 +555,20 @@ static int _python_request(mod_python_ctx_t *ctx, http_message_t *request)
 	inputlen = httpmessage_content(request, &input, &rest);
 	if (inputlen > 0)
 	{
-#ifdef DEBUG
-		static int length = 0;
-		length += inputlen;
-		python_dbg("python: %d input %s", length,input);
-#endif
-		PyObject *pychunk = PyUnicode_FromStringAndSize(input, inputlen);
-		if (ctx->pycontent == NULL)
-			ctx->pycontent = pychunk;
-		else
+		python_dbg("python: %lu input %.*s", ctx->bodylength + inputlen, inputlen, input);
+		if (ctx->bodylength + inputlen > ctx->bodysize)
 		{
-			PyUnicode_AppendAndDel(&ctx->pycontent, pychunk);
+			size_t size = (ctx->bodysize > 0)? ctx->bodysize: 1024;
+			while (size < ctx->bodylength + inputlen)
+				size *= 2;
+			char *body = realloc(ctx->body, size);
+			if (body == NULL)
+				return EREJECT;
+			ctx->body = body;
+			ctx->bodysize = size;
 		}
+		memcpy(ctx->body + ctx->bodylength, input, inputlen);
+		ctx->bodylength += inputlen;
 	}
 	if (inputlen != EINCOMPLETE && rest == 0)
 	{
@@ -387,7 +599,7 @@ static void _python_is(const char * name,PyObject *obj)
 }
 #endif
 
-static int _python_responseheader(mod_python_ctx_t *ctx, http_message_t *response)
+static int _python_call(mod_python_ctx_t *ctx, http_message_t *response)
 {
 	int ret = ECONTINUE;
 
@@ -409,9 +621,10 @@ static int _python_responseheader(mod_python_ctx_t *ctx, http_message_t *respons
 		return ESUCCESS;
 	}
 	PyObject_SetAttrString(pyrequest, "META", ctx->pyenv);
-	if (ctx->pycontent)
+	if (ctx->bodylength > 0)
 	{
-		PyObject_SetAttrString(pyrequest, "_body", ctx->pycontent);
+		ctx->pybody = PyMemoryView_FromMemory(ctx->body, ctx->bodylength, PyBUF_READ);
+		PyObject_SetAttrString(pyrequest, "_body", ctx->pybody);
 	}
 	PyObject *pyrequestfunc = PyObject_GetAttrString(pyrequest, "_load");
 	if (pyrequestfunc && PyCallable_Check(pyrequestfunc))
@@ -426,12 +639,12 @@ static int _python_responseheader(mod_python_ctx_t *ctx, http_message_t *respons
 		httpmessage_result(response, RESULT_500);
 		warn("python: script bad syntax HttpResponse not available");
 		PyErr_Print();
+		Py_DECREF(pyrequest);
 		return ESUCCESS;
 	}
+	Py_DECREF(pyresponse);
 	ctx->pyresult = PyObject_CallFunctionObjArgs(ctx->pyfunc, pyrequest, NULL);
-	if (ctx->pycontent)
-		Py_DECREF(ctx->pycontent);
-	ctx->pycontent = NULL;
+	Py_DECREF(pyrequest);
 	if (ctx->pyenv)
 		Py_DECREF(ctx->pyenv);
 	ctx->pyenv = NULL;
@@ -465,11 +678,8 @@ static int _python_responseheader(mod_python_ctx_t *ctx, http_message_t *respons
 					mime = strdup(value);
 				else if (key && !strcmp(key, str_contentlength))
 					length = atol(value);
-				Py_DECREF(pyheader);
-				Py_DECREF(pyasciikey);
-				Py_DECREF(pylatin1value);
-				Py_DECREF(pykey);
-				Py_DECREF(pyvalue);
+				Py_XDECREF(pyasciikey);
+				Py_XDECREF(pylatin1value);
 			}
 			Py_DECREF(pyheaders);
 		}
@@ -502,12 +712,21 @@ static int _python_responseheader(mod_python_ctx_t *ctx, http_message_t *respons
 	return ret;
 }
 
+static int _python_responseheader(mod_python_ctx_t *ctx, http_message_t *response)
+{
+	_python_enter(ctx);
+	int ret = _python_call(ctx, response);
+	_python_leave(ctx);
+	return ret;
+}
+
 static int _python_responsecontent(mod_python_ctx_t *ctx, http_message_t *response)
 {
 	int ret = ECONTINUE;
 
 	if (ctx->pycontent != NULL)
 	{
+		_python_enter(ctx);
 		Py_ssize_t size = 0;
 		char *content = NULL;
 		PyBytes_AsStringAndSize(ctx->pycontent, &content, &size);
@@ -520,6 +739,7 @@ static int _python_responsecontent(mod_python_ctx_t *ctx, http_message_t *respon
 		{
 			ctx->state = STATE_OUTFINISH;
 		}
+		_python_leave(ctx);
 	}
 	return ret;
 }
@@ -565,10 +785,6 @@ static int _python_connector(void *arg, http_message_t *request, http_message_t
 		}
 		break;
 		case STATE_END:
-			if (ctx->pycontent)
-				Py_DECREF(ctx->pycontent);
-			if (ctx->pyresult)
-				Py_DECREF(ctx->pyresult);
 			_python_freectx(ctx);
 			httpmessage_private(request, NULL);
 			ret = ESUCCESS;
@@ -596,13 +812,18 @@ extern module_t mod_info __attribute__ ((weak, alias ("mod_python")));
 static void __attribute__ ((constructor)) _mod_python_init(void);
 static void __attribute__ ((destructor)) _mod_python_finalize(void);
 
+static PyThreadState *g_mainstate = NULL;
+
 static void _mod_python_init(void)
 {
 	Py_SetProgramName(L"ouistiti");
 	Py_Initialize();
+	/// the GIL is taken by each connector
+	g_mainstate = PyEval_SaveThread();
 }
 
 static void _mod_python_finalize(void)
 {
+	PyEval_RestoreThread(g_mainstate);
 	Py_Finalize();
 }
@@ -32,6 +32,7 @@
 #include <httpserver/log.h>
 #include <httpserver/httpserver.h>
 #include "mod_skeleton.h"
+#include "log.h"
 
 typedef struct _mod_skeleton_config_s _mod_skeleton_config_t;
 typedef struct _mod_skeleton_s _mod_skeleton_t;
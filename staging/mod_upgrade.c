@@ -56,6 +56,7 @@
 #include "ouistiti/hash.h"
 #include "mod_upgrade.h"
 #include "ouistiti/utils.h"
+#include "log.h"
 
 #ifndef MSG_NOSIGNAL
 #define MSG_NOSIGNAL 0
@@ -174,13 +175,14 @@ static int _upgrade_socket_inet(_mod_upgrade_ctx_t *ctx, const char *uri)
 static int upgrade_connector(void *arg, http_message_t *request, http_message_t *response)
 {
 	int ret = EREJECT;
-	_mod_upgrade_ctx_t *ctx = (_mod_upgrade_ctx_t *)arg;
-	_mod_upgrade_t *mod = ctx->mod;
+	_mod_upgrade_t *mod = (_mod_upgrade_t *)arg;
+	http_client_t *clt = httpmessage_client(request);
+	_mod_upgrade_ctx_t *ctx = ouistiti_clientctx(clt, &mod_upgrade, 0);
 	const char *connection = httpmessage_REQUEST(request, str_connection);
 	const char *upgrade = httpmessage_REQUEST(request, str_upgrade);
 	const char *uri = httpmessage_REQUEST(request, "uri");
 
-	if (ctx->socket == 0 &&
+	if (ctx == NULL &&
 		connection != NULL && (strcasestr(connection, str_upgrade) != NULL) &&
 		upgrade != NULL && (strcasestr(upgrade, mod->upgrade) != NULL))
 	{
@@ -191,6 +193,11 @@ static int upgrade_connector(void *arg, http_message_t *request, http_message_t
 			httpmessage_result(response, RESULT_403);
 			return ESUCCESS;
 		}
+		/// the context exists only for the upgraded connection
+		ctx = ouistiti_clientctx(clt, &mod_upgrade, sizeof(*ctx));
+		if (ctx == NULL)
+			return EREJECT;
+		ctx->mod = mod;
 		while (*uri == '/' && *uri != '\0') uri++;
 		ret = _upgrade_socket_unix(ctx, uri);
 #ifdef UPGRADE_INET
@@ -215,8 +222,10 @@ static int upgrade_connector(void *arg, http_message_t *request, http_message_t
 			upgrade_dbg("upgrade: to %s result 101", mod->upgrade);
 			ctx->socket = httpmessage_lock(response);
 		}
+		if (ctx->socket == 0)
+			ouistiti_freeclientctx(clt, &mod_upgrade);
 	}
-	else if (ctx->socket > 0)
+	else if (ctx != NULL && ctx->socket > 0)
 	{
 		ctx->pid = default_upgrade_run(ctx, ctx->socket, request);
 		ret = ESUCCESS;
@@ -228,17 +237,18 @@ static void *_mod_upgrade_getctx(void *arg, http_client_t *ctl, struct sockaddr
 {
 	_mod_upgrade_t *mod = (_mod_upgrade_t *)arg;
 
-	_mod_upgrade_ctx_t *ctx = calloc(1, sizeof(*ctx));
-	ctx->mod = mod;
-	httpclient_addconnector(ctl, upgrade_connector, ctx, CONNECTOR_DOCUMENT, str_upgrade);
-
-	return ctx;
+	ouistiti_addclientconnector(ctl, upgrade_connector, mod, CONNECTOR_DOCUMENT, str_upgrade);
+	/// the context is allocated by the upgrade of the connection
+	return ctl;
 }
 
 static void _mod_upgrade_freectx(void *arg)
 {
-	_mod_upgrade_ctx_t *ctx = (_mod_upgrade_ctx_t *)arg;
+	http_client_t *clt = (http_client_t *)arg;
+	_mod_upgrade_ctx_t *ctx = ouistiti_clientctx(clt, &mod_upgrade, 0);
 
+	if (ctx == NULL)
+		return;
 	if (ctx->pid > 0)
 	{
 #ifdef VTHREAD
@@ -256,7 +266,7 @@ static void _mod_upgrade_freectx(void *arg)
 		sigaction(SIGCHLD, &action, NULL);
 #endif
 	}
-	free(ctx);
+	ouistiti_freeclientctx(clt, &mod_upgrade);
 }
 
 #ifdef FILE_CONFIG
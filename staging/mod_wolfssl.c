@@ -38,6 +38,7 @@ typedef int (wolfls_ssl_recv_t)(void *, unsigned char *, size_t);
 #include "ouistiti/log.h"
 #include "ouistiti/httpserver.h"
 #include "mod_tls.h"
+#include "log.h"
 
 static const char str_wolftls[] = "tls";
 
@@ -0,0 +1,22 @@
+#!/bin/sh
+# send the beginning of a PUT and close the connection before the end of
+# the content, then check that the server leaves no file, complete or
+# partial, into the directory.
+# the request of the document is printed when the directory is clean,
+# a request for a missing document otherwise.
+PORT=$1
+TESTDIR=$(dirname $0)
+TESTCLIENT=./host/utils/testclient
+NAME=aborted.txt
+rm -f ${TESTDIR}/htdocs/${NAME} ${TESTDIR}/htdocs/.${NAME}.*.part
+(printf "PUT /${NAME} HTTP/1.1\r\nHOST: 127.0.0.1\r\nContent-Type: text/plain\r\n"; \
+ printf "Content-Length: 1048576\r\nAuthorization: Basic dGVzdDp0ZXN0\r\n\r\n"; \
+ head -c 1000 /dev/zero | tr '\0' 'a') | ${TESTCLIENT} -p ${PORT} > /dev/null
+sleep 2
+if [ ! -e ${TESTDIR}/htdocs/${NAME} ] && [ -z "$(ls -a ${TESTDIR}/htdocs | grep "^\.${NAME}\..*\.part$")" ]; then
+	cat ${TESTDIR}/test004_rq.txt
+else
+	echo "abort: the upload of ${NAME} remains after the end of the connection" >&2
+	ls -la ${TESTDIR}/htdocs | grep "${NAME}" >&2
+	printf "GET /abort-upload.html HTTP/1.1\nHOST: 127.0.0.1\n\n"
+fi
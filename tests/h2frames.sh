@@ -0,0 +1,94 @@
+#!/bin/bash
+# send a request with the HTTP/2 prior knowledge of the clear text and
+# check the frames of the response. With a WINDOW argument (lower than
+# 256), the client opens a window smaller than the document: the server
+# must defer the stream without GOAWAY until the WINDOW_UPDATE.
+# With "reset", the client resets the stream of a slow CGI during its
+# response and requests the document on the stream 3: the server must
+# drop the response of the first stream and answer the second one.
+# the request of the document is printed when the frames are right,
+# a request for a missing document otherwise.
+PORT=$1
+WINDOW=$2
+RESET=
+if [ "${WINDOW}" = "reset" ]; then
+	RESET=1
+	WINDOW=
+fi
+TESTDIR=$(dirname $0)
+RESPONSE=/tmp/ouistiti.h2frames
+
+# print "type flags stream length" for each frame of the response
+frames () {
+	od -An -v -tu1 ${RESPONSE} | tr -s ' ' '\n' | grep -v '^$' | awk '
+	BEGIN { state = 0; n = 0 }
+	{
+		if (state == 0) {
+			header[n++] = $1
+			if (n == 9) {
+				size = header[0] * 65536 + header[1] * 256 + header[2]
+				stream = (header[5] % 128) * 16777216 + header[6] * 65536 + header[7] * 256 + header[8]
+				print header[3], header[4], stream, size
+				n = 0
+				state = size
+			}
+		} else {
+			state--
+		}
+	}'
+}
+
+fail () {
+	echo "h2frames: $1" >&2
+	frames >&2
+	printf "GET /h2frames.html HTTP/1.1\nHOST: 127.0.0.1\n\n"
+	exit 0
+}
+
+exec 3<>/dev/tcp/127.0.0.1/${PORT} || fail "connection refused"
+printf "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" >&3
+if [ -n "${WINDOW}" ]; then
+	# SETTINGS with SETTINGS_INITIAL_WINDOW_SIZE
+	printf "\0\0\6\4\0\0\0\0\0\0\4\0\0\0\\$(printf %o ${WINDOW})" >&3
+else
+	printf "\0\0\0\4\0\0\0\0\0" >&3
+fi
+if [ -n "${RESET}" ]; then
+	# HEADERS on stream 1 with END_STREAM and END_HEADERS: GET http /slow.cgi 127.0.0.1
+	printf "\0\0\030\1\5\0\0\0\1\202\206\104\011/slow.cgi\101\011127.0.0.1" >&3
+	printf "\0\0\0\4\1\0\0\0\0" >&3
+	sleep 0.5
+	# RST_STREAM of stream 1 with CANCEL
+	printf "\0\0\4\3\0\0\0\0\1\0\0\0\010" >&3
+	# HEADERS on stream 3: GET http /index.html 127.0.0.1
+	printf "\0\0\032\1\5\0\0\0\3\202\206\104\013/index.html\101\011127.0.0.1" >&3
+	timeout 3 cat <&3 > ${RESPONSE}
+	frames | grep -q "^7 " && fail "GOAWAY received"
+	frames | grep -q "^0 1 1 " && fail "end of the reset stream sent"
+	frames | grep -q "^1 [0-9]* 3 " || fail "HEADERS of the stream 3 missing"
+	frames | grep -q "^0 1 3 " || fail "DATA with END_STREAM of the stream 3 missing"
+	exec 3>&-
+	cat ${TESTDIR}/test004_rq.txt
+	exit 0
+fi
+# HEADERS on stream 1 with END_STREAM and END_HEADERS: GET http /index.html 127.0.0.1
+printf "\0\0\032\1\5\0\0\0\1\202\206\104\013/index.html\101\011127.0.0.1" >&3
+# SETTINGS ACK
+printf "\0\0\0\4\1\0\0\0\0" >&3
+timeout 2 cat <&3 > ${RESPONSE}
+
+# type 0x4 SETTINGS, 0x1 HEADERS, 0x0 DATA, 0x7 GOAWAY, flag 0x1 END_STREAM
+frames | grep -q "^4 0 0 " || fail "SETTINGS of the server missing"
+frames | grep -q "^1 [0-9]* 1 " || fail "HEADERS of the stream missing"
+frames | grep -q "^7 " && fail "GOAWAY received"
+if [ -n "${WINDOW}" ]; then
+	frames | grep -q "^0 0 1 ${WINDOW}$" || fail "DATA limited to the window missing"
+	frames | grep -q "^0 1 1 " && fail "DATA over the window"
+	# WINDOW_UPDATE of stream 1
+	printf "\0\0\4\010\0\0\0\0\1\0\0\377\377" >&3
+	timeout 2 cat <&3 >> ${RESPONSE}
+	frames | grep -q "^7 " && fail "GOAWAY received"
+fi
+frames | grep -q "^0 1 1 " || fail "DATA with END_STREAM missing"
+exec 3>&-
+cat ${TESTDIR}/test004_rq.txt
@@ -0,0 +1,10 @@
+#!/bin/bash
+# the counter changes on each run, a hit returns the previous value
+COUNTER=/tmp/ouistiti.cache.count
+COUNT=$(( $(cat $COUNTER 2> /dev/null || echo 0) + 1 ))
+echo $COUNT > $COUNTER
+printf "Content-Type: text/plain\r\n"
+printf "Cache-Control: max-age=60\r\n"
+printf "Content-Length: 9\r\n"
+printf "\r\n"
+printf "cached %d\n" $((COUNT % 10))
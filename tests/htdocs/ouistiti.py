@@ -123,5 +123,8 @@ class HttpResponse:
 			self._container = bytes(content,self._charset)
 		elif isinstance(content, bytes):
 			self._container = content
+		elif isinstance(content, memoryview):
+			# the request body is released after the request
+			self._container = content.tobytes()
 	content = property(_get_content, _set_content)
 
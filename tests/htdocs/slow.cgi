@@ -0,0 +1,8 @@
+#!/bin/sh
+# the response stays in progress during one second.
+
+printf "Content-Type: text/plain\r\n"
+printf "\r\n"
+echo start
+sleep 1
+echo end
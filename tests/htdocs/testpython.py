@@ -10,7 +10,7 @@ def index(request):
         if meta != "DOCUMENT_ROOT":
             message += meta + " => "+ request.META[meta] + '\n'
     message += '\n'
-    message += request.body
+    message += str(request.body, 'utf-8')
     response = HttpResponse(bytes(message , 'utf-8'), content_type="text/plain")
     response["Content-Length"] = len(response.content)
     print(len(response.content))
@@ -0,0 +1,49 @@
+#!/bin/sh
+# open idle keep-alive connections and check the memory per client
+# against a budget in bytes. The memory is the growth of the PSS of the
+# server processes (the RSS without smaps_rollup), measured by the
+# kernel and not by the counters of the server.
+# the request of the document is printed when the budget is respected,
+# a request for a missing document otherwise.
+PORT=$1
+COUNT=$2
+BUDGET=$3
+TESTDIR=$(dirname $0)
+TESTCLIENT=./host/utils/testclient
+PIDS=""
+
+# the memory in kB of the processes of the server listening on PORT
+memory () {
+	TOTAL=0
+	for PID in $(pgrep -f "ouistiti .*-P ${PORT}"); do
+		if [ -r /proc/${PID}/smaps_rollup ]; then
+			SIZE=$(awk '/^Pss:/{print $2}' /proc/${PID}/smaps_rollup)
+		else
+			SIZE=$(awk '/^VmRSS:/{print $2}' /proc/${PID}/status)
+		fi
+		TOTAL=$((TOTAL + ${SIZE:-0}))
+	done
+	echo ${TOTAL}
+}
+
+# a first client allocates the memory shared by all the clients
+cat ${TESTDIR}/test004_rq.txt | ${TESTCLIENT} -p ${PORT} > /dev/null
+BEFORE=$(memory)
+i=0
+while [ $i -lt $COUNT ]; do
+	(cat ${TESTDIR}/test004_rq.txt; sleep 3) | ${TESTCLIENT} -p ${PORT} > /dev/null &
+	PIDS="${PIDS} $!"
+	i=$((i + 1))
+done
+sleep 1
+AFTER=$(memory)
+METRICS=$(printf "GET /metrics HTTP/1.1\nHOST: 127.0.0.1\nAccept: application/json\n\n" | ${TESTCLIENT} -p ${PORT})
+kill ${PIDS} 2> /dev/null
+CLIENTS=$(echo "${METRICS}" | sed -n 's/.*"clients":\([0-9]*\).*/\1/p')
+MEMORY=$(((AFTER - BEFORE) * 1024))
+if [ ${BEFORE} -gt 0 ] && [ -n "${CLIENTS}" ] && [ "${CLIENTS}" -ge ${COUNT} ] && [ $((MEMORY / COUNT)) -le ${BUDGET} ]; then
+	cat ${TESTDIR}/test004_rq.txt
+else
+	echo "idle: ${CLIENTS} clients, the server grows of ${MEMORY} bytes for ${COUNT} clients" >&2
+	printf "GET /idle-budget.html HTTP/1.1\nHOST: 127.0.0.1\n\n"
+fi
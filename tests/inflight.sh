@@ -0,0 +1,5 @@
+#!/bin/sh
+# print the request of a slow CGI and send SIGHUP to the server while
+# the response is in progress.
+( sleep 0.3; pkill -HUP -f "ouistiti.*-f .*conf/$1" ) > /dev/null 2>&1 &
+printf "GET /slow.cgi HTTP/1.1\nHOST: 127.0.0.1\n\n"
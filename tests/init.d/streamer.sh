@@ -13,6 +13,7 @@ case "$1" in
                 ${PATH}${SERVICE} -n reverse ${OPTIONS} -D -S
                 ${PATH}${SERVICE} -n dummy ${OPTIONS} -D -S
                 ${PATH}${SERVICE} -n dummy2 ${OPTIONS} -D -S
+                ${PATH}${SERVICE} -n live.ts -R /tmp -s 1880 -T -D -S
 		;;
 	stop)
 		/usr/bin/killall ${SERVICE}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# wait the playlist of the segmenter with its first segments, download
+# a segment of the playlist and check that it contains whole packets and
+# starts with the PAT and the PMT, then print the request of the playlist.
+# Nothing is printed if the segmenter does not publish a valid segment.
+PORT=$1
+TESTDIR=$(dirname $0)
+PLAYLIST=${TESTDIR}/htdocs/live/live.m3u8
+SEGMENT=/tmp/ouistiti.segment
+i=0
+while [ $i -lt 10 ]; do
+	if grep -q "^#EXTINF" ${PLAYLIST} 2> /dev/null; then
+		break
+	fi
+	sleep 1
+	i=$((i + 1))
+done
+NAME=$(grep -A1 "^#EXTINF" ${PLAYLIST} 2> /dev/null | grep -v "^#\|^--" | head -n 1)
+if [ -z "${NAME}" ]; then
+	echo "live: no segment into the playlist" >&2
+	exit 1
+fi
+rm -f ${SEGMENT}
+curl -f -s -S -o ${SEGMENT} http://127.0.0.1:${PORT}/live/${NAME}
+SIZE=$(cat ${SEGMENT} 2> /dev/null | wc -c)
+if [ ${SIZE} -eq 0 ] || [ $((SIZE % 188)) -ne 0 ]; then
+	echo "live: segment ${NAME} of ${SIZE} bytes" >&2
+	exit 1
+fi
+# the sync byte and the pid of the two first packets, then the table_id of the PMT
+PAT=$(od -An -tu1 -N 3 ${SEGMENT} | tr -s ' ')
+PMT=$(od -An -tu1 -j 188 -N 1 ${SEGMENT} | tr -d ' ')
+POINTER=$(od -An -tu1 -j 192 -N 1 ${SEGMENT} | tr -d ' ')
+TABLE=$(od -An -tu1 -j $((193 + POINTER)) -N 1 ${SEGMENT} | tr -d ' ')
+if [ "${PAT}" != " 71 64 0" ] || [ "${PMT}" != "71" ] || [ "${TABLE}" != "2" ]; then
+	echo "live: segment ${NAME} without PAT and PMT (${PAT}) (${PMT} ${TABLE})" >&2
+	exit 1
+fi
+printf "GET /live/live.m3u8 HTTP/1.1\nHOST: 127.0.0.1\n\n"
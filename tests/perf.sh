@@ -0,0 +1,307 @@
+#!/bin/sh
+# performance regression suite.
+# Each scenario of tests/perf/ starts ouistiti with its configuration
+# and loads it with testclient in benchmark mode. The throughput, the
+# median and 99th percentile latencies, the peak RSS of the server
+# processes and the number of syscalls per request are compared to
+# tests/perf/baseline with the tolerances of the file.
+# The baseline is recorded with -u on the reference host, a scenario
+# without row is reported but it is not a regression.
+
+TESTDIR=$(dirname $0)/
+PERFDIR=${TESTDIR}perf/
+BASELINE=${PERFDIR}baseline
+PWD=$(pwd)
+DEFAULTPORT=8080
+LOGFILE=/tmp/ouistiti.log
+TMPPERF=/tmp/ouistiti.perf
+
+DURATION=10
+SYSCALLREQUESTS=2000
+UPDATE=0
+STRACE=1
+BUILDS=""
+NAME=default
+while [ -n "$1" ]; do
+case $1 in
+	-b)
+		shift
+		BUILDS="${BUILDS} $1"
+		;;
+	-n)
+		shift
+		NAME=$1
+		;;
+	-d)
+		shift
+		DURATION=$1
+		;;
+	-P)
+		shift
+		DEFAULTPORT=$1
+		;;
+	-u)
+		UPDATE=1
+		;;
+	-S)
+		STRACE=0
+		;;
+	-h)
+		printf "$0 [-b <defconfig>]... [-n <name>] [-d <duration s>] [-u] [-S] [scenario]...\n"
+		printf "\t-b    build configs/<defconfig>_defconfig into _perf/ and measure it\n"
+		printf "\t-n    name of the current build into the baseline (default)\n"
+		printf "\t-d    duration of each measure\n"
+		printf "\t-u    record the results into the baseline\n"
+		printf "\t-S    do not count the syscalls\n"
+		printf "\tthe scenarios are the files of $PERFDIR, all by default\n"
+		exit 1
+		;;
+	*)
+		SCENARIOS="${SCENARIOS} $1"
+		;;
+esac
+shift
+done
+
+if [ -z "$SCENARIOS" ]; then
+	SCENARIOS=$(find $PERFDIR -maxdepth 1 -type f ! -name "*.txt" ! -name baseline | sort)
+fi
+if [ $STRACE -eq 1 ] && ! which strace > /dev/null 2>&1; then
+	echo "strace not found, the syscalls are not counted"
+	STRACE=0
+fi
+
+AWK=awk
+SED=sed
+USER=$(ps -p $$ -o user --no-headers)
+if [ ! -f $BASELINE ]; then
+	echo "baseline $BASELINE not found"
+	exit 1
+fi
+TOLERANCE=$(${AWK} '/^tolerance /{print $2, $3, $4, $5, $6}' $BASELINE)
+if [ -z "$TOLERANCE" ] && [ $UPDATE -eq 0 ]; then
+	echo "no tolerance into $BASELINE"
+	exit 1
+fi
+HOST="$(uname -n) $(uname -srm) $(nproc) cpus"
+if [ $UPDATE -eq 0 ]; then
+	RECORDED=$(${AWK} '/^host /{print substr($0, 6)}' $BASELINE)
+	if [ -z "$RECORDED" ]; then
+		echo "$BASELINE is empty, record it on the reference host with -u"
+		exit 1
+	fi
+	if [ "$RECORDED" != "$HOST" ]; then
+		echo "the baseline was recorded on: $RECORDED"
+		echo "the measures run on:          $HOST"
+	fi
+else
+	${SED} -i "/^host /d" $BASELINE
+	${SED} -i "/^tolerance /a host ${HOST}" $BASELINE
+fi
+
+REGRESSION=""
+UNRECORDED=""
+
+config () {
+	CONFIG=$1
+
+	cp ${TESTDIR}conf/${CONFIG}.in ${TESTDIR}conf/${CONFIG}
+	${SED} -i "s,\%PWD\%,$PWD,g" ${TESTDIR}conf/${CONFIG}
+	${SED} -i "s,\%USER\%,$USER,g" ${TESTDIR}conf/${CONFIG}
+	${SED} -i "s,\%LOGFILE\%,$LOGFILE,g" ${TESTDIR}conf/${CONFIG}
+}
+
+# the peak of the resident memory of the server and its children
+rss () {
+	SERVERPID=$1
+	MAX=0
+	echo 0 > $TMPPERF.rss
+	while kill -0 $SERVERPID 2> /dev/null; do
+		RSS=0
+		for P in $SERVERPID $(pgrep -P $SERVERPID); do
+			VALUE=$(${AWK} '/^VmRSS:/{print $2}' /proc/$P/status 2> /dev/null)
+			RSS=$((RSS + ${VALUE:-0}))
+		done
+		if [ $RSS -gt $MAX ]; then
+			MAX=$RSS
+			echo $MAX > $TMPPERF.rss
+		fi
+		sleep 0.2
+	done
+}
+
+compare () {
+	BUILD=$1
+	SCENARIO=$2
+	RESULT="$3 $4 $5 $6 $7"
+
+	BASE=$(${AWK} -v build=$BUILD -v scenario=$SCENARIO '$1 == build && $2 == scenario {print $3, $4, $5, $6, $7}' $BASELINE)
+	if [ $UPDATE -eq 1 ]; then
+		${SED} -i "/^${BUILD} ${SCENARIO} /d" $BASELINE
+		echo "${BUILD} ${SCENARIO} ${RESULT}" >> $BASELINE
+		echo "baseline recorded"
+		return
+	fi
+	if [ -z "$BASE" ]; then
+		echo "no baseline for ${BUILD} ${SCENARIO}, record it with -u"
+		UNRECORDED="${UNRECORDED} ${BUILD}/${SCENARIO}"
+		return
+	fi
+	# the throughput must not go down, the others must not go up
+	echo "$RESULT $BASE $TOLERANCE" | ${AWK} '
+		function check(label, current, base, tolerance, lower) {
+			if (current == "-" || base == "-" || base == 0)
+				return 0;
+			delta = (current - base) * 100 / base;
+			if (lower)
+				delta = -delta;
+			printf "%-10s %12s %12s %+7.1f%%", label, current, base, (lower)? -delta: delta;
+			if (delta > tolerance) {
+				printf " > %d%% regression\n", tolerance;
+				return 1;
+			}
+			printf "\n";
+			return 0;
+		}
+		{
+			printf "%-10s %12s %12s\n", "", "current", "baseline";
+			error = check("req/s", $1, $6, $11, 1);
+			error += check("p50 ms", $2, $7, $12, 0);
+			error += check("p99 ms", $3, $8, $13, 0);
+			error += check("rss kB", $4, $9, $14, 0);
+			error += check("syscalls", $5, $10, $15, 0);
+			exit (error > 0);
+		}'
+	if [ $? -ne 0 ]; then
+		REGRESSION="${REGRESSION} ${BUILD}/${SCENARIO}"
+	fi
+}
+
+measure () {
+	BUILD=$1
+	SCENARIO=$2
+
+	unset CONFIG
+	unset PREPARE
+	unset PREPARE_ASYNC
+	unset ASYNC_PID
+	unset BENCHOPTION
+	if [ ! -f $SCENARIO ]; then
+		SCENARIO=${PERFDIR}${SCENARIO}
+	fi
+	REQUEST=$(basename ${SCENARIO})_rq.txt
+	DISABLED=0
+	. $SCENARIO
+
+	echo
+	echo "******************************"
+	echo ${BUILD} $(basename ${SCENARIO})
+	echo $DESC
+	if [ $DISABLED -eq 1 ]; then
+		return
+	fi
+
+	config $CONFIG
+	if [ -n "$PREPARE" ]; then
+		eval $PREPARE
+	fi
+	if [ -n "$PREPARE_ASYNC" ]; then
+		$PREPARE_ASYNC &
+		ASYNC_PID=$!
+		sleep 1
+	fi
+
+	${SRCDIR}ouistiti -f ${TESTDIR}conf/${CONFIG} -P ${DEFAULTPORT} -M ${MODULESDIR} &
+	PID=$!
+	sleep 1
+
+	BENCH="$TESTCLIENT -p ${DEFAULTPORT} ${BENCHOPTION} -f ${PERFDIR}${REQUEST}"
+	# warm up the caches and the pools before the measure
+	$BENCH -n 200 > /dev/null
+
+	rss $PID &
+	RSS_PID=$!
+	echo $BENCH -d ${DURATION}
+	$BENCH -d ${DURATION} > $TMPPERF
+	kill $RSS_PID 2> /dev/null
+	wait $RSS_PID 2> /dev/null
+	cat $TMPPERF
+
+	SYSCALLS="-"
+	if [ $STRACE -eq 1 ]; then
+		strace -f -c -o $TMPPERF.strace -p $PID 2> /dev/null &
+		STRACE_PID=$!
+		sleep 0.5
+		$BENCH -n ${SYSCALLREQUESTS} > $TMPPERF.syscalls
+		kill -INT $STRACE_PID
+		wait $STRACE_PID
+		CALLS=$(${AWK} '/ total$/{print $4}' $TMPPERF.strace 2> /dev/null)
+		RESPONSES=$(${AWK} '/ responses in /{print $1}' $TMPPERF.syscalls)
+		if [ -n "$CALLS" ] && [ ${RESPONSES:-0} -gt 0 ]; then
+			SYSCALLS=$(${AWK} -v calls=$CALLS -v responses=$RESPONSES 'BEGIN{printf "%.1f", calls / responses}')
+		fi
+	fi
+
+	kill $PID
+	sleep 0.5
+	kill -9 $PID 2> /dev/null
+	if [ -n "$ASYNC_PID" ]; then
+		kill $ASYNC_PID
+	fi
+
+	ERRORS=$(${AWK} '/ responses in /{print $6}' $TMPPERF)
+	THROUGHPUT=$(${AWK} '/^throughput /{print $2}' $TMPPERF)
+	P50=$(${AWK} '/^latency ms /{print $6}' $TMPPERF)
+	P99=$(${AWK} '/^latency ms /{print $10}' $TMPPERF)
+	RSS=$(cat $TMPPERF.rss)
+	if [ -z "$THROUGHPUT" ] || [ ${ERRORS:-1} -ne 0 ]; then
+		echo "$(basename ${SCENARIO}) fails on error"
+		cat $LOGFILE
+		REGRESSION="${REGRESSION} ${BUILD}/$(basename ${SCENARIO})"
+		return
+	fi
+	echo "rss kB ${RSS} syscalls/req ${SYSCALLS}"
+	compare ${BUILD} $(basename ${SCENARIO}) ${THROUGHPUT} ${P50} ${P99} ${RSS} ${SYSCALLS}
+}
+
+# set the paths of the binaries of a build
+build () {
+	BUILDDIR=$1
+
+	SRCDIR=${BUILDDIR}src/
+	UTILSDIR=${BUILDDIR}utils/
+	MODULESDIR=${BUILDDIR}staging:${BUILDDIR}src
+	TESTCLIENT="${BUILDDIR}host/utils/testclient"
+	LD_LIBRARY_PATH=${SRCDIR}:${BUILDDIR}libhttpserver/src/:${BUILDDIR}libhttpserver/src/httpserver/:${UTILSDIR}
+	export LD_LIBRARY_PATH
+	. ${BUILDDIR}.config
+}
+
+if [ -z "$BUILDS" ]; then
+	build ./
+	for SCENARIO in ${SCENARIOS}
+	do
+		measure ${NAME} ${SCENARIO}
+	done
+fi
+for DEFCONFIG in ${BUILDS}
+do
+	BUILDDIR=_perf/${DEFCONFIG}/
+	make BUILDDIR=${BUILDDIR} ${DEFCONFIG}_defconfig > /dev/null || exit 1
+	make BUILDDIR=${BUILDDIR} > /dev/null || exit 1
+	build ${BUILDDIR}
+	for SCENARIO in ${SCENARIOS}
+	do
+		measure ${DEFCONFIG} ${SCENARIO}
+	done
+done
+
+if [ -n "$UNRECORDED" ]; then
+	echo
+	echo "not recorded:${UNRECORDED}"
+fi
+if [ -n "$REGRESSION" ]; then
+	echo
+	echo "regression on:${REGRESSION}"
+	exit 1
+fi
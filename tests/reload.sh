@@ -0,0 +1,14 @@
+#!/bin/sh
+# send SIGHUP to the server after its start.
+# with "invalid", the configuration file is broken during the reload.
+CONFIG=$(dirname $0)/conf/$1
+sleep 1.5
+if [ "$2" = "invalid" ]; then
+	cp ${CONFIG} ${CONFIG}.bak
+	echo "servers = ({" >> ${CONFIG}
+fi
+pkill -HUP -f "ouistiti.*-f .*conf/$1"
+sleep 0.2
+if [ "$2" = "invalid" ]; then
+	mv ${CONFIG}.bak ${CONFIG}
+fi
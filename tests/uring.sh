@@ -0,0 +1,31 @@
+#!/bin/sh
+# download a file of several chunks of io_uring, then a range of it,
+# compare them with the file and check that a process of the server
+# holds a ring.
+# the request of the document is printed when the checks are right,
+# a request for a missing document otherwise.
+PORT=$1
+TESTDIR=$(dirname $0)
+FILE=${TESTDIR}/htdocs/uring.txt
+RESPONSE=/tmp/ouistiti.uring
+ERROR=""
+# more than 8 chunks of 128 kB, the last one is short
+seq 1 200000 > ${FILE}
+curl -f -s -S -o ${RESPONSE} http://127.0.0.1:${PORT}/uring.txt
+cmp -s ${FILE} ${RESPONSE} || ERROR="content"
+curl -f -s -S -r 300000-700000 -o ${RESPONSE} http://127.0.0.1:${PORT}/uring.txt
+dd if=${FILE} bs=1 skip=300000 count=400001 2> /dev/null | cmp -s - ${RESPONSE} || ERROR="${ERROR} range"
+RING=0
+for PID in $(pgrep -f "ouistiti .*-P ${PORT}"); do
+	if ls -l /proc/${PID}/fd 2> /dev/null | grep -q "io_uring"; then
+		RING=1
+	fi
+done
+[ ${RING} -eq 1 ] || ERROR="${ERROR} io_uring"
+rm -f ${FILE} ${RESPONSE}
+if [ -z "${ERROR}" ]; then
+	cat ${TESTDIR}/test004_rq.txt
+else
+	echo "uring: error on ${ERROR}" >&2
+	printf "GET /uring-error.html HTTP/1.1\nHOST: 127.0.0.1\n\n"
+fi
@@ -0,0 +1,147 @@
+/*****************************************************************************
+ * headerbench.c: benchmark of the static headers serialisation
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    headerbench measures the cost of the default headers of mod_server
+    on a response message:
+     - "header": one httpmessage_addheader per header
+       (ouistiti_setheader).
+     - "block": the headers serialised once and added as one buffer,
+       kept for the comparison.
+    The creation and the destruction of the message are measured alone
+    and removed from the results.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/log.h"
+
+#define DEFAULT_ITERATIONS 100000
+
+#define STRING_REF(string) string, sizeof(string)-1
+
+typedef struct bench_header_s bench_header_t;
+struct bench_header_s
+{
+	const char *key;
+	const char *value;
+	size_t valuelen;
+};
+
+static const bench_header_t bench_headers[] =
+{
+	{"Server", STRING_REF("ouistiti")},
+	{"X-Frame-Options", STRING_REF("DENY")},
+	{"Cache-Control", STRING_REF("no-cache,no-store,max-age=0,must-revalidate")},
+	{"Pragma", STRING_REF("no-cache")},
+	{"Expires", STRING_REF("0")},
+	{"X-Content-Type-Options", STRING_REF("nosniff")},
+	{"Referrer-Policy", STRING_REF("origin-when-cross-origin")},
+	{"Strict-Transport-Security", STRING_REF("max-age=31536000; includeSubDomains")},
+};
+#define NB_HEADERS (sizeof(bench_headers) / sizeof(*bench_headers))
+
+static double _bench_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static size_t _bench_block(char *block, size_t size)
+{
+	size_t length = 0;
+	for (int i = 0; i < NB_HEADERS; i++)
+	{
+		if (i > 0)
+			length += snprintf(block + length, size - length, "\r\n%s: ", bench_headers[i].key);
+		length += snprintf(block + length, size - length, "%s", bench_headers[i].value);
+	}
+	return length;
+}
+
+static double _bench_run(int iterations, int mode, const char *block, size_t blocklen)
+{
+	double start = _bench_now();
+	for (int i = 0; i < iterations; i++)
+	{
+		http_message_t *response = httpmessage_create(0);
+		if (mode == 1)
+		{
+			for (int j = 0; j < NB_HEADERS; j++)
+				httpmessage_addheader(response, bench_headers[j].key, bench_headers[j].value, bench_headers[j].valuelen);
+		}
+		else if (mode == 2)
+			httpmessage_addheader(response, bench_headers[0].key, block, blocklen);
+		httpmessage_destroy(response);
+	}
+	return _bench_now() - start;
+}
+
+static void _bench_result(const char *name, int iterations, double duration, double reference)
+{
+	double cost = duration - reference;
+	printf("%-8s %8d responses %10.3f ms %8.1f ns/response\n",
+		name, iterations, cost * 1000, cost * 1e9 / iterations);
+}
+
+int main(int argc, char * const *argv)
+{
+	int iterations = DEFAULT_ITERATIONS;
+
+	int opt;
+	do
+	{
+		opt = getopt(argc, argv, "n:h");
+		switch (opt)
+		{
+			case 'h':
+				printf("%s [-n <iterations>]\n", argv[0]);
+				printf("\tmeasure the cost of the default headers per response\n");
+				return 0;
+			case 'n':
+				iterations = strtol(optarg, NULL, 10);
+			break;
+		}
+	} while(opt != -1);
+	if (iterations <= 0)
+		iterations = DEFAULT_ITERATIONS;
+
+	char block[1024];
+	size_t blocklen = _bench_block(block, sizeof(block));
+
+	/// warm up the allocator before the first measure
+	_bench_run(iterations / 10, 0, NULL, 0);
+	double reference = _bench_run(iterations, 0, NULL, 0);
+	_bench_result("header", iterations, _bench_run(iterations, 1, NULL, 0), reference);
+	_bench_result("block", iterations, _bench_run(iterations, 2, block, blocklen), reference);
+	return 0;
+}
@@ -0,0 +1,304 @@
+/*****************************************************************************
+ * jwksbench.c: benchmark of the JWT signature verification
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    jwksbench generates one key per algorithm, stores the public keys
+    into a JWKS file, signs a token and measures the number of checks
+    per second through authz_jwks (the same path as mod_auth).
+    HS256 is measured with the "secret" for comparison.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <jansson.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/bn.h>
+#include <openssl/obj_mac.h>
+
+#include "ouistiti/httpserver.h"
+#include "ouistiti/hash.h"
+#include "ouistiti/log.h"
+#include "authz_jwks.h"
+
+#define TOKEN_MAX 2048
+#define DEFAULT_ITERATIONS 10000
+
+static const char payload[] = "{\"user\": \"foo\", \"roles\": \"users\", \"exp\": 1800}";
+
+typedef struct bench_alg_s bench_alg_t;
+struct bench_alg_s
+{
+	const char *name;
+	int type;
+	const EVP_MD *(*md)(void);
+	int componentlen;
+	EVP_PKEY *pkey;
+	char token[TOKEN_MAX];
+	size_t datalen;
+};
+
+static bench_alg_t bench_algs[] =
+{
+	{ .name = "RS256", .type = EVP_PKEY_RSA, .md = EVP_sha256},
+	{ .name = "ES256", .type = EVP_PKEY_EC, .md = EVP_sha256, .componentlen = 32},
+	{ .name = "EdDSA", .type = EVP_PKEY_ED25519},
+};
+
+static json_t *_bench_b64(const unsigned char *data, size_t datalen)
+{
+	char b64[1024];
+	int length = base64_urlencoding->encode((const char *)data, datalen, b64, sizeof(b64));
+	return json_stringn(b64, length);
+}
+
+static json_t *_bench_bn(const BIGNUM *bn, int padding)
+{
+	unsigned char data[512];
+	int length = BN_bn2binpad(bn, data, (padding > 0)? padding: BN_num_bytes(bn));
+	return _bench_b64(data, length);
+}
+
+static EVP_PKEY *_bench_keygen(bench_alg_t *alg)
+{
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(alg->type, NULL);
+	if (ctx == NULL || EVP_PKEY_keygen_init(ctx) != 1)
+		return NULL;
+	if (alg->type == EVP_PKEY_RSA)
+		EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048);
+	else if (alg->type == EVP_PKEY_EC)
+		EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1);
+	EVP_PKEY_keygen(ctx, &pkey);
+	EVP_PKEY_CTX_free(ctx);
+	return pkey;
+}
+
+static json_t *_bench_jwk(bench_alg_t *alg)
+{
+	json_t *jkey = json_object();
+	json_object_set_new(jkey, "kid", json_string(alg->name));
+	json_object_set_new(jkey, "alg", json_string(alg->name));
+	json_object_set_new(jkey, "use", json_string("sig"));
+	if (alg->type == EVP_PKEY_RSA)
+	{
+		const BIGNUM *n = NULL;
+		const BIGNUM *e = NULL;
+		RSA_get0_key(EVP_PKEY_get0_RSA(alg->pkey), &n, &e, NULL);
+		json_object_set_new(jkey, "kty", json_string("RSA"));
+		json_object_set_new(jkey, "n", _bench_bn(n, 0));
+		json_object_set_new(jkey, "e", _bench_bn(e, 0));
+	}
+	else if (alg->type == EVP_PKEY_EC)
+	{
+		const EC_KEY *ec = EVP_PKEY_get0_EC_KEY(alg->pkey);
+		BIGNUM *x = BN_new();
+		BIGNUM *y = BN_new();
+		EC_POINT_get_affine_coordinates_GFp(EC_KEY_get0_group(ec), EC_KEY_get0_public_key(ec), x, y, NULL);
+		json_object_set_new(jkey, "kty", json_string("EC"));
+		json_object_set_new(jkey, "crv", json_string("P-256"));
+		json_object_set_new(jkey, "x", _bench_bn(x, alg->componentlen));
+		json_object_set_new(jkey, "y", _bench_bn(y, alg->componentlen));
+		BN_free(x);
+		BN_free(y);
+	}
+	else
+	{
+		unsigned char x[32];
+		size_t xlen = sizeof(x);
+		EVP_PKEY_get_raw_public_key(alg->pkey, x, &xlen);
+		json_object_set_new(jkey, "kty", json_string("OKP"));
+		json_object_set_new(jkey, "crv", json_string("Ed25519"));
+		json_object_set_new(jkey, "x", _bench_b64(x, xlen));
+	}
+	return jkey;
+}
+
+static int _bench_sign(bench_alg_t *alg)
+{
+	char header[128];
+	int headerlen = snprintf(header, sizeof(header), "{\"alg\":\"%s\",\"typ\":\"JWT\",\"kid\":\"%s\"}", alg->name, alg->name);
+	char *offset = alg->token;
+	size_t length = sizeof(alg->token);
+	int ret = base64_urlencoding->encode(header, headerlen, offset, length);
+	offset += ret;
+	*offset++ = '.';
+	ret = base64_urlencoding->encode(payload, sizeof(payload) - 1, offset, length - (offset - alg->token));
+	offset += ret;
+	alg->datalen = offset - alg->token;
+
+	unsigned char sign[512];
+	size_t signlen = sizeof(sign);
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+	if (EVP_DigestSignInit(mdctx, NULL, (alg->md)? alg->md(): NULL, NULL, alg->pkey) != 1 ||
+		EVP_DigestSign(mdctx, sign, &signlen, (unsigned char *)alg->token, alg->datalen) != 1)
+	{
+		EVP_MD_CTX_free(mdctx);
+		return EREJECT;
+	}
+	EVP_MD_CTX_free(mdctx);
+
+	if (alg->type == EVP_PKEY_EC)
+	{
+		const unsigned char *der = sign;
+		ECDSA_SIG *ecsig = d2i_ECDSA_SIG(NULL, &der, signlen);
+		const BIGNUM *r = NULL;
+		const BIGNUM *s = NULL;
+		ECDSA_SIG_get0(ecsig, &r, &s);
+		unsigned char raw[128];
+		BN_bn2binpad(r, raw, alg->componentlen);
+		BN_bn2binpad(s, raw + alg->componentlen, alg->componentlen);
+		ECDSA_SIG_free(ecsig);
+		memcpy(sign, raw, alg->componentlen * 2);
+		signlen = alg->componentlen * 2;
+	}
+	*offset++ = '.';
+	base64_urlencoding->encode((char *)sign, signlen, offset, length - (offset - alg->token));
+	return ESUCCESS;
+}
+
+static double _bench_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void _bench_result(const char *name, int iterations, int errors, double duration)
+{
+	printf("%-6s %8d checks %4d errors %10.3f ms %12.0f checks/s %8.2f us/check\n",
+		name, iterations, errors, duration * 1000,
+		iterations / duration, duration * 1e6 / iterations);
+}
+
+static void _bench_hmac(int iterations)
+{
+	const char secret[] = "kXp2s5v8y/B?E(H+KbPeShVmYq3t6w9z";
+	const char *data = bench_algs[0].token;
+	size_t datalen = bench_algs[0].datalen;
+	char signature[HASH_MAX_SIZE];
+	char check[HASH_MAX_SIZE];
+
+	if (hash_macsha256 == NULL)
+		return;
+	void *ctx = hash_macsha256->initkey(secret, sizeof(secret) - 1);
+	hash_macsha256->update(ctx, data, datalen);
+	size_t signlen = hash_macsha256->finish(ctx, signature);
+
+	int errors = 0;
+	double start = _bench_now();
+	for (int i = 0; i < iterations; i++)
+	{
+		ctx = hash_macsha256->initkey(secret, sizeof(secret) - 1);
+		hash_macsha256->update(ctx, data, datalen);
+		hash_macsha256->finish(ctx, check);
+		if (memcmp(signature, check, signlen))
+			errors++;
+	}
+	_bench_result("HS256", iterations, errors, _bench_now() - start);
+}
+
+int main(int argc, char * const *argv)
+{
+	int iterations = DEFAULT_ITERATIONS;
+	char path[] = "/tmp/jwksbench.XXXXXX";
+
+	int opt;
+	do
+	{
+		opt = getopt(argc, argv, "n:h");
+		switch (opt)
+		{
+			case 'h':
+				printf("%s [-n <iterations>]\n", argv[0]);
+				printf("\tmeasure the JWT signature checks per second for each algorithm\n");
+				return 0;
+			case 'n':
+				iterations = strtol(optarg, NULL, 10);
+			break;
+		}
+	} while(opt != -1);
+	if (iterations <= 0)
+		iterations = DEFAULT_ITERATIONS;
+
+	json_t *jkeys = json_array();
+	for (int i = 0; i < (sizeof(bench_algs) / sizeof(*bench_algs)); i++)
+	{
+		bench_alg_t *alg = &bench_algs[i];
+		alg->pkey = _bench_keygen(alg);
+		if (alg->pkey == NULL || _bench_sign(alg) != ESUCCESS)
+		{
+			err("jwksbench: %s not available", alg->name);
+			return -1;
+		}
+		json_array_append_new(jkeys, _bench_jwk(alg));
+	}
+	int fd = mkstemp(path);
+	if (fd < 0)
+	{
+		err("jwksbench: temporary file error %m");
+		return -1;
+	}
+	close(fd);
+	json_t *jwksfile = json_object();
+	json_object_set_new(jwksfile, "keys", jkeys);
+	json_dump_file(jwksfile, path, JSON_INDENT(1));
+	json_decref(jwksfile);
+
+	authz_jwks_t *jwks = authz_jwks_create(path);
+	if (jwks == NULL)
+	{
+		unlink(path);
+		return -1;
+	}
+
+	_bench_hmac(iterations);
+	for (int i = 0; i < (sizeof(bench_algs) / sizeof(*bench_algs)); i++)
+	{
+		bench_alg_t *alg = &bench_algs[i];
+		const char *sign = alg->token + alg->datalen + 1;
+		size_t signlen = strlen(sign);
+		int errors = 0;
+		double start = _bench_now();
+		for (int j = 0; j < iterations; j++)
+		{
+			if (authz_jwks_check(jwks, alg->token, alg->datalen, sign, signlen) != ESUCCESS)
+				errors++;
+		}
+		_bench_result(alg->name, iterations, errors, _bench_now() - start);
+		EVP_PKEY_free(alg->pkey);
+	}
+
+	authz_jwks_destroy(jwks);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,206 @@
+/*****************************************************************************
+ * oauth2idp.c: mock of oAuth2 authorization server for the tests
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    oauth2idp answers to the token and userinfo endpoints with a
+    configurable delay. It counts the requests of each endpoint to
+    check the cache and the single-flight of authn_oauth2:
+     - POST /token returns a new access_token for the user.
+     - GET /userinfo accepts all the Bearer tokens except the ones
+       starting with "invalid".
+    The counters are printed on SIGTERM/SIGINT.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define err(format, ...) fprintf(stderr, "\x1B[31m"format"\x1B[0m\n",  ##__VA_ARGS__)
+#define warn(format, ...) fprintf(stderr, "\x1B[35m"format"\x1B[0m\n",  ##__VA_ARGS__)
+
+#define DEFAULT_PORT 8090
+#define BUFFER_MAX 4096
+
+static int run = 1;
+static unsigned long count_token = 0;
+static unsigned long count_userinfo = 0;
+static unsigned long count_refused = 0;
+
+static void _idp_stop(int sig)
+{
+	run = 0;
+}
+
+static int _idp_send(int sock, int status, const char *reason, const char *content)
+{
+	char buffer[BUFFER_MAX];
+	size_t contentlen = strlen(content);
+	int length = snprintf(buffer, sizeof(buffer),
+		"HTTP/1.1 %d %s\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: %lu\r\n"
+		"Cache-Control: no-store\r\n"
+		"Connection: close\r\n"
+		"\r\n%s", status, reason, (unsigned long)contentlen, content);
+	return send(sock, buffer, length, MSG_NOSIGNAL);
+}
+
+static const char *_idp_header(const char *request, const char *name)
+{
+	size_t namelen = strlen(name);
+	const char *line = strstr(request, "\r\n");
+	while (line != NULL && line[2] != '\r')
+	{
+		line += 2;
+		if (!strncasecmp(line, name, namelen) && line[namelen] == ':')
+		{
+			line += namelen + 1;
+			while (*line == ' ')
+				line++;
+			return line;
+		}
+		line = strstr(line, "\r\n");
+	}
+	return NULL;
+}
+
+static void _idp_request(int sock, const char *user, int delay)
+{
+	char request[BUFFER_MAX];
+	ssize_t length = 0;
+	/// the request is small, it is read until the end of the header
+	do
+	{
+		ssize_t ret = recv(sock, request + length, sizeof(request) - length - 1, 0);
+		if (ret <= 0)
+			return;
+		length += ret;
+		request[length] = '\0';
+	} while (strstr(request, "\r\n\r\n") == NULL && length < sizeof(request) - 1);
+
+	if (delay > 0)
+		usleep(delay * 1000);
+
+	char content[512];
+	if (!strncmp(request, "POST /token", 11))
+	{
+		count_token++;
+		snprintf(content, sizeof(content),
+			"{\"access_token\":\"token%lu.%ld\",\"token_type\":\"Bearer\","
+			"\"expires_in\":3600,\"username\":\"%s\"}",
+			count_token, (long)time(NULL), user);
+		_idp_send(sock, 200, "OK", content);
+	}
+	else if (!strncmp(request, "GET /userinfo", 13))
+	{
+		count_userinfo++;
+		const char *authorization = _idp_header(request, "Authorization");
+		if (authorization == NULL || strncmp(authorization, "Bearer ", 7) ||
+			!strncmp(authorization + 7, "invalid", 7))
+		{
+			count_refused++;
+			_idp_send(sock, 401, "Unauthorized", "{\"error\":\"invalid_token\"}");
+			return;
+		}
+		snprintf(content, sizeof(content),
+			"{\"sub\":\"%s\",\"preferred_username\":\"%s\"}", user, user);
+		_idp_send(sock, 200, "OK", content);
+	}
+	else
+		_idp_send(sock, 404, "Not Found", "{\"error\":\"not_found\"}");
+}
+
+int main(int argc, char * const *argv)
+{
+	int port = DEFAULT_PORT;
+	int delay = 0;
+	const char *user = "foo";
+
+	int opt;
+	do
+	{
+		opt = getopt(argc, argv, "p:d:u:h");
+		switch (opt)
+		{
+			case 'h':
+				printf("%s [-p <port>] [-d <delay ms>] [-u <user>]\n", argv[0]);
+				printf("\tmock of the token and userinfo endpoints of an authorization server\n");
+				return 0;
+			case 'p':
+				port = strtol(optarg, NULL, 10);
+			break;
+			case 'd':
+				delay = strtol(optarg, NULL, 10);
+			break;
+			case 'u':
+				user = optarg;
+			break;
+		}
+	} while(opt != -1);
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+	{
+		err("oauth2idp: socket error %s", strerror(errno));
+		return -1;
+	}
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0)
+	{
+		err("oauth2idp: bind error %s", strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	struct sigaction action = {0};
+	action.sa_handler = _idp_stop;
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+
+	while (run)
+	{
+		int client = accept(sock, NULL, NULL);
+		if (client < 0)
+			continue;
+		_idp_request(client, user, delay);
+		close(client);
+	}
+	close(sock);
+	warn("oauth2idp: token %lu userinfo %lu refused %lu", count_token, count_userinfo, count_refused);
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*****************************************************************************
+ * putbench.c: benchmark of the uploads with PUT
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    putbench measures the throughput of the uploads on a http server
+    with the "rest" option of the document module:
+     - each iteration sends a PUT of the size in MB to "<uri>.<iteration>"
+       and waits the response.
+     - the file is removed with DELETE before the next iteration.
+    The default size is 2048 MB to measure the disk and not the cache.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define DEFAULT_ITERATIONS 3
+#define DEFAULT_SIZE 2048
+#define BUFFERSIZE (256 * 1024)
+
+static double _bench_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int _bench_socket(struct addrinfo *addr)
+{
+	int sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (sock < 0)
+		return -1;
+	if (connect(sock, addr->ai_addr, addr->ai_addrlen) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int _bench_send(int sock, const char *data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t ret = send(sock, data, length, MSG_NOSIGNAL);
+		if (ret <= 0)
+			return -1;
+		length -= ret;
+		data += ret;
+	}
+	return 0;
+}
+
+/// returns the status code of the response
+static int _bench_response(int sock)
+{
+	char response[1024];
+	int length = 0;
+	int ret;
+	while ((ret = recv(sock, response + length, sizeof(response) - length - 1, 0)) > 0)
+		length += ret;
+	response[length] = '\0';
+	int status = -1;
+	if (sscanf(response, "HTTP/%*s %d", &status) != 1)
+		return -1;
+	return status;
+}
+
+static int _bench_request(struct addrinfo *addr, const char *host, const char *method,
+			const char *uri, int index, unsigned long long size, const char *buffer)
+{
+	int sock = _bench_socket(addr);
+	if (sock < 0)
+		return -1;
+	char request[512];
+	int length = snprintf(request, sizeof(request),
+			"%s %s.%d HTTP/1.1\r\nHost: %s\r\nContent-Type: application/octet-stream\r\n"
+			"Content-Length: %llu\r\nConnection: close\r\n\r\n",
+			method, uri, index, host, size);
+	int ret = _bench_send(sock, request, length);
+	while (ret == 0 && size > 0)
+	{
+		size_t chunk = (size > BUFFERSIZE)? BUFFERSIZE: size;
+		ret = _bench_send(sock, buffer, chunk);
+		size -= chunk;
+	}
+	shutdown(sock, SHUT_WR);
+	if (ret == 0)
+		ret = _bench_response(sock);
+	close(sock);
+	return ret;
+}
+
+int main(int argc, char * const *argv)
+{
+	int iterations = DEFAULT_ITERATIONS;
+	unsigned long long size = DEFAULT_SIZE;
+	const char *host = "127.0.0.1";
+	const char *port = "80";
+	const char *uri = "/putbench";
+
+	int opt;
+	do
+	{
+		opt = getopt(argc, argv, "n:s:a:p:u:h");
+		switch (opt)
+		{
+			case 'h':
+				printf("%s [-n <iterations>] [-s <size MB>] [-a <address>] [-p <port>] [-u <uri>]\n", argv[0]);
+				printf("\tmeasure the throughput of the uploads with PUT\n");
+				return 0;
+			case 'n':
+				iterations = strtol(optarg, NULL, 10);
+			break;
+			case 's':
+				size = strtoull(optarg, NULL, 10);
+			break;
+			case 'a':
+				host = optarg;
+			break;
+			case 'p':
+				port = optarg;
+			break;
+			case 'u':
+				uri = optarg;
+			break;
+		}
+	} while(opt != -1);
+	if (iterations <= 0)
+		iterations = DEFAULT_ITERATIONS;
+	if (size == 0)
+		size = DEFAULT_SIZE;
+	size *= 1024 * 1024;
+
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addr = NULL;
+	if (getaddrinfo(host, port, &hints, &addr) != 0)
+	{
+		fprintf(stderr, "putbench: address %s:%s not found\n", host, port);
+		return -1;
+	}
+
+	char *buffer = malloc(BUFFERSIZE);
+	for (int i = 0; i < BUFFERSIZE; i++)
+		buffer[i] = 'a' + (i % 26);
+
+	double total = 0;
+	int errors = 0;
+	for (int i = 0; i < iterations; i++)
+	{
+		double start = _bench_now();
+		int status = _bench_request(addr, host, "PUT", uri, i, size, buffer);
+		double duration = _bench_now() - start;
+		if (status != 200 && status != 201)
+		{
+			fprintf(stderr, "putbench: upload %s.%d error %d\n", uri, i, status);
+			errors++;
+			continue;
+		}
+		total += duration;
+		printf("PUT %s.%d %12llu bytes %10.3f ms %8.1f MB/s\n",
+			uri, i, size, duration * 1000, size / duration / (1024 * 1024));
+		_bench_request(addr, host, "DELETE", uri, i, 0, buffer);
+	}
+	if (iterations > errors)
+		printf("average %8.1f MB/s %4d errors\n",
+			size * (iterations - errors) / total / (1024 * 1024), errors);
+
+	free(buffer);
+	freeaddrinfo(addr);
+	return 0;
+}
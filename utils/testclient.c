@@ -33,6 +33,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
 
 #ifndef WIN32
 # include <sys/socket.h>
@@ -82,6 +87,12 @@ enum
 void display_help(char **name)
 {
 	printf("%s [-t][-a <address>][-p <port>][-w]\n", name[0]);
+	printf("\tsend the request from stdin and write the response on stdout\n");
+	printf("%s [-t][-a <address>][-p <port>] [-c <connections>][-T <threads>]\n", name[0]);
+	printf("\t[-n <requests>][-d <duration s>][-r <rate req/s>][-k][-l <pipeline depth>]\n");
+	printf("\t[-f <request file>]...\n");
+	printf("\tbenchmark: send the requests of the files (GET / by default)\n");
+	printf("\tin closed loop or at a fixed rate and report the latencies\n");
 }
 
 typedef struct net_api_s
@@ -91,6 +102,7 @@ typedef struct net_api_s
 	int (*send)(void *arg, const void *buf, size_t len);
 	int (*recv)(void *arg, void *buf, size_t len);
 	void (*close)(void *sock);
+	int (*pending)(void *arg);
 } net_api_t;
 
 #ifdef MBEDTLS
@@ -104,11 +116,24 @@ typedef struct tls_s
     mbedtls_entropy_context entropy;
 } tls_t;
 
+static void _tls_free(tls_t *tls)
+{
+	mbedtls_net_free( &tls->server_fd );
+	mbedtls_x509_crt_free( &tls->cacert );
+	mbedtls_ssl_free( &tls->ssl );
+	mbedtls_ssl_config_free( &tls->conf );
+	mbedtls_ctr_drbg_free( &tls->ctr_drbg );
+	mbedtls_entropy_free( &tls->entropy );
+	free(tls);
+}
+
 void *tls_connect(const char *serveraddr, const int port)
 {
 	int ret;
+	char service[8];
 
 	tls_t *tls = calloc(1, sizeof(*tls));
+	snprintf(service, sizeof(service), "%d", port);
 
     mbedtls_ssl_init( &tls->ssl );
 
@@ -122,7 +147,7 @@ void *tls_connect(const char *serveraddr, const int port)
 
     mbedtls_entropy_init( &tls->entropy );
 
-    if( ( ret = mbedtls_net_connect( &tls->server_fd, serveraddr, "443", MBEDTLS_NET_PROTO_TCP ) ) != 0 )
+    if( ( ret = mbedtls_net_connect( &tls->server_fd, serveraddr, service, MBEDTLS_NET_PROTO_TCP ) ) != 0 )
     {
         err(" failed\n  ! mbedtls_net_connect returned %d\n\n", ret );
         goto exit;
@@ -196,6 +221,7 @@ void *tls_connect(const char *serveraddr, const int port)
 
 	return tls;
 exit:
+	_tls_free(tls);
 	return NULL;
 }
 
@@ -223,14 +249,26 @@ int tls_send(void *arg, const void *buf, size_t len)
 int tls_recv(void *arg, void *buf, size_t len)
 {
 	tls_t *tls = (tls_t *)arg;
-	return mbedtls_ssl_read( &tls->ssl, buf, len );
+	int ret = mbedtls_ssl_read( &tls->ssl, buf, len );
+	if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+	{
+		errno = EAGAIN;
+		ret = -1;
+	}
+	return ret;
 }
 
 void tls_close(void *arg)
 {
 	tls_t *tls = (tls_t *)arg;
 	mbedtls_ssl_close_notify(&tls->ssl);
-	free(tls);
+	_tls_free(tls);
+}
+
+int tls_pending(void *arg)
+{
+	tls_t *tls = (tls_t *)arg;
+	return mbedtls_ssl_get_bytes_avail(&tls->ssl);
 }
 
 net_api_t tls =
@@ -240,6 +278,7 @@ net_api_t tls =
 	.send = tls_send,
 	.recv = tls_recv,
 	.close = tls_close,
+	.pending = tls_pending,
 };
 #endif
 
@@ -264,7 +303,8 @@ void *direct_connect(const char *serveraddr, const int port)
 	hints.ai_next = NULL;
 
 	struct addrinfo *result, *rp;
-	getaddrinfo(serveraddr, NULL, &hints, &result);
+	if (getaddrinfo(serveraddr, NULL, &hints, &result) != 0)
+		return NULL;
 
 	for (rp = result; rp != NULL; rp = rp->ai_next)
 	{
@@ -278,6 +318,7 @@ void *direct_connect(const char *serveraddr, const int port)
 		close(sock);
 		sock = -1;
 	}
+	freeaddrinfo(result);
 
 	if (sock == -1)
 	{
@@ -299,7 +340,8 @@ int direct_recv(void *arg, void *buf, size_t len)
 	int sock = (long)arg;
 	int flags;
 	flags = fcntl(sock, F_GETFL, 0);
-	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+	if (!(flags & O_NONBLOCK))
+		fcntl(sock, F_SETFL, flags | O_NONBLOCK);
 
 	int ret;
 	while ((ret = recv(sock, buf, len, MSG_NOSIGNAL)) == -1 && (errno == EAGAIN))
@@ -336,6 +378,588 @@ net_api_t direct =
 	.close = direct_close,
 };
 
+/**
+ * Benchmark mode:
+ * The connections are shared between the threads, each thread drives its
+ * connections with poll. In closed loop, a new request is sent as soon as
+ * a response is received (up to the pipeline depth). With a rate, the
+ * requests are scheduled at a fixed interval on each connection and the
+ * latency is measured from the scheduled time: a slow response delays
+ * the next requests and their latency includes the waiting (no
+ * coordinated omission).
+ * The latencies are stored into log-linear histograms (HDR style) of
+ * microseconds, with 16 sub-buckets for each power of two.
+ */
+#define BENCH_MAXREQUESTS 64
+#define BENCH_MAXDEPTH 16
+#define BENCH_BUFFERSIZE 16384
+#define BENCH_SUBBITS 4
+#define BENCH_SUBBUCKETS (1 << BENCH_SUBBITS)
+#define BENCH_BUCKETS (32 * BENCH_SUBBUCKETS)
+#define BENCH_POLLTIMEOUT 100
+
+enum
+{
+	BENCH_HEADER,
+	BENCH_CONTENT,
+	BENCH_CHUNKSIZE,
+	BENCH_CHUNKDATA,
+	BENCH_TRAILER,
+	BENCH_UNTILEOF,
+};
+
+typedef struct bench_request_s bench_request_t;
+struct bench_request_s
+{
+	char *data;
+	size_t length;
+	int head;
+};
+
+typedef struct bench_histogram_s bench_histogram_t;
+struct bench_histogram_s
+{
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[BENCH_BUCKETS];
+};
+
+typedef struct bench_s bench_t;
+struct bench_s
+{
+	net_api_t *net;
+	const char *serveraddr;
+	int port;
+	int connections;
+	int threads;
+	long requests;
+	int limited;
+	uint64_t duration;
+	double rate;
+	int keepalive;
+	int depth;
+	bench_request_t mix[BENCH_MAXREQUESTS];
+	int nmix;
+	uint64_t start;
+};
+
+typedef struct bench_conn_s bench_conn_t;
+struct bench_conn_s
+{
+	void *sock;
+	int state;
+	size_t rest;
+	int close;
+	char buffer[BENCH_BUFFERSIZE + 1];
+	size_t length;
+	uint64_t sent[BENCH_MAXDEPTH];
+	int request[BENCH_MAXDEPTH];
+	int first;
+	int pending;
+	uint64_t next;
+	uint64_t interval;
+	int mix;
+};
+
+typedef struct bench_thread_s bench_thread_t;
+struct bench_thread_s
+{
+	pthread_t thread;
+	bench_t *bench;
+	int nconns;
+	bench_conn_t *conns;
+	bench_histogram_t histogram;
+	unsigned long responses;
+	unsigned long errors;
+	unsigned long status[6];
+	unsigned long connects;
+	uint64_t bytes;
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int bench_bucket(uint64_t value)
+{
+	if (value < BENCH_SUBBUCKETS)
+		return value;
+	int exponent = 63 - __builtin_clzll(value);
+	int sub = (value >> (exponent - BENCH_SUBBITS)) & (BENCH_SUBBUCKETS - 1);
+	int index = ((exponent - BENCH_SUBBITS + 1) << BENCH_SUBBITS) + sub;
+	return (index < BENCH_BUCKETS)? index: BENCH_BUCKETS - 1;
+}
+
+static uint64_t bench_bucketmax(int index)
+{
+	int block = index >> BENCH_SUBBITS;
+	uint64_t sub = index & (BENCH_SUBBUCKETS - 1);
+	if (block == 0)
+		return sub + 1;
+	return (BENCH_SUBBUCKETS + sub + 1) << (block - 1);
+}
+
+static void bench_record(bench_histogram_t *histogram, uint64_t latency)
+{
+	if (histogram->count == 0 || latency < histogram->min)
+		histogram->min = latency;
+	if (latency > histogram->max)
+		histogram->max = latency;
+	histogram->count++;
+	histogram->buckets[bench_bucket(latency / 1000)]++;
+}
+
+static void bench_merge(bench_histogram_t *histogram, const bench_histogram_t *other)
+{
+	if (other->count == 0)
+		return;
+	if (histogram->count == 0 || other->min < histogram->min)
+		histogram->min = other->min;
+	if (other->max > histogram->max)
+		histogram->max = other->max;
+	histogram->count += other->count;
+	for (int i = 0; i < BENCH_BUCKETS; i++)
+		histogram->buckets[i] += other->buckets[i];
+}
+
+/**
+ * returns the latency in milliseconds
+ */
+static double bench_percentile(const bench_histogram_t *histogram, int permille)
+{
+	if (histogram->count == 0)
+		return 0;
+	uint64_t rank = (histogram->count * permille + 999) / 1000;
+	uint64_t count = 0;
+	for (int i = 0; i < BENCH_BUCKETS; i++)
+	{
+		count += histogram->buckets[i];
+		if (count >= rank)
+		{
+			double value = bench_bucketmax(i) / 1e3;
+			/// the bucket may be larger than the maximum
+			return (value < histogram->max / 1e6)? value: histogram->max / 1e6;
+		}
+	}
+	return histogram->max / 1e6;
+}
+
+static int bench_loadrequest(bench_t *bench, const char *path)
+{
+	if (bench->nmix == BENCH_MAXREQUESTS)
+	{
+		err("testclient: too many requests, %s ignored", path);
+		return -1;
+	}
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+	{
+		err("testclient: %s %s", path, strerror(errno));
+		return -1;
+	}
+	bench_request_t *request = &bench->mix[bench->nmix];
+	size_t size = 0;
+	int ret;
+	do
+	{
+		size += BENCH_BUFFERSIZE;
+		request->data = realloc(request->data, size);
+		ret = fread(request->data + request->length, 1, size - request->length, file);
+		if (ret > 0)
+			request->length += ret;
+	} while (ret > 0);
+	fclose(file);
+	if (request->length == 0)
+	{
+		free(request->data);
+		request->data = NULL;
+		return -1;
+	}
+	request->head = !strncmp(request->data, "HEAD ", 5);
+	bench->nmix++;
+	return 0;
+}
+
+static int bench_connect(bench_thread_t *thread, bench_conn_t *conn)
+{
+	const bench_t *bench = thread->bench;
+	conn->state = BENCH_HEADER;
+	conn->length = 0;
+	conn->first = 0;
+	conn->pending = 0;
+	conn->close = 0;
+	conn->sock = bench->net->connect(bench->serveraddr, bench->port);
+	if (conn->sock == NULL)
+	{
+		thread->errors++;
+		return -1;
+	}
+	int on = 1;
+	setsockopt(bench->net->fd(conn->sock), IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	thread->connects++;
+	return 0;
+}
+
+static void bench_close(bench_thread_t *thread, bench_conn_t *conn)
+{
+	if (conn->sock == NULL)
+		return;
+	thread->bench->net->close(conn->sock);
+	conn->sock = NULL;
+	/// the pipelined requests are lost
+	thread->errors += conn->pending;
+	conn->pending = 0;
+}
+
+/**
+ * returns 0 on success, 1 when all the requests are sent
+ */
+static int bench_send(bench_thread_t *thread, bench_conn_t *conn, uint64_t scheduled)
+{
+	bench_t *bench = thread->bench;
+	if (bench->limited && __atomic_sub_fetch(&bench->requests, 1, __ATOMIC_RELAXED) < 0)
+		return 1;
+	const bench_request_t *request = &bench->mix[conn->mix];
+	size_t offset = 0;
+	while (offset < request->length)
+	{
+		int ret = bench->net->send(conn->sock, request->data + offset, request->length - offset);
+		if (ret < 0 && errno == EAGAIN)
+		{
+			struct pollfd pfd = {.fd = bench->net->fd(conn->sock), .events = POLLOUT};
+			poll(&pfd, 1, BENCH_POLLTIMEOUT);
+			continue;
+		}
+		if (ret <= 0)
+			return -1;
+		offset += ret;
+	}
+	int slot = (conn->first + conn->pending) % BENCH_MAXDEPTH;
+	conn->sent[slot] = scheduled;
+	conn->request[slot] = conn->mix;
+	conn->pending++;
+	conn->mix = (conn->mix + 1) % bench->nmix;
+	return 0;
+}
+
+static void bench_consume(bench_conn_t *conn, size_t length)
+{
+	conn->length -= length;
+	memmove(conn->buffer, conn->buffer + length, conn->length);
+	conn->buffer[conn->length] = '\0';
+}
+
+static void bench_complete(bench_thread_t *thread, bench_conn_t *conn)
+{
+	bench_record(&thread->histogram, bench_now() - conn->sent[conn->first]);
+	conn->first = (conn->first + 1) % BENCH_MAXDEPTH;
+	conn->pending--;
+	conn->state = BENCH_HEADER;
+	thread->responses++;
+}
+
+static const char *bench_header(const char *header, const char *key)
+{
+	size_t keylen = strlen(key);
+	const char *line = strstr(header, "\r\n");
+	while (line != NULL)
+	{
+		line += 2;
+		if (!strncasecmp(line, key, keylen) && line[keylen] == ':')
+		{
+			line += keylen + 1;
+			while (*line == ' ')
+				line++;
+			return line;
+		}
+		line = strstr(line, "\r\n");
+	}
+	return NULL;
+}
+
+/**
+ * returns -1 on error, 1 when the connection must be closed
+ */
+static int bench_parse(bench_thread_t *thread, bench_conn_t *conn)
+{
+	while (conn->length > 0)
+	{
+		if (conn->state == BENCH_HEADER)
+		{
+			char *end = strstr(conn->buffer, "\r\n\r\n");
+			if (end == NULL)
+				return (conn->length == BENCH_BUFFERSIZE)? -1: 0;
+			if (strncmp(conn->buffer, "HTTP/1.", 7) || conn->pending == 0)
+				return -1;
+			int status = strtol(conn->buffer + 9, NULL, 10);
+			end[2] = '\0';
+			const char *value = bench_header(conn->buffer, "Content-Length");
+			/// without length, the content ends with the connection
+			int untileof = (value == NULL);
+			size_t contentlength = (value != NULL)? strtoul(value, NULL, 10): 0;
+			value = bench_header(conn->buffer, "Transfer-Encoding");
+			int chunked = (value != NULL && !strncasecmp(value, "chunked", 7));
+			value = bench_header(conn->buffer, "Connection");
+			if (value != NULL && !strncasecmp(value, "close", 5))
+				conn->close = 1;
+			end[2] = '\r';
+			bench_consume(conn, end + 4 - conn->buffer);
+			/// the connection switched to another protocol, the handshake is measured
+			if (status == 101)
+				conn->close = 1;
+			else if (status / 100 == 1)
+				continue;
+			thread->status[(status / 100 < 6)? status / 100: 0]++;
+			if (thread->bench->mix[conn->request[conn->first]].head ||
+				status == 101 || status == 204 || status == 304)
+				bench_complete(thread, conn);
+			else if (chunked)
+				conn->state = BENCH_CHUNKSIZE;
+			else if (untileof)
+				conn->state = BENCH_UNTILEOF;
+			else if (contentlength > 0)
+			{
+				conn->state = BENCH_CONTENT;
+				conn->rest = contentlength;
+			}
+			else
+				bench_complete(thread, conn);
+		}
+		else if (conn->state == BENCH_CONTENT || conn->state == BENCH_CHUNKDATA)
+		{
+			size_t length = (conn->rest < conn->length)? conn->rest: conn->length;
+			bench_consume(conn, length);
+			conn->rest -= length;
+			if (conn->rest > 0)
+				return 0;
+			if (conn->state == BENCH_CHUNKDATA)
+				conn->state = BENCH_CHUNKSIZE;
+			else
+				bench_complete(thread, conn);
+		}
+		else if (conn->state == BENCH_CHUNKSIZE || conn->state == BENCH_TRAILER)
+		{
+			char *end = strstr(conn->buffer, "\r\n");
+			if (end == NULL)
+				return (conn->length == BENCH_BUFFERSIZE)? -1: 0;
+			if (conn->state == BENCH_TRAILER)
+			{
+				if (end == conn->buffer)
+					bench_complete(thread, conn);
+			}
+			else
+			{
+				conn->rest = strtoul(conn->buffer, NULL, 16) + 2;
+				conn->state = (conn->rest > 2)? BENCH_CHUNKDATA: BENCH_TRAILER;
+			}
+			bench_consume(conn, end + 2 - conn->buffer);
+		}
+		else
+			bench_consume(conn, conn->length);
+		if (conn->state == BENCH_HEADER && (conn->close || !thread->bench->keepalive))
+			return 1;
+	}
+	return 0;
+}
+
+static void bench_read(bench_thread_t *thread, bench_conn_t *conn)
+{
+	const bench_t *bench = thread->bench;
+	int ret = bench->net->recv(conn->sock, conn->buffer + conn->length, BENCH_BUFFERSIZE - conn->length);
+	if (ret < 0 && errno == EAGAIN)
+		return;
+	if (ret > 0)
+	{
+		conn->length += ret;
+		conn->buffer[conn->length] = '\0';
+		thread->bytes += ret;
+		ret = bench_parse(thread, conn);
+		if (ret == 0)
+			return;
+		if (ret < 0)
+			thread->errors++;
+	}
+	else if (conn->state == BENCH_UNTILEOF && conn->pending > 0)
+		bench_complete(thread, conn);
+	bench_close(thread, conn);
+}
+
+static void *bench_thread(void *arg)
+{
+	bench_thread_t *thread = (bench_thread_t *)arg;
+	bench_t *bench = thread->bench;
+	struct pollfd *fds = calloc(thread->nconns, sizeof(*fds));
+	int exhausted = 0;
+
+	while (1)
+	{
+		uint64_t now = bench_now();
+		if (bench->duration > 0 && now - bench->start >= bench->duration)
+			break;
+		uint64_t timeout = BENCH_POLLTIMEOUT * 1000000ULL;
+		int pending = 0;
+		for (int i = 0; i < thread->nconns; i++)
+		{
+			bench_conn_t *conn = &thread->conns[i];
+			fds[i].fd = -1;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+			if (bench->limited && __atomic_load_n(&bench->requests, __ATOMIC_RELAXED) <= 0)
+				exhausted = 1;
+			if (conn->sock == NULL && !exhausted && bench_connect(thread, conn) < 0)
+				continue;
+			while (conn->sock != NULL && !exhausted && conn->pending < bench->depth)
+			{
+				uint64_t scheduled = bench_now();
+				if (conn->interval > 0)
+				{
+					if (conn->next > scheduled)
+					{
+						if (conn->next - scheduled < timeout)
+							timeout = conn->next - scheduled;
+						break;
+					}
+					scheduled = conn->next;
+					conn->next += conn->interval;
+				}
+				int ret = bench_send(thread, conn, scheduled);
+				if (ret == 1)
+					exhausted = 1;
+				else if (ret < 0)
+				{
+					thread->errors++;
+					bench_close(thread, conn);
+				}
+			}
+			if (conn->sock == NULL)
+				continue;
+			pending += conn->pending;
+			fds[i].fd = bench->net->fd(conn->sock);
+			if (bench->net->pending != NULL && bench->net->pending(conn->sock) > 0)
+				timeout = 0;
+		}
+		if (exhausted && pending == 0)
+			break;
+		struct timespec wait = {.tv_sec = timeout / 1000000000ULL, .tv_nsec = timeout % 1000000000ULL};
+		int ret = ppoll(fds, thread->nconns, &wait, NULL);
+		for (int i = 0; i < thread->nconns && ret >= 0; i++)
+		{
+			bench_conn_t *conn = &thread->conns[i];
+			if (conn->sock == NULL)
+				continue;
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) ||
+				(bench->net->pending != NULL && bench->net->pending(conn->sock) > 0))
+				bench_read(thread, conn);
+		}
+	}
+	for (int i = 0; i < thread->nconns; i++)
+	{
+		/// the requests in progress at the end of the duration are not errors
+		thread->conns[i].pending = 0;
+		bench_close(thread, &thread->conns[i]);
+	}
+	free(fds);
+	return NULL;
+}
+
+static int bench_run(bench_t *bench)
+{
+	if (bench->nmix == 0)
+	{
+		bench_request_t *request = &bench->mix[0];
+		request->data = malloc(BENCH_BUFFERSIZE);
+		request->length = snprintf(request->data, BENCH_BUFFERSIZE,
+				"GET / HTTP/1.1\r\nHost: %s\r\n\r\n", bench->serveraddr);
+		bench->nmix = 1;
+	}
+	if (bench->connections < 1)
+		bench->connections = 1;
+	if (bench->threads < 1)
+		bench->threads = 1;
+	if (bench->threads > bench->connections)
+		bench->threads = bench->connections;
+	if (bench->depth < 1 || !bench->keepalive)
+		bench->depth = 1;
+	if (bench->depth > BENCH_MAXDEPTH)
+		bench->depth = BENCH_MAXDEPTH;
+	if (bench->requests <= 0 && bench->duration == 0)
+		bench->requests = 1000;
+	bench->limited = (bench->requests > 0);
+
+	signal(SIGPIPE, SIG_IGN);
+	bench_thread_t *threads = calloc(bench->threads, sizeof(*threads));
+	bench_conn_t *conns = calloc(bench->connections, sizeof(*conns));
+	bench->start = bench_now();
+	int index = 0;
+	for (int i = 0; i < bench->threads; i++)
+	{
+		bench_thread_t *thread = &threads[i];
+		thread->bench = bench;
+		thread->nconns = bench->connections / bench->threads;
+		if (i < bench->connections % bench->threads)
+			thread->nconns++;
+		thread->conns = &conns[index];
+		for (int j = 0; j < thread->nconns; j++, index++)
+		{
+			bench_conn_t *conn = &conns[index];
+			conn->mix = index % bench->nmix;
+			if (bench->rate > 0)
+			{
+				/// the connections are shifted to spread the requests
+				conn->interval = bench->connections * 1e9 / bench->rate;
+				conn->next = bench->start + index * (uint64_t)(1e9 / bench->rate);
+			}
+		}
+		if (pthread_create(&thread->thread, NULL, bench_thread, thread))
+		{
+			err("testclient: thread error %s", strerror(errno));
+			thread->nconns = 0;
+			bench_thread(thread);
+		}
+	}
+
+	bench_histogram_t histogram = {0};
+	unsigned long responses = 0;
+	unsigned long errors = 0;
+	unsigned long connects = 0;
+	unsigned long status[6] = {0};
+	uint64_t bytes = 0;
+	for (int i = 0; i < bench->threads; i++)
+	{
+		bench_thread_t *thread = &threads[i];
+		if (thread->nconns > 0)
+			pthread_join(thread->thread, NULL);
+		bench_merge(&histogram, &thread->histogram);
+		responses += thread->responses;
+		errors += thread->errors;
+		connects += thread->connects;
+		bytes += thread->bytes;
+		for (int j = 0; j < 6; j++)
+			status[j] += thread->status[j];
+	}
+	double duration = (bench_now() - bench->start) / 1e9;
+
+	printf("%lu responses in %.3f s, %lu errors, %lu connections\n",
+		responses, duration, errors, connects);
+	printf("status 2xx %lu 3xx %lu 4xx %lu 5xx %lu\n",
+		status[2], status[3], status[4], status[5]);
+	printf("throughput %.1f req/s %.3f MB/s\n",
+		responses / duration, bytes / duration / 1e6);
+	printf("latency ms min %.3f p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+		histogram.min / 1e6, bench_percentile(&histogram, 500), bench_percentile(&histogram, 900),
+		bench_percentile(&histogram, 990), bench_percentile(&histogram, 999), histogram.max / 1e6);
+
+	for (int i = 0; i < bench->nmix; i++)
+		free(bench->mix[i].data);
+	free(conns);
+	free(threads);
+	return (errors > 0)? -1: 0;
+}
+
 #define OPT_WEBSOCKET 0x01
 #define OPT_PIPELINE 0x02
 int main(int argc, char **argv)
@@ -345,6 +969,8 @@ int main(int argc, char **argv)
 	void *sock = NULL;
 	int options = 0;
 	net_api_t *net = &direct;
+	bench_t bench = {.connections = 1, .threads = 1, .requests = -1, .depth = 1};
+	int benchmark = 0;
 
 	setvbuf(stdout, NULL, _IONBF, 0);
 	setvbuf(stderr, NULL, _IONBF, 0);
@@ -353,7 +979,7 @@ int main(int argc, char **argv)
 	int opt;
 	do
 	{
-		opt = getopt(argc, argv, "a:p:hwPt");
+		opt = getopt(argc, argv, "a:p:hwPtc:T:n:d:r:kl:f:");
 		switch (opt)
 		{
 			case 'a':
@@ -371,6 +997,36 @@ int main(int argc, char **argv)
 			case 'P':
 				options |= OPT_PIPELINE;
 			break;
+			case 'c':
+				bench.connections = atoi(optarg);
+				benchmark = 1;
+			break;
+			case 'T':
+				bench.threads = atoi(optarg);
+			break;
+			case 'n':
+				bench.requests = atol(optarg);
+				benchmark = 1;
+			break;
+			case 'd':
+				bench.duration = atol(optarg) * 1000000000ULL;
+				benchmark = 1;
+			break;
+			case 'r':
+				bench.rate = atof(optarg);
+				benchmark = 1;
+			break;
+			case 'k':
+				bench.keepalive = 1;
+			break;
+			case 'l':
+				bench.depth = atoi(optarg);
+			break;
+			case 'f':
+				if (bench_loadrequest(&bench, optarg) < 0)
+					return -1;
+				benchmark = 1;
+			break;
 #ifdef MBEDTLS
 			case 't':
 				port = 443;
@@ -381,6 +1037,14 @@ int main(int argc, char **argv)
 	} while(opt != -1);
 #endif
 
+	if (benchmark)
+	{
+		bench.net = net;
+		bench.serveraddr = serveraddr;
+		bench.port = port;
+		return bench_run(&bench);
+	}
+
 	dbg("testclient: connect");
 	sock = net->connect(serveraddr, port);
 	if (sock == NULL)
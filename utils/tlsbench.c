@@ -0,0 +1,195 @@
+/*****************************************************************************
+ * tlsbench.c: benchmark of the TLS handshakes
+ * this file is part of https://github.com/ouistiti-project/ouistiti
+ *****************************************************************************
+ * Copyright (C) 2016-2017
+ *
+ * Authors: Marc Chalain <marc.chalain@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+/**
+    tlsbench measures the connections per second on a https server:
+     - "full": each connection negotiates a new session.
+     - "resumed": each connection presents the last session received
+       (session id with TLS1.2 or ticket).
+    Each connection sends one HEAD request and reads the response to
+    receive the tickets of TLS1.3. The number of resumed sessions is
+    displayed to check the configuration of the server.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define DEFAULT_ITERATIONS 200
+
+static SSL_SESSION *g_session = NULL;
+
+static double _bench_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int _bench_newsession(SSL *ssl, SSL_SESSION *session)
+{
+	if (g_session != NULL)
+		SSL_SESSION_free(g_session);
+	/// the reference is kept
+	g_session = session;
+	return 1;
+}
+
+static int _bench_socket(struct addrinfo *addr)
+{
+	int sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (sock < 0)
+		return -1;
+	/// the Finished of the resumed handshake is not delayed by the request
+	int nodelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	if (connect(sock, addr->ai_addr, addr->ai_addrlen) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int _bench_connection(SSL_CTX *ctx, struct addrinfo *addr, const char *host, int resume)
+{
+	int sock = _bench_socket(addr);
+	if (sock < 0)
+		return -1;
+	SSL *ssl = SSL_new(ctx);
+	SSL_set_fd(ssl, sock);
+	SSL_set_tlsext_host_name(ssl, host);
+	if (resume && g_session != NULL)
+		SSL_set_session(ssl, g_session);
+	int ret = -1;
+	if (SSL_connect(ssl) == 1)
+	{
+		char request[256];
+		int length = snprintf(request, sizeof(request),
+				"HEAD / HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", host);
+		SSL_write(ssl, request, length);
+		char response[1024];
+		while (SSL_read(ssl, response, sizeof(response)) > 0);
+		ret = SSL_session_reused(ssl);
+	}
+	else
+		ERR_print_errors_fp(stderr);
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+	close(sock);
+	return ret;
+}
+
+static void _bench_run(const char *name, SSL_CTX *ctx, struct addrinfo *addr, const char *host, int iterations, int resume)
+{
+	int reused = 0;
+	int errors = 0;
+	double start = _bench_now();
+	for (int i = 0; i < iterations; i++)
+	{
+		int ret = _bench_connection(ctx, addr, host, resume);
+		if (ret < 0)
+			errors++;
+		else
+			reused += ret;
+	}
+	double duration = _bench_now() - start;
+	printf("%-8s %6d connections %10.3f ms %8.1f conn/s %6d resumed %4d errors\n",
+		name, iterations, duration * 1000, iterations / duration, reused, errors);
+}
+
+int main(int argc, char * const *argv)
+{
+	int iterations = DEFAULT_ITERATIONS;
+	const char *host = "127.0.0.1";
+	const char *port = "443";
+	int version = 0;
+
+	int opt;
+	do
+	{
+		opt = getopt(argc, argv, "n:a:p:2h");
+		switch (opt)
+		{
+			case 'h':
+				printf("%s [-n <iterations>] [-a <address>] [-p <port>] [-2]\n", argv[0]);
+				printf("\tmeasure the full and the resumed handshakes per second\n");
+				printf("\t-2 limits the connections to TLS1.2\n");
+				return 0;
+			case 'n':
+				iterations = strtol(optarg, NULL, 10);
+			break;
+			case 'a':
+				host = optarg;
+			break;
+			case 'p':
+				port = optarg;
+			break;
+			case '2':
+				version = TLS1_2_VERSION;
+			break;
+		}
+	} while(opt != -1);
+	if (iterations <= 0)
+		iterations = DEFAULT_ITERATIONS;
+
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addr = NULL;
+	if (getaddrinfo(host, port, &hints, &addr) != 0)
+	{
+		fprintf(stderr, "tlsbench: address %s:%s not found\n", host, port);
+		return -1;
+	}
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+	if (version)
+		SSL_CTX_set_max_proto_version(ctx, version);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, _bench_newsession);
+
+	/// the first connection receives the session of the resumed loop
+	_bench_connection(ctx, addr, host, 0);
+	_bench_run("full", ctx, addr, host, iterations, 0);
+	_bench_run("resumed", ctx, addr, host, iterations, 1);
+
+	if (g_session != NULL)
+		SSL_SESSION_free(g_session);
+	SSL_CTX_free(ctx);
+	freeaddrinfo(addr);
+	return 0;
+}
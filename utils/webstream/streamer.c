@@ -28,6 +28,7 @@
 #include <stdio.h>
 #define __USE_GNU
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -57,6 +58,12 @@
 #define OPTION_TEST 0x02
 #define OPTION_DAEMON 0x04
 #define OPTION_STREAM 0x08
+#define OPTION_TS 0x10
+
+#define TS_PACKETSIZE 188
+#define TS_PID 0x100
+#define TS_PMTPID 0x1000
+#define TS_NULLPID 0x1FFF
 
 typedef int (*server_t)(int sock);
 
@@ -147,6 +154,87 @@ int startstream(int sock, buffer_t *origin, int options, pthread_t *thread)
 	pthread_create(thread, &attr, runstream, stream);
 }
 
+/**
+ * the MPEG-TS test stream: each chunk starts with the PAT and the PMT,
+ * a random access point with the PCR on the pid 0x100, and continues
+ * with null packets. One chunk is sent each second.
+ */
+static uint32_t tscrc(const unsigned char *data, int length)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	for (int i = 0; i < length; i++)
+	{
+		crc ^= (uint32_t)data[i] << 24;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80000000)? (crc << 1) ^ 0x04C11DB7: crc << 1;
+	}
+	return crc;
+}
+
+static void tssection(unsigned char *packet, const unsigned char *section, int length)
+{
+	/// pointer field, then the section and its CRC
+	packet[4] = 0;
+	memcpy(packet + 5, section, length);
+	uint32_t crc = tscrc(section, length);
+	packet[5 + length] = crc >> 24;
+	packet[6 + length] = crc >> 16;
+	packet[7 + length] = crc >> 8;
+	packet[8 + length] = crc;
+}
+
+static int tsgenerator(char *data, int size, int elem)
+{
+	static unsigned char counter = 0;
+	static uint64_t pcr = 0;
+	const unsigned char pat[] = {0x00, 0xB0, 0x0D, 0x00, 0x01, 0xC1, 0x00, 0x00,
+		0x00, 0x01, 0xE0 | (TS_PMTPID >> 8), TS_PMTPID & 0xFF};
+	const unsigned char pmt[] = {0x02, 0xB0, 0x12, 0x00, 0x01, 0xC1, 0x00, 0x00,
+		0xE0 | (TS_PID >> 8), TS_PID & 0xFF, 0xF0, 0x00,
+		0x1B, 0xE0 | (TS_PID >> 8), TS_PID & 0xFF, 0xF0, 0x00};
+	int length = size - (size % TS_PACKETSIZE);
+	for (int offset = 0; offset < length; offset += TS_PACKETSIZE)
+	{
+		unsigned char *packet = (unsigned char *)data + offset;
+		int index = offset / TS_PACKETSIZE;
+		int pid = TS_NULLPID;
+		if (index == 0)
+			pid = 0;
+		else if (index == 1)
+			pid = TS_PMTPID;
+		else if (index == 2)
+			pid = TS_PID;
+		memset(packet, 0xFF, TS_PACKETSIZE);
+		packet[0] = 0x47;
+		packet[1] = ((pid != TS_NULLPID)? 0x40: 0x00) | (pid >> 8);
+		packet[2] = pid & 0xFF;
+		packet[3] = 0x10;
+		if (index == 0)
+			tssection(packet, pat, sizeof(pat));
+		else if (index == 1)
+			tssection(packet, pmt, sizeof(pmt));
+		else if (index == 2)
+		{
+			/// adaptation field with the random access indicator and the PCR
+			packet[3] = 0x30 | (counter++ & 0x0F);
+			packet[4] = 7;
+			packet[5] = 0x50;
+			packet[6] = pcr >> 25;
+			packet[7] = pcr >> 17;
+			packet[8] = pcr >> 9;
+			packet[9] = pcr >> 1;
+			packet[10] = ((pcr & 0x01) << 7) | 0x7E;
+			packet[11] = 0;
+			memset(packet + 12, elem + 0x30, TS_PACKETSIZE - 12);
+		}
+		else
+			memset(packet + 4, 0, TS_PACKETSIZE - 4);
+	}
+	/// the base of the PCR at 90 kHz
+	pcr = (pcr + 90000) & ((1ULL << 33) - 1);
+	return length;
+}
+
 void *rungenerator(void *arg)
 {
 	buffer_t *buffer = (buffer_t *)arg;
@@ -158,7 +246,13 @@ void *rungenerator(void *arg)
 
 	while (run)
 	{
-		if (!(buffer->options & OPTION_TEST))
+		if (buffer->options & OPTION_TS)
+		{
+			elem++;
+			elem %= 10;
+			buffer->length = tsgenerator(buffer->data, buffer->size, elem);
+		}
+		else if (!(buffer->options & OPTION_TEST))
 		{
 			elem++;
 			elem %= 10;
@@ -210,6 +304,7 @@ void help(char **argv)
 	fprintf(stderr, "\t-D \tdaemonize the server\n");
 	fprintf(stderr, "\t-w \tstart streamer with specific ouistiti features\n");
 	fprintf(stderr, "\t-t \ttest mode\n");
+	fprintf(stderr, "\t-T \tsend a MPEG-TS stream (chunk size rounded to 188 bytes)\n");
 }
 
 int main(int argc, char **argv)
@@ -228,7 +323,7 @@ int main(int argc, char **argv)
 
 	do
 	{
-		opt = getopt(argc, argv, "u:R:m:hon:ts:DS");
+		opt = getopt(argc, argv, "u:R:m:hon:ts:DST");
 		switch (opt)
 		{
 			case 'R':
@@ -262,6 +357,9 @@ int main(int argc, char **argv)
 			case 'S':
 				options |= OPTION_STREAM;
 			break;
+			case 'T':
+				options |= OPTION_TS;
+			break;
 		}
 	} while(opt != -1);
 